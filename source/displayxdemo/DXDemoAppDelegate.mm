@@ -18,6 +18,7 @@ using namespace ts;
 - (BOOL)enableDisplayStream;
 - (void)updateControlState;
 - (void)notificationDisplayState:(unsigned)displayIndex;
+- (void)notificationDisplayMode:(unsigned)displayIndex;
 - (void)notificationCursorState:(unsigned)displayIndex;
 - (void)notificationCursorImage:(unsigned)displayIndex;
 - (void)notificationDisplayReconfiguration:(CGDirectDisplayID)displayID flags:(CGDisplayChangeSummaryFlags)flags;
@@ -42,6 +43,7 @@ static void displayNotificationCallback(DisplayXFBInterface::Notification notifi
     switch (notification)
     {
         case DisplayXFBInterface::kNotificationDisplayState:  [object notificationDisplayState:displayIndex];   break;
+        case DisplayXFBInterface::kNotificationDisplayMode:   [object notificationDisplayMode:displayIndex];    break;
         case DisplayXFBInterface::kNotificationCursorState:   [object notificationCursorState:displayIndex];    break;
         case DisplayXFBInterface::kNotificationCursorImage:   [object notificationCursorImage:displayIndex];    break;
         default:    NSLog(@">>> Display %d unknown event %d", displayIndex, (int)notification);                 break;
@@ -150,8 +152,9 @@ static void displayReconfigurationCallBack(CGDirectDisplayID displayID, CGDispla
             }
         }
 
-        // Setup notification callbacks from the driver.
+        // Setup notification callbacks from the driver. Only the visible display is of interest.
         _displayInterface->setNotificationHandler(displayNotificationCallback, (__bridge void*)self);
+        _displayInterface->setNotificationMask(1u << _visibleDisplayIndex);
 
 
         // Setup reconfiguration callbacks from Quartz.
@@ -292,6 +295,7 @@ static void displayReconfigurationCallBack(CGDirectDisplayID displayID, CGDispla
         [self disableDisplayStream];
 
         _visibleDisplayIndex = newDisplayIndex;
+        _displayInterface->setNotificationMask(1u << _visibleDisplayIndex);
 
         if (_displayInterface->displayIsConnected(_visibleDisplayIndex))
         {
@@ -504,6 +508,14 @@ static void displayReconfigurationCallBack(CGDirectDisplayID displayID, CGDispla
 }
 
 
+- (void)notificationDisplayMode:(unsigned)displayIndex
+{
+    // The framebuffer and cursor mappings survive a mode switch, but the stream must be restarted at the new size.
+    [self actionCapture:nil];
+    [self updateControlState];
+}
+
+
 - (void)notificationCursorState:(unsigned)displayIndex
 {
     const DisplayXFBCursor* crsr = _cursor[_visibleDisplayIndex];
@@ -9,11 +9,25 @@
 #import <OpenGL/OpenGL.h>
 #import <OpenGL/glu.h>
 #import "DXDemoOpenGLView.h"
+#import "DisplayXFBFramePool.h"
+#import "DisplayXFBPixelKernels.h"
+
+using namespace ts;
+
+/** Return the pool shared by all textures. Buffers freed when a display changes size are reused when it changes back.
+ */
+static DisplayXFBFramePool& texturePool()
+{
+    static DisplayXFBFramePool pool;
+    return pool;
+}
+
 
 /** Helper class used to manage an OpenGL texture.
  */
 class Texture
 {
+    DisplayXFBFramePool::Frame* m_frame;
     uint32_t* m_textureData;
     uint32_t m_textureWidth;
     uint32_t m_textureHeight;
@@ -21,7 +35,7 @@ class Texture
 
 public:
 
-    Texture() : m_textureData(0), m_textureWidth(0), m_textureHeight(0)
+    Texture() : m_frame(0), m_textureData(0), m_textureWidth(0), m_textureHeight(0)
     {
         glEnable(GL_TEXTURE_RECTANGLE_ARB);
         glGenTextures(1, &m_textureId);
@@ -35,7 +49,8 @@ public:
 
     void initialise()
     {
-        if (m_textureData) free(m_textureData);
+        texturePool().release(m_frame);
+        m_frame = 0;
         m_textureData = 0;
         m_textureWidth = 0;
         m_textureHeight = 0;
@@ -47,13 +62,13 @@ public:
         // Save the texture data.
         if (!m_textureData || m_textureWidth != w || m_textureHeight != h)
         {
-            if (m_textureData) free(m_textureData);
+            initialise();
+            m_frame = texturePool().acquire(w, h);
+            if (!m_frame) return;
             m_textureWidth = w;
             m_textureHeight = h;
-            size_t size = m_textureWidth * m_textureHeight * sizeof (uint32_t);
-            void* ptr = 0;
-            posix_memalign(&ptr, 256, size);
-            m_textureData = (uint32_t*)ptr;
+            size_t size = m_frame->size();
+            m_textureData = (uint32_t*)m_frame->data();
 
             if (size >= 1024*1024)
             {
@@ -62,7 +77,9 @@ public:
             }
         }
 
-        memcpy(m_textureData, bitmap, m_textureWidth * m_textureHeight * sizeof (uint32_t));
+        // Full frames are large enough to flush the cache: copyFrame() streams them past it.
+        size_t rowBytes = m_textureWidth * sizeof (uint32_t);
+        DisplayXFBPixelKernels::copyFrame(m_textureData, rowBytes, bitmap, rowBytes, m_textureWidth, m_textureHeight);
 
         glEnable(GL_TEXTURE_RECTANGLE_ARB);
         glBindTexture(GL_TEXTURE_RECTANGLE_ARB, m_textureId);
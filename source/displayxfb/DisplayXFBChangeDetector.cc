@@ -0,0 +1,116 @@
+/** @file   DisplayXFBChangeDetector.cc
+ *  @brief  Low cost detection of framebuffer content changes.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBChangeDetector.h"
+
+
+/** Discard all history. The next update reports a change to the whole frame.
+ */
+void DisplayXFBChangeDetector::reset()
+{
+    for (unsigned i = 0; i < kPhases; i++) m_primed[i] = false;
+    m_phase = 0;
+    m_width = 0;
+    m_height = 0;
+    m_bytesPerRow = 0;
+}
+
+
+/** Sample the frame and report any change.
+ *
+ *  @param  pixels          The first pixel of the frame (32 bits per pixel).
+ *  @param  width           The frame width (pixels).
+ *  @param  height          The frame height (pixels).
+ *  @param  bytesPerRow     The frame stride (bytes).
+ *  @param  x               Returns the left edge of the changed area (pixels).
+ *  @param  y               Returns the top edge of the changed area (pixels).
+ *  @param  w               Returns the width of the changed area (pixels).
+ *  @param  h               Returns the height of the changed area (pixels).
+ *  @return                 Logical true if a change was detected (the bounds are valid), false otherwise.
+ */
+bool DisplayXFBChangeDetector::update(const uint32_t* pixels, unsigned width, unsigned height, unsigned bytesPerRow,
+                                      unsigned& x, unsigned& y, unsigned& w, unsigned& h)
+{
+    if (!pixels || width < kTilesX || height < kTilesY) return false;
+
+    // Any change of geometry invalidates all history and counts as a change to everything.
+    bool geometryChanged = (width != m_width || height != m_height || bytesPerRow != m_bytesPerRow);
+    if (geometryChanged)
+    {
+        reset();
+        m_width = width;
+        m_height = height;
+        m_bytesPerRow = bytesPerRow;
+    }
+
+    unsigned phase = m_phase;
+    m_phase = (m_phase + 1) % kPhases;
+
+    const unsigned tileWidth = (width + kTilesX - 1) / kTilesX;
+    const unsigned tileHeight = (height + kTilesY - 1) / kTilesY;
+    // Short frames (fewer than kPhases * kRowsPerPhase rows per tile) sample adjacent rows, and step the offset by one
+    // row per phase so that the phases still cover different rows.
+    const unsigned rowSpacing = (tileHeight >= kRowsPerPhase) ? tileHeight / kRowsPerPhase : 1;    // Distance between rows sampled together
+    const unsigned rowOffset = (rowSpacing >= kPhases) ? (phase * rowSpacing) / kPhases : phase % rowSpacing;   // Rotates the sampled rows between phases
+    const uint8_t* base = (const uint8_t*)pixels;
+
+    unsigned minX = kTilesX, maxX = 0, minY = kTilesY, maxY = 0;
+
+    for (unsigned ty = 0; ty < kTilesY; ty++)
+    {
+        unsigned y0 = ty * tileHeight;
+        for (unsigned tx = 0; tx < kTilesX; tx++)
+        {
+            unsigned x0 = tx * tileWidth;
+            unsigned x1 = x0 + tileWidth;
+            if (x1 > width) x1 = width;
+
+            // FNV-1a over the sampled pixels.
+            uint32_t hash = 2166136261u;
+            for (unsigned r = 0; r < kRowsPerPhase; r++)
+            {
+                unsigned row = y0 + rowOffset + (r * rowSpacing);
+                if (row >= height) break;
+                const uint32_t* line = (const uint32_t*)(base + (row * bytesPerRow));
+                for (unsigned px = x0 + (phase % kPixelStep); px < x1; px += kPixelStep)
+                {
+                    hash = (hash ^ line[px]) * 16777619u;
+                }
+            }
+
+            if (m_primed[phase] && hash != m_hash[phase][ty][tx])
+            {
+                if (tx < minX) minX = tx;
+                if (tx > maxX) maxX = tx;
+                if (ty < minY) minY = ty;
+                if (ty > maxY) maxY = ty;
+            }
+            m_hash[phase][ty][tx] = hash;
+        }
+    }
+    m_primed[phase] = true;
+
+    if (geometryChanged)
+    {
+        x = 0;
+        y = 0;
+        w = width;
+        h = height;
+        return true;
+    }
+    else if (minX > maxX)
+    {
+        return false;
+    }
+    else
+    {
+        x = minX * tileWidth;
+        y = minY * tileHeight;
+        w = ((maxX + 1) * tileWidth > width) ? (width - x) : ((maxX - minX + 1) * tileWidth);
+        h = ((maxY + 1) * tileHeight > height) ? (height - y) : ((maxY - minY + 1) * tileHeight);
+        return true;
+    }
+}
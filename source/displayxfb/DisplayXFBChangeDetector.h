@@ -0,0 +1,48 @@
+/** @file   DisplayXFBChangeDetector.h
+ *  @brief  Low cost detection of framebuffer content changes.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBChangeDetector_H
+#define COM_TSONIQ_DisplayXFBChangeDetector_H   (1)
+
+#include <stdint.h>
+#include "DisplayXFBNames.h"
+
+
+/** Class used to detect probable changes to the framebuffer content by sampling.
+ *
+ *  The frame is divided in to a fixed grid of tiles. Each update hashes a few sparse rows of every tile (reading
+ *  every kPixelStep'th pixel) and compares the result with the hash of the same samples taken kPhases updates
+ *  earlier. The sampled rows and columns move on each update, so most drawing is seen on the first frame. Changes
+ *  smaller than the sampling grid (for example, a single pixel) may be missed: the result means that the content
+ *  has probably changed, and roughly where. Clients needing exact results must still compare the data themselves.
+ */
+class DisplayXFBChangeDetector
+{
+public:
+
+    static const unsigned kTilesX = 16;             //! Number of tile columns
+    static const unsigned kTilesY = 16;             //! Number of tile rows
+    static const unsigned kPhases = 4;              //! Number of updates needed to cover every row
+    static const unsigned kRowsPerPhase = 4;        //! Rows sampled per tile on each update
+    static const unsigned kPixelStep = 4;           //! Horizontal sampling interval (pixels)
+
+    DisplayXFBChangeDetector() { reset(); }
+
+    void reset();
+    bool update(const uint32_t* pixels, unsigned width, unsigned height, unsigned bytesPerRow,
+                unsigned& x, unsigned& y, unsigned& w, unsigned& h);
+
+private:
+
+    uint32_t m_hash[kPhases][kTilesY][kTilesX];     //! Tile hashes for each sampling phase
+    bool m_primed[kPhases];                         //! Logical true once m_hash[phase] holds valid data
+    unsigned m_phase;                               //! The phase for the next update
+    unsigned m_width;                               //! The frame width for the stored hashes
+    unsigned m_height;                              //! The frame height for the stored hashes
+    unsigned m_bytesPerRow;                         //! The frame stride for the stored hashes
+};
+
+#endif      // COM_TSONIQ_DisplayXFBChangeDetector_H
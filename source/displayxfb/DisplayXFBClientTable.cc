@@ -0,0 +1,176 @@
+/** @file   DisplayXFBClientTable.cc
+ *  @brief  Registry of the user-clients that currently have the driver open.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBClientTable.h"
+
+using namespace ts;
+
+
+/** Allocate the table.
+ *
+ *  @param  initialCapacity     The initial number of slots (rounded up to a power of two).
+ *  @param  limit               The maximum number of clients that may be inserted.
+ *  @return                     Logical true for success, false if no memory is available.
+ */
+bool DisplayXFBClientTable::initialise(unsigned initialCapacity, unsigned limit)
+{
+    finalise();
+
+    unsigned capacity = 4;
+    while (capacity < initialCapacity) capacity <<= 1;
+
+    m_limit = limit;
+    m_nextIdent = 1;
+    return resize(capacity);
+}
+
+
+/** Release the table storage.
+ */
+void DisplayXFBClientTable::finalise()
+{
+    if (m_slots) IOFree(m_slots, m_capacity * sizeof m_slots[0]);
+    m_slots = 0;
+    m_capacity = 0;
+    m_count = 0;
+    m_peak = 0;
+}
+
+
+/** Add a client.
+ *
+ *  @param  client      The client to add.
+ *  @return             Logical true for success, false if the client is already present, the client limit has
+ *                      been reached or no memory is available.
+ */
+bool DisplayXFBClientTable::insert(const IOService* client)
+{
+    if (!client || !m_slots || m_count >= m_limit || contains(client)) return false;
+
+    // Keep the load factor at or below one half, so that probe sequences stay short.
+    if ((m_count + 1) * 2 > m_capacity && !resize(m_capacity * 2)) return false;
+
+    unsigned mask = m_capacity - 1;
+    unsigned index = home(client);
+    while (m_slots[index].m_client) index = (index + 1) & mask;
+
+    m_slots[index].m_client = client;
+    m_slots[index].m_statistics.initialise(m_nextIdent++);
+    m_count ++;
+    if (m_count > m_peak) m_peak = m_count;
+    return true;
+}
+
+
+/** Remove a client.
+ *
+ *  @param  client      The client to remove.
+ *  @return             Logical true if the client was removed, false if it was not present.
+ */
+bool DisplayXFBClientTable::remove(const IOService* client)
+{
+    unsigned index = find(client);
+    if (index == m_capacity) return false;
+
+    // Backward-shift deletion: move any following entries that are displaced from their home slot in to
+    // the hole, so that lookups never need tombstones.
+    unsigned mask = m_capacity - 1;
+    unsigned hole = index;
+    unsigned next = (hole + 1) & mask;
+    while (m_slots[next].m_client)
+    {
+        unsigned want = home(m_slots[next].m_client);
+        if (((next - want) & mask) >= ((next - hole) & mask))
+        {
+            m_slots[hole] = m_slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    m_slots[hole].m_client = 0;
+    m_count --;
+    return true;
+}
+
+
+/** Return the statistics record for a client.
+ *
+ *  @param  client      The client.
+ *  @return             The client's statistics, or zero if the client is not present. The pointer is valid only
+ *                      until the next insert() or remove().
+ */
+DisplayXFBClientStatistics* DisplayXFBClientTable::statistics(const IOService* client)
+{
+    unsigned index = find(client);
+    if (index == m_capacity) return 0;
+
+    DisplayXFBClientStatistics* stats = &m_slots[index].m_statistics;
+    stats->m_clientCount = m_count;
+    stats->m_clientPeak = m_peak;
+    return stats;
+}
+
+
+/** Return the preferred slot for a client.
+ */
+unsigned DisplayXFBClientTable::home(const IOService* client) const
+{
+    // Objects are at least 16 byte aligned, so discard the low bits and mix the rest (Fibonacci hashing).
+    uint64_t key = ((uint64_t)(uintptr_t)client) >> 4;
+    return (unsigned)((key * 0x9e3779b97f4a7c15ull) >> 32) & (m_capacity - 1);
+}
+
+
+/** Find the slot holding a client.
+ *
+ *  @return             The slot index, or m_capacity if the client is not present.
+ */
+unsigned DisplayXFBClientTable::find(const IOService* client) const
+{
+    if (!client || !m_slots) return m_capacity;
+
+    unsigned mask = m_capacity - 1;
+    unsigned index = home(client);
+    while (m_slots[index].m_client)
+    {
+        if (m_slots[index].m_client == client) return index;
+        index = (index + 1) & mask;
+    }
+    return m_capacity;
+}
+
+
+/** Change the table allocation, re-hashing all entries.
+ *
+ *  @param  newCapacity     The new slot count. Must be a power of two and greater than the current client count.
+ *  @return                 Logical true for success, false if no memory is available (the table is unchanged).
+ */
+bool DisplayXFBClientTable::resize(unsigned newCapacity)
+{
+    Slot* newSlots = (Slot*)IOMalloc(newCapacity * sizeof newSlots[0]);
+    if (!newSlots) return false;
+    bzero(newSlots, newCapacity * sizeof newSlots[0]);
+
+    Slot* oldSlots = m_slots;
+    unsigned oldCapacity = m_capacity;
+
+    m_slots = newSlots;
+    m_capacity = newCapacity;
+
+    unsigned mask = m_capacity - 1;
+    for (unsigned i = 0; i < oldCapacity; i++)
+    {
+        if (oldSlots[i].m_client)
+        {
+            unsigned index = home(oldSlots[i].m_client);
+            while (m_slots[index].m_client) index = (index + 1) & mask;
+            m_slots[index] = oldSlots[i];
+        }
+    }
+
+    if (oldSlots) IOFree(oldSlots, oldCapacity * sizeof oldSlots[0]);
+    return true;
+}
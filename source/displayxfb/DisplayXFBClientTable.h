@@ -0,0 +1,65 @@
+/** @file   DisplayXFBClientTable.h
+ *  @brief  Registry of the user-clients that currently have the driver open.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBClientTable_H
+#define COM_TSONIQ_DisplayXFBClientTable_H   (1)
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOLib.h>
+#include "DisplayXFBNames.h"
+#include "DisplayXFBShared.h"
+
+
+/** A growable set of open clients, each with its own statistics record.
+ *
+ *  The table is an open-addressed hash keyed by the client pointer, using linear probing and backward-shift
+ *  deletion, so insert, remove and lookup are constant time on average. The table doubles in size when it becomes
+ *  half full, up to a hard limit on the number of clients. The class performs no locking - the owner must serialise
+ *  access.
+ */
+class DisplayXFBClientTable
+{
+public:
+
+    DisplayXFBClientTable() : m_slots(0), m_capacity(0), m_count(0), m_peak(0), m_limit(0), m_nextIdent(0) { }
+    ~DisplayXFBClientTable() { finalise(); }
+
+    bool initialise(unsigned initialCapacity, unsigned limit);
+    void finalise();
+
+    bool insert(const IOService* client);
+    bool remove(const IOService* client);
+    bool contains(const IOService* client) const { return find(client) != m_capacity; }
+    ts::DisplayXFBClientStatistics* statistics(const IOService* client);
+
+    unsigned count() const { return m_count; }              //! Return the number of clients in the table
+    unsigned peak() const { return m_peak; }                //! Return the highest number of clients seen
+    unsigned capacity() const { return m_capacity; }        //! Return the current table allocation (slots)
+
+private:
+
+    struct Slot
+    {
+        const IOService* m_client;                          //! The client, or zero if the slot is empty
+        ts::DisplayXFBClientStatistics m_statistics;        //! The client's statistics
+    };
+
+    Slot* m_slots;                                          //! The slot array (m_capacity entries, a power of two)
+    unsigned m_capacity;                                    //! The number of slots
+    unsigned m_count;                                       //! The number of occupied slots
+    unsigned m_peak;                                        //! The highest value of m_count
+    unsigned m_limit;                                       //! The maximum permitted value of m_count
+    uint32_t m_nextIdent;                                   //! The next client ident to assign
+
+    unsigned home(const IOService* client) const;
+    unsigned find(const IOService* client) const;
+    bool resize(unsigned newCapacity);
+
+    DisplayXFBClientTable(const DisplayXFBClientTable&);            // Prevent copy constructor
+    DisplayXFBClientTable& operator=(const DisplayXFBClientTable&); // Prevent assignment
+};
+
+#endif      // COM_TSONIQ_DisplayXFBClientTable_H
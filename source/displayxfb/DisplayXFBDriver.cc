@@ -56,7 +56,9 @@ bool DisplayXFBDriver::init(OSDictionary* dictionary)
     memset(m_displayName, 0, sizeof m_displayName);
     m_accelerator = 0;
     for (unsigned i = 0; i < sizeof m_framebuffers / sizeof m_framebuffers[0]; i++) m_framebuffers[i] = 0;
-    for (unsigned i = 0; i < sizeof m_clients / sizeof m_clients[0]; i++) m_clients[i] = 0;
+    m_clientLock = 0;
+    m_mapLock = 0;
+    m_mapCache = 0;
 
 
     // Validate expiry date. Very crude protection against permanent use.
@@ -83,6 +85,15 @@ bool DisplayXFBDriver::init(OSDictionary* dictionary)
     if (!super::init(dictionary)) return false;
 
 
+    // Create the client registry. This starts small and grows as clients are opened.
+    m_clientLock = IOLockAlloc();
+    if (!m_clientLock) return false;
+    if (!m_clients.initialise(8, kDisplayXFBMaxClients)) return false;
+
+    m_mapLock = IOLockAlloc();
+    if (!m_mapLock) return false;
+
+
     // Read the configuration to use from the plist entries.
     getPropertyU32(&m_displayCount, kDisplayXFBKeyDisplayCount, 1, kDisplayXFBMaxDisplays, 1);
     getPropertyU32(&m_vramSize, kDisplayXFBKeyVRAMSize, kDisplayXFBMinVRAMSize, kDisplayXFBMaxVRAMSize, kDisplayXFBDefaultVRAMSize);
@@ -101,9 +112,28 @@ void DisplayXFBDriver::free()
 {
     TSTrace();
 
-    for (unsigned i = 0; i < sizeof m_clients / sizeof m_clients[0]; i++)
+    if (m_clients.count() != 0) IOLog("Driver being freed with open client(s)\n");
+    m_clients.finalise();
+
+    if (m_clientLock)
+    {
+        IOLockFree(m_clientLock);
+        m_clientLock = 0;
+    }
+
+    if (m_mapCache) IOLog("Driver being freed with active mapping(s)\n");
+    while (m_mapCache)
     {
-        if (m_clients[i] != 0) { IOLog("Driver being freed with open client(s)\n"); break; }
+        MapCacheEntry* entry = m_mapCache;
+        m_mapCache = entry->m_next;
+        entry->m_map->release();
+        IOFree(entry, sizeof *entry);
+    }
+
+    if (m_mapLock)
+    {
+        IOLockFree(m_mapLock);
+        m_mapLock = 0;
     }
 
     super::free();
@@ -282,24 +312,13 @@ bool DisplayXFBDriver::handleOpen(IOService* forClient, IOOptionBits options, vo
         TSLog("Open with null client denied");
         return false;
     }
-    else if (handleIsOpen(forClient))
-    {
-        TSLog("Duplicate client-open request");
-        return false;
-    }
     else
     {
-        TSLog("Open client");
-        for (unsigned i = 0; i < sizeof m_clients / sizeof m_clients[0]; i++)
-        {
-            if (0 == m_clients[i])
-            {
-                m_clients[i] = forClient;
-                return true;
-            }
-        }
-        TSLog("Too many clients open");
-        return false;
+        IOLockLock(m_clientLock);
+        bool ok = m_clients.insert(forClient);
+        IOLockUnlock(m_clientLock);
+        if (!ok) TSLog("Duplicate client-open request or too many clients open");
+        return ok;
     }
 }
 
@@ -310,10 +329,9 @@ void DisplayXFBDriver::handleClose(IOService* forClient, IOOptionBits options)
 {
     TSTrace();
     (void)options;
-    for (unsigned i = 0; i < sizeof m_clients / sizeof m_clients[0]; i++)
-    {
-        if (forClient == m_clients[i]) m_clients[i] = 0;
-    }
+    IOLockLock(m_clientLock);
+    m_clients.remove(forClient);
+    IOLockUnlock(m_clientLock);
 }
 
 
@@ -322,11 +340,10 @@ void DisplayXFBDriver::handleClose(IOService* forClient, IOOptionBits options)
 bool DisplayXFBDriver::handleIsOpen(const IOService* forClient) const
 {
     TSTrace();
-    for (unsigned i = 0; i < sizeof m_clients / sizeof m_clients[0]; i++)
-    {
-        if (forClient == m_clients[i]) return true;
-    }
-    return false;
+    IOLockLock(m_clientLock);
+    bool isOpen = m_clients.contains(forClient);
+    IOLockUnlock(m_clientLock);
+    return isOpen;
 }
 
 
@@ -559,24 +576,193 @@ IOReturn DisplayXFBDriver::userClientDisconnect(unsigned displayIndex)
 }
 
 
+/** Connect or disconnect a set of displays together.
+ *
+ *  The state of every display is changed first, and only then are the connect interrupts raised, back to back. The
+ *  window server therefore sees all of the changes in a single reconfiguration pass instead of one per display.
+ *
+ *  @param  displayMask     Bit mask of the displays to change (bit n set for display n).
+ *  @param  connect         Logical true to connect the displays, false to disconnect them.
+ *  @return                 An IOReturn code. Displays already in the requested state are skipped. If any display
+ *                          could not be changed, the first failure is returned (other displays are still changed).
+ */
+IOReturn DisplayXFBDriver::userClientConnectMask(uint32_t displayMask, bool connect)
+{
+    TSTrace();
+    if (0 != (displayMask >> kDisplayXFBMaxDisplays)) return kIOReturnNotFound;
+
+    IOReturn status = kIOReturnSuccess;
+    uint32_t changedMask = 0;
+    for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+    {
+        if (0 == (displayMask & (1u << i))) continue;
+
+        com_tsoniq_driver_DisplayXFBFramebuffer* device = indexToFramebuffer(i);
+        if (!device)
+        {
+            if (kIOReturnSuccess == status) status = kIOReturnNotFound;
+            continue;
+        }
+
+        IOReturn deviceStatus;
+        if (connect)
+        {
+            deviceStatus = device->userClientConnect(true);
+            if (kIOReturnNotPermitted == deviceStatus) continue;    // Already connected
+        }
+        else
+        {
+            deviceStatus = device->userClientDisconnect(true);
+            if (kIOReturnNotPermitted == deviceStatus) continue;    // Already disconnected
+        }
+
+        if (kIOReturnSuccess == deviceStatus) changedMask |= (1u << i);
+        else if (kIOReturnSuccess == status) status = deviceStatus;
+    }
+
+    for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+    {
+        if (0 != (changedMask & (1u << i))) indexToFramebuffer(i)->raiseConnectInterrupt();
+    }
+
+    return status;
+}
+
+
 /** Map the shared data in to a client's address space.
+ *
+ *  Mappings are cached per task. If the task already holds a current mapping for the same object, that mapping
+ *  is shared rather than creating a new one. A mapping is current if the framebuffer has not reallocated the
+ *  memory since the mapping was made (see DisplayXFBFramebuffer::mapGeneration()).
  *
  *  @param  readOnly        Logical true to create a read-only mapping.
  *  @param  task            The task to map the data to.
  *  @param  displayIndex    The display index.
  *  @param  mapType         The object to be mapped.
- *  @return                 An IOMemoryMap for the data, or zero if failed. Ownership of the object
- *                          is passed to the caller (releasing it will remove the mapping).
+ *  @param  generation      Returns the map generation.
+ *  @return                 An IOMemoryMap for the data, or zero if failed. A reference is passed to the caller,
+ *                          which must be returned via userClientUnmapInTask() before being released.
+ */
+IOMemoryMap* DisplayXFBDriver::userClientMapInTask(bool readOnly, task_t task, unsigned displayIndex, unsigned mapType, uint32_t* generation)
+{
+    TSTrace();
+    com_tsoniq_driver_DisplayXFBFramebuffer* device = indexToFramebuffer(displayIndex);
+    if (!device) return 0;
+
+    uint32_t currentGeneration = device->mapGeneration();
+    IOMemoryMap* map = 0;
+
+    IOLockLock(m_mapLock);
+
+    for (MapCacheEntry* entry = m_mapCache; entry; entry = entry->m_next)
+    {
+        if (entry->m_task == task && entry->m_displayIndex == displayIndex && entry->m_mapType == mapType &&
+            entry->m_readOnly == readOnly && entry->m_generation == currentGeneration)
+        {
+            entry->m_users ++;
+            map = entry->m_map;
+            map->retain();
+            break;
+        }
+    }
+
+    if (!map)
+    {
+        MapCacheEntry* entry = (MapCacheEntry*)IOMalloc(sizeof *entry);
+        if (entry)
+        {
+            map = device->userClientMapInTask(readOnly, task, mapType);
+            if (!map)
+            {
+                IOFree(entry, sizeof *entry);
+            }
+            else
+            {
+                entry->m_task = task;
+                entry->m_displayIndex = displayIndex;
+                entry->m_mapType = mapType;
+                entry->m_readOnly = readOnly;
+                entry->m_generation = currentGeneration;
+                entry->m_map = map;
+                entry->m_users = 1;
+                entry->m_next = m_mapCache;
+                m_mapCache = entry;
+                map->retain();                      // One reference for the cache, one for the caller
+            }
+        }
+    }
+
+    IOLockUnlock(m_mapLock);
+
+    if (map && generation) *generation = currentGeneration;
+    return map;
+}
+
+
+/** Return a mapping obtained from userClientMapInTask(). The caller should release its own reference afterwards.
+ *  The mapping is removed from the task when the last user-client has returned it.
+ *
+ *  @param  map             The mapping.
  */
-IOMemoryMap* DisplayXFBDriver::userClientMapInTask(bool readOnly, task_t task, unsigned displayIndex, unsigned mapType)
+void DisplayXFBDriver::userClientUnmapInTask(IOMemoryMap* map)
 {
     TSTrace();
+    if (!map) return;
+
+    IOLockLock(m_mapLock);
+    MapCacheEntry** link = &m_mapCache;
+    while (*link)
+    {
+        MapCacheEntry* entry = *link;
+        if (entry->m_map == map)
+        {
+            if (0 == --entry->m_users)
+            {
+                *link = entry->m_next;
+                entry->m_map->release();
+                IOFree(entry, sizeof *entry);
+            }
+            break;
+        }
+        link = &entry->m_next;
+    }
+    IOLockUnlock(m_mapLock);
+}
+
+
+/** Return the shared memory generation for a display.
+ *
+ *  @param  displayIndex    The display index.
+ *  @return                 The generation, or zero if the display does not exist.
+ */
+unsigned DisplayXFBDriver::mapGeneration(unsigned displayIndex) const
+{
     com_tsoniq_driver_DisplayXFBFramebuffer* device = indexToFramebuffer(displayIndex);
-    return (device) ? device->userClientMapInTask(readOnly, task, mapType) : 0;
+    return (device) ? device->mapGeneration() : 0;
 }
 
 
 
+/** Return the statistics for a client.
+ *
+ *  @param  client          The client (user-client instance).
+ *  @param  stats           Returns the statistics.
+ *  @return                 An IOReturn code.
+ */
+IOReturn DisplayXFBDriver::userClientGetStatistics(const IOService* client, DisplayXFBClientStatistics* stats)
+{
+    TSTrace();
+    if (!stats) return kIOReturnBadArgument;
+
+    IOLockLock(m_clientLock);
+    const DisplayXFBClientStatistics* entry = m_clients.statistics(client);
+    if (entry) *stats = *entry;
+    IOLockUnlock(m_clientLock);
+
+    return (entry) ? kIOReturnSuccess : kIOReturnNotOpen;
+}
+
+
 /** Check if a display index references a display.
  *
  *  @param  displayIndex    The display number.
@@ -610,6 +796,8 @@ void DisplayXFBDriver::sendNotification(uint32_t code, const com_tsoniq_driver_D
             case kDisplayXFBNotificationDisplayState:
             case kDisplayXFBNotificationCursorState:
             case kDisplayXFBNotificationCursorImage:
+            case kDisplayXFBNotificationDisplayMode:
+            case kDisplayXFBNotificationFrameChanged:
                 messageClients(code, (void*)(uintptr_t)displayIndex);
                 break;
 
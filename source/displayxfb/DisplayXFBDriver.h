@@ -13,6 +13,7 @@
 #include "DisplayXFBFramebuffer.h"
 #include "DisplayXFBShared.h"
 #include "DisplayXFBAccelerator.h"
+#include "DisplayXFBClientTable.h"
 
 class DisplayXFBDriver : public IOService
 {
@@ -41,7 +42,11 @@ public:
     IOReturn userClientGetState(ts::DisplayXFBState* state, uint32_t displayIndex);
     IOReturn userClientConnect(unsigned displayIndex);
     IOReturn userClientDisconnect(unsigned displayIndex);
-    IOMemoryMap* userClientMapInTask(bool readOnly, task_t task, unsigned displayIndex, unsigned mapType);
+    IOReturn userClientConnectMask(uint32_t displayMask, bool connect);
+    IOMemoryMap* userClientMapInTask(bool readOnly, task_t task, unsigned displayIndex, unsigned mapType, uint32_t* generation);
+    void userClientUnmapInTask(IOMemoryMap* map);
+    unsigned mapGeneration(unsigned displayIndex) const;
+    IOReturn userClientGetStatistics(const IOService* client, ts::DisplayXFBClientStatistics* stats);
     bool validateDisplayIndex(unsigned displayIndex) const;
 
     // Methods that are used from com_tsoniq_driver_DisplayXFBFramebuffer.
@@ -52,12 +57,30 @@ public:
 
 private:
 
+    /** Entry in the per-task mapping cache. Mappings are shared between all user-clients in a task, so that
+     *  repeated or concurrent map requests do not create new VM objects.
+     */
+    struct MapCacheEntry
+    {
+        MapCacheEntry* m_next;                                              //! The next entry, or zero
+        task_t m_task;                                                      //! The task holding the mapping
+        unsigned m_displayIndex;                                            //! The display index
+        unsigned m_mapType;                                                 //! The map type (kDisplayXFBMapTypeXyz)
+        bool m_readOnly;                                                    //! Logical true if the mapping is read-only
+        uint32_t m_generation;                                              //! The framebuffer map generation when mapped
+        IOMemoryMap* m_map;                                                 //! The mapping (retained by the cache)
+        unsigned m_users;                                                   //! The number of user-client references
+    };
+
     unsigned m_displayCount;                                                //! The number of display nubs that were created
     unsigned m_vramSize;                                                    //! The VRAM size (bytes)
     char m_displayName[32];                                                 //! The display name
     com_tsoniq_driver_DisplayXFBAccelerator* m_accelerator;                 //! The accelerator, or zero if not available
     com_tsoniq_driver_DisplayXFBFramebuffer* m_framebuffers[ts::kDisplayXFBMaxDisplays];  //! Array of one frame buffer per display
-    IOService* m_clients[ts::kDisplayXFBMaxClients];                        //! Array of currently attached user-clients
+    IOLock* m_clientLock;                                                   //! Lock protecting m_clients
+    com_tsoniq_driver_DisplayXFBClientTable m_clients;                      //! The currently attached user-clients
+    IOLock* m_mapLock;                                                      //! Lock protecting m_mapCache
+    MapCacheEntry* m_mapCache;                                              //! List of active mappings
 
     com_tsoniq_driver_DisplayXFBFramebuffer* indexToFramebuffer(unsigned displayIndex) const;
     bool getPropertyU32(unsigned* value, const char* key, unsigned minValue, unsigned maxValue, unsigned defValue) const;
@@ -13,6 +13,7 @@
 #include <IOKit/graphics/IOGraphicsInterfaceTypes.h>
 #include <IOKit/ndrvsupport/IOMacOSVideo.h>
 #include <libkern/OSByteOrder.h>
+#include <libkern/OSAtomic.h>
 
 using namespace ts;
 
@@ -145,12 +146,17 @@ bool DisplayXFBFramebuffer::start(IOService* provider)
     m_vramSize = 0;
     m_vblankWorkLoop = 0;
     m_vblankTimerEventSource = 0;
+    m_commandGate = 0;
+    m_stateSequence = 0;
     m_vblankPeriodUS = 0;
     //m_vblankTiming;
     m_vblankTimerIsEnabled = false;
     m_displayMemory = 0;
     m_cursorMemory = 0;
     m_cursor = 0;
+    m_statusMemory = 0;
+    m_status = 0;
+    m_mapGeneration = 0;
     m_connectInterruptHandler.init();
     m_vblankInterruptHandler.init();
     m_configuration.invalidate();
@@ -208,10 +214,21 @@ bool DisplayXFBFramebuffer::start(IOService* provider)
     // indicates that the timer will not be used.
     // To support this, we create a dedicated work loop here. IOFramebuffer overrides getWorkLoop() to do some
     // undocumented things and will return NULL if called at this point.
+    // The same work loop also carries the command gate that serialises state changes, so that the vblank timer
+    // always sees a consistent configuration.
     m_vblankWorkLoop = IOWorkLoop::workLoop();
     if (!m_vblankWorkLoop) TSLog("no vblank workloop");
     else
     {
+        m_commandGate = IOCommandGate::commandGate(this);
+        if (!m_commandGate) TSLog("no command gate");
+        else if (kIOReturnSuccess != m_vblankWorkLoop->addEventSource(m_commandGate))
+        {
+            TSLog("Error adding command gate");
+            m_commandGate->release();
+            m_commandGate = 0;
+        }
+
         m_vblankTimerEventSource = IOTimerEventSource::timerEventSource(this, (IOTimerEventSource::Action)&DisplayXFBFramebuffer::vblankEventHandler);
         if (!m_vblankTimerEventSource) TSLog("no vblank event source");
         else
@@ -251,6 +268,13 @@ void DisplayXFBFramebuffer::stop(IOService* provider)
         m_vblankTimerEventSource = 0;
     }
 
+    if (m_commandGate)
+    {
+        if (m_vblankWorkLoop) m_vblankWorkLoop->removeEventSource(m_commandGate);
+        m_commandGate->release();
+        m_commandGate = 0;
+    }
+
     if (m_vblankWorkLoop)
     {
         m_vblankWorkLoop->release();
@@ -264,6 +288,9 @@ void DisplayXFBFramebuffer::stop(IOService* provider)
     }
 
     m_cursor = 0;
+    if (m_status) m_status->retire();
+    m_status = 0;
+    sharedMemoryFree(&m_statusMemory);
     sharedMemoryFree(&m_cursorMemory);
     sharedMemoryFree(&m_displayMemory);
 
@@ -304,6 +331,19 @@ IOReturn DisplayXFBFramebuffer::enableController()
         if (!m_cursor) { status = kIOReturnNoMemory; break; }
         m_cursor->initialise();
 
+        // Allocate and initialise the status page.
+        status = sharedMemoryAlloc(&m_statusMemory, (unsigned)sizeof (ts::DisplayXFBStatus), false);
+        if (kIOReturnSuccess != status) break;
+
+        m_status = (DisplayXFBStatus*)m_statusMemory->getBytesNoCopy();
+        if (!m_status) { status = kIOReturnNoMemory; break; }
+        m_status->initialise();
+
+        // Any existing client mappings refer to the old memory.
+        m_mapGeneration ++;
+        stateWriteBegin();
+        stateWriteEnd();
+
 
         // Register the power management states
         // Do not need to call PMinit()/PMstop() as this is handled in the super-class.
@@ -316,6 +356,10 @@ IOReturn DisplayXFBFramebuffer::enableController()
     // Clean up if there was an error.
     if (kIOReturnSuccess != status)
     {
+        m_cursor = 0;
+        if (m_status) m_status->retire();
+        m_status = 0;
+        sharedMemoryFree(&m_statusMemory);
         sharedMemoryFree(&m_cursorMemory);
         sharedMemoryFree(&m_displayMemory);
     }
@@ -729,19 +773,14 @@ IOReturn DisplayXFBFramebuffer::getTimingInfoForDisplayMode(IODisplayModeID disp
  */
 IOReturn DisplayXFBFramebuffer::setDisplayMode(IODisplayModeID displayMode, IOIndex depth)
 {
-    unsigned modeIndex = ((unsigned)displayMode) - 1;
-    if (0 == depth && modeIndex < m_configuration.modeCount())
+    IOReturn status = runGated(kCommandSetDisplayMode, (void*)(intptr_t)displayMode, (void*)(intptr_t)depth);
+    if (kIOReturnSuccess == status)
     {
-        m_state.setMode(m_configuration.mode(modeIndex), modeIndex);
+        // Clients that predate kDisplayXFBNotificationDisplayMode expect a display state change on a mode switch.
+        m_provider->sendNotification(kDisplayXFBNotificationDisplayMode, this);
         m_provider->sendNotification(kDisplayXFBNotificationDisplayState, this);
-        TSLog("success : modeIndex %u", modeIndex);
-        return kIOReturnSuccess;
-    }
-    else
-    {
-        TSLog("fail : modeIndex %u", modeIndex);
-        return kIOReturnUnsupported;
     }
+    return status;
 }
 
 
@@ -900,57 +939,9 @@ IOReturn DisplayXFBFramebuffer::getDDCBlock(
      */
     IOReturn DisplayXFBFramebuffer::setCursorImage(void* cursorImage)
     {
-        // Create a description of the hardware format that we support (just ARGB32 in our case).
-        IOHardwareCursorDescriptor description;
-        memset(&description, 0, sizeof description);
-        description.majorVersion = kHardwareCursorDescriptorMajorVersion;
-        description.minorVersion = kHardwareCursorDescriptorMinorVersion;
-        description.height = DisplayXFBCursor::kMaxHeight;
-        description.width = DisplayXFBCursor::kMaxWidth;
-        description.bitDepth = kIO32ARGBPixelFormat;
-        description.numColors = 0;
-        description.colorEncodings = 0;
-        description.flags = 0;
-        description.supportedSpecialEncodings = 0;
-
-        // Create a description of the cursor data.
-        IOHardwareCursorInfo info;
-        memset(&info, 0, sizeof info);
-        info.majorVersion = kHardwareCursorInfoMajorVersion;        // Structure version
-        info.minorVersion = kHardwareCursorInfoMinorVersion;        //
-        info.cursorHeight = 0;                                      // Returns the actual cursor height
-        info.cursorWidth = 0;                                       // Returns the actual cursor width
-        info.colorMap = 0;                                          // No indexed colours
-        info.hardwareCursorData = (UInt8*)m_cursor->m_pixelData;    // Pointer to the memory to receive the image
-        info.cursorHotSpotX = 0;                                    // Returns the host spot position
-        info.cursorHotSpotY = 0;                                    // Returns the host spot position
-
-        // Convert the cursor data.
-        bool ok = convertCursorImage(cursorImage, &description, &info);
-        IOReturn status;
-        if (!ok)
-        {
-            m_cursor->m_isValid = 0;
-            status = kIOReturnUnsupported;
-            static bool didWarn = false;
-            if (!didWarn)
-            {
-                didWarn = true;
-                IOLog("DisplayX: convertCursorImage failed\n");
-            }
-        }
-        else
-        {
-            m_cursor->m_hotspotX = info.cursorHotSpotX;
-            m_cursor->m_hotspotY = info.cursorHotSpotY;
-            m_cursor->m_width = info.cursorWidth;
-            m_cursor->m_height = info.cursorHeight;
-            m_cursor->m_isValid = 1;
-            m_provider->sendNotification(kDisplayXFBNotificationCursorImage, this);
-            status = kIOReturnSuccess;
-        }
+        IOReturn status = runGated(kCommandSetCursorImage, cursorImage);
+        if (kIOReturnSuccess == status) m_provider->sendNotification(kDisplayXFBNotificationCursorImage, this);
         return status;
-
     }
 
 
@@ -963,11 +954,9 @@ IOReturn DisplayXFBFramebuffer::getDDCBlock(
      */
     IOReturn DisplayXFBFramebuffer::setCursorState(SInt32 x, SInt32 y, bool visible)
     {
-        m_cursor->m_x = x;
-        m_cursor->m_y = y;
-        m_cursor->m_isVisible = (visible) ? 1 : 0;
-        m_provider->sendNotification(kDisplayXFBNotificationCursorState, this);
-        return kIOReturnSuccess;
+        IOReturn status = runGated(kCommandSetCursorState, (void*)(intptr_t)x, (void*)(intptr_t)y, (void*)(uintptr_t)visible);
+        if (kIOReturnSuccess == status) m_provider->sendNotification(kDisplayXFBNotificationCursorState, this);
+        return status;
     }
 
 
@@ -1005,6 +994,28 @@ void DisplayXFBFramebuffer::vblankEventEnable(bool enable)
 
 
 
+/** Sample the frame for content changes, publishing any change to the status page and to subscribed clients.
+ *  Called from the vblank timer, on the work loop (so the state can not change underneath it).
+ */
+void DisplayXFBFramebuffer::vblankDetectChanges()
+{
+    if (!m_status || !m_displayMemory || !m_state.isConnected()) return;
+    if ((m_state.offset() + m_state.bytesPerFrame()) > m_vramSize) return;
+
+    const uint8_t* base = (const uint8_t*)m_displayMemory->getBytesNoCopy();
+    if (!base) return;
+
+    unsigned x, y, w, h;
+    if (m_changeDetector.update((const uint32_t*)(base + m_state.offset()), m_state.width(), m_state.height(), m_state.bytesPerRow(), x, y, w, h))
+    {
+        m_status->beginUpdate();
+        m_status->recordFrameChange(x, y, w, h);
+        m_status->endUpdate();
+        m_provider->sendNotification(kDisplayXFBNotificationFrameChanged, this);
+    }
+}
+
+
 /** Helper method: allocate memory suitable for sharing with a client application.
  *
  *  @param  buffer      Returns the buffer memory descriptor. Use getBytesNoCopy() to access the memory directly.
@@ -1063,8 +1074,7 @@ IOReturn DisplayXFBFramebuffer::userClientGetConfiguration(DisplayXFBConfigurati
 {
     TSTrace();
     if (!config) return kIOReturnBadArgument;
-    *config = m_configuration;
-    return kIOReturnSuccess;
+    return runGated(kCommandGetConfiguration, config);
 }
 
 
@@ -1076,30 +1086,7 @@ IOReturn DisplayXFBFramebuffer::userClientGetConfiguration(DisplayXFBConfigurati
 IOReturn DisplayXFBFramebuffer::userClientSetConfiguration(const DisplayXFBConfiguration* config)
 {
     TSTrace();
-    if (!config) return kIOReturnBadArgument;                       // Missing config
-    if (!config->isValid()) return kIOReturnBadArgument;            // Invalid config object
-    if (0 == config->modeCount()) return kIOReturnBadArgument;      // Need at least one mode to be defined...
-    if (m_state.isConnected()) return kIOReturnBusy;                // Can't change the mode while the display is connected
-
-    // Loop through the configuration to confirm that all requested modes can be supported.
-    // We do this by briefly creating a state object for each mode and checking that there
-    // is sufficient video memory to support the mode. If any mode is not usable, the whole
-    // configuration is rejected.
-    for (unsigned i = 0; i < config->modeCount(); i++)
-    {
-        const DisplayXFBMode& mode = config->mode(i);
-        if (mode.width() < kDisplayXFBMinWidth || mode.height() < kDisplayXFBMinHeight) return kIOReturnBadArgument;    // Implausibly small size
-
-        DisplayXFBState state;
-        if (!config->makeState(state, i)) return kIOReturnBadArgument;
-        if ((state.bytesPerFrame() + kFramePadding) > m_vramSize) return kIOReturnNoMemory;
-    }
-
-    // Looks plausible.
-    m_configuration = *config;
-    m_state.setMode(m_configuration.defaultMode(), m_configuration.defaultModeIndex());
-
-    return kIOReturnSuccess;
+    return runGated(kCommandSetConfiguration, (void*)config);
 }
 
 
@@ -1107,13 +1094,29 @@ IOReturn DisplayXFBFramebuffer::userClientSetConfiguration(const DisplayXFBConfi
  *
  *  @param  state       Returns the current state data.
  *  @return             An status value.
+ *
+ *  State queries are frequent, so they do not take the command gate. Instead the state is copied optimistically and
+ *  the copy retried if it overlapped a change (m_stateSequence is odd during a change, and is incremented again
+ *  when the change completes).
  */
 IOReturn DisplayXFBFramebuffer::userClientGetState(DisplayXFBState* state)
 {
     //TSTrace();
     if (!state) return kIOReturnBadArgument;
-    *state = m_state;
-    return m_state.isValid() ? kIOReturnSuccess : kIOReturnOffline;
+    for (;;)
+    {
+        uint32_t sequence = m_stateSequence;
+        if (0 == (sequence & 1))
+        {
+            OSMemoryBarrier();
+            *state = m_state;
+            OSMemoryBarrier();
+            if (sequence == m_stateSequence) break;
+        }
+        IODelay(1);
+    }
+    state->setMapGeneration(m_mapGeneration);
+    return state->isValid() ? kIOReturnSuccess : kIOReturnOffline;
 }
 
 
@@ -1127,40 +1130,38 @@ IOReturn DisplayXFBFramebuffer::userClientGetState(DisplayXFBState* state)
  *  @note   This will start the display in the last used mode unless a preceding set-configuration request
  *          has been issued (which implicitly resets the default mode).
  *
+ *  @param  deferInterrupt  Logical true to leave the connect interrupt to the caller (see raiseConnectInterrupt()).
  */
-IOReturn DisplayXFBFramebuffer::userClientConnect()
+IOReturn DisplayXFBFramebuffer::userClientConnect(bool deferInterrupt)
 {
     TSTrace();
-    if (m_state.isConnected()) { return kIOReturnNotPermitted; }
-    else if (!m_configuration.isValid() || 0 == m_configuration.modeCount()) return kIOReturnUnsupportedMode;
-    else
+    IOReturn status = runGated(kCommandConnect);
+    if (kIOReturnSuccess == status)
     {
-        m_configuration.makeState(m_state, m_configuration.defaultModeIndex());
-        m_state.setIsConnected(true);
-        vblankEventEnable(true);
-        m_connectInterruptHandler.fire();
+        if (!deferInterrupt) m_connectInterruptHandler.fire();
         m_provider->sendNotification(kDisplayXFBNotificationDisplayState, this);
-        return kIOReturnSuccess;
     }
+    return status;
 }
 
 
 /** Handle disconnect requests, simulating a plug-in of a new monitor.
  *
- *  @return                 An IO status return.
- *                          kIOReturnNotPermitted => display was already disconnected.
+ *  @param  deferInterrupt  Logical true to leave the connect interrupt to the caller (see raiseConnectInterrupt()).
+ *  @return                 An IO status return. If deferInterrupt is set, kIOReturnNotPermitted is returned if the
+ *                          display was already disconnected (so no interrupt is needed); otherwise the result is
+ *                          always kIOReturnSuccess.
  */
-IOReturn DisplayXFBFramebuffer::userClientDisconnect()
+IOReturn DisplayXFBFramebuffer::userClientDisconnect(bool deferInterrupt)
 {
     TSTrace();
-    if (m_state.isConnected())
+    IOReturn status = runGated(kCommandDisconnect);
+    if (kIOReturnSuccess == status)
     {
-        m_state.setIsConnected(false);
-        vblankEventEnable(false);
         m_provider->sendNotification(kDisplayXFBNotificationDisplayState, this);
-        m_connectInterruptHandler.fire();
+        if (!deferInterrupt) m_connectInterruptHandler.fire();
     }
-    return kIOReturnSuccess;
+    return (deferInterrupt) ? status : kIOReturnSuccess;
 }
 
 
@@ -1182,6 +1183,7 @@ IOMemoryMap* DisplayXFBFramebuffer::userClientMapInTask(bool readOnly, task_t ta
     {
         case kDisplayXFBMapTypeDisplay:         mem = m_displayMemory;      break;
         case kDisplayXFBMapTypeCursor:          mem = m_cursorMemory;       break;
+        case kDisplayXFBMapTypeStatus:          mem = m_statusMemory;       options |= kIOMapReadOnly;  break;
         default:                                mem = 0;                    break;
     }
     return (mem) ? (mem->createMappingInTask(task, 0, options)) : 0;
@@ -1190,6 +1192,288 @@ IOMemoryMap* DisplayXFBFramebuffer::userClientMapInTask(bool readOnly, task_t ta
 
 
 
+#pragma mark    -
+#pragma mark    Gated Methods
+
+
+
+/** Execute a command with the command gate held. All changes to m_configuration, m_state and m_cursor are made
+ *  this way, so they are serialised with each other and with the vblank timer (which runs on the same work loop).
+ *  Notifications and interrupts are raised by the callers after the gate has been released, so that no foreign
+ *  locks are taken while the gate is held.
+ *
+ *  @param  command     The command to execute.
+ *  @param  arg1        Command specific argument.
+ *  @param  arg2        Command specific argument.
+ *  @param  arg3        Command specific argument.
+ *  @return             The command status.
+ */
+IOReturn DisplayXFBFramebuffer::runGated(Command command, void* arg1, void* arg2, void* arg3)
+{
+    if (m_commandGate) return m_commandGate->runAction(&DisplayXFBFramebuffer::gatedAction, (void*)(uintptr_t)command, arg1, arg2, arg3);
+    else return gatedAction(this, (void*)(uintptr_t)command, arg1, arg2, arg3);     // No gate - not expected, but not fatal
+}
+
+
+/** Command gate action, dispatching to the gated method for a command.
+ */
+IOReturn DisplayXFBFramebuffer::gatedAction(OSObject* owner, void* command, void* arg1, void* arg2, void* arg3)
+{
+    DisplayXFBFramebuffer* framebuffer = OSDynamicCast(DisplayXFBFramebuffer, owner);
+    if (!framebuffer) return kIOReturnBadArgument;
+
+    IOReturn status;
+    switch ((Command)(uintptr_t)command)
+    {
+        case kCommandGetConfiguration:
+            *(DisplayXFBConfiguration*)arg1 = framebuffer->m_configuration;
+            status = kIOReturnSuccess;
+            break;
+
+        case kCommandSetConfiguration:
+            status = framebuffer->gatedSetConfiguration((const DisplayXFBConfiguration*)arg1);
+            break;
+
+        case kCommandConnect:
+            status = framebuffer->gatedConnect();
+            break;
+
+        case kCommandDisconnect:
+            status = framebuffer->gatedDisconnect();
+            break;
+
+        case kCommandSetDisplayMode:
+            status = framebuffer->gatedSetDisplayMode((IODisplayModeID)(intptr_t)arg1, (IOIndex)(intptr_t)arg2);
+            break;
+
+        case kCommandSetCursorImage:
+            status = framebuffer->gatedSetCursorImage(arg1);
+            break;
+
+        case kCommandSetCursorState:
+            status = framebuffer->gatedSetCursorState((SInt32)(intptr_t)arg1, (SInt32)(intptr_t)arg2, 0 != (uintptr_t)arg3);
+            break;
+
+        default:
+            status = kIOReturnBadArgument;
+            break;
+    }
+    return status;
+}
+
+
+/** Mark the start of a change to m_state. Must be called with the command gate held.
+ */
+void DisplayXFBFramebuffer::stateWriteBegin()
+{
+    m_stateSequence ++;
+    OSMemoryBarrier();
+}
+
+
+/** Mark the end of a change to m_state, and publish the new state to the status page. Must be called with the
+ *  command gate held.
+ */
+void DisplayXFBFramebuffer::stateWriteEnd()
+{
+    OSMemoryBarrier();
+    m_stateSequence ++;
+
+    if (m_status)
+    {
+        const DisplayXFBState& old = m_status->m_state;
+        bool modeChanged = !old.isValid() || old.modeIndex() != m_state.modeIndex() || old.width() != m_state.width() ||
+                           old.height() != m_state.height() || old.bytesPerRow() != m_state.bytesPerRow();
+
+        m_status->beginUpdate();
+        m_status->m_state = m_state;
+        m_status->m_state.setMapGeneration(m_mapGeneration);
+        if (modeChanged) m_status->m_modeGeneration ++;
+        m_status->endUpdate();
+    }
+}
+
+
+/** Set the current configuration (gated).
+ *
+ *  @param  config      Supplies the new configuration data.
+ *  @return             An status value.
+ */
+IOReturn DisplayXFBFramebuffer::gatedSetConfiguration(const DisplayXFBConfiguration* config)
+{
+    if (!config) return kIOReturnBadArgument;                       // Missing config
+    if (!config->isValid()) return kIOReturnBadArgument;            // Invalid config object
+    if (0 == config->modeCount()) return kIOReturnBadArgument;      // Need at least one mode to be defined...
+    if (m_state.isConnected()) return kIOReturnBusy;                // Can't change the mode while the display is connected
+
+    // Loop through the configuration to confirm that all requested modes can be supported.
+    // We do this by briefly creating a state object for each mode and checking that there
+    // is sufficient video memory to support the mode. If any mode is not usable, the whole
+    // configuration is rejected.
+    for (unsigned i = 0; i < config->modeCount(); i++)
+    {
+        const DisplayXFBMode& mode = config->mode(i);
+        if (mode.width() < kDisplayXFBMinWidth || mode.height() < kDisplayXFBMinHeight) return kIOReturnBadArgument;    // Implausibly small size
+
+        DisplayXFBState state;
+        if (!config->makeState(state, i)) return kIOReturnBadArgument;
+        if ((state.bytesPerFrame() + kFramePadding) > m_vramSize) return kIOReturnNoMemory;
+    }
+
+    // Looks plausible.
+    m_configuration = *config;
+    stateWriteBegin();
+    m_state.setMode(m_configuration.defaultMode(), m_configuration.defaultModeIndex());
+    stateWriteEnd();
+
+    return kIOReturnSuccess;
+}
+
+
+/** Connect the display (gated).
+ *
+ *  @return                 An IO status return (see userClientConnect()).
+ */
+IOReturn DisplayXFBFramebuffer::gatedConnect()
+{
+    if (m_state.isConnected()) { return kIOReturnNotPermitted; }
+    else if (!m_configuration.isValid() || 0 == m_configuration.modeCount()) return kIOReturnUnsupportedMode;
+    else
+    {
+        stateWriteBegin();
+        m_configuration.makeState(m_state, m_configuration.defaultModeIndex());
+        m_state.setIsConnected(true);
+        stateWriteEnd();
+        m_changeDetector.reset();
+        vblankEventEnable(true);
+        return kIOReturnSuccess;
+    }
+}
+
+
+/** Disconnect the display (gated).
+ *
+ *  @return                 kIOReturnSuccess if the display was disconnected, kIOReturnNotPermitted if it was
+ *                          not connected.
+ */
+IOReturn DisplayXFBFramebuffer::gatedDisconnect()
+{
+    if (!m_state.isConnected()) return kIOReturnNotPermitted;
+
+    stateWriteBegin();
+    m_state.setIsConnected(false);
+    stateWriteEnd();
+    vblankEventEnable(false);
+    return kIOReturnSuccess;
+}
+
+
+/** Configure the output display mode (gated).
+ */
+IOReturn DisplayXFBFramebuffer::gatedSetDisplayMode(IODisplayModeID displayMode, IOIndex depth)
+{
+    unsigned modeIndex = ((unsigned)displayMode) - 1;
+    if (0 == depth && modeIndex < m_configuration.modeCount())
+    {
+        stateWriteBegin();
+        m_state.setMode(m_configuration.mode(modeIndex), modeIndex);
+        stateWriteEnd();
+        TSLog("success : modeIndex %u", modeIndex);
+        return kIOReturnSuccess;
+    }
+    else
+    {
+        TSLog("fail : modeIndex %u", modeIndex);
+        return kIOReturnUnsupported;
+    }
+}
+
+
+/** Set the display image for the cursor (gated).
+ *
+ *  @param  cursorImage     The new image data.
+ *  @return                 An IOStatus return.
+ */
+IOReturn DisplayXFBFramebuffer::gatedSetCursorImage(void* cursorImage)
+{
+    if (!m_cursor) return kIOReturnNotReady;
+
+    // Create a description of the hardware format that we support (just ARGB32 in our case).
+    IOHardwareCursorDescriptor description;
+    memset(&description, 0, sizeof description);
+    description.majorVersion = kHardwareCursorDescriptorMajorVersion;
+    description.minorVersion = kHardwareCursorDescriptorMinorVersion;
+    description.height = DisplayXFBCursor::kMaxHeight;
+    description.width = DisplayXFBCursor::kMaxWidth;
+    description.bitDepth = kIO32ARGBPixelFormat;
+    description.numColors = 0;
+    description.colorEncodings = 0;
+    description.flags = 0;
+    description.supportedSpecialEncodings = 0;
+
+    // Create a description of the cursor data.
+    IOHardwareCursorInfo info;
+    memset(&info, 0, sizeof info);
+    info.majorVersion = kHardwareCursorInfoMajorVersion;        // Structure version
+    info.minorVersion = kHardwareCursorInfoMinorVersion;        //
+    info.cursorHeight = 0;                                      // Returns the actual cursor height
+    info.cursorWidth = 0;                                       // Returns the actual cursor width
+    info.colorMap = 0;                                          // No indexed colours
+    info.hardwareCursorData = (UInt8*)m_cursor->m_pixelData;    // Pointer to the memory to receive the image
+    info.cursorHotSpotX = 0;                                    // Returns the host spot position
+    info.cursorHotSpotY = 0;                                    // Returns the host spot position
+
+    // Convert the cursor data.
+    m_cursor->beginPixelUpdate();
+    bool ok = convertCursorImage(cursorImage, &description, &info);
+    IOReturn status;
+    if (!ok)
+    {
+        m_cursor->m_isValid = 0;
+        status = kIOReturnUnsupported;
+        static bool didWarn = false;
+        if (!didWarn)
+        {
+            didWarn = true;
+            IOLog("DisplayX: convertCursorImage failed\n");
+        }
+    }
+    else
+    {
+        m_cursor->m_hotspotX = info.cursorHotSpotX;
+        m_cursor->m_hotspotY = info.cursorHotSpotY;
+        m_cursor->m_width = info.cursorWidth;
+        m_cursor->m_height = info.cursorHeight;
+        m_cursor->m_isValid = 1;
+        status = kIOReturnSuccess;
+    }
+    m_cursor->endPixelUpdate();
+    return status;
+}
+
+
+/** Update the cursor state (gated).
+ *
+ *  @param  x           The cursor x-position.
+ *  @param  y           The cursor y-position.
+ *  @param  visible     Logical true if the cursor is visible.
+ *  @return             An IOStatus return.
+ */
+IOReturn DisplayXFBFramebuffer::gatedSetCursorState(SInt32 x, SInt32 y, bool visible)
+{
+    if (!m_cursor) return kIOReturnNotReady;
+
+    m_cursor->beginStateUpdate();
+    m_cursor->m_x = x;
+    m_cursor->m_y = y;
+    m_cursor->m_isVisible = (visible) ? 1 : 0;
+    m_cursor->endStateUpdate();
+    return kIOReturnSuccess;
+}
+
+
+
+
 #pragma mark    -
 #pragma mark    Callbacks
 
@@ -1218,6 +1502,7 @@ void DisplayXFBFramebuffer::vblankEventHandler(OSObject* owner, IOTimerEventSour
                 // Less than 0.1ms to next tick - trigger immediately and delay for 1 full tick
                 framebuffer->m_vblankTimerEventSource->setTimeoutUS(framebuffer->m_vblankPeriodUS);
                 framebuffer->m_vblankInterruptHandler.fire();               // Trigger the vblank interrupt(s)
+                framebuffer->vblankDetectChanges();
             }
             else
             {
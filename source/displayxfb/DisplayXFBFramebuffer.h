@@ -9,9 +9,11 @@
 #include "DisplayXFBNames.h"
 #include "DisplayXFBShared.h"
 #include "DisplayXFBTiming.h"
+#include "DisplayXFBChangeDetector.h"
 
 #include <IOKit/graphics/IOFramebuffer.h>
 #include <IOKit/IOPlatformExpert.h>
+#include <IOKit/IOCommandGate.h>
 //#include <IOKit/pci/IOPCIDevice.h>
 
 
@@ -66,9 +68,11 @@ public:
     IOReturn userClientGetConfiguration(ts::DisplayXFBConfiguration* config);
     IOReturn userClientSetConfiguration(const ts::DisplayXFBConfiguration* config);
     IOReturn userClientGetState(ts::DisplayXFBState* state);
-    IOReturn userClientConnect();
-    IOReturn userClientDisconnect();
+    IOReturn userClientConnect(bool deferInterrupt=false);
+    IOReturn userClientDisconnect(bool deferInterrupt=false);
+    void raiseConnectInterrupt() { m_connectInterruptHandler.fire(); }  //! Raise a deferred connect interrupt
     IOMemoryMap* userClientMapInTask(bool readOnly, task_t task, unsigned mapType);
+    unsigned mapGeneration() const { return m_mapGeneration; }  //! Return the shared memory generation (changes on reallocation)
 
 
 private:
@@ -114,6 +118,19 @@ private:
         }
     };
 
+    /** Commands executed under the command gate (see runGated()).
+     */
+    enum Command
+    {
+        kCommandGetConfiguration,                           //! arg1 = DisplayXFBConfiguration*
+        kCommandSetConfiguration,                           //! arg1 = const DisplayXFBConfiguration*
+        kCommandConnect,                                    //! No arguments
+        kCommandDisconnect,                                 //! No arguments
+        kCommandSetDisplayMode,                             //! arg1 = IODisplayModeID, arg2 = IOIndex depth
+        kCommandSetCursorImage,                             //! arg1 = void* cursorImage
+        kCommandSetCursorState,                             //! arg1 = SInt32 x, arg2 = SInt32 y, arg3 = bool visible
+    };
+
     DisplayXFBFramebuffer(const DisplayXFBFramebuffer&);            // Prevent copy constructor
     DisplayXFBFramebuffer& operator=(const DisplayXFBFramebuffer&); // Prevent assignment
 
@@ -123,19 +140,37 @@ private:
     unsigned m_vramSize;                                        //! The maximum display width
     IOWorkLoop* m_vblankWorkLoop;                               //! Work loop used for vblank events
     IOTimerEventSource* m_vblankTimerEventSource;               //! Event source used to emulate vblank timing interrupts
+    IOCommandGate* m_commandGate;                               //! Gate serialising all state changes (on m_vblankWorkLoop)
+    volatile uint32_t m_stateSequence;                          //! Odd while m_state is being modified (see userClientGetState())
     UInt32 m_vblankPeriodUS;                                    //! The vblank interval, in microseconds
     com_tsoniq_driver_DisplayXFBTiming m_vblankTiming;          //! Timing handler
     bool m_vblankTimerIsEnabled;                                //! Logical true if the timer is enabled
     IOBufferMemoryDescriptor* m_displayMemory;                  //! The framebuffer memory description (the raw RGBA32 pixel array)
     IOBufferMemoryDescriptor* m_cursorMemory;                   //! The cursor state (DisplayXFBCursor)
     ts::DisplayXFBCursor* m_cursor;                             //! The cursor referenced by m_cursorMemory
+    IOBufferMemoryDescriptor* m_statusMemory;                   //! The status page (DisplayXFBStatus)
+    ts::DisplayXFBStatus* m_status;                             //! The status page referenced by m_statusMemory
+    com_tsoniq_driver_DisplayXFBChangeDetector m_changeDetector;//! Detects frame content changes at vblank
+    uint32_t m_mapGeneration;                                   //! Incremented each time the shared memory is allocated
     InterruptHandler m_connectInterruptHandler;                 //! Handler for connect interrupts
     InterruptHandler m_vblankInterruptHandler;                  //! Handler for VBlank interrupts
     ts::DisplayXFBConfiguration m_configuration;                //! The current configuration
     ts::DisplayXFBState m_state;                                //! The current state
 
+	static IOReturn gatedAction(OSObject* owner, void* command, void* arg1, void* arg2, void* arg3);
+	IOReturn runGated(Command command, void* arg1=0, void* arg2=0, void* arg3=0);
+	IOReturn gatedSetConfiguration(const ts::DisplayXFBConfiguration* config);
+	IOReturn gatedConnect();
+	IOReturn gatedDisconnect();
+	IOReturn gatedSetDisplayMode(IODisplayModeID displayMode, IOIndex depth);
+	IOReturn gatedSetCursorImage(void* cursorImage);
+	IOReturn gatedSetCursorState(SInt32 x, SInt32 y, bool visible);
+	void stateWriteBegin();
+	void stateWriteEnd();
+
 	static void vblankEventHandler(OSObject* owner, IOTimerEventSource* sender);
 	void vblankEventEnable(bool enable);
+	void vblankDetectChanges();
 
 	IOReturn sharedMemoryAlloc(IOBufferMemoryDescriptor** buffer, unsigned size, bool contiguous);
 	void sharedMemoryFree(IOBufferMemoryDescriptor** buffer);
@@ -20,5 +20,9 @@
 #define DisplayXFBMap                   com_tsoniq_driver_DisplayXFBMap
 #define DisplayXFBCursor                com_tsoniq_driver_DisplayXFBCursor
 #define DisplayXEDID                    com_tsoniq_driver_DisplayXEDID
+#define DisplayXFBClientTable           com_tsoniq_driver_DisplayXFBClientTable
+#define DisplayXFBClientStatistics      com_tsoniq_driver_DisplayXFBClientStatistics
+#define DisplayXFBStatus                com_tsoniq_driver_DisplayXFBStatus
+#define DisplayXFBChangeDetector        com_tsoniq_driver_DisplayXFBChangeDetector
 
 #endif      // COM_TSONIQ_DisplayXFBNames_H
@@ -13,6 +13,7 @@
  *      DisplayXFBConfiguration Structure supplying a list of modes and additional shared data (from user to driver)
  *      DisplayXFBState         Structure describing the current display state (from driver to user)
  *      DisplayXFBCursor        Structure describing the cursor position and image.
+ *      DisplayXFBClientStatistics  Per-client usage counters (from driver to user)
  *
  *  In use, the user opens the driver, returning the info structure. The user then creates a configuration specifying
  *  a list of display modes and common parameters such as refresh rate and padding information. This is passed to the
@@ -37,11 +38,11 @@ namespace ts
     // The driver version. This defines the format of structures exchanged between user and kernel land.
     // If any structural changes are made, adjust the version number accordingly.
     static const uint32_t kDisplayXFBVersionMajor   = 2;            //! The major version number (change for incompatible changes)
-    static const uint32_t kDisplayXFBVersionMinor   = 1;            //! The minor version number (change for bug-fixes or compatible changes)
+    static const uint32_t kDisplayXFBVersionMinor   = 7;            //! The minor version number (change for bug-fixes or compatible changes)
 
     // Global limits.
     static const unsigned kDisplayXFBMaxDisplays    = 4;            //! The maximum number of displays that can be used (note that there is also a hard limit of 16 displays due to the use of 16 bit integer bit-masks in some code)
-    static const unsigned kDisplayXFBMaxClients     = 8;            //! The maximum number of concurrent user-clients (must be at least 2, for the GA and the client app)
+    static const unsigned kDisplayXFBMaxClients     = 1024;         //! The maximum number of concurrent user-clients (must be at least 2, for the GA and the client app). The client table grows on demand up to this limit.
     static const unsigned kDisplayXFBMinWidth       = 320;          //! The minimum display width considered valid
     static const unsigned kDisplayXFBMinHeight      = 200;          //! The minimum display height considered valid
     static const unsigned kDisplayXFBDefaultWidth   = 1280;         //! The default display width
@@ -187,7 +188,8 @@ namespace ts
         uint32_t m_pad;                                     //! The number of padding bytes at the end of each row
         uint32_t m_flags;                                   //! Bit flags (kFlagXxx)
         uint32_t m_modeIndex;                               //! The current mode index number
-        uint32_t m_reserved[3];                             //! Reserved for future use
+        uint32_t m_mapGeneration;                           //! Changes whenever the display's shared memory is reallocated (see DisplayXFBMap)
+        uint32_t m_reserved[2];                             //! Reserved for future use
         struct DisplayXFBMode m_mode;                       //! The mode description
 
         DisplayXFBState()
@@ -201,6 +203,7 @@ namespace ts
             m_offset = off;
             m_pad = pd;
             m_flags = 0;
+            m_mapGeneration = 0;
             for (unsigned i = 0; i < sizeof m_reserved / sizeof m_reserved[0]; i++) m_reserved[i] = 0;
             m_mode = m;
         }
@@ -211,6 +214,7 @@ namespace ts
             m_offset = 0;
             m_pad = 0;
             m_flags = 0;
+            m_mapGeneration = 0;
             for (unsigned i = 0; i < sizeof m_reserved / sizeof m_reserved[0]; i++) m_reserved[i] = 0;
             m_mode.initialise();
         }
@@ -237,10 +241,12 @@ namespace ts
         unsigned bytesPerRow() const  { return pad() + (bytesPerPixel()*width()); }     //! Return the number of bytes in each row (the stride)
         unsigned bytesPerFrame() const { return bytesPerRow()*height(); }               //! Return the total frame buffer data size, excluding offset
         bool isConnected() const { return 0 != (m_flags & kFlagConnected); }            //! Return the current connection state for the display
+        unsigned mapGeneration() const { return m_mapGeneration; }                      //! Return the shared memory generation (compare with DisplayXFBMap::generation())
 
         void setOffset(unsigned o) { m_offset = (uint32_t)o; }                          //! Set the offset
         void setPad(unsigned p) { m_pad = (uint32_t)p; }                                //! Set the pad
         void setIsConnected(bool con) { m_flags = (con) ? (m_flags | kFlagConnected) : ( m_flags & ~kFlagConnected); }; //! Set the connection state
+        void setMapGeneration(unsigned g) { m_mapGeneration = (uint32_t)g; }            //! Set the shared memory generation
 
         /** Set the current mode information.
          */
@@ -397,13 +403,17 @@ namespace ts
      *
      *  @warning    This structure must be a multiple of 64 bits in length (due to kernel-user-space crossing).
      *  @note       A uint64_t is used to return the address mapping to avoid SDK & build dependent structure sizes.
+     *
+     *  Mappings are cached by the driver per task, so repeated map requests return the same address. The generation
+     *  number changes only if the underlying memory is reallocated: a client need only remap when the generation
+     *  reported in DisplayXFBState::mapGeneration() differs from the one in its map.
      */
     struct DisplayXFBMap
     {
         static const uint32_t kMagic = 0x78464261;  //! The value for m_magic ("xFBa")
 
         uint32_t m_magic;               //! The value kMagic
-        uint32_t m_reserved0;           //! Reserved
+        uint32_t m_generation;          //! The shared memory generation at the time the mapping was made
         uint64_t m_address;             //! The address of the data in the task's virtual address space, or zero if invalid.
         uint64_t m_size;                //! The size of the mapping (bytes), or zero if invalid.
 
@@ -412,10 +422,10 @@ namespace ts
             invalidate();
         }
 
-        void initialise(uint64_t initAddress, uint64_t initSize)
+        void initialise(uint64_t initAddress, uint64_t initSize, uint32_t initGeneration=0)
         {
             m_magic = kMagic;
-            m_reserved0 = 0;
+            m_generation = initGeneration;
             m_address = initAddress;
             m_size = initSize;
         }
@@ -423,7 +433,7 @@ namespace ts
         void invalidate()
         {
             m_magic = ~kMagic;
-            m_reserved0 = 0;
+            m_generation = 0;
             m_address = 0;
             m_size = 0;
         }
@@ -431,6 +441,7 @@ namespace ts
         bool isValid() const { return m_address != 0; }
         uint64_t address() const { return m_address; }
         uint64_t size() const { return m_size; }
+        unsigned generation() const { return m_generation; }
 
     };
     TSFBVDS_CHECK_STRUCTURE(DisplayXFBMap);
@@ -438,9 +449,10 @@ namespace ts
 
     /** The cursor state. This is memory mapped as a read-only structure to a client.
      *
-     *  REVIEW: break this in to two structures - a cursor position and a cursor image object. These
-     *  should be read via user-client calls rather than memory mapping, to avoid asynchronous
-     *  changes.
+     *  The driver updates the structure in place. m_sequenceState covers the position and visibility, and
+     *  m_sequencePixel covers the image, size and hot spot. Each is odd while an update is in progress and is
+     *  incremented again when it completes, so a reader can take a consistent copy with readState() and
+     *  readImage(), and can tell whether anything changed since its last copy by comparing the sequence numbers.
      */
     struct DisplayXFBCursor
     {
@@ -457,8 +469,8 @@ namespace ts
         uint32_t m_height;                              //! The cursor height
         int32_t m_hotspotX;                             //! The cursor hostspot position
         int32_t m_hotspotY;                             //! The cursor hostspot position
-        uint32_t m_sequenceState;                       //! Counter incremented on state updates
-        uint32_t m_sequencePixel;                       //! Counter incremented on pixel data updates
+        volatile uint32_t m_sequenceState;              //! Counter incremented on state updates (odd while updating)
+        volatile uint32_t m_sequencePixel;              //! Counter incremented on pixel data updates (odd while updating)
         uint32_t m_reserved[5];                         //! Reserved for future use
         uint32_t m_pixelData[kMaxWidth * kMaxHeight];   //! The RGBA32 pixel data
 
@@ -479,6 +491,66 @@ namespace ts
             bzero(m_pixelData, sizeof m_pixelData);
         }
 
+        void beginStateUpdate() { m_sequenceState ++; __sync_synchronize(); }   //! Start a state update (driver use only)
+        void endStateUpdate() { __sync_synchronize(); m_sequenceState ++; }     //! Complete a state update (driver use only)
+        void beginPixelUpdate() { m_sequencePixel ++; __sync_synchronize(); }   //! Start an image update (driver use only)
+        void endPixelUpdate() { __sync_synchronize(); m_sequencePixel ++; }     //! Complete an image update (driver use only)
+
+        /** Take a consistent copy of the position and visibility.
+         *
+         *  @param  x               Returns the cursor position.
+         *  @param  y               ..
+         *  @param  visible         Returns logical true if the cursor is visible.
+         *  @param  sequence        Returns the state sequence number of the copy.
+         *  @return                 Logical true for success, false if no consistent copy could be made.
+         */
+        bool readState(int& x, int& y, bool& visible, uint32_t& sequence) const
+        {
+            for (unsigned attempt = 0; attempt < 1000; attempt++)
+            {
+                sequence = m_sequenceState;
+                if (0 != (sequence & 1)) continue;
+                __sync_synchronize();
+                x = m_x;
+                y = m_y;
+                visible = (0 != m_isVisible);
+                __sync_synchronize();
+                if (sequence == m_sequenceState) return true;
+            }
+            return false;
+        }
+
+        /** Take a consistent copy of the image.
+         *
+         *  @param  pixels          Returns the pixel data: width * height words, in packed rows of width words as
+         *                          written by the driver. Must have room for kMaxWidth * kMaxHeight words.
+         *  @param  width           Returns the image size.
+         *  @param  height          ..
+         *  @param  hotX            Returns the hot spot.
+         *  @param  hotY            ..
+         *  @param  sequence        Returns the pixel sequence number of the copy.
+         *  @return                 Logical true for success, false if the image is not valid or no consistent copy
+         *                          could be made.
+         */
+        bool readImage(uint32_t* pixels, unsigned& width, unsigned& height, int& hotX, int& hotY, uint32_t& sequence) const
+        {
+            for (unsigned attempt = 0; attempt < 1000; attempt++)
+            {
+                sequence = m_sequencePixel;
+                if (0 != (sequence & 1)) continue;
+                __sync_synchronize();
+                bool valid = (0 != m_isValid);
+                width = (m_width < kMaxWidth) ? m_width : kMaxWidth;
+                height = (m_height < kMaxHeight) ? m_height : kMaxHeight;
+                hotX = m_hotspotX;
+                hotY = m_hotspotY;
+                memcpy(pixels, m_pixelData, width * height * sizeof (uint32_t));
+                __sync_synchronize();
+                if (sequence == m_sequencePixel) return valid;
+            }
+            return false;
+        }
+
         bool isValid() const { return m_magic == kMagic; }
         bool isVisible() const { return 0 != m_isVisible; }
         int x() const { return m_x; }
@@ -487,12 +559,246 @@ namespace ts
         unsigned height() const { return m_height; }
         int hotX() const { return m_hotspotX; }
         int hotY() const { return m_hotspotY; }
+        uint32_t sequenceState() const { return m_sequenceState; }
+        uint32_t sequencePixel() const { return m_sequencePixel; }
         const uint32_t* pixelData() const { return &m_pixelData[0]; }
     };
     TSFBVDS_CHECK_STRUCTURE(DisplayXFBCursor);
 
 
 
+    /** The display status page. This is memory mapped as a read-only structure to a client, so that the current
+     *  state can be read without a user-client call.
+     *
+     *  The driver updates the page in place. m_sequence is odd while an update is in progress and is incremented
+     *  again when it completes, so a reader copies the data and retries if the sequence changed (see read()).
+     *  m_modeGeneration changes whenever the display mode (size or stride) changes. A mode change reuses the
+     *  existing VRAM allocation, so mappings remain valid: a client need only re-read the geometry. The state's map
+     *  generation is also published here, so a client can check its cached mappings without a user-client call. When
+     *  the driver frees the shared memory it clears m_magic in the old page, so a client holding a stale mapping of
+     *  the page sees isValid() fail and maps the page again.
+     *
+     *  m_frameSequence is incremented whenever the driver detects (by sampling at vblank) that the frame content has
+     *  probably changed, and m_dirtyXxx give a coarse bounding box for the most recent change. The bounds of the last
+     *  kChangeHistory changes are also kept in m_changeHistory, so a client that has fallen a few changes behind can
+     *  recover the area it missed (see readFrameChangesSince()) rather than assuming that the whole frame changed.
+     */
+    struct DisplayXFBStatus
+    {
+        static const uint32_t kMagic = 0x78464274;  //! The value for m_magic ("xFBt")
+        static const unsigned kChangeHistory = 16;  //! The number of recent content changes recorded in m_changeHistory
+
+        uint32_t m_magic;                   //! The value kMagic
+        volatile uint32_t m_sequence;       //! Update sequence number (odd while an update is in progress)
+        uint32_t m_modeGeneration;          //! Incremented on each change of display mode
+        uint32_t m_reserved0;               //! Reserved for future use
+        DisplayXFBState m_state;            //! The current display state
+        uint32_t m_frameSequence;           //! Incremented on each detected change of frame content
+        uint32_t m_dirtyX;                  //! Bounds of the most recent content change (pixels)
+        uint32_t m_dirtyY;                  //!
+        uint32_t m_dirtyWidth;              //!
+        uint32_t m_dirtyHeight;             //!
+        uint32_t m_reserved[11];            //! Reserved for future use
+        uint32_t m_changeHistory[kChangeHistory][4];    //! Bounds (x, y, width, height) of change n at [n % kChangeHistory]
+
+        void initialise()
+        {
+            m_magic = kMagic;
+            m_sequence = 0;
+            m_modeGeneration = 0;
+            m_reserved0 = 0;
+            m_state.invalidate();
+            m_frameSequence = 0;
+            m_dirtyX = 0;
+            m_dirtyY = 0;
+            m_dirtyWidth = 0;
+            m_dirtyHeight = 0;
+            bzero(m_reserved, sizeof m_reserved);
+            bzero(m_changeHistory, sizeof m_changeHistory);
+        }
+
+        /** Record a content change (driver use only, between beginUpdate() and endUpdate()).
+         */
+        void recordFrameChange(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+        {
+            m_frameSequence ++;
+            m_dirtyX = x;
+            m_dirtyY = y;
+            m_dirtyWidth = width;
+            m_dirtyHeight = height;
+            uint32_t* entry = m_changeHistory[m_frameSequence % kChangeHistory];
+            entry[0] = x;
+            entry[1] = y;
+            entry[2] = width;
+            entry[3] = height;
+        }
+
+        void beginUpdate() { m_sequence ++; __sync_synchronize(); }       //! Start an update (driver use only)
+        void endUpdate() { __sync_synchronize(); m_sequence ++; }         //! Complete an update (driver use only)
+        void retire() { __sync_synchronize(); m_magic = 0; __sync_synchronize(); }    //! Mark the page as no longer updated (driver use only)
+
+        bool isValid() const { return m_magic == kMagic; }
+
+        /** Take a consistent copy of the state.
+         *
+         *  @param  state           Returns the display state.
+         *  @param  modeGeneration  Returns the mode generation.
+         *  @return                 Logical true for success, false if no consistent copy could be made (the driver
+         *                          is continuously updating the page).
+         */
+        bool read(DisplayXFBState& state, unsigned& modeGeneration) const
+        {
+            for (unsigned attempt = 0; attempt < 1000; attempt++)
+            {
+                uint32_t sequence = m_sequence;
+                if (0 != (sequence & 1)) continue;
+                __sync_synchronize();
+                state = m_state;
+                modeGeneration = m_modeGeneration;
+                __sync_synchronize();
+                if (sequence == m_sequence) return true;
+            }
+            return false;
+        }
+
+        /** Take a consistent copy of the most recent content change.
+         *
+         *  @param  frameSequence   Returns the frame sequence number.
+         *  @param  x               Returns the bounds of the change (pixels).
+         *  @param  y               ..
+         *  @param  width           ..
+         *  @param  height          ..
+         *  @return                 Logical true for success, false if no consistent copy could be made.
+         */
+        bool readFrameChange(unsigned& frameSequence, unsigned& x, unsigned& y, unsigned& width, unsigned& height) const
+        {
+            for (unsigned attempt = 0; attempt < 1000; attempt++)
+            {
+                uint32_t sequence = m_sequence;
+                if (0 != (sequence & 1)) continue;
+                __sync_synchronize();
+                frameSequence = m_frameSequence;
+                x = m_dirtyX;
+                y = m_dirtyY;
+                width = m_dirtyWidth;
+                height = m_dirtyHeight;
+                __sync_synchronize();
+                if (sequence == m_sequence) return true;
+            }
+            return false;
+        }
+
+        /** Take a consistent copy of the union of all content changes made after a given frame sequence number.
+         *
+         *  @param  since           The frame sequence number of the client's last update.
+         *  @param  frameSequence   Returns the current frame sequence number.
+         *  @param  x               Returns the bounds of the accumulated change (pixels). The width and height are
+         *  @param  y               zero if nothing has changed since @a since. If more than kChangeHistory changes
+         *  @param  width           have been made (or @a since is ahead of the driver) the bounds are the whole
+         *  @param  height          frame.
+         *  @return                 Logical true for success, false if no consistent copy could be made.
+         */
+        bool readFrameChangesSince(unsigned since, unsigned& frameSequence, unsigned& x, unsigned& y, unsigned& width, unsigned& height) const
+        {
+            for (unsigned attempt = 0; attempt < 1000; attempt++)
+            {
+                uint32_t sequence = m_sequence;
+                if (0 != (sequence & 1)) continue;
+                __sync_synchronize();
+                frameSequence = m_frameSequence;
+                uint32_t count = (uint32_t)frameSequence - (uint32_t)since;
+                uint32_t x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+                if (count > kChangeHistory)
+                {
+                    x1 = m_state.width();
+                    y1 = m_state.height();
+                }
+                else
+                {
+                    for (uint32_t n = (uint32_t)since + 1; count != 0; n++, count--)
+                    {
+                        const uint32_t* entry = m_changeHistory[n % kChangeHistory];
+                        if (0 == entry[2] || 0 == entry[3]) continue;
+                        if (x0 == x1 || y0 == y1)
+                        {
+                            x0 = entry[0];
+                            y0 = entry[1];
+                            x1 = entry[0] + entry[2];
+                            y1 = entry[1] + entry[3];
+                        }
+                        else
+                        {
+                            if (entry[0] < x0) x0 = entry[0];
+                            if (entry[1] < y0) y0 = entry[1];
+                            if (entry[0] + entry[2] > x1) x1 = entry[0] + entry[2];
+                            if (entry[1] + entry[3] > y1) y1 = entry[1] + entry[3];
+                        }
+                    }
+                }
+                x = x0;
+                y = y0;
+                width = x1 - x0;
+                height = y1 - y0;
+                __sync_synchronize();
+                if (sequence == m_sequence) return true;
+            }
+            return false;
+        }
+    };
+    TSFBVDS_CHECK_STRUCTURE(DisplayXFBStatus);
+
+
+
+    /** Per-client statistics. This is returned via the user-client in response to a GetStatistics message.
+     *
+     *  @warning    This structure must be a multiple of 64 bits in length (due to kernel-user-space crossing).
+     */
+    struct DisplayXFBClientStatistics
+    {
+        static const uint32_t kMagic = 0x78464273;  //! The value for m_magic ("xFBs")
+
+        uint32_t m_magic;                   //! The value kMagic
+        uint32_t m_clientIdent;             //! Driver-unique identifier for the client session (never reused)
+        uint64_t m_methodCalls;             //! Number of user-client method calls made by the client
+        uint64_t m_notificationsDelivered;  //! Number of notifications forwarded to the client
+        uint64_t m_notificationsFiltered;   //! Number of notifications suppressed by the client's subscription masks
+        uint32_t m_clientCount;             //! The number of clients currently open on the driver
+        uint32_t m_clientPeak;              //! The highest number of concurrently open clients seen by the driver
+
+        DisplayXFBClientStatistics()
+        {
+            invalidate();
+        }
+
+        void initialise(uint32_t initIdent)
+        {
+            m_magic = kMagic;
+            m_clientIdent = initIdent;
+            m_methodCalls = 0;
+            m_notificationsDelivered = 0;
+            m_notificationsFiltered = 0;
+            m_clientCount = 0;
+            m_clientPeak = 0;
+        }
+
+        void invalidate()
+        {
+            initialise(0);
+            m_magic = ~kMagic;
+        }
+
+        bool isValid() const { return m_magic == kMagic; }
+        unsigned clientIdent() const { return m_clientIdent; }
+        uint64_t methodCalls() const { return m_methodCalls; }
+        uint64_t notificationsDelivered() const { return m_notificationsDelivered; }
+        uint64_t notificationsFiltered() const { return m_notificationsFiltered; }
+        unsigned clientCount() const { return m_clientCount; }
+        unsigned clientPeak() const { return m_clientPeak; }
+    };
+    TSFBVDS_CHECK_STRUCTURE(DisplayXFBClientStatistics);
+
+
+
     // Definitions for various property keys used by the driver classes.
     // Unless otherwise stated, the values are stored on both the com_tsoniq_driver_DisplayXFBDriver and com_tsoniq_driver_DisplayXFBFramebuffer
     // instances.
@@ -506,6 +812,21 @@ namespace ts
     #define kDisplayXFBNotificationDisplayState     iokit_vendor_specific_msg(0x01)     //! Message sent on a display state change
     #define kDisplayXFBNotificationCursorState      iokit_vendor_specific_msg(0x02)     //! Message sent on a cursor change
     #define kDisplayXFBNotificationCursorImage      iokit_vendor_specific_msg(0x03)     //! Message sent on a cursor change
+    #define kDisplayXFBNotificationDisplayMode      iokit_vendor_specific_msg(0x04)     //! Message sent on a mode change, before kDisplayXFBNotificationDisplayState (see DisplayXFBStatus)
+    #define kDisplayXFBNotificationFrameChanged     iokit_vendor_specific_msg(0x05)     //! Message sent when frame content has probably changed (see DisplayXFBStatus)
+
+
+    /** Notification subscription masks. Each client may restrict the notifications that it receives by supplying a
+     *  display mask (bit n set to receive events for display n) and an event mask (a combination of the following bits).
+     *  A newly opened client receives the default set (everything except frame changes) for all displays.
+     */
+    #define kDisplayXFBNotificationMaskDisplayState (1u << 0)                           //! Receive kDisplayXFBNotificationDisplayState
+    #define kDisplayXFBNotificationMaskCursorState  (1u << 1)                           //! Receive kDisplayXFBNotificationCursorState
+    #define kDisplayXFBNotificationMaskCursorImage  (1u << 2)                           //! Receive kDisplayXFBNotificationCursorImage
+    #define kDisplayXFBNotificationMaskDisplayMode  (1u << 3)                           //! Receive kDisplayXFBNotificationDisplayMode
+    #define kDisplayXFBNotificationMaskFrameChanged (1u << 4)                           //! Receive kDisplayXFBNotificationFrameChanged (up to once per vblank)
+    #define kDisplayXFBNotificationMaskAll          (0xffffffffu)                       //! Receive everything
+    #define kDisplayXFBNotificationMaskDefault      (kDisplayXFBNotificationMaskAll & ~kDisplayXFBNotificationMaskFrameChanged) //! The default for a new client
 
 
     /** Type codes for memory mapping. A single API call is used to establish shared memory mappings, indexed
@@ -513,7 +834,8 @@ namespace ts
      */
     #define kDisplayXFBMapTypeDisplay           (0)     //! Mapping is for the display VRAM
     #define kDisplayXFBMapTypeCursor            (1)     //! Mapping is for the mouse cursor
-    #define kDisplayXFBMaxMapTypes              (2)     //! The highest permitted map type
+    #define kDisplayXFBMapTypeStatus            (2)     //! Mapping is for the display status page (always read-only)
+    #define kDisplayXFBMaxMapTypes              (3)     //! The highest permitted map type
 
 
     /** User client method dispatch selectors.
@@ -530,7 +852,11 @@ namespace ts
         kDisplayXFBSelectorConnect                  =   5,      //! Connect a display
         kDisplayXFBSelectorDisconnect               =   6,      //! Disconnect a display
         kDisplayXFBSelectorMap                      =   7,      //! Map shared memory in to application memory space
-        kDisplayXFBNumberSelectors                  =   8
+        kDisplayXFBSelectorSetNotificationMask      =   8,      //! Set the displays and events for which notifications are delivered
+        kDisplayXFBSelectorGetStatistics            =   9,      //! Get the statistics for the calling client
+        kDisplayXFBSelectorConnectMask              =   10,     //! Connect or disconnect a set of displays together
+        kDisplayXFBSelectorSetNotificationPort      =   11,     //! Register (or clear) the async port that receives notifications
+        kDisplayXFBNumberSelectors                  =   12
     };
 
 }   // namespace
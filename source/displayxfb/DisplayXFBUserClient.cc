@@ -4,13 +4,13 @@
  *  Copyright (c) 2010 tsoniq. All rights reserved.
  *
  *  The user-client provides the kernel<->user-mode communication. Several clients may be connected
- *  concurrently (limited by com_tsoniq_driver_DisplayXFBDriver::kMaxClients), and a state-less protocol is used
- *  for communication.
+ *  concurrently (limited by kDisplayXFBMaxClients), and a state-less protocol is used for communication.
  */
 
 #include "DisplayXFBUserClient.h"
 #include "DisplayXFBDriver.h"
 #include <IOKit/IOKitKeys.h>
+#include <libkern/OSAtomic.h>
 
 
 using namespace ts;
@@ -95,6 +95,30 @@ IOReturn DisplayXFBUserClient::selectorUserClientMap(DisplayXFBUserClient* targe
     return target->userClientMap((unsigned)arguments->scalarInput[0], (unsigned)arguments->scalarInput[1], (bool)arguments->scalarInput[2], (DisplayXFBMap*)arguments->structureOutput, &arguments->structureOutputSize);
 }
 
+IOReturn DisplayXFBUserClient::selectorUserClientSetNotificationMask(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    (void)reference;
+    return target->userClientSetNotificationMask((uint32_t)arguments->scalarInput[0], (uint32_t)arguments->scalarInput[1]);
+}
+
+IOReturn DisplayXFBUserClient::selectorUserClientGetStatistics(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    (void)reference;
+    return target->userClientGetStatistics((DisplayXFBClientStatistics*)arguments->structureOutput, &arguments->structureOutputSize);
+}
+
+IOReturn DisplayXFBUserClient::selectorUserClientConnectMask(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    (void)reference;
+    return target->userClientConnectMask((uint32_t)arguments->scalarInput[0], 0 != arguments->scalarInput[1]);
+}
+
+IOReturn DisplayXFBUserClient::selectorUserClientSetNotificationPort(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    (void)reference;
+    return target->userClientSetNotificationPort(arguments->asyncWakePort, arguments->asyncReference, arguments->asyncReferenceCount);
+}
+
 
 
 /** The selector dispatch table (supports 10.5 or later only).
@@ -158,6 +182,34 @@ const IOExternalMethodDispatch DisplayXFBUserClient::selectorMethods[kDisplayXFB
         0,                                      // Size of input structure
         0,                                      // Number of scalar outputs
         sizeof(DisplayXFBMap)                   // Size of output structure (the memory mapping)
+    },
+    {   // kDisplayXFBSelectorSetNotificationMask
+        (IOExternalMethodAction)&DisplayXFBUserClient::selectorUserClientSetNotificationMask,
+        2,                                      // Number of scalar inputs {displayMask, eventMask}
+        0,                                      // Size of input structure
+        0,                                      // Number of scalar outputs
+        0                                       // Size of output structure
+    },
+    {   // kDisplayXFBSelectorGetStatistics
+        (IOExternalMethodAction)&DisplayXFBUserClient::selectorUserClientGetStatistics,
+        0,                                      // No scalar input values.
+        0,                                      // No struct input value.
+        0,                                      // No scalar output values.
+        sizeof(DisplayXFBClientStatistics)      // Size of output structure (the client statistics)
+    },
+    {   // kDisplayXFBSelectorConnectMask
+        (IOExternalMethodAction)&DisplayXFBUserClient::selectorUserClientConnectMask,
+        2,                                      // Number of scalar inputs {displayMask, connect}
+        0,                                      // Size of input structure
+        0,                                      // Number of scalar outputs
+        0                                       // Size of output structure
+    },
+    {   // kDisplayXFBSelectorSetNotificationPort (async - the wake port is passed with the call)
+        (IOExternalMethodAction)&DisplayXFBUserClient::selectorUserClientSetNotificationPort,
+        0,                                      // No scalar input values.
+        0,                                      // No struct input value.
+        0,                                      // No scalar output values.
+        0                                       // No struct output value.
     }
 };
 
@@ -178,6 +230,7 @@ IOReturn DisplayXFBUserClient::externalMethod(
     {
         dispatch = (IOExternalMethodDispatch*)&selectorMethods[selector];
         if (!target) target = this;
+        OSIncrementAtomic64(&m_methodCalls);
     }
 
     return super::externalMethod(selector, arguments, dispatch, target, reference);
@@ -201,12 +254,21 @@ bool DisplayXFBUserClient::initWithTask(task_t owningTask, void* securityToken,
 
     m_provider = 0;
     m_owningTask = 0;
+    m_notificationDisplayMask = kDisplayXFBNotificationMaskAll;
+    m_notificationEventMask = kDisplayXFBNotificationMaskDefault;
+    m_methodCalls = 0;
+    m_notificationsDelivered = 0;
+    m_notificationsFiltered = 0;
+    m_notificationLock = 0;
+    m_notificationRegistered = false;
+    m_memoryMapLock = 0;
 
     for (unsigned i = 0; i < ts::kDisplayXFBMaxDisplays; i++)
     {
         for (unsigned j = 0; j != kDisplayXFBMaxMapTypes; j++)
         {
             m_memoryMaps[i][j] = 0;
+            m_memoryMapGenerations[i][j] = 0;
         }
     }
 
@@ -226,6 +288,9 @@ bool DisplayXFBUserClient::initWithTask(task_t owningTask, void* securityToken,
         {
             // Successful initialisation.
             m_owningTask = owningTask;
+            m_notificationLock = IOLockAlloc();
+            m_memoryMapLock = IOLockAlloc();
+            if (!m_notificationLock || !m_memoryMapLock) ok = false;
         }
     }
     return ok;
@@ -333,6 +398,24 @@ bool DisplayXFBUserClient::finalize(IOOptionBits options)
 }
 
 
+/** Object destruction.
+ */
+void DisplayXFBUserClient::free()
+{
+    if (m_notificationLock)
+    {
+        IOLockFree(m_notificationLock);
+        m_notificationLock = 0;
+    }
+    if (m_memoryMapLock)
+    {
+        IOLockFree(m_memoryMapLock);
+        m_memoryMapLock = 0;
+    }
+    super::free();
+}
+
+
 
 #pragma mark    -
 #pragma mark    DisplayXFBUserClient Methods
@@ -354,20 +437,44 @@ IOReturn DisplayXFBUserClient::message(UInt32 type, IOService* provider, void* a
      *  See IOMessage.h for some definitions.
      */
 
-    IOReturn status;
+    uint32_t eventBit;
 
     switch (type)
     {
-        case kDisplayXFBNotificationDisplayState:
-        case kDisplayXFBNotificationCursorState:
-        case kDisplayXFBNotificationCursorImage:
-            status = messageClients(type, argument);
-            break;
-
-        default:
-            status = super::message(type, provider, argument);
-            break;
+        case kDisplayXFBNotificationDisplayState:   eventBit = kDisplayXFBNotificationMaskDisplayState;     break;
+        case kDisplayXFBNotificationCursorState:    eventBit = kDisplayXFBNotificationMaskCursorState;      break;
+        case kDisplayXFBNotificationCursorImage:    eventBit = kDisplayXFBNotificationMaskCursorImage;      break;
+        case kDisplayXFBNotificationDisplayMode:    eventBit = kDisplayXFBNotificationMaskDisplayMode;      break;
+        case kDisplayXFBNotificationFrameChanged:   eventBit = kDisplayXFBNotificationMaskFrameChanged;     break;
+        default:                                    return super::message(type, provider, argument);
+    }
+
+    // Only wake the client if it has subscribed to both the display and the event type. The argument
+    // is the display index (see com_tsoniq_driver_DisplayXFBDriver::sendNotification()).
+    IOReturn status;
+    uint32_t displayBit = 1u << ((uintptr_t)argument & 31);
+    bool deliver = (0 != (m_notificationEventMask & eventBit) && 0 != (m_notificationDisplayMask & displayBit));
+
+    // Deliver through this client's own async reference. Notifications are not broadcast with messageClients(),
+    // as that would also reach every other task's interest notifier and bypass their masks.
+    OSAsyncReference64 reference;
+    if (deliver)
+    {
+        IOLockLock(m_notificationLock);
+        deliver = m_notificationRegistered;
+        if (deliver) bcopy(m_notificationReference, reference, sizeof reference);
+        IOLockUnlock(m_notificationLock);
+    }
+
+    if (deliver)
+    {
+        // The send does not block: if the client is not draining its port, the notification is dropped.
+        io_user_reference_t args[2] = { (io_user_reference_t)type, (io_user_reference_t)(uintptr_t)argument };
+        status = sendAsyncResult64(reference, kIOReturnSuccess, args, 2);
+        if (kIOReturnSuccess != status) deliver = false;
     }
+    else status = kIOReturnSuccess;
+    OSIncrementAtomic64((deliver) ? &m_notificationsDelivered : &m_notificationsFiltered);
 
     return status;
 }
@@ -425,6 +532,13 @@ IOReturn DisplayXFBUserClient::userClientOpen(DisplayXFBInfo* info, uint32_t* in
             //IOLog("%s[%p]::%s: frame buffer open failed with %08x\n", getName(), this, __FUNCTION__, (unsigned)status);
             m_provider->close(this);
         }
+        else
+        {
+            // The counters cover the current session only.
+            m_methodCalls = 0;
+            m_notificationsDelivered = 0;
+            m_notificationsFiltered = 0;
+        }
     }
 
     if (kIOReturnSuccess != status && infoSize) *infoSize = 0;      // If returning an error, also signal that no data is returned
@@ -449,19 +563,19 @@ IOReturn DisplayXFBUserClient::userClientClose()
     }
     else
     {
+        // Stop notification delivery.
+        clearNotificationPort();
+
         // Clean up any memory mappings
+        IOLockLock(m_memoryMapLock);
         for (unsigned i = 0; i < ts::kDisplayXFBMaxDisplays; i++)
         {
             for (unsigned j = 0; j != kDisplayXFBMaxMapTypes; j++)
             {
-                IOMemoryMap* map = m_memoryMaps[i][j];
-                if (map)
-                {
-                    map->release();
-                    m_memoryMaps[i][j] = 0;
-                }
+                unmap(i, j);
             }
         }
+        IOLockUnlock(m_memoryMapLock);
 
         // Close the device.
         m_provider->userClientClose();
@@ -612,10 +726,33 @@ IOReturn DisplayXFBUserClient::userClientDisconnect(unsigned displayIndex)
 }
 
 
+/** Connect or disconnect several displays at once.
+ *
+ *  @param  displayMask     Bit mask of the displays to change (bit n set for display n).
+ *  @param  connect         Logical true to connect the displays, false to disconnect them.
+ *  @return                 The completion status.
+ *                          kIOReturnNotAttached - Client service is not correctly attached (likely client bug)
+ *                          kIOReturnNotOpen - client is not open.
+ *                          kIOReturnNotFound - the mask includes a display that does not exist.
+ *                          kIOReturnSuccess - all displays are in the requested state.
+ */
+IOReturn DisplayXFBUserClient::userClientConnectMask(uint32_t displayMask, bool connect)
+{
+    IOReturn status;
+
+    if (!m_provider || isInactive())                                    status = kIOReturnNotAttached;
+    else if (!m_provider->isOpen(this))                                 status = kIOReturnNotOpen;
+    else status = m_provider->userClientConnectMask(displayMask, connect);
+
+    return status;
+}
+
+
 /** Map shared data in to a task's address space.
  *
- *  The shared data address and allocation size must remain the constant and valid regardless of display
- *  connect/disconnect. The mapping is released only when the client task closes the connection.
+ *  Repeated requests return the existing mapping unless the framebuffer memory has been reallocated since it
+ *  was made, in which case the stale mapping is dropped and a new one created. The map generation is returned in
+ *  the map structure so that the client can cache the result. Mappings are released when the client closes.
  *
  *  @param  displayIndex    The display index (0 - n-1).
  *  @param  mapType         The object type to be mapped (kDisplayXFBMapTypeXyz).
@@ -643,8 +780,21 @@ IOReturn DisplayXFBUserClient::userClientMap(unsigned displayIndex, unsigned map
     else if (!m_provider->validateDisplayIndex(displayIndex))   status = kIOReturnNotFound;
     else
     {
+        // Method calls from several threads in the task may arrive concurrently. The lock makes the check, unmap and
+        // map below one step, so that two callers can not both create a mapping and leak one of them.
+        IOLockLock(m_memoryMapLock);
+
+        // Reuse the existing mapping unless the framebuffer has since reallocated the memory.
+        if (m_memoryMaps[displayIndex][mapType] && m_memoryMapGenerations[displayIndex][mapType] != m_provider->mapGeneration(displayIndex))
+        {
+            unmap(displayIndex, mapType);
+        }
+
         IOMemoryMap* iomap = m_memoryMaps[displayIndex][mapType];
-        if (!iomap) iomap = m_provider->userClientMapInTask((readOnly != 0) ? true : false, m_owningTask, displayIndex, mapType);
+        if (!iomap)
+        {
+            iomap = m_provider->userClientMapInTask((readOnly != 0) ? true : false, m_owningTask, displayIndex, mapType, &m_memoryMapGenerations[displayIndex][mapType]);
+        }
         if (!iomap)
         {
             status = kIOReturnNoMemory;
@@ -655,12 +805,151 @@ IOReturn DisplayXFBUserClient::userClientMap(unsigned displayIndex, unsigned map
             // Note: documentation says to use getVirtualAddress, but internet & console logs say to use
             // the undocumented getAddress() for 32/64 bit compatibility.
             m_memoryMaps[displayIndex][mapType] = iomap;
-            map->initialise(iomap->getAddress(), iomap->getLength());
+            map->initialise(iomap->getAddress(), iomap->getLength(), m_memoryMapGenerations[displayIndex][mapType]);
             TSLog("Map --> %p, %u", (void*)iomap->getAddress(), (unsigned)iomap->getLength());
             status = kIOReturnSuccess;
         }
+
+        IOLockUnlock(m_memoryMapLock);
     }
 
     if (kIOReturnSuccess != status && mapSize) *mapSize = 0;    // If returning an error, also signal that no data is returned
     return status;
 }
+
+
+/** Release a mapping held by this client. The caller must hold m_memoryMapLock.
+ *
+ *  @param  displayIndex    The display index (0 - n-1).
+ *  @param  mapType         The object type (kDisplayXFBMapTypeXyz).
+ */
+void DisplayXFBUserClient::unmap(unsigned displayIndex, unsigned mapType)
+{
+    IOMemoryMap* map = m_memoryMaps[displayIndex][mapType];
+    if (map)
+    {
+        if (m_provider) m_provider->userClientUnmapInTask(map);
+        map->release();
+        m_memoryMaps[displayIndex][mapType] = 0;
+        m_memoryMapGenerations[displayIndex][mapType] = 0;
+    }
+}
+
+
+/** Set the notifications that are forwarded to the client.
+ *
+ *  @param  displayMask     Bit mask of the displays of interest (bit n set for display n).
+ *  @param  eventMask       Bit mask of the events of interest (kDisplayXFBNotificationMaskXyz).
+ *  @return                 The completion status.
+ *                          kIOReturnNotAttached - Client service is not correctly attached (likely client bug)
+ *                          kIOReturnNotOpen - client is not open.
+ *                          kIOReturnSuccess - the masks have been applied.
+ *
+ *  Notifications that do not match both masks are discarded in the kernel, so the client task is not woken for them.
+ */
+IOReturn DisplayXFBUserClient::userClientSetNotificationMask(uint32_t displayMask, uint32_t eventMask)
+{
+    TSLog("displayMask %08x eventMask %08x", (unsigned)displayMask, (unsigned)eventMask);
+
+    IOReturn status;
+
+    if (!m_provider || isInactive())                                    status = kIOReturnNotAttached;
+    else if (!m_provider->isOpen(this))                                 status = kIOReturnNotOpen;
+    else
+    {
+        m_notificationDisplayMask = displayMask;
+        m_notificationEventMask = eventMask;
+        status = kIOReturnSuccess;
+    }
+
+    return status;
+}
+
+
+/** Register the port that receives notifications for this client.
+ *
+ *  This is an async method: the wake port and reference are supplied by IOConnectCallAsyncScalarMethod() and are
+ *  retained for as long as the client remains open. Each notification that passes the masks is sent to the port as
+ *  an async result with two arguments {type, displayIndex}. Passing MACH_PORT_NULL clears the registration.
+ *
+ *  @param  wakePort        The client's notification port.
+ *  @param  reference       The async reference (holds the client's callback and refcon).
+ *  @param  referenceCount  The number of entries in reference.
+ *  @return                 The completion status.
+ *                          kIOReturnBadArgument - the async reference is missing.
+ *                          kIOReturnNotAttached - Client service is not correctly attached (likely client bug)
+ *                          kIOReturnNotOpen - client is not open.
+ *                          kIOReturnSuccess - the port has been registered (or cleared).
+ */
+IOReturn DisplayXFBUserClient::userClientSetNotificationPort(mach_port_t wakePort, io_user_reference_t* reference, uint32_t referenceCount)
+{
+    TSLog("port %p count %u", (void*)(uintptr_t)wakePort, (unsigned)referenceCount);
+
+    IOReturn status;
+
+    if (!m_provider || isInactive())                                    status = kIOReturnNotAttached;
+    else if (!m_provider->isOpen(this))                                 status = kIOReturnNotOpen;
+    else if (MACH_PORT_NULL == wakePort)
+    {
+        clearNotificationPort();
+        status = kIOReturnSuccess;
+    }
+    else if (!reference || referenceCount > kOSAsyncRef64Count)         status = kIOReturnBadArgument;
+    else
+    {
+        IOLockLock(m_notificationLock);
+        bzero(m_notificationReference, sizeof m_notificationReference);
+        bcopy(reference, m_notificationReference, referenceCount * sizeof reference[0]);
+        m_notificationRegistered = true;
+        IOLockUnlock(m_notificationLock);
+        status = kIOReturnSuccess;
+    }
+
+    return status;
+}
+
+
+/** Stop delivering notifications to the client.
+ */
+void DisplayXFBUserClient::clearNotificationPort()
+{
+    if (m_notificationLock)
+    {
+        IOLockLock(m_notificationLock);
+        m_notificationRegistered = false;
+        IOLockUnlock(m_notificationLock);
+    }
+}
+
+
+/** Return the statistics for this client.
+ *
+ *  @param  stats           Structure to receive the statistics.
+ *  @param  statsSize       On entry, the structure allocation size, on return the size written.
+ *  @return                 The completion status.
+ *                          kIOReturnBadArgument - supplied parameters are unusable (eg incorrect structure size).
+ *                          kIOReturnNotAttached - Client service is not correctly attached (likely client bug)
+ *                          kIOReturnNotOpen - client is not open.
+ *                          kIOReturnSuccess - statistics were returned.
+ */
+IOReturn DisplayXFBUserClient::userClientGetStatistics(DisplayXFBClientStatistics* stats, uint32_t* statsSize)
+{
+    IOReturn status;
+
+    if (!stats || !statsSize || *statsSize != sizeof *stats)            status = kIOReturnBadArgument;
+    else if (!m_provider || isInactive())                               status = kIOReturnNotAttached;
+    else if (!m_provider->isOpen(this))                                 status = kIOReturnNotOpen;
+    else status = m_provider->userClientGetStatistics(this, stats);
+
+    if (kIOReturnSuccess == status)
+    {
+        // The counters are kept here, rather than in the driver's client table, so that counting a call or a
+        // notification needs no lock.
+        stats->m_methodCalls = (uint64_t)m_methodCalls;
+        stats->m_notificationsDelivered = (uint64_t)m_notificationsDelivered;
+        stats->m_notificationsFiltered = (uint64_t)m_notificationsFiltered;
+    }
+
+    if (kIOReturnSuccess != status && statsSize) *statsSize = 0;    // If returning an error, also signal that no data is returned
+    return status;
+}
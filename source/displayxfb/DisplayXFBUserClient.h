@@ -29,6 +29,7 @@ public:
     virtual bool willTerminate(IOService* provider, IOOptionBits options);
     virtual bool didTerminate(IOService* provider, IOOptionBits options, bool* defer);
     virtual bool finalize(IOOptionBits options);
+    virtual void free();
 
     // Messaging
     virtual IOReturn message(UInt32 type, IOService* provider, void* argument);
@@ -42,7 +43,11 @@ public:
     IOReturn userClientGetState(uint32_t displayIndex, ts::DisplayXFBState* state, uint32_t* stateSize);
     IOReturn userClientConnect(unsigned displayIndex);
     IOReturn userClientDisconnect(unsigned displayIndex);
+    IOReturn userClientConnectMask(uint32_t displayMask, bool connect);
     IOReturn userClientMap(unsigned displayIndex, unsigned mapType, bool readOnly, ts::DisplayXFBMap* map, uint32_t* mapSize);
+    IOReturn userClientSetNotificationMask(uint32_t displayMask, uint32_t eventMask);
+    IOReturn userClientGetStatistics(ts::DisplayXFBClientStatistics* stats, uint32_t* statsSize);
+    IOReturn userClientSetNotificationPort(mach_port_t wakePort, io_user_reference_t* reference, uint32_t referenceCount);
 
     static const IOExternalMethodDispatch selectorMethods[ts::kDisplayXFBNumberSelectors];
 
@@ -54,12 +59,30 @@ public:
     static IOReturn selectorUserClientConnect(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
     static IOReturn selectorUserClientDisconnect(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
     static IOReturn selectorUserClientMap(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn selectorUserClientSetNotificationMask(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn selectorUserClientGetStatistics(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn selectorUserClientConnectMask(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn selectorUserClientSetNotificationPort(DisplayXFBUserClient* target, void* reference, IOExternalMethodArguments* arguments);
 
 private:
 
     com_tsoniq_driver_DisplayXFBDriver* m_provider;                                     //! The providing service
     task_t m_owningTask;                                                                //! The client's task handle
     IOMemoryMap* m_memoryMaps[ts::kDisplayXFBMaxDisplays][kDisplayXFBMaxMapTypes];      //! Array of memory mappings
+    uint32_t m_memoryMapGenerations[ts::kDisplayXFBMaxDisplays][kDisplayXFBMaxMapTypes];//! The generation of each mapping
+    IOLock* m_memoryMapLock;                                                            //! Guards m_memoryMaps and m_memoryMapGenerations
+    volatile uint32_t m_notificationDisplayMask;                                        //! Displays for which notifications are forwarded
+    volatile uint32_t m_notificationEventMask;                                          //! Events that are forwarded (kDisplayXFBNotificationMaskXyz)
+    volatile SInt64 m_methodCalls;                                                      //! Method calls since the client opened (atomic)
+    volatile SInt64 m_notificationsDelivered;                                           //! Notifications forwarded since the client opened (atomic)
+    volatile SInt64 m_notificationsFiltered;                                            //! Notifications suppressed since the client opened (atomic)
+    IOLock* m_notificationLock;                                                         //! Guards the notification async reference
+    OSAsyncReference64 m_notificationReference;                                         //! Async reference used to deliver notifications
+    bool m_notificationRegistered;                                                      //! True if m_notificationReference is valid
+
+    void clearNotificationPort();
+
+    void unmap(unsigned displayIndex, unsigned mapType);
 
     DisplayXFBUserClient(const DisplayXFBUserClient&);              // Prevent copy constructor
     DisplayXFBUserClient& operator=(const DisplayXFBUserClient&);   // Prevent assignment
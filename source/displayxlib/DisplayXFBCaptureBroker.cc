@@ -0,0 +1,530 @@
+/** @file   DisplayXFBCaptureBroker.cc
+ *  @brief  Single capture of each display, shared by many consumers.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBCaptureBroker.h"
+#include "DisplayXFBPixelKernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    static const unsigned kFullArea = 0x7fffffff;          //!< Rect size meaning "everything" (clipped on use)
+
+
+    /** Return the average of a block of source pixels, clipped to the source.
+     */
+    static inline uint32_t averageBlock(const uint8_t* pixels, size_t bytesPerRow, unsigned x, unsigned y, unsigned scale,
+                                        unsigned width, unsigned height)
+    {
+        unsigned w = (width - x < scale) ? width - x : scale;
+        unsigned h = (height - y < scale) ? height - y : scale;
+        if (1 == w && 1 == h) return *(const uint32_t*)(pixels + ((size_t)y * bytesPerRow) + ((size_t)x * 4));
+
+        unsigned sum[4] = { 0, 0, 0, 0 };
+        for (unsigned j = 0; j < h; j++)
+        {
+            const uint32_t* row = (const uint32_t*)(pixels + ((size_t)(y + j) * bytesPerRow)) + x;
+            for (unsigned i = 0; i < w; i++)
+            {
+                uint32_t p = row[i];
+                sum[0] += p & 0xff;
+                sum[1] += (p >> 8) & 0xff;
+                sum[2] += (p >> 16) & 0xff;
+                sum[3] += p >> 24;
+            }
+        }
+        unsigned n = w * h;
+        return (sum[0] / n) | ((sum[1] / n) << 8) | ((sum[2] / n) << 16) | ((sum[3] / n) << 24);
+    }
+
+
+    /** Extend a rectangle to include another.
+     */
+    void DisplayXFBCaptureBroker::Rect::add(unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        if (0 == width || 0 == height) return;
+        if (0 == m_width || 0 == m_height)
+        {
+            m_x = x;
+            m_y = y;
+            m_width = width;
+            m_height = height;
+            return;
+        }
+        unsigned x1 = ((m_x + m_width) > (x + width)) ? m_x + m_width : x + width;
+        unsigned y1 = ((m_y + m_height) > (y + height)) ? m_y + m_height : y + height;
+        m_x = (m_x < x) ? m_x : x;
+        m_y = (m_y < y) ? m_y : y;
+        m_width = x1 - m_x;
+        m_height = y1 - m_y;
+    }
+
+
+    DisplayXFBCaptureBroker::DisplayXFBCaptureBroker(DisplayXFBInterface& displayInterface)
+        :
+        m_interface(displayInterface),
+        m_workers(0),
+        m_pool(),
+        m_snapshots(),
+        m_stages(),
+        m_subscribers(),
+        m_work(),
+        m_statistics()
+    {
+        memset(m_snapshots, 0, sizeof m_snapshots);
+        memset(m_stages, 0, sizeof m_stages);
+        memset(m_subscribers, 0, sizeof m_subscribers);
+        memset(m_work, 0, sizeof m_work);
+        memset(&m_statistics, 0, sizeof m_statistics);
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+        {
+            m_work[i].m_broker = this;
+            m_work[i].m_displayIndex = i;
+        }
+    }
+
+
+    DisplayXFBCaptureBroker::~DisplayXFBCaptureBroker()
+    {
+        for (unsigned i = 0; i < kMaxStages; i++)
+        {
+            if (m_stages[i].m_references) releaseStage(m_stages[i]);
+        }
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++) m_pool.release(m_snapshots[i].m_frame);
+    }
+
+
+    /** Add a subscriber. It receives its first frame (with the whole frame marked as changed) on the next tick.
+     *
+     *  @param  subscription    The display, format, scale and frame rate.
+     *  @param  handler         The callback.
+     *  @param  context         The callback argument.
+     *  @return                 The subscriber ident, or -1 if the parameters are invalid or the limits are reached.
+     */
+    int DisplayXFBCaptureBroker::subscribe(const Subscription& subscription, FrameHandler handler, void* context)
+    {
+        unsigned scale = subscription.m_scale;
+        if (!handler || subscription.m_displayIndex >= kDisplayXFBMaxDisplays) return -1;
+        if (1 != scale && 2 != scale && 4 != scale) return -1;
+        if (subscription.m_format > kFormatTileCodec) return -1;
+
+        int slot = -1;
+        for (unsigned i = 0; i < kMaxSubscribers && slot < 0; i++)
+        {
+            if (!m_subscribers[i].m_active) slot = (int)i;
+        }
+        if (slot < 0) return -1;
+
+        // Share a stage with the same output, or start a new one.
+        int stageIndex = -1;
+        int freeStage = -1;
+        for (unsigned i = 0; i < kMaxStages && stageIndex < 0; i++)
+        {
+            const Stage& stage = m_stages[i];
+            if (0 == stage.m_references)
+            {
+                if (freeStage < 0) freeStage = (int)i;
+            }
+            else if (stage.m_displayIndex == subscription.m_displayIndex && stage.m_format == subscription.m_format &&
+                     stage.m_scale == scale && (kFormatTileCodec != stage.m_format || stage.m_quality == subscription.m_quality))
+            {
+                stageIndex = (int)i;
+            }
+        }
+        if (stageIndex < 0)
+        {
+            if (freeStage < 0) return -1;
+            Stage& stage = m_stages[freeStage];
+            memset(&stage, 0, sizeof stage);
+            stage.m_displayIndex = subscription.m_displayIndex;
+            stage.m_format = subscription.m_format;
+            stage.m_scale = scale;
+            stage.m_quality = subscription.m_quality;
+            stage.m_dirty.add(0, 0, kFullArea, kFullArea);
+            if (kFormatTileCodec == stage.m_format) stage.m_codec = new DisplayXFBTileCodec(subscription.m_quality);
+            stageIndex = freeStage;
+        }
+        m_stages[stageIndex].m_references ++;
+
+        Subscriber& subscriber = m_subscribers[slot];
+        subscriber.m_active = true;
+        subscriber.m_stage = stageIndex;
+        subscriber.m_handler = handler;
+        subscriber.m_context = context;
+        subscriber.m_intervalUS = (subscription.m_frameRate) ? 1000000u / subscription.m_frameRate : 0;
+        subscriber.m_nextUS = 0;
+        subscriber.m_dirty.clear();
+        subscriber.m_dirty.add(0, 0, kFullArea, kFullArea);
+        return slot;
+    }
+
+
+    /** Remove a subscriber. Its stage is released when no other subscriber uses it.
+     */
+    void DisplayXFBCaptureBroker::unsubscribe(int subscriber)
+    {
+        if (subscriber < 0 || subscriber >= (int)kMaxSubscribers || !m_subscribers[subscriber].m_active) return;
+
+        Stage& stage = m_stages[m_subscribers[subscriber].m_stage];
+        if (0 == --stage.m_references) releaseStage(stage);
+        m_subscribers[subscriber].m_active = false;
+    }
+
+
+    /** Return the number of conversion stages in use.
+     */
+    unsigned DisplayXFBCaptureBroker::stageCount() const
+    {
+        unsigned count = 0;
+        for (unsigned i = 0; i < kMaxStages; i++)
+        {
+            if (m_stages[i].m_references) count ++;
+        }
+        return count;
+    }
+
+
+    /** Capture the displays that have a subscriber due, run the stages they need and deliver the frames.
+     *
+     *  @param  timeUS          The current time (microseconds), used for frame rate limiting.
+     *  @return                 The number of frames delivered.
+     */
+    unsigned DisplayXFBCaptureBroker::tick(uint64_t timeUS)
+    {
+        m_statistics.m_ticks ++;
+        unsigned delivered = 0;
+
+        // Capture and convert each display with a subscriber due: on the display's worker if there is one, so that
+        // displays are processed in parallel, and otherwise in turn on this thread. Only a display's own snapshot,
+        // stages and driver mappings are touched while it is processed.
+        unsigned workers = (m_workers) ? m_workers->count() : 0;
+        for (unsigned d = 0; d < kDisplayXFBMaxDisplays; d++)
+        {
+            DisplayWork& work = m_work[d];
+            work.m_due = false;
+            work.m_captured = false;
+            work.m_dirty.clear();
+            for (unsigned i = 0; i < kMaxSubscribers; i++)
+            {
+                Subscriber& subscriber = m_subscribers[i];
+                if (!subscriber.m_active || m_stages[subscriber.m_stage].m_displayIndex != d || timeUS < subscriber.m_nextUS) continue;
+                m_stages[subscriber.m_stage].m_due = true;
+                work.m_due = true;
+            }
+            if (!work.m_due) continue;
+            if (d >= workers || !m_workers->submit(d, displayWork, &work)) processDisplay(d);
+        }
+        for (unsigned d = 0; d < workers && d < kDisplayXFBMaxDisplays; d++)
+        {
+            if (m_work[d].m_due) m_workers->wait(d);
+        }
+
+        for (unsigned d = 0; d < kDisplayXFBMaxDisplays; d++)
+        {
+            const DisplayWork& work = m_work[d];
+            if (!work.m_due) continue;
+
+            const Rect& dirty = work.m_dirty;
+            const DisplayXFBFramePool::Frame* snapshot = m_snapshots[d].m_frame;
+            for (unsigned i = 0; i < kMaxSubscribers; i++)
+            {
+                Subscriber& subscriber = m_subscribers[i];
+                if (!subscriber.m_active) continue;
+                Stage& stage = m_stages[subscriber.m_stage];
+                if (stage.m_displayIndex != d) continue;
+                subscriber.m_dirty.add(dirty.m_x, dirty.m_y, dirty.m_width, dirty.m_height);
+                if (!stage.m_due || timeUS < subscriber.m_nextUS) continue;
+
+                Frame frame;
+                frame.m_displayIndex = d;
+                frame.m_format = stage.m_format;
+                frame.m_width = stage.m_width;
+                frame.m_height = stage.m_height;
+                frame.m_timeUS = timeUS;
+                if (kFormatTileCodec == stage.m_format)
+                {
+                    frame.m_data = stage.m_encoded;
+                    frame.m_size = stage.m_encodedSize;
+                    frame.m_bytesPerRow = 0;
+                }
+                else
+                {
+                    const DisplayXFBFramePool::Frame* pixels = (stage.m_frame) ? stage.m_frame : snapshot;
+                    frame.m_data = pixels->data();
+                    frame.m_bytesPerRow = pixels->bytesPerRow();
+                    frame.m_size = frame.m_bytesPerRow * frame.m_height;
+                }
+
+                // Scale the accumulated change to the output, rounding outwards.
+                const Rect& r = subscriber.m_dirty;
+                unsigned s = stage.m_scale;
+                unsigned x0 = r.m_x / s, y0 = r.m_y / s;
+                unsigned x1 = (r.m_width > kFullArea - r.m_x) ? stage.m_width : (r.m_x + r.m_width + s - 1) / s;
+                unsigned y1 = (r.m_height > kFullArea - r.m_y) ? stage.m_height : (r.m_y + r.m_height + s - 1) / s;
+                if (x1 > stage.m_width) x1 = stage.m_width;
+                if (y1 > stage.m_height) y1 = stage.m_height;
+                bool changed = (r.m_width && r.m_height && x0 < x1 && y0 < y1);
+                frame.m_dirtyX = (changed) ? x0 : 0;
+                frame.m_dirtyY = (changed) ? y0 : 0;
+                frame.m_dirtyWidth = (changed) ? x1 - x0 : 0;
+                frame.m_dirtyHeight = (changed) ? y1 - y0 : 0;
+
+                subscriber.m_handler(frame, subscriber.m_context);
+                subscriber.m_dirty.clear();
+                subscriber.m_nextUS = timeUS + subscriber.m_intervalUS;
+                m_statistics.m_deliveries ++;
+                delivered ++;
+            }
+
+            for (unsigned i = 0; i < kMaxStages; i++)
+            {
+                if (m_stages[i].m_displayIndex == d) m_stages[i].m_due = false;
+            }
+        }
+        return delivered;
+    }
+
+
+    /** Capture a display and run its stages that are due, recording the result in m_work.
+     */
+    void DisplayXFBCaptureBroker::processDisplay(unsigned displayIndex)
+    {
+        // One capture, whose changes are recorded against every stage for the display.
+        DisplayWork& work = m_work[displayIndex];
+        work.m_captured = captureDisplay(displayIndex, work.m_dirty);
+        const DisplayXFBFramePool::Frame* snapshot = m_snapshots[displayIndex].m_frame;
+        for (unsigned i = 0; i < kMaxStages; i++)
+        {
+            Stage& stage = m_stages[i];
+            if (0 == stage.m_references || stage.m_displayIndex != displayIndex) continue;
+            stage.m_dirty.add(work.m_dirty.m_x, work.m_dirty.m_y, work.m_dirty.m_width, work.m_dirty.m_height);
+            if (stage.m_due && work.m_captured) stage.m_due = runStage(stage, snapshot);
+            else stage.m_due = false;
+        }
+    }
+
+
+    /** Worker entry point for processDisplay().
+     */
+    void DisplayXFBCaptureBroker::displayWork(void* context)
+    {
+        DisplayWork* work = (DisplayWork*)context;
+        work->m_broker->processDisplay(work->m_displayIndex);
+    }
+
+
+    /** Bring a display's snapshot up to date, copying only the driver's dirty area when possible.
+     *
+     *  @param  displayIndex    The display.
+     *  @param  dirty           Returns the area copied (empty if nothing changed).
+     *  @return                 Logical true for success, false if the display is not available.
+     */
+    bool DisplayXFBCaptureBroker::captureDisplay(unsigned displayIndex, Rect& dirty)
+    {
+        Snapshot& snapshot = m_snapshots[displayIndex];
+        DisplayXFBState state;
+        unsigned modeGeneration = 0;
+        DisplayXFBMap map;
+        if (!m_interface.displayGetStatus(state, modeGeneration, displayIndex) || !state.isConnected() ||
+            !m_interface.displayMapFramebuffer(map, displayIndex, true) || map.size() < state.offset() + state.bytesPerFrame())
+        {
+            snapshot.m_valid = false;
+            return false;
+        }
+
+        unsigned width = state.width();
+        unsigned height = state.height();
+        if (!snapshot.m_frame || snapshot.m_frame->width() != width || snapshot.m_frame->height() != height)
+        {
+            m_pool.release(snapshot.m_frame);
+            snapshot.m_frame = m_pool.acquire(width, height);
+            snapshot.m_valid = false;
+            if (!snapshot.m_frame) return false;
+        }
+
+        unsigned sequence = 0, x = 0, y = 0, w = 0, h = 0;
+        bool haveChange = m_interface.displayGetFrameChangesSince(snapshot.m_frameSequence, sequence, x, y, w, h, displayIndex);
+        bool full = !snapshot.m_valid || modeGeneration != snapshot.m_modeGeneration || !haveChange;
+        if (full)
+        {
+            x = 0;
+            y = 0;
+            w = width;
+            h = height;
+        }
+        if (x >= width || y >= height) w = h = 0;
+        if (w > width - x) w = width - x;
+        if (h > height - y) h = height - y;
+
+        const uint8_t* vram = (const uint8_t*)(uintptr_t)map.address() + state.offset();
+        if (w && h)
+        {
+            const uint8_t* src = vram + ((size_t)y * state.bytesPerRow()) + ((size_t)x * 4);
+            uint8_t* dst = (uint8_t*)snapshot.m_frame->data() + ((size_t)y * snapshot.m_frame->bytesPerRow()) + ((size_t)x * 4);
+            for (unsigned row = 0; row < h; row++)
+            {
+                memcpy(dst, src, (size_t)w * 4);
+                src += state.bytesPerRow();
+                dst += snapshot.m_frame->bytesPerRow();
+            }
+            __sync_fetch_and_add(&m_statistics.m_captureBytes, (uint64_t)w * h * 4);
+            dirty.add(x, y, w, h);
+        }
+
+        if (!full)
+        {
+            // Compare the next band of rows with VRAM and copy any that differ, picking up changes that the
+            // driver's sampling missed.
+            unsigned band = (height + kVerifyCaptures - 1) / kVerifyCaptures;
+            if (snapshot.m_verifyRow >= height) snapshot.m_verifyRow = 0;
+            unsigned first = snapshot.m_verifyRow;
+            unsigned last = (first + band < height) ? first + band : height;
+            snapshot.m_verifyRow = last;
+
+            Rect missed;
+            missed.clear();
+            size_t rowBytes = (size_t)width * 4;
+            for (unsigned row = first; row < last; row++)
+            {
+                const uint8_t* src = vram + ((size_t)row * state.bytesPerRow());
+                uint8_t* dst = (uint8_t*)snapshot.m_frame->data() + ((size_t)row * snapshot.m_frame->bytesPerRow());
+                if (0 == memcmp(dst, src, rowBytes)) continue;
+                memcpy(dst, src, rowBytes);
+                __sync_fetch_and_add(&m_statistics.m_captureBytes, (uint64_t)rowBytes);
+                missed.add(0, row, width, 1);
+            }
+            if (missed.m_height)
+            {
+                dirty.add(missed.m_x, missed.m_y, missed.m_width, missed.m_height);
+                __sync_fetch_and_add(&m_statistics.m_verifyRepairs, 1);
+            }
+        }
+
+        snapshot.m_valid = true;
+        snapshot.m_modeGeneration = modeGeneration;
+        snapshot.m_frameSequence = (haveChange) ? sequence : 0;
+        __sync_fetch_and_add(&m_statistics.m_captures, 1);
+        return true;
+    }
+
+
+    /** Convert the changed area of a snapshot for a stage.
+     *
+     *  @return                 Logical true for success, false if no memory is available.
+     */
+    bool DisplayXFBCaptureBroker::runStage(Stage& stage, const DisplayXFBFramePool::Frame* snapshot)
+    {
+        unsigned sw = snapshot->width();
+        unsigned sh = snapshot->height();
+        unsigned scale = stage.m_scale;
+        unsigned ow = (sw / scale) ? sw / scale : 1;
+        unsigned oh = (sh / scale) ? sh / scale : 1;
+        if (ow != stage.m_width || oh != stage.m_height) stage.m_dirty.add(0, 0, kFullArea, kFullArea);
+        stage.m_width = ow;
+        stage.m_height = oh;
+
+        // Nothing has changed since the last run, so the stage's output (including any encoded stream) is current.
+        if (0 == stage.m_dirty.m_width || 0 == stage.m_dirty.m_height) return true;
+
+        // Native pixels at full scale need no conversion: the snapshot is delivered directly.
+        if (kFormatBGRA32 == stage.m_format && 1 == scale)
+        {
+            stage.m_dirty.clear();
+            return true;
+        }
+
+        bool needPixels = !(kFormatTileCodec == stage.m_format && 1 == scale);
+        if (needPixels)
+        {
+            // Gray output is one byte per pixel; the pool works in 32 bit pixels, so ask for a quarter of the width.
+            unsigned poolWidth = (kFormatGray8 == stage.m_format) ? (ow + 3) / 4 : ow;
+            if (!stage.m_frame || stage.m_frame->width() != poolWidth || stage.m_frame->height() != oh)
+            {
+                m_pool.release(stage.m_frame);
+                stage.m_frame = m_pool.acquire(poolWidth, oh);
+                if (!stage.m_frame) return false;
+                stage.m_dirty.add(0, 0, kFullArea, kFullArea);
+            }
+
+            const Rect& r = stage.m_dirty;
+            unsigned x0 = r.m_x / scale, y0 = r.m_y / scale;
+            unsigned x1 = (r.m_width > kFullArea - r.m_x) ? ow : (r.m_x + r.m_width + scale - 1) / scale;
+            unsigned y1 = (r.m_height > kFullArea - r.m_y) ? oh : (r.m_y + r.m_height + scale - 1) / scale;
+            if (x1 > ow) x1 = ow;
+            if (y1 > oh) y1 = oh;
+
+            const uint8_t* src = (const uint8_t*)snapshot->data();
+            size_t srcStride = snapshot->bytesPerRow();
+            uint8_t* dst = (uint8_t*)stage.m_frame->data();
+            size_t dstStride = stage.m_frame->bytesPerRow();
+            if (1 == scale)
+            {
+                // Straight format conversion: use the specialised kernels. Broker and kernel formats share values.
+                DisplayXFBPixelKernelTable kernels =
+                    DisplayXFBPixelKernels::select((DisplayXFBPixelKernels::Format)stage.m_format, 0, false, DisplayXFBPixelKernels::cpuIsa());
+                size_t dstPixel = (kFormatGray8 == stage.m_format) ? 1 : 4;
+                if (r.m_width && x0 < x1 && y0 < y1)
+                {
+                    kernels.m_convert(dst + ((size_t)y0 * dstStride) + (x0 * dstPixel), dstStride,
+                                      src + ((size_t)y0 * srcStride) + ((size_t)x0 * 4), srcStride, x1 - x0, y1 - y0);
+                }
+            }
+            for (unsigned y = y0; 1 != scale && r.m_width && y < y1; y++)
+            {
+                uint8_t* out = dst + ((size_t)y * dstStride);
+                for (unsigned x = x0; x < x1; x++)
+                {
+                    uint32_t p = averageBlock(src, srcStride, x * scale, y * scale, scale, sw, sh);
+                    if (kFormatGray8 == stage.m_format)
+                    {
+                        out[x] = (uint8_t)(((77 * ((p >> 16) & 0xff)) + (150 * ((p >> 8) & 0xff)) + (29 * (p & 0xff))) >> 8);
+                    }
+                    else if (kFormatRGBA32 == stage.m_format)
+                    {
+                        ((uint32_t*)out)[x] = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+                    }
+                    else
+                    {
+                        ((uint32_t*)out)[x] = p;
+                    }
+                }
+            }
+        }
+
+        if (kFormatTileCodec == stage.m_format)
+        {
+            size_t needed = DisplayXFBTileCodec::maxEncodedSize(ow, oh);
+            if (stage.m_encodedCapacity < needed)
+            {
+                free(stage.m_encoded);
+                stage.m_encoded = (uint8_t*)malloc(needed);
+                stage.m_encodedCapacity = (stage.m_encoded) ? needed : 0;
+                if (!stage.m_encoded) return false;
+            }
+            const DisplayXFBFramePool::Frame* pixels = (stage.m_frame) ? stage.m_frame : snapshot;
+            stage.m_codec->setParallel(0 == m_workers);
+            stage.m_encodedSize = stage.m_codec->encode(pixels->data(), ow, oh, pixels->bytesPerRow(), stage.m_encoded, stage.m_encodedCapacity);
+            if (0 == stage.m_encodedSize) return false;
+        }
+
+        stage.m_dirty.clear();
+        __sync_fetch_and_add(&m_statistics.m_conversions, 1);
+        return true;
+    }
+
+
+    /** Free a stage's buffers.
+     */
+    void DisplayXFBCaptureBroker::releaseStage(Stage& stage)
+    {
+        m_pool.release(stage.m_frame);
+        delete stage.m_codec;
+        free(stage.m_encoded);
+        memset(&stage, 0, sizeof stage);
+    }
+
+}   // namespace
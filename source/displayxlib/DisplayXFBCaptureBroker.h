@@ -0,0 +1,192 @@
+/** @file   DisplayXFBCaptureBroker.h
+ *  @brief  Single capture of each display, shared by many consumers.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBCaptureBroker_H
+#define COM_TSONIQ_DisplayXFBCaptureBroker_H   (1)
+
+#include "DisplayXFBInterface.h"
+#include "DisplayXFBFramePool.h"
+#include "DisplayXFBTileCodec.h"
+#include "DisplayXFBWorkerGroup.h"
+
+namespace ts
+{
+    /** Class used to capture each display once and deliver the result to any number of subscribers, each with its
+     *  own pixel format, scale and frame rate.
+     *
+     *  On each tick(), a display is captured only if at least one of its subscribers is due. The capture copies
+     *  the union of the driver's dirty areas since the previous capture from VRAM in to a snapshot (see
+     *  DisplayXFBInterface::displayGetFrameChangesSince()). The driver finds changes by sampling and can miss
+     *  small ones, so each capture also compares a band of the snapshot's rows with VRAM and copies any that
+     *  differ, verifying the whole snapshot every kVerifyCaptures captures. Subscribers asking for the same display, format and
+     *  scale share one conversion stage. A stage is reference counted by its subscribers and converts only the
+     *  area that has changed since it last ran, and does nothing if nothing has changed. A stage for native BGRA at full scale is the snapshot itself. So
+     *  the capture and the conversions are each done once however many subscribers share them, and adding a
+     *  subscriber with an existing format costs only its callback.
+     *
+     *  Each subscriber is given the union of the changes since its own previous delivery, so subscribers running
+     *  at a lower frame rate see every change. Frame data is only valid during the callback. The class is not
+     *  thread safe, and handlers must not subscribe or unsubscribe.
+     *
+     *  If a worker group is set with setWorkers(), each display's capture and stages (including any encoding) run
+     *  on that display's worker (see DisplayXFBWorkerGroup), so displays are processed in parallel and a pinned
+     *  group keeps each display's stages on one core set. The snapshot and stage buffers are first written by that
+     *  worker, so they are local to its memory node. Handlers are still called from tick(), after all the workers
+     *  have finished.
+     */
+    class DisplayXFBCaptureBroker
+    {
+    public:
+
+        static const unsigned kMaxSubscribers = 32;                     //!< Maximum number of subscribers
+        static const unsigned kMaxStages = 16;                          //!< Maximum number of distinct conversions
+        static const unsigned kVerifyCaptures = 30;                     //!< Captures taken to verify a whole snapshot
+
+        /** Output formats.
+         */
+        enum Format
+        {
+            kFormatBGRA32,                                              //!< Native 32 bit BGRA
+            kFormatRGBA32,                                              //!< 32 bit RGBA
+            kFormatGray8,                                               //!< 8 bit luma
+            kFormatTileCodec                                            //!< DisplayXFBTileCodec stream
+        };
+
+        /** A delivered frame.
+         */
+        struct Frame
+        {
+            unsigned m_displayIndex;                                    //!< The display
+            Format m_format;                                            //!< The data format
+            const void* m_data;                                         //!< The pixels, or the encoded stream
+            size_t m_size;                                              //!< The data size (bytes)
+            unsigned m_width;                                           //!< The (scaled) width (pixels)
+            unsigned m_height;                                          //!< The (scaled) height (pixels)
+            size_t m_bytesPerRow;                                       //!< The stride (bytes, zero for encoded data)
+            unsigned m_dirtyX;                                          //!< Area changed since this subscriber's last frame
+            unsigned m_dirtyY;                                          //!< (scaled pixels)
+            unsigned m_dirtyWidth;                                      //!< ..
+            unsigned m_dirtyHeight;                                     //!< ..
+            uint64_t m_timeUS;                                          //!< The tick time
+        };
+
+        typedef void (*FrameHandler)(const Frame& frame, void* context);
+
+        /** Subscription parameters.
+         */
+        struct Subscription
+        {
+            unsigned m_displayIndex;                                    //!< The display
+            Format m_format;                                            //!< The output format
+            unsigned m_scale;                                           //!< Downscale factor (1, 2 or 4)
+            unsigned m_frameRate;                                       //!< Maximum deliveries per second (0 for every tick)
+            unsigned m_quality;                                         //!< Codec quality (kFormatTileCodec only)
+
+            Subscription() : m_displayIndex(0), m_format(kFormatBGRA32), m_scale(1), m_frameRate(0), m_quality(DisplayXFBTileCodec::kDefaultQuality) { }
+        };
+
+        /** Counters, accumulated since construction.
+         */
+        struct Statistics
+        {
+            uint64_t m_ticks;                                           //!< Calls to tick()
+            uint64_t m_captures;                                        //!< Display snapshots taken
+            uint64_t m_captureBytes;                                    //!< VRAM bytes copied
+            uint64_t m_verifyRepairs;                                   //!< Snapshots repaired after a missed change
+            uint64_t m_conversions;                                     //!< Stage runs (shared between subscribers)
+            uint64_t m_deliveries;                                      //!< Frames delivered
+        };
+
+        explicit DisplayXFBCaptureBroker(DisplayXFBInterface& displayInterface);
+        ~DisplayXFBCaptureBroker();
+
+        int subscribe(const Subscription& subscription, FrameHandler handler, void* context);
+        void unsubscribe(int subscriber);
+        unsigned tick(uint64_t timeUS);
+        void setWorkers(DisplayXFBWorkerGroup* workers) { m_workers = workers; }   //!< Set the worker group (zero for none)
+
+        unsigned stageCount() const;
+        const Statistics& statistics() const { return m_statistics; }   //!< Return the counters
+
+    private:
+
+        struct Rect
+        {
+            unsigned m_x, m_y, m_width, m_height;                       //!< The area (empty if m_width or m_height is zero)
+
+            void clear() { m_x = m_y = m_width = m_height = 0; }
+            void add(unsigned x, unsigned y, unsigned width, unsigned height);
+        };
+
+        struct Snapshot
+        {
+            DisplayXFBFramePool::Frame* m_frame;                        //!< The copy of the display
+            unsigned m_modeGeneration;                                  //!< Mode generation of the copy
+            unsigned m_frameSequence;                                   //!< Frame sequence of the copy
+            unsigned m_verifyRow;                                       //!< Next row to verify
+            bool m_valid;                                               //!< Logical true if the copy is complete
+        };
+
+        struct Stage
+        {
+            unsigned m_references;                                      //!< Subscribers using the stage (0 if free)
+            unsigned m_displayIndex;                                    //!< The display
+            Format m_format;                                            //!< The output format
+            unsigned m_scale;                                           //!< The downscale factor
+            unsigned m_quality;                                         //!< The codec quality
+            DisplayXFBFramePool::Frame* m_frame;                        //!< Converted pixels (zero if the snapshot is used)
+            unsigned m_width;                                           //!< Output size (pixels)
+            unsigned m_height;                                          //!< ..
+            Rect m_dirty;                                               //!< Source area changed since the last run
+            bool m_due;                                                 //!< Set while a subscriber is due this tick
+            DisplayXFBTileCodec* m_codec;                               //!< Encoder (kFormatTileCodec)
+            uint8_t* m_encoded;                                         //!< Encoder output
+            size_t m_encodedCapacity;                                   //!< Size of m_encoded
+            size_t m_encodedSize;                                       //!< Bytes in m_encoded
+        };
+
+        struct Subscriber
+        {
+            bool m_active;                                              //!< Logical true if in use
+            int m_stage;                                                //!< Index of the stage
+            FrameHandler m_handler;                                     //!< The callback
+            void* m_context;                                            //!< The callback argument
+            uint64_t m_intervalUS;                                      //!< Minimum time between deliveries
+            uint64_t m_nextUS;                                          //!< Earliest time of the next delivery
+            Rect m_dirty;                                               //!< Source area changed since the last delivery
+        };
+
+        struct DisplayWork
+        {
+            DisplayXFBCaptureBroker* m_broker;                          //!< The owner
+            unsigned m_displayIndex;                                    //!< The display
+            bool m_due;                                                 //!< Logical true if a subscriber is due this tick
+            bool m_captured;                                            //!< Logical true if the capture succeeded
+            Rect m_dirty;                                               //!< Area changed by the capture
+        };
+
+        DisplayXFBInterface& m_interface;                               //!< The driver connection
+        DisplayXFBWorkerGroup* m_workers;                               //!< Per display workers (zero to run on the caller)
+        DisplayXFBFramePool m_pool;                                     //!< Buffers for snapshots and stages
+        Snapshot m_snapshots[kDisplayXFBMaxDisplays];                   //!< Per display snapshot
+        Stage m_stages[kMaxStages];                                     //!< Conversion stages
+        Subscriber m_subscribers[kMaxSubscribers];                      //!< Subscribers
+        DisplayWork m_work[kDisplayXFBMaxDisplays];                     //!< Per display work for the current tick
+        Statistics m_statistics;                                        //!< The counters
+
+        void processDisplay(unsigned displayIndex);
+        static void displayWork(void* context);
+        bool captureDisplay(unsigned displayIndex, Rect& dirty);
+        bool runStage(Stage& stage, const DisplayXFBFramePool::Frame* snapshot);
+        void releaseStage(Stage& stage);
+
+        DisplayXFBCaptureBroker(const DisplayXFBCaptureBroker&);            // Prevent copy constructor
+        DisplayXFBCaptureBroker& operator=(const DisplayXFBCaptureBroker&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBCaptureBroker_H
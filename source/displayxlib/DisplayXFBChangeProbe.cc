@@ -0,0 +1,265 @@
+/** @file   DisplayXFBChangeProbe.cc
+ *  @brief  Sampling change detector for large framebuffers.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBChangeProbe.h"
+#include "DisplayXFBPageAllocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    static unsigned greatestCommonDivisor(unsigned a, unsigned b)
+    {
+        while (b) { unsigned t = a % b; a = b; b = t; }
+        return a;
+    }
+
+
+    DisplayXFBChangeProbe::DisplayXFBChangeProbe()
+        :
+        m_config(),
+        m_statistics(),
+        m_width(0),
+        m_height(0),
+        m_tilesX(0),
+        m_tilesY(0),
+        m_linesPerRow(0),
+        m_lineStep(1),
+        m_reference(0),
+        m_changed(0),
+        m_frame(0),
+        m_verifyCursor(0),
+        m_primed(false)
+    {
+    }
+
+
+    DisplayXFBChangeProbe::~DisplayXFBChangeProbe()
+    {
+        release();
+    }
+
+
+    /** Set the configuration and frame size. This discards the reference frame, so the next probe reports a change
+     *  to every tile.
+     *
+     *  @param  config      The configuration.
+     *  @param  width       The frame width (pixels).
+     *  @param  height      The frame height (pixels).
+     *  @return             Logical true for success, false if the configuration is unusable or no memory is available.
+     */
+    bool DisplayXFBChangeProbe::configure(const Config& config, unsigned width, unsigned height)
+    {
+        release();
+
+        if (0 == width || 0 == height) return false;
+        if (0 == config.m_tileWidth || 0 == config.m_tileHeight) return false;
+        if (0 == config.m_samplesPerTile || 0 == config.m_verifyFrames) return false;
+
+        m_config = config;
+        m_width = width;
+        m_height = height;
+        m_tilesX = (width + config.m_tileWidth - 1) / config.m_tileWidth;
+        m_tilesY = (height + config.m_tileHeight - 1) / config.m_tileHeight;
+        m_linesPerRow = ((config.m_tileWidth * 4) + kCacheLineSize - 1) / kCacheLineSize;
+
+        // Step through the lines of a tile in a scattered order that still visits each one: any step that is
+        // co-prime to the line count will do, and one near the golden ratio spreads successive samples well.
+        unsigned linesPerTile = m_linesPerRow * config.m_tileHeight;
+        m_lineStep = (unsigned)(linesPerTile * 0.618) | 1;
+        while (greatestCommonDivisor(m_lineStep, linesPerTile) != 1) m_lineStep ++;
+
+        m_reference = (uint32_t*)DisplayXFBPageAllocator::allocate((size_t)width * height * sizeof m_reference[0]);
+        m_changed = (uint8_t*)calloc((size_t)m_tilesX * m_tilesY, sizeof m_changed[0]);
+        if (!m_reference || !m_changed)
+        {
+            release();
+            return false;
+        }
+
+        reset();
+        return true;
+    }
+
+
+    /** Discard the reference frame and counters.
+     */
+    void DisplayXFBChangeProbe::reset()
+    {
+        m_statistics = Statistics();
+        m_frame = 0;
+        m_verifyCursor = 0;
+        m_primed = false;
+        if (m_changed) memset(m_changed, 0, (size_t)m_tilesX * m_tilesY);
+    }
+
+
+    /** Check a frame for changes.
+     *
+     *  @param  pixels          The first pixel of the frame (32 bits per pixel, m_width by m_height).
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @return                 The number of changed tiles (see isTileChanged() and changedBounds()).
+     */
+    unsigned DisplayXFBChangeProbe::probe(const void* pixels, size_t bytesPerRow)
+    {
+        if (!m_reference || !pixels) return 0;
+
+        const uint8_t* base = (const uint8_t*)pixels;
+        const unsigned tileCount = m_tilesX * m_tilesY;
+        unsigned changed = 0;
+
+        m_statistics.m_probes ++;
+        memset(m_changed, 0, tileCount);
+
+        if (!m_primed)
+        {
+            // No reference yet - take one and report everything.
+            for (unsigned y = 0; y < m_height; y++) memcpy(&m_reference[(size_t)y * m_width], base + (y * bytesPerRow), m_width * 4);
+            memset(m_changed, 1, tileCount);
+            m_statistics.m_bytesRead += (uint64_t)m_width * m_height * 4;
+            m_statistics.m_tilesChanged += tileCount;
+            m_primed = true;
+            m_frame ++;
+            return tileCount;
+        }
+
+        // Sample every tile, confirming (and recording) any apparent change with a full compare.
+        for (unsigned ty = 0; ty < m_tilesY; ty++)
+        {
+            for (unsigned tx = 0; tx < m_tilesX; tx++)
+            {
+                if (sampleTile(base, bytesPerRow, tx, ty) && compareTile(base, bytesPerRow, tx, ty))
+                {
+                    m_changed[(ty * m_tilesX) + tx] = 1;
+                    m_statistics.m_tilesFoundBySample ++;
+                    changed ++;
+                }
+            }
+        }
+
+        // Fully verify the next batch of tiles, to catch anything that sampling has missed.
+        unsigned verifyCount = (tileCount + m_config.m_verifyFrames - 1) / m_config.m_verifyFrames;
+        for (unsigned i = 0; i < verifyCount; i++)
+        {
+            unsigned tile = m_verifyCursor;
+            m_verifyCursor = (m_verifyCursor + 1) % tileCount;
+            if (!m_changed[tile] && compareTile(base, bytesPerRow, tile % m_tilesX, tile / m_tilesX))
+            {
+                m_changed[tile] = 1;
+                m_statistics.m_tilesFoundByVerify ++;
+                changed ++;
+            }
+        }
+
+        m_statistics.m_tilesChanged += changed;
+        m_frame ++;
+        return changed;
+    }
+
+
+    /** Return the bounding box of the tiles that changed in the last probe.
+     *
+     *  @return             Logical true if any tile changed, false otherwise.
+     */
+    bool DisplayXFBChangeProbe::changedBounds(unsigned& x, unsigned& y, unsigned& width, unsigned& height) const
+    {
+        unsigned minX = m_tilesX, maxX = 0, minY = m_tilesY, maxY = 0;
+        for (unsigned ty = 0; ty < m_tilesY; ty++)
+        {
+            for (unsigned tx = 0; tx < m_tilesX; tx++)
+            {
+                if (!m_changed[(ty * m_tilesX) + tx]) continue;
+                if (tx < minX) minX = tx;
+                if (tx > maxX) maxX = tx;
+                if (ty < minY) minY = ty;
+                if (ty > maxY) maxY = ty;
+            }
+        }
+        if (minX > maxX) return false;
+
+        x = minX * m_config.m_tileWidth;
+        y = minY * m_config.m_tileHeight;
+        unsigned x1 = (maxX + 1) * m_config.m_tileWidth;
+        unsigned y1 = (maxY + 1) * m_config.m_tileHeight;
+        width = ((x1 > m_width) ? m_width : x1) - x;
+        height = ((y1 > m_height) ? m_height : y1) - y;
+        return true;
+    }
+
+
+    /** Compare a few rotating cache lines of a tile with the reference.
+     *
+     *  @return             Logical true if any sample differs.
+     */
+    bool DisplayXFBChangeProbe::sampleTile(const uint8_t* pixels, size_t bytesPerRow, unsigned tx, unsigned ty)
+    {
+        unsigned x0 = tx * m_config.m_tileWidth;
+        unsigned y0 = ty * m_config.m_tileHeight;
+        unsigned rowBytes = ((x0 + m_config.m_tileWidth > m_width) ? (m_width - x0) : m_config.m_tileWidth) * 4;
+        unsigned rows = (y0 + m_config.m_tileHeight > m_height) ? (m_height - y0) : m_config.m_tileHeight;
+        unsigned linesPerRow = (rowBytes + kCacheLineSize - 1) / kCacheLineSize;
+        unsigned lines = linesPerRow * rows;
+
+        // Offset the sequence for each tile so that neighbouring tiles sample different areas.
+        uint64_t sequence = (m_frame * m_config.m_samplesPerTile) + ((uint64_t)(ty * m_tilesX + tx) * 7);
+        for (unsigned i = 0; i < m_config.m_samplesPerTile; i++)
+        {
+            unsigned line = (unsigned)(((sequence + i) * m_lineStep) % lines);
+            unsigned row = line / linesPerRow;
+            unsigned offset = (line % linesPerRow) * kCacheLineSize;
+            unsigned length = (offset + kCacheLineSize > rowBytes) ? (rowBytes - offset) : kCacheLineSize;
+
+            const uint8_t* src = pixels + ((y0 + row) * bytesPerRow) + (x0 * 4) + offset;
+            const uint8_t* ref = (const uint8_t*)&m_reference[((size_t)(y0 + row) * m_width) + x0] + offset;
+            m_statistics.m_bytesRead += length;
+            if (0 != memcmp(src, ref, length)) return true;
+        }
+        return false;
+    }
+
+
+    /** Compare a tile in full with the reference, updating the reference.
+     *
+     *  @return             Logical true if the tile differs.
+     */
+    bool DisplayXFBChangeProbe::compareTile(const uint8_t* pixels, size_t bytesPerRow, unsigned tx, unsigned ty)
+    {
+        unsigned x0 = tx * m_config.m_tileWidth;
+        unsigned y0 = ty * m_config.m_tileHeight;
+        unsigned rowBytes = ((x0 + m_config.m_tileWidth > m_width) ? (m_width - x0) : m_config.m_tileWidth) * 4;
+        unsigned rows = (y0 + m_config.m_tileHeight > m_height) ? (m_height - y0) : m_config.m_tileHeight;
+
+        bool changed = false;
+        for (unsigned row = 0; row < rows; row++)
+        {
+            const uint8_t* src = pixels + ((y0 + row) * bytesPerRow) + (x0 * 4);
+            uint32_t* ref = &m_reference[((size_t)(y0 + row) * m_width) + x0];
+            if (0 != memcmp(src, ref, rowBytes))
+            {
+                memcpy(ref, src, rowBytes);
+                changed = true;
+            }
+        }
+        m_statistics.m_bytesRead += (uint64_t)rowBytes * rows;
+        return changed;
+    }
+
+
+    void DisplayXFBChangeProbe::release()
+    {
+        DisplayXFBPageAllocator::release(m_reference, (size_t)m_width * m_height * sizeof m_reference[0]);
+        free(m_changed);
+        m_reference = 0;
+        m_changed = 0;
+        m_tilesX = 0;
+        m_tilesY = 0;
+        m_width = 0;
+        m_height = 0;
+        m_primed = false;
+    }
+
+}   // namespace
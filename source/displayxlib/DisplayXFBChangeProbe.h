@@ -0,0 +1,102 @@
+/** @file   DisplayXFBChangeProbe.h
+ *  @brief  Sampling change detector for large framebuffers.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBChangeProbe_H
+#define COM_TSONIQ_DisplayXFBChangeProbe_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ts
+{
+    /** Class used to find the changed areas of a frame without reading all of it.
+     *
+     *  The frame is divided in to tiles. On each probe, a few cache lines of every tile are compared with a reference
+     *  copy of the frame. The lines checked rotate from frame to frame, so that every line of a tile is sampled after
+     *  a number of frames. A tile is only compared in full when a sample differs. In addition, a rolling subset of the
+     *  tiles is compared in full on every probe, so that every tile is fully verified at least once every
+     *  Config::m_verifyFrames probes. This bounds the latency of a change that the sampling misses.
+     *
+     *  The two settings trade cost against detection latency:
+     *
+     *      m_samplesPerTile    More samples find small changes sooner, at a cost of 64 bytes per sample per tile.
+     *      m_verifyFrames      Fewer frames lower the worst case latency, at a cost of (frame size / m_verifyFrames)
+     *                          bytes per probe.
+     *
+     *  The class keeps a private copy of the frame and is not thread safe.
+     */
+    class DisplayXFBChangeProbe
+    {
+    public:
+
+        static const unsigned kCacheLineSize = 64;      //!< The unit of sampling (bytes)
+
+        /** Configuration.
+         */
+        struct Config
+        {
+            unsigned m_tileWidth;                       //!< Tile width (pixels)
+            unsigned m_tileHeight;                      //!< Tile height (pixels)
+            unsigned m_samplesPerTile;                  //!< Cache lines sampled per tile per probe
+            unsigned m_verifyFrames;                    //!< Every tile is fully compared at least once in this many probes
+
+            Config() : m_tileWidth(64), m_tileHeight(64), m_samplesPerTile(4), m_verifyFrames(30) { }
+        };
+
+        /** Counters, accumulated since the last configure() or reset().
+         */
+        struct Statistics
+        {
+            uint64_t m_probes;                          //!< Number of probe() calls
+            uint64_t m_bytesRead;                       //!< Bytes of frame data read (samples and full compares)
+            uint64_t m_tilesChanged;                    //!< Tiles reported as changed
+            uint64_t m_tilesFoundBySample;              //!< Changed tiles found by sampling
+            uint64_t m_tilesFoundByVerify;              //!< Changed tiles missed by sampling and found by full verification
+
+            Statistics() : m_probes(0), m_bytesRead(0), m_tilesChanged(0), m_tilesFoundBySample(0), m_tilesFoundByVerify(0) { }
+        };
+
+        DisplayXFBChangeProbe();
+        ~DisplayXFBChangeProbe();
+
+        bool configure(const Config& config, unsigned width, unsigned height);
+        void reset();
+        unsigned probe(const void* pixels, size_t bytesPerRow);
+
+        unsigned tilesX() const { return m_tilesX; }                            //!< Return the number of tile columns
+        unsigned tilesY() const { return m_tilesY; }                            //!< Return the number of tile rows
+        const Config& config() const { return m_config; }                       //!< Return the configuration
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+        bool isTileChanged(unsigned tx, unsigned ty) const { return 0 != m_changed[(ty * m_tilesX) + tx]; }  //!< Test a tile in the last probe
+        bool changedBounds(unsigned& x, unsigned& y, unsigned& width, unsigned& height) const;
+
+    private:
+
+        Config m_config;                                //!< The configuration
+        Statistics m_statistics;                        //!< The counters
+        unsigned m_width;                               //!< Frame width (pixels)
+        unsigned m_height;                              //!< Frame height (pixels)
+        unsigned m_tilesX;                              //!< Number of tile columns
+        unsigned m_tilesY;                              //!< Number of tile rows
+        unsigned m_linesPerRow;                         //!< Cache lines per tile row
+        unsigned m_lineStep;                            //!< Step between sampled lines (co-prime to lines per tile)
+        uint32_t* m_reference;                          //!< Copy of the frame, m_width * m_height pixels
+        uint8_t* m_changed;                             //!< Per-tile flags for the last probe
+        uint64_t m_frame;                               //!< Probe counter (drives the sample rotation)
+        unsigned m_verifyCursor;                        //!< The next tile to verify in full
+        bool m_primed;                                  //!< Logical true once m_reference holds a frame
+
+        bool compareTile(const uint8_t* pixels, size_t bytesPerRow, unsigned tx, unsigned ty);
+        bool sampleTile(const uint8_t* pixels, size_t bytesPerRow, unsigned tx, unsigned ty);
+        void release();
+
+        DisplayXFBChangeProbe(const DisplayXFBChangeProbe&);            // Prevent copy constructor
+        DisplayXFBChangeProbe& operator=(const DisplayXFBChangeProbe&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBChangeProbe_H
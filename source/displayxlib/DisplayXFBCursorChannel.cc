@@ -0,0 +1,332 @@
+/** @file   DisplayXFBCursorChannel.cc
+ *  @brief  Cursor position and shape messages, sent separately from encoded frames.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBCursorChannel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    static const size_t kImageWords = DisplayXFBCursor::kMaxWidth * DisplayXFBCursor::kMaxHeight;
+
+
+    static inline void put16(uint8_t* p, uint32_t value)
+    {
+        p[0] = (uint8_t)value;
+        p[1] = (uint8_t)(value >> 8);
+    }
+
+    static inline void put32(uint8_t* p, uint32_t value)
+    {
+        put16(p, value);
+        put16(p + 2, value >> 16);
+    }
+
+    static inline uint32_t get16(const uint8_t* p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+    }
+
+    static inline uint32_t get32(const uint8_t* p)
+    {
+        return get16(p) | (get16(p + 2) << 16);
+    }
+
+
+#pragma mark    -
+
+
+    DisplayXFBCursorChannel::DisplayXFBCursorChannel()
+        :
+        m_cursor(0),
+        m_image((uint32_t*)malloc(kImageWords * sizeof (uint32_t))),
+        m_sentState(0),
+        m_sentPixel(0),
+        m_haveSentState(false),
+        m_haveSentPixel(false),
+        m_statistics()
+    {
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    DisplayXFBCursorChannel::~DisplayXFBCursorChannel()
+    {
+        free(m_image);
+    }
+
+
+    /** Set the cursor record to follow. The next polls send the current shape and position.
+     *
+     *  @param  cursor          The cursor record (from DisplayXFBInterface::displayMapCursor), or zero to detach.
+     */
+    void DisplayXFBCursorChannel::attach(const DisplayXFBCursor* cursor)
+    {
+        m_cursor = (cursor && cursor->isValid()) ? cursor : 0;
+        m_haveSentState = false;
+        m_haveSentPixel = false;
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    /** Produce the next message, if the cursor has changed.
+     *
+     *  @param  timeUS          The current time (microseconds), stamped on position messages.
+     *  @param  buffer          The output buffer.
+     *  @param  capacity        The buffer size. DisplayXFBCursorMessage::kMaxSize is always enough.
+     *  @return                 The message size, or zero if there is nothing to send (or the buffer is too small).
+     */
+    size_t DisplayXFBCursorChannel::poll(uint64_t timeUS, void* buffer, size_t capacity)
+    {
+        m_statistics.m_polls ++;
+        if (!m_cursor || !m_image || !buffer) return 0;
+        uint8_t* out = (uint8_t*)buffer;
+
+        // The shape goes first, so that the receiver never positions an image it does not have.
+        if (!m_haveSentPixel || m_cursor->sequencePixel() != m_sentPixel)
+        {
+            unsigned width = 0, height = 0;
+            int hotX = 0, hotY = 0;
+            uint32_t sequence = 0;
+            if (!m_cursor->readImage(m_image, width, height, hotX, hotY, sequence))
+            {
+                // Either no image has been set (send an empty shape) or the driver is busy (try again later).
+                if (0 != (m_cursor->sequencePixel() & 1))
+                {
+                    m_statistics.m_readFailures ++;
+                    return 0;
+                }
+                width = 0;
+                height = 0;
+            }
+
+            size_t size = DisplayXFBCursorMessage::kShapeHeaderSize + (width * height * 4);
+            if (capacity < size) return 0;
+
+            out[0] = DisplayXFBCursorMessage::kTypeShape;
+            out[1] = 0;
+            out[2] = 0;
+            out[3] = 0;
+            put32(out + 4, sequence);
+            put16(out + 8, width);
+            put16(out + 10, height);
+            put16(out + 12, (uint32_t)hotX);
+            put16(out + 14, (uint32_t)hotY);
+            uint8_t* p = out + DisplayXFBCursorMessage::kShapeHeaderSize;
+            for (unsigned row = 0; row < height; row++)
+            {
+                const uint32_t* src = &m_image[row * width];
+                for (unsigned x = 0; x < width; x++, p += 4) put32(p, src[x]);
+            }
+
+            m_sentPixel = sequence;
+            m_haveSentPixel = true;
+            m_statistics.m_shapeMessages ++;
+            m_statistics.m_bytes += size;
+            return size;
+        }
+
+        if (!m_haveSentState || m_cursor->sequenceState() != m_sentState)
+        {
+            int x = 0, y = 0;
+            bool visible = false;
+            uint32_t sequence = 0;
+            if (!m_cursor->readState(x, y, visible, sequence))
+            {
+                m_statistics.m_readFailures ++;
+                return 0;
+            }
+            if (capacity < DisplayXFBCursorMessage::kPositionSize) return 0;
+
+            out[0] = DisplayXFBCursorMessage::kTypePosition;
+            out[1] = (visible) ? 1 : 0;
+            out[2] = 0;
+            out[3] = 0;
+            put32(out + 4, sequence);
+            put32(out + 8, (uint32_t)x);
+            put32(out + 12, (uint32_t)y);
+            put32(out + 16, (uint32_t)timeUS);
+            put32(out + 20, (uint32_t)(timeUS >> 32));
+
+            m_sentState = sequence;
+            m_haveSentState = true;
+            m_statistics.m_positionMessages ++;
+            m_statistics.m_bytes += DisplayXFBCursorMessage::kPositionSize;
+            return DisplayXFBCursorMessage::kPositionSize;
+        }
+        return 0;
+    }
+
+
+#pragma mark    -
+
+
+    DisplayXFBCursorOverlay::DisplayXFBCursorOverlay()
+        :
+        m_image((uint32_t*)malloc(kImageWords * sizeof (uint32_t))),
+        m_width(0),
+        m_height(0),
+        m_hotX(0),
+        m_hotY(0),
+        m_visible(false),
+        m_predict(true),
+        m_samples(0),
+        m_x(),
+        m_y(),
+        m_senderTime(),
+        m_arrivalTime(0),
+        m_stateSequence(0)
+    {
+    }
+
+
+    DisplayXFBCursorOverlay::~DisplayXFBCursorOverlay()
+    {
+        free(m_image);
+    }
+
+
+    /** Apply a message.
+     *
+     *  @param  message         The message.
+     *  @param  size            The message size (bytes).
+     *  @param  localTimeUS     The local arrival time (microseconds).
+     *  @return                 Logical true if the message was applied, false if it was malformed or out of date.
+     */
+    bool DisplayXFBCursorOverlay::receive(const void* message, size_t size, uint64_t localTimeUS)
+    {
+        const uint8_t* in = (const uint8_t*)message;
+        if (!in || size < 1 || !m_image) return false;
+
+        if (DisplayXFBCursorMessage::kTypePosition == in[0])
+        {
+            if (size != DisplayXFBCursorMessage::kPositionSize) return false;
+            uint32_t sequence = get32(in + 4);
+            if (m_samples && (int32_t)(sequence - m_stateSequence) <= 0) return false;     // Reordered or repeated
+
+            if (m_samples)
+            {
+                m_x[0] = m_x[1];
+                m_y[0] = m_y[1];
+                m_senderTime[0] = m_senderTime[1];
+            }
+            m_x[1] = (int)(int32_t)get32(in + 8);
+            m_y[1] = (int)(int32_t)get32(in + 12);
+            m_senderTime[1] = (uint64_t)get32(in + 16) | ((uint64_t)get32(in + 20) << 32);
+            m_visible = (0 != (in[1] & 1));
+            m_stateSequence = sequence;
+            m_arrivalTime = localTimeUS;
+            if (m_samples < 2) m_samples ++;
+            return true;
+        }
+
+        if (DisplayXFBCursorMessage::kTypeShape == in[0])
+        {
+            if (size < DisplayXFBCursorMessage::kShapeHeaderSize) return false;
+            unsigned width = get16(in + 8);
+            unsigned height = get16(in + 10);
+            if (width > DisplayXFBCursor::kMaxWidth || height > DisplayXFBCursor::kMaxHeight) return false;
+            if (size != DisplayXFBCursorMessage::kShapeHeaderSize + (width * height * 4)) return false;
+
+            const uint8_t* p = in + DisplayXFBCursorMessage::kShapeHeaderSize;
+            for (unsigned i = 0; i < width * height; i++, p += 4) m_image[i] = get32(p);
+            m_width = width;
+            m_height = height;
+            m_hotX = (int)(int16_t)get16(in + 12);
+            m_hotY = (int)(int16_t)get16(in + 14);
+            return true;
+        }
+        return false;
+    }
+
+
+    /** Return the position at which to draw the image (top left), predicted for a given local time.
+     */
+    void DisplayXFBCursorOverlay::position(uint64_t localTimeUS, int& x, int& y) const
+    {
+        x = m_x[1];
+        y = m_y[1];
+        if (!m_predict || m_samples < 2 || localTimeUS <= m_arrivalTime) return;
+
+        uint64_t interval = m_senderTime[1] - m_senderTime[0];
+        if (m_senderTime[1] <= m_senderTime[0] || interval > kMaxSampleGapUS) return;
+
+        uint64_t ahead = localTimeUS - m_arrivalTime;
+        if (ahead > kMaxPredictionUS) ahead = kMaxPredictionUS;
+        x += (int)(((int64_t)(m_x[1] - m_x[0]) * (int64_t)ahead) / (int64_t)interval);
+        y += (int)(((int64_t)(m_y[1] - m_y[0]) * (int64_t)ahead) / (int64_t)interval);
+    }
+
+
+    /** Draw the cursor over a frame (alpha blended, non-premultiplied). Draw in to a copy of the decoded frame,
+     *  since the pixels under the cursor are not kept.
+     *
+     *  @param  pixels          The frame (32 bit BGRA).
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @param  localTimeUS     The display time, for prediction.
+     */
+    void DisplayXFBCursorOverlay::composite(void* pixels, unsigned width, unsigned height, size_t bytesPerRow, uint64_t localTimeUS) const
+    {
+        if (!pixels || !isVisible()) return;
+
+        int cx, cy;
+        position(localTimeUS, cx, cy);
+        blend(m_image, m_width, m_height, m_width, cx, cy, pixels, width, height, bytesPerRow);
+    }
+
+
+    /** Alpha blend (non-premultiplied) a cursor image over a frame, clipping to the frame.
+     *
+     *  @param  image           The cursor image (32 bit BGRA).
+     *  @param  imageWidth      The image width (pixels).
+     *  @param  imageHeight     The image height (pixels).
+     *  @param  imageStride     The image row stride (pixels).
+     *  @param  x               The position of the image's top left in the frame (may be negative).
+     *  @param  y               ..
+     *  @param  pixels          The frame (32 bit BGRA).
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  bytesPerRow     The frame stride (bytes).
+     */
+    void DisplayXFBCursorOverlay::blend(const uint32_t* image, unsigned imageWidth, unsigned imageHeight, size_t imageStride, int x, int y,
+                                        void* pixels, unsigned width, unsigned height, size_t bytesPerRow)
+    {
+        for (unsigned row = 0; row < imageHeight; row++)
+        {
+            int py = y + (int)row;
+            if (py < 0 || py >= (int)height) continue;
+            uint32_t* dst = (uint32_t*)((uint8_t*)pixels + ((size_t)py * bytesPerRow));
+            const uint32_t* src = &image[row * imageStride];
+            for (unsigned col = 0; col < imageWidth; col++)
+            {
+                int px = x + (int)col;
+                if (px < 0 || px >= (int)width) continue;
+
+                uint32_t s = src[col];
+                uint32_t a = s >> 24;
+                if (0 == a) continue;
+                if (255 == a)
+                {
+                    dst[px] = s;
+                    continue;
+                }
+                uint32_t d = dst[px];
+                uint32_t result = 0xff000000u;
+                for (unsigned shift = 0; shift < 24; shift += 8)
+                {
+                    uint32_t sc = (s >> shift) & 0xff;
+                    uint32_t dc = (d >> shift) & 0xff;
+                    result |= (((sc * a) + (dc * (255 - a)) + 127) / 255) << shift;
+                }
+                dst[px] = result;
+            }
+        }
+    }
+
+}   // namespace
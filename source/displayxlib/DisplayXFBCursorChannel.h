@@ -0,0 +1,135 @@
+/** @file   DisplayXFBCursorChannel.h
+ *  @brief  Cursor position and shape messages, sent separately from encoded frames.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBCursorChannel_H
+#define COM_TSONIQ_DisplayXFBCursorChannel_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DisplayXFBShared.h"
+
+namespace ts
+{
+    /** Message format constants shared by the sender and the receiver. All fields are little-endian.
+     *
+     *      Position    'P', flags (bit 0: visible), 2 reserved, state sequence (u32), x (s32), y (s32),
+     *                  sender time in microseconds (u64). 24 bytes.
+     *      Shape       'S', 3 reserved, pixel sequence (u32), width (u16), height (u16), hot spot x (s16),
+     *                  hot spot y (s16), then width * height 32 bit BGRA pixels. 16 bytes plus the image.
+     *
+     *  The position is that of the top left of the image, as in DisplayXFBCursor (add the hot spot for the pointer).
+     */
+    struct DisplayXFBCursorMessage
+    {
+        static const uint8_t kTypePosition = 'P';                       //!< Position message identifier
+        static const uint8_t kTypeShape = 'S';                          //!< Shape message identifier
+        static const size_t kPositionSize = 24;                         //!< Size of a position message (bytes)
+        static const size_t kShapeHeaderSize = 16;                      //!< Size of a shape message header (bytes)
+        static const size_t kMaxSize = kShapeHeaderSize + (DisplayXFBCursor::kMaxWidth * DisplayXFBCursor::kMaxHeight * 4);
+    };
+
+
+    /** Class used to turn the driver's cursor record in to small messages.
+     *
+     *  Call poll() whenever a cursor notification arrives, or from a fast timer. It compares the record's sequence
+     *  numbers with those last sent and returns at most one message per call: a shape message if the image
+     *  changed, otherwise a position message if the position or visibility changed. Call it until it returns zero.
+     *  Because the driver implements a hardware cursor, captured frames never contain the cursor, so the receiver
+     *  (DisplayXFBCursorOverlay) draws it locally and pointer latency is set by message latency rather than by
+     *  frame encoding. The class is not thread safe.
+     */
+    class DisplayXFBCursorChannel
+    {
+    public:
+
+        /** Counters, accumulated since the last attach().
+         */
+        struct Statistics
+        {
+            uint64_t m_polls;                                           //!< Calls to poll()
+            uint64_t m_positionMessages;                                //!< Position messages produced
+            uint64_t m_shapeMessages;                                   //!< Shape messages produced
+            uint64_t m_bytes;                                           //!< Total message bytes produced
+            uint64_t m_readFailures;                                    //!< Polls that could not take a consistent copy
+        };
+
+        DisplayXFBCursorChannel();
+        ~DisplayXFBCursorChannel();
+
+        void attach(const DisplayXFBCursor* cursor);
+        size_t poll(uint64_t timeUS, void* buffer, size_t capacity);
+        const Statistics& statistics() const { return m_statistics; }   //!< Return the counters
+
+    private:
+
+        const DisplayXFBCursor* m_cursor;                               //!< The mapped cursor record
+        uint32_t* m_image;                                              //!< Scratch copy of the image
+        uint32_t m_sentState;                                           //!< State sequence last sent
+        uint32_t m_sentPixel;                                           //!< Pixel sequence last sent
+        bool m_haveSentState;                                           //!< Logical true once a position was sent
+        bool m_haveSentPixel;                                           //!< Logical true once a shape was sent
+        Statistics m_statistics;                                        //!< The counters
+
+        DisplayXFBCursorChannel(const DisplayXFBCursorChannel&);            // Prevent copy constructor
+        DisplayXFBCursorChannel& operator=(const DisplayXFBCursorChannel&); // Prevent assignment
+    };
+
+
+    /** Class used by the receiver to track the cursor from messages and draw it over decoded frames.
+     *
+     *  With prediction enabled, position() extrapolates from the last two position messages (using the sender's
+     *  time stamps for the velocity), for at most kMaxPredictionUS after the last message arrived. Prediction is
+     *  not used if the last two messages are more than kMaxSampleGapUS apart. This hides one message interval of
+     *  latency while the pointer is moving, without overshooting once it stops. The class is not thread safe.
+     */
+    class DisplayXFBCursorOverlay
+    {
+    public:
+
+        static const uint64_t kMaxPredictionUS = 50000;                 //!< Longest extrapolation
+        static const uint64_t kMaxSampleGapUS = 100000;                 //!< Longest message gap used for a velocity
+
+        DisplayXFBCursorOverlay();
+        ~DisplayXFBCursorOverlay();
+
+        bool receive(const void* message, size_t size, uint64_t localTimeUS);
+        void setPredictionEnabled(bool enable) { m_predict = enable; }  //!< Enable or disable extrapolation
+
+        bool isVisible() const { return m_visible && m_width && m_height; }    //!< Return true if there is a cursor to draw
+        void position(uint64_t localTimeUS, int& x, int& y) const;
+        unsigned width() const { return m_width; }                      //!< Return the image width
+        unsigned height() const { return m_height; }                    //!< Return the image height
+        int hotX() const { return m_hotX; }                             //!< Return the hot spot
+        int hotY() const { return m_hotY; }                             //!< Return the hot spot
+        const uint32_t* image() const { return m_image; }               //!< Return the image (rows of width() pixels)
+
+        void composite(void* pixels, unsigned width, unsigned height, size_t bytesPerRow, uint64_t localTimeUS) const;
+        static void blend(const uint32_t* image, unsigned imageWidth, unsigned imageHeight, size_t imageStride, int x, int y,
+                          void* pixels, unsigned width, unsigned height, size_t bytesPerRow);
+
+    private:
+
+        uint32_t* m_image;                                              //!< The image
+        unsigned m_width;                                               //!< Image width
+        unsigned m_height;                                              //!< Image height
+        int m_hotX;                                                     //!< Hot spot
+        int m_hotY;                                                     //!< Hot spot
+        bool m_visible;                                                 //!< Visibility from the last position
+        bool m_predict;                                                 //!< Logical true to extrapolate
+        unsigned m_samples;                                             //!< Number of valid position samples (0 to 2)
+        int m_x[2];                                                     //!< Last two positions (newest in [1])
+        int m_y[2];                                                     //!< ..
+        uint64_t m_senderTime[2];                                       //!< Their sender time stamps
+        uint64_t m_arrivalTime;                                         //!< Local arrival time of the newest
+        uint32_t m_stateSequence;                                       //!< Sequence of the newest position
+
+        DisplayXFBCursorOverlay(const DisplayXFBCursorOverlay&);            // Prevent copy constructor
+        DisplayXFBCursorOverlay& operator=(const DisplayXFBCursorOverlay&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBCursorChannel_H
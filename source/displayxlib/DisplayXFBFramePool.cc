@@ -0,0 +1,353 @@
+/** @file   DisplayXFBFramePool.cc
+ *  @brief  Recycling allocator for frame buffers.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBFramePool.h"
+#include "DisplayXFBPageAllocator.h"
+
+#include <string.h>
+
+namespace ts
+{
+    DisplayXFBFramePool::DisplayXFBFramePool(size_t budget)
+        :
+        m_lock(),
+        m_threadKey(),
+        m_classes(0),
+        m_threadCaches(0),
+        m_budget(budget),
+        m_statistics()
+    {
+        memset(&m_statistics, 0, sizeof m_statistics);
+        pthread_mutex_init(&m_lock, 0);
+        pthread_key_create(&m_threadKey, threadCacheDestructor);
+    }
+
+
+    DisplayXFBFramePool::~DisplayXFBFramePool()
+    {
+        pthread_key_delete(m_threadKey);        // No further thread exit callbacks
+
+        pthread_mutex_lock(&m_lock);
+        while (m_threadCaches)
+        {
+            ThreadCache* cache = m_threadCaches;
+            m_threadCaches = cache->m_next;
+            for (unsigned i = 0; i < kThreadCacheSize; i++)
+            {
+                if (cache->m_frames[i]) destroyFrame(cache->m_frames[i]);
+            }
+            delete cache;
+        }
+        while (m_classes)
+        {
+            SizeClass* sizeClass = m_classes;
+            m_classes = sizeClass->m_next;
+            while (sizeClass->m_free)
+            {
+                Frame* frame = sizeClass->m_free;
+                sizeClass->m_free = frame->m_next;
+                destroyFrame(frame);
+            }
+            delete sizeClass;
+        }
+        pthread_mutex_unlock(&m_lock);
+        pthread_mutex_destroy(&m_lock);
+    }
+
+
+    /** Get a buffer.
+     *
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  bytesPerRow     The frame stride (bytes), or zero for width * 4.
+     *  @return                 The buffer, or zero if the parameters are invalid, the budget would be exceeded or
+     *                          no memory is available. The contents are undefined. Return it with release().
+     */
+    DisplayXFBFramePool::Frame* DisplayXFBFramePool::acquire(unsigned width, unsigned height, unsigned bytesPerRow)
+    {
+        if (0 == bytesPerRow) bytesPerRow = width * 4;
+        if (0 == width || 0 == height || bytesPerRow < width * 4) return 0;
+
+        // Fast path: the calling thread's cache. Slots are emptied with an atomic swap before the frame is examined,
+        // as reclaim() may take cached frames from any thread.
+        ThreadCache* cache = threadCache();
+        Frame* evicted[kThreadCacheSize];
+        unsigned evictedCount = 0;
+        if (cache)
+        {
+            bool sameSize = (cache->m_width == width && cache->m_height == height && cache->m_bytesPerRow == bytesPerRow);
+            for (unsigned i = 0; i < kThreadCacheSize; i++)
+            {
+                if (!cache->m_frames[i]) continue;
+                Frame* frame = __sync_lock_test_and_set(&cache->m_frames[i], (Frame*)0);
+                if (!frame) continue;
+                if (sameSize)
+                {
+                    __sync_fetch_and_add(&m_statistics.m_hits, 1);
+                    __sync_fetch_and_add(&m_statistics.m_threadHits, 1);
+                    return frame;
+                }
+                evicted[evictedCount++] = frame;    // The thread has moved to a new size: return these to the classes
+            }
+            cache->m_width = width;
+            cache->m_height = height;
+            cache->m_bytesPerRow = bytesPerRow;
+        }
+
+        pthread_mutex_lock(&m_lock);
+        for (unsigned i = 0; i < evictedCount; i++) freeFrame(evicted[i]);
+
+        // Shared free list for the size class.
+        SizeClass* sizeClass = findClass(width, height, bytesPerRow, false);
+        if (sizeClass && sizeClass->m_free)
+        {
+            Frame* frame = sizeClass->m_free;
+            sizeClass->m_free = frame->m_next;
+            m_statistics.m_freeBytes -= DisplayXFBPageAllocator::allocationSize(frame->m_size);
+            pthread_mutex_unlock(&m_lock);
+            __sync_fetch_and_add(&m_statistics.m_hits, 1);
+            return frame;
+        }
+
+        // Allocate a new buffer, making room within the budget if necessary.
+        Frame* frame = 0;
+        size_t size = (size_t)bytesPerRow * height;
+        size_t allocation = DisplayXFBPageAllocator::allocationSize(size);
+        if (reclaim(allocation))
+        {
+            frame = new Frame;
+            frame->m_data = DisplayXFBPageAllocator::allocate(size);
+            frame->m_width = width;
+            frame->m_height = height;
+            frame->m_bytesPerRow = bytesPerRow;
+            frame->m_size = size;
+            frame->m_next = 0;
+            if (!frame->m_data)
+            {
+                delete frame;
+                frame = 0;
+            }
+        }
+
+        if (frame)
+        {
+            m_statistics.m_misses ++;
+            m_statistics.m_residentBytes += allocation;
+        }
+        else
+        {
+            m_statistics.m_failures ++;
+        }
+        pthread_mutex_unlock(&m_lock);
+        return frame;
+    }
+
+
+    /** Return a buffer to the pool.
+     *
+     *  @param  frame           The buffer (may be zero).
+     */
+    void DisplayXFBFramePool::release(Frame* frame)
+    {
+        if (!frame) return;
+
+        // Only the size the thread is currently acquiring is worth keeping locally.
+        ThreadCache* cache = threadCache();
+        if (cache && frame->m_width == cache->m_width && frame->m_height == cache->m_height && frame->m_bytesPerRow == cache->m_bytesPerRow)
+        {
+            for (unsigned i = 0; i < kThreadCacheSize; i++)
+            {
+                if (!cache->m_frames[i] && __sync_bool_compare_and_swap(&cache->m_frames[i], (Frame*)0, frame)) return;
+            }
+        }
+
+        pthread_mutex_lock(&m_lock);
+        freeFrame(frame);
+        pthread_mutex_unlock(&m_lock);
+    }
+
+
+    /** Release all free buffers, including those held in thread caches, back to the system.
+     */
+    void DisplayXFBFramePool::trim()
+    {
+        pthread_mutex_lock(&m_lock);
+        size_t budget = m_budget;
+        m_budget = 0;
+        reclaim(0);
+        m_budget = budget;
+        pthread_mutex_unlock(&m_lock);
+    }
+
+
+    /** Change the memory budget. Free buffers are released if the pool is now over budget.
+     *
+     *  @param  budget          The limit on resident memory (bytes).
+     */
+    void DisplayXFBFramePool::setBudget(size_t budget)
+    {
+        pthread_mutex_lock(&m_lock);
+        m_budget = budget;
+        reclaim(0);
+        pthread_mutex_unlock(&m_lock);
+    }
+
+
+    /** Return a snapshot of the pool counters.
+     */
+    DisplayXFBFramePool::Statistics DisplayXFBFramePool::statistics()
+    {
+        pthread_mutex_lock(&m_lock);
+        Statistics result = m_statistics;
+        pthread_mutex_unlock(&m_lock);
+        return result;
+    }
+
+
+    /** Return the calling thread's cache, creating it if necessary.
+     *
+     *  @return                 The cache, or zero if none could be created.
+     */
+    DisplayXFBFramePool::ThreadCache* DisplayXFBFramePool::threadCache()
+    {
+        ThreadCache* cache = (ThreadCache*)pthread_getspecific(m_threadKey);
+        if (!cache)
+        {
+            cache = new ThreadCache;
+            cache->m_pool = this;
+            for (unsigned i = 0; i < kThreadCacheSize; i++) cache->m_frames[i] = 0;
+            cache->m_width = 0;
+            cache->m_height = 0;
+            cache->m_bytesPerRow = 0;
+
+            pthread_mutex_lock(&m_lock);
+            cache->m_next = m_threadCaches;
+            m_threadCaches = cache;
+            pthread_mutex_unlock(&m_lock);
+
+            pthread_setspecific(m_threadKey, cache);
+        }
+        return cache;
+    }
+
+
+    /** Find a size class. Must be called with m_lock held.
+     *
+     *  @return                 The class, or zero if not found and create is false.
+     */
+    DisplayXFBFramePool::SizeClass* DisplayXFBFramePool::findClass(unsigned width, unsigned height, unsigned bytesPerRow, bool create)
+    {
+        for (SizeClass* sizeClass = m_classes; sizeClass; sizeClass = sizeClass->m_next)
+        {
+            if (sizeClass->m_width == width && sizeClass->m_height == height && sizeClass->m_bytesPerRow == bytesPerRow) return sizeClass;
+        }
+        if (!create) return 0;
+
+        SizeClass* sizeClass = new SizeClass;
+        sizeClass->m_width = width;
+        sizeClass->m_height = height;
+        sizeClass->m_bytesPerRow = bytesPerRow;
+        sizeClass->m_free = 0;
+        sizeClass->m_next = m_classes;
+        m_classes = sizeClass;
+        return sizeClass;
+    }
+
+
+    /** Release free buffers until an allocation fits within the budget. Must be called with m_lock held.
+     *
+     *  The shared classes are emptied first, then the thread caches. Classes left without free buffers are deleted
+     *  (they are created again on demand by release()).
+     *
+     *  @param  needed          The size of the pending allocation (bytes).
+     *  @return                 Logical true if the allocation now fits.
+     */
+    bool DisplayXFBFramePool::reclaim(size_t needed)
+    {
+        SizeClass** link = &m_classes;
+        while (*link)
+        {
+            SizeClass* sizeClass = *link;
+            while (sizeClass->m_free && m_statistics.m_residentBytes + needed > m_budget)
+            {
+                Frame* frame = sizeClass->m_free;
+                sizeClass->m_free = frame->m_next;
+                m_statistics.m_freeBytes -= DisplayXFBPageAllocator::allocationSize(frame->m_size);
+                destroyFrame(frame);
+            }
+            if (!sizeClass->m_free)
+            {
+                *link = sizeClass->m_next;
+                delete sizeClass;
+            }
+            else
+            {
+                link = &sizeClass->m_next;
+            }
+        }
+
+        for (ThreadCache* cache = m_threadCaches; cache && m_statistics.m_residentBytes + needed > m_budget; cache = cache->m_next)
+        {
+            for (unsigned i = 0; i < kThreadCacheSize && m_statistics.m_residentBytes + needed > m_budget; i++)
+            {
+                Frame* frame = __sync_lock_test_and_set(&cache->m_frames[i], (Frame*)0);
+                if (frame) destroyFrame(frame);
+            }
+        }
+        return m_statistics.m_residentBytes + needed <= m_budget;
+    }
+
+
+    /** Put a buffer on its class's free list, creating the class if necessary. Must be called with m_lock held.
+     */
+    void DisplayXFBFramePool::freeFrame(Frame* frame)
+    {
+        SizeClass* sizeClass = findClass(frame->m_width, frame->m_height, frame->m_bytesPerRow, true);
+        if (!sizeClass)
+        {
+            destroyFrame(frame);
+        }
+        else
+        {
+            frame->m_next = sizeClass->m_free;
+            sizeClass->m_free = frame;
+            m_statistics.m_freeBytes += DisplayXFBPageAllocator::allocationSize(frame->m_size);
+        }
+    }
+
+
+    /** Free a buffer's memory. Must be called with m_lock held.
+     */
+    void DisplayXFBFramePool::destroyFrame(Frame* frame)
+    {
+        m_statistics.m_residentBytes -= DisplayXFBPageAllocator::allocationSize(frame->m_size);
+        DisplayXFBPageAllocator::release(frame->m_data, frame->m_size);
+        delete frame;
+    }
+
+
+    /** Thread exit callback: return the thread's cached buffers to the shared classes.
+     */
+    void DisplayXFBFramePool::threadCacheDestructor(void* value)
+    {
+        ThreadCache* cache = (ThreadCache*)value;
+        DisplayXFBFramePool* pool = cache->m_pool;
+
+        pthread_mutex_lock(&pool->m_lock);
+        for (unsigned i = 0; i < kThreadCacheSize; i++)
+        {
+            Frame* frame = cache->m_frames[i];
+            if (frame) pool->freeFrame(frame);
+        }
+        ThreadCache** link = &pool->m_threadCaches;
+        while (*link && *link != cache) link = &(*link)->m_next;
+        if (*link) *link = cache->m_next;
+        pthread_mutex_unlock(&pool->m_lock);
+
+        delete cache;
+    }
+
+}   // namespace
@@ -0,0 +1,120 @@
+/** @file   DisplayXFBFramePool.h
+ *  @brief  Recycling allocator for frame buffers.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBFramePool_H
+#define COM_TSONIQ_DisplayXFBFramePool_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+namespace ts
+{
+    /** Class used to recycle frame buffers, so that a capture pipeline running at a steady frame size does not
+     *  allocate memory per frame.
+     *
+     *  Free buffers are kept in classes keyed by width, height and stride. Each thread has a small private cache
+     *  that is checked first without locking; the shared classes are protected by a mutex. A thread only caches
+     *  buffers of the size it last acquired: other buffers (for example, those released by a consumer thread, or
+     *  left over after a mode change) go to the shared classes, and a thread that starts acquiring a new size moves
+     *  its cached buffers there too. New buffers are only allocated when no free buffer of the right class exists,
+     *  and only while the total resident size is within the budget. Unused buffers are released first to make room,
+     *  from the shared classes and then from the thread caches, so no free buffer can hold the pool over budget.
+     *  Buffers come from DisplayXFBPageAllocator, so large frames use huge pages where available.
+     *
+     *  All methods are thread safe. The pool must outlive every thread that uses it and every buffer that it issues.
+     */
+    class DisplayXFBFramePool
+    {
+    public:
+
+        static const size_t kDefaultBudget = 512 * 1024 * 1024;    //!< Default limit on resident memory (bytes)
+        static const unsigned kThreadCacheSize = 4;                 //!< Buffers held per thread
+
+        /** A buffer issued by the pool.
+         */
+        class Frame
+        {
+        public:
+            void* data() const { return m_data; }                   //!< Return the pixel data
+            unsigned width() const { return m_width; }              //!< Return the width (pixels)
+            unsigned height() const { return m_height; }            //!< Return the height (pixels)
+            unsigned bytesPerRow() const { return m_bytesPerRow; }  //!< Return the stride (bytes)
+            size_t size() const { return m_size; }                  //!< Return the data size (bytes)
+
+        private:
+            friend class DisplayXFBFramePool;
+            void* m_data;
+            unsigned m_width;
+            unsigned m_height;
+            unsigned m_bytesPerRow;
+            size_t m_size;
+            Frame* m_next;
+        };
+
+        /** Pool counters.
+         */
+        struct Statistics
+        {
+            uint64_t m_hits;                                        //!< Requests satisfied by a recycled buffer
+            uint64_t m_threadHits;                                  //!< Hits satisfied from the calling thread's cache
+            uint64_t m_misses;                                      //!< Requests that allocated a new buffer
+            uint64_t m_failures;                                    //!< Requests refused (budget or no memory)
+            uint64_t m_residentBytes;                               //!< Total size of all buffers (issued and free)
+            uint64_t m_freeBytes;                                   //!< Size of the free buffers in the shared classes
+        };
+
+        explicit DisplayXFBFramePool(size_t budget=kDefaultBudget);
+        ~DisplayXFBFramePool();
+
+        Frame* acquire(unsigned width, unsigned height, unsigned bytesPerRow=0);
+        void release(Frame* frame);
+        void trim();
+        void setBudget(size_t budget);
+        Statistics statistics();
+
+    private:
+
+        struct SizeClass
+        {
+            unsigned m_width;
+            unsigned m_height;
+            unsigned m_bytesPerRow;
+            Frame* m_free;
+            SizeClass* m_next;
+        };
+
+        struct ThreadCache
+        {
+            DisplayXFBFramePool* m_pool;
+            Frame* volatile m_frames[kThreadCacheSize];             //!< Cached buffers (swapped atomically: reclaim() may take them)
+            unsigned m_width;                                       //!< The size last acquired by the thread (owner use only)
+            unsigned m_height;
+            unsigned m_bytesPerRow;
+            ThreadCache* m_next;
+        };
+
+        pthread_mutex_t m_lock;                                     //!< Protects everything below except the hit counters (atomic)
+        pthread_key_t m_threadKey;                                  //!< Key for the per-thread ThreadCache
+        SizeClass* m_classes;                                       //!< The size classes
+        ThreadCache* m_threadCaches;                                //!< All thread caches (for destruction)
+        size_t m_budget;                                            //!< Limit on m_statistics.m_residentBytes
+        Statistics m_statistics;                                    //!< Counters
+
+        ThreadCache* threadCache();
+        SizeClass* findClass(unsigned width, unsigned height, unsigned bytesPerRow, bool create);
+        bool reclaim(size_t needed);
+        void freeFrame(Frame* frame);
+        void destroyFrame(Frame* frame);
+        static void threadCacheDestructor(void* value);
+
+        DisplayXFBFramePool(const DisplayXFBFramePool&);            // Prevent copy constructor
+        DisplayXFBFramePool& operator=(const DisplayXFBFramePool&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBFramePool_H
@@ -28,16 +28,39 @@ namespace ts
         m_notificationHandler(0),
         m_notificationHandlerContext(0),
         m_notificationHandlerNotificationPort(0),
-        m_notificationObject(0),
-        m_notificationRunloop(0)
+        m_notificationRegistered(false),
+        m_notificationRunloop(0),
+        m_asyncQueue(0),
+        m_asyncPending(0),
+        m_asyncReconfigurationRegistered(false)
     {
         m_info.invalidate();
+        m_asyncQueue = dispatch_queue_create("com.tsoniq.displayx.interface", NULL);
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+        {
+            for (unsigned j = 0; j < kDisplayXFBMaxMapTypes; j++)
+            {
+                m_maps[i][j].invalidate();
+                m_mapsReadOnly[i][j] = false;
+            }
+        }
     }
 
 
     DisplayXFBInterface::~DisplayXFBInterface()
     {
         close();
+        if (m_asyncReconfigurationRegistered)
+        {
+            CGDisplayRemoveReconfigurationCallback(reconfigurationCallback, this);
+            m_asyncReconfigurationRegistered = false;
+        }
+        if (m_asyncQueue)
+        {
+            dispatch_sync_f(m_asyncQueue, this, asyncCancelFunction);   // Also flushes any queued checks
+            dispatch_release(m_asyncQueue);
+            m_asyncQueue = 0;
+        }
     }
 
 
@@ -72,6 +95,7 @@ namespace ts
     void DisplayXFBInterface::close()
     {
         clearNotificationHandler();
+        if (m_asyncQueue) dispatch_sync_f(m_asyncQueue, this, asyncCancelFunction);   // Fail any outstanding requests
         if (m_isOpen)
         {
             userClose();
@@ -80,6 +104,10 @@ namespace ts
             IOObjectRelease(m_service);
             m_service = 0;
             m_info.invalidate();
+            for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+            {
+                for (unsigned j = 0; j < kDisplayXFBMaxMapTypes; j++) m_maps[i][j].invalidate();
+            }
             m_isOpen = false;
         }
     }
@@ -141,20 +169,283 @@ namespace ts
     }
 
 
-    bool DisplayXFBInterface::displayMapFramebuffer(DisplayXFBMap& map, unsigned displayIndex, bool readOnly)
+    bool DisplayXFBInterface::displayConnectMask(unsigned displayMask)
     {
-        if (!isOpen() || !userMap(displayIndex, kDisplayXFBMapTypeDisplay, readOnly, &map)) { map.invalidate(); return false; }
+        if (!isOpen() || !userDisplayConnectMask(displayMask, true)) return false;
         else return true;
     }
 
 
-    bool DisplayXFBInterface::displayMapCursor(DisplayXFBMap& map, unsigned displayIndex, bool readOnly)
+    bool DisplayXFBInterface::displayDisconnectMask(unsigned displayMask)
     {
-        if (!isOpen() || !userMap(displayIndex, kDisplayXFBMapTypeCursor, readOnly, &map)) { map.invalidate(); return false; }
+        if (!isOpen() || !userDisplayConnectMask(displayMask, false)) return false;
         else return true;
     }
 
 
+    /** Private state for an asynchronous request.
+     */
+    struct DisplayXFBInterface::AsyncRequest
+    {
+        enum Command
+        {
+            kCommandConnect,
+            kCommandDisconnect,
+            kCommandSetConfiguration
+        };
+
+        DisplayXFBInterface* m_owner;                   //!< The interface issuing the request
+        AsyncRequest* m_next;                           //!< The next pending request
+        Command m_command;                              //!< The request type
+        unsigned m_displayIndex;                        //!< The display
+        unsigned m_timeoutMS;                           //!< The time limit for Quartz to reconfigure
+        CompletionHandler m_handler;                    //!< The completion handler (may be zero)
+        void* m_context;                                //!< Client context for m_handler
+        dispatch_queue_t m_queue;                       //!< The queue for m_handler (retained)
+        dispatch_source_t m_timer;                      //!< The timeout source, or zero if none
+        bool m_isPending;                               //!< Logical true if in the pending list
+        DisplayXFBConfiguration m_configuration;        //!< The configuration (kCommandSetConfiguration only)
+
+        /** Test if Quartz has caught up with the request.
+         */
+        bool isSatisfied() const
+        {
+            CGDirectDisplayID displayID;
+            bool isActive = displayIndexToID(displayID, m_displayIndex);
+            return (kCommandConnect == m_command) ? isActive : !isActive;
+        }
+    };
+
+
+    /** The completion callback parameters, delivered on the client's queue.
+     */
+    struct DisplayXFBInterfaceAsyncCompletion
+    {
+        DisplayXFBInterface::CompletionHandler m_handler;
+        void* m_context;
+        unsigned m_displayIndex;
+        bool m_success;
+    };
+
+
+    bool DisplayXFBInterface::displayConnectAsync(unsigned displayIndex, CompletionHandler handler, void* context, dispatch_queue_t queue, unsigned timeoutMS)
+    {
+        if (!isOpen() || displayIndex >= displayCount()) return false;
+        AsyncRequest* request = new AsyncRequest;
+        request->m_command = AsyncRequest::kCommandConnect;
+        request->m_displayIndex = displayIndex;
+        request->m_handler = handler;
+        request->m_context = context;
+        request->m_queue = queue;
+        return asyncStart(request, timeoutMS);
+    }
+
+
+    bool DisplayXFBInterface::displayDisconnectAsync(unsigned displayIndex, CompletionHandler handler, void* context, dispatch_queue_t queue, unsigned timeoutMS)
+    {
+        if (!isOpen() || displayIndex >= displayCount()) return false;
+        AsyncRequest* request = new AsyncRequest;
+        request->m_command = AsyncRequest::kCommandDisconnect;
+        request->m_displayIndex = displayIndex;
+        request->m_handler = handler;
+        request->m_context = context;
+        request->m_queue = queue;
+        return asyncStart(request, timeoutMS);
+    }
+
+
+    bool DisplayXFBInterface::displaySetConfigurationAsync(const DisplayXFBConfiguration& configuration, unsigned displayIndex, CompletionHandler handler, void* context, dispatch_queue_t queue)
+    {
+        if (!isOpen() || displayIndex >= displayCount()) return false;
+        AsyncRequest* request = new AsyncRequest;
+        request->m_command = AsyncRequest::kCommandSetConfiguration;
+        request->m_displayIndex = displayIndex;
+        request->m_handler = handler;
+        request->m_context = context;
+        request->m_queue = queue;
+        request->m_configuration = configuration;
+        return asyncStart(request, 0);
+    }
+
+
+    bool DisplayXFBInterface::asyncStart(AsyncRequest* request, unsigned timeoutMS)
+    {
+        if (!m_asyncQueue) { delete request; return false; }
+
+        // Quartz callbacks are needed to detect completion of connect and disconnect requests.
+        if (!m_asyncReconfigurationRegistered && AsyncRequest::kCommandSetConfiguration != request->m_command)
+        {
+            if (kCGErrorSuccess != CGDisplayRegisterReconfigurationCallback(reconfigurationCallback, this)) { delete request; return false; }
+            m_asyncReconfigurationRegistered = true;
+        }
+
+        if (!request->m_queue) request->m_queue = dispatch_get_main_queue();
+        dispatch_retain(request->m_queue);
+        request->m_owner = this;
+        request->m_next = 0;
+        request->m_timeoutMS = timeoutMS;
+        request->m_timer = 0;
+        request->m_isPending = false;
+
+        dispatch_async_f(m_asyncQueue, request, asyncIssueFunction);
+        return true;
+    }
+
+
+    void DisplayXFBInterface::asyncCheckPending()
+    {
+        AsyncRequest* request = m_asyncPending;
+        while (request)
+        {
+            AsyncRequest* next = request->m_next;
+            if (request->isSatisfied()) asyncComplete(request, true);
+            request = next;
+        }
+    }
+
+
+    void DisplayXFBInterface::asyncComplete(AsyncRequest* request, bool success)
+    {
+        if (request->m_isPending)
+        {
+            AsyncRequest** link = &m_asyncPending;
+            while (*link != request) link = &(*link)->m_next;
+            *link = request->m_next;
+            request->m_isPending = false;
+        }
+
+        if (request->m_handler)
+        {
+            DisplayXFBInterfaceAsyncCompletion* completion = new DisplayXFBInterfaceAsyncCompletion;
+            completion->m_handler = request->m_handler;
+            completion->m_context = request->m_context;
+            completion->m_displayIndex = request->m_displayIndex;
+            completion->m_success = success;
+            dispatch_async_f(request->m_queue, completion, asyncCompletionFunction);
+        }
+        dispatch_release(request->m_queue);
+        request->m_queue = 0;
+
+        // The request is deleted by the timer's cancel handler, if there is one.
+        if (request->m_timer) dispatch_source_cancel(request->m_timer);
+        else delete request;
+    }
+
+
+    void DisplayXFBInterface::asyncCancelAll()
+    {
+        while (m_asyncPending) asyncComplete(m_asyncPending, false);
+    }
+
+
+    bool DisplayXFBInterface::displayMapFramebuffer(DisplayXFBMap& map, unsigned displayIndex, bool readOnly)
+    {
+        return cachedMap(map, displayIndex, kDisplayXFBMapTypeDisplay, readOnly);
+    }
+
+
+    bool DisplayXFBInterface::displayMapCursor(DisplayXFBMap& map, unsigned displayIndex, bool readOnly)
+    {
+        return cachedMap(map, displayIndex, kDisplayXFBMapTypeCursor, readOnly);
+    }
+
+
+    bool DisplayXFBInterface::displayMapStatus(DisplayXFBMap& map, unsigned displayIndex)
+    {
+        return cachedMap(map, displayIndex, kDisplayXFBMapTypeStatus, true);
+    }
+
+
+    bool DisplayXFBInterface::displayGetStatus(DisplayXFBState& state, unsigned& modeGeneration, unsigned displayIndex)
+    {
+        DisplayXFBMap map;
+        if (!displayMapStatus(map, displayIndex) || map.size() < sizeof (DisplayXFBStatus)) { state.invalidate(); return false; }
+
+        const DisplayXFBStatus* status = (const DisplayXFBStatus*)map.address();
+        if (!status->isValid() || !status->read(state, modeGeneration)) { state.invalidate(); return false; }
+        return state.isValid();
+    }
+
+
+    bool DisplayXFBInterface::displayGetFrameChange(unsigned& frameSequence, unsigned& x, unsigned& y, unsigned& width, unsigned& height, unsigned displayIndex)
+    {
+        DisplayXFBMap map;
+        if (!displayMapStatus(map, displayIndex) || map.size() < sizeof (DisplayXFBStatus)) return false;
+
+        const DisplayXFBStatus* status = (const DisplayXFBStatus*)map.address();
+        return status->isValid() && status->readFrameChange(frameSequence, x, y, width, height);
+    }
+
+
+    bool DisplayXFBInterface::displayGetFrameChangesSince(unsigned since, unsigned& frameSequence, unsigned& x, unsigned& y, unsigned& width, unsigned& height, unsigned displayIndex)
+    {
+        DisplayXFBMap map;
+        if (!displayMapStatus(map, displayIndex) || map.size() < sizeof (DisplayXFBStatus)) return false;
+
+        const DisplayXFBStatus* status = (const DisplayXFBStatus*)map.address();
+        return status->isValid() && status->readFrameChangesSince(since, frameSequence, x, y, width, height);
+    }
+
+
+    bool DisplayXFBInterface::cachedMap(DisplayXFBMap& map, unsigned displayIndex, unsigned mapType, bool readOnly)
+    {
+        if (!isOpen() || displayIndex >= kDisplayXFBMaxDisplays) { map.invalidate(); return false; }
+
+        unsigned generation;
+        if (kDisplayXFBMapTypeStatus == mapType)
+        {
+            if (!statusMapGeneration(generation, displayIndex)) { map.invalidate(); return false; }
+            map = m_maps[displayIndex][mapType];
+            return true;
+        }
+
+        // A cached mapping remains usable for as long as the status page reports the same map generation. A
+        // read-only mapping cannot satisfy a request for write access.
+        DisplayXFBMap& cached = m_maps[displayIndex][mapType];
+        if (cached.isValid() && (readOnly || !m_mapsReadOnly[displayIndex][mapType]))
+        {
+            if (statusMapGeneration(generation, displayIndex) && generation == cached.generation())
+            {
+                map = cached;
+                return true;
+            }
+        }
+
+        if (!userMap(displayIndex, mapType, readOnly, &map)) { map.invalidate(); return false; }
+        cached = map;
+        m_mapsReadOnly[displayIndex][mapType] = readOnly;
+        return true;
+    }
+
+
+    bool DisplayXFBInterface::statusMapGeneration(unsigned& generation, unsigned displayIndex)
+    {
+        // The status page is mapped once and then read directly. A page that no longer matches the driver's map
+        // generation (or that the driver has retired) is mapped again, which costs the only driver round trip.
+        DisplayXFBMap& statusMap = m_maps[displayIndex][kDisplayXFBMapTypeStatus];
+        for (unsigned attempt = 0; attempt < 2; attempt++)
+        {
+            if (!statusMap.isValid())
+            {
+                if (!userMap(displayIndex, kDisplayXFBMapTypeStatus, true, &statusMap)) { statusMap.invalidate(); return false; }
+                m_mapsReadOnly[displayIndex][kDisplayXFBMapTypeStatus] = true;
+            }
+
+            const DisplayXFBStatus* status = (const DisplayXFBStatus*)statusMap.address();
+            DisplayXFBState state;
+            unsigned modeGeneration;
+            if (statusMap.size() >= sizeof *status && status->isValid() && status->read(state, modeGeneration) &&
+                state.mapGeneration() == statusMap.generation())
+            {
+                generation = state.mapGeneration();
+                return true;
+            }
+            statusMap.invalidate();
+        }
+        return false;
+    }
+
+
     bool DisplayXFBInterface::setNotificationHandler(NotificationHandler handler, void* context, CFRunLoopRef runloop)
     {
         clearNotificationHandler();
@@ -179,29 +470,25 @@ namespace ts
         m_notificationHandler = handler;
         m_notificationHandlerContext = context;
 
-        IOReturn status = IOServiceAddInterestNotification(
-                m_notificationHandlerNotificationPort,
-                m_service,
-                kIOGeneralInterest,
-                &interestCallback, this,
-                &m_notificationObject);
-
-        if (kIOReturnSuccess != status)
+        // Notifications are delivered by this connection's user client, which applies the masks set via
+        // setNotificationMask(). An interest notification on the service would see every client's traffic.
+        if (!userSetNotificationPort(IONotificationPortGetMachPort(m_notificationHandlerNotificationPort)))
         {
             clearNotificationHandler();
             return false;
         }
-        else return true;
+        m_notificationRegistered = true;
+        return true;
     }
 
 
     void DisplayXFBInterface::clearNotificationHandler()
     {
         // This method is also used to clean up in the event of some failure - don't make it conditional on everything being ok.
-        if (m_notificationObject)
+        if (m_notificationRegistered)
         {
-            IOObjectRelease(m_notificationObject);
-            m_notificationObject = 0;
+            if (isOpen()) userSetNotificationPort(MACH_PORT_NULL);
+            m_notificationRegistered = false;
         }
         if (m_notificationHandlerNotificationPort)
         {
@@ -224,6 +511,20 @@ namespace ts
     }
 
 
+    bool DisplayXFBInterface::setNotificationMask(unsigned displayMask, unsigned eventMask)
+    {
+        if (!isOpen() || !userSetNotificationMask(displayMask, eventMask)) return false;
+        else return true;
+    }
+
+
+    bool DisplayXFBInterface::getStatistics(DisplayXFBClientStatistics& stats)
+    {
+        if (!isOpen() || !userGetStatistics(&stats)) { stats.invalidate(); return false; }
+        else return stats.isValid();
+    }
+
+
 #pragma     -
 #pragma     RPC Methods
 
@@ -423,6 +724,34 @@ namespace ts
     }
 
 
+
+    bool DisplayXFBInterface::userDisplayConnectMask(unsigned displayMask, bool connect)
+    {
+        assert(isOpen());
+        assert(m_connect);
+
+        uint64_t scalarInData[2] = { displayMask, connect ? 1u : 0u };
+        uint32_t scalarInCount = (uint32_t) (sizeof scalarInData / sizeof scalarInData[0]);
+        uint32_t scalarOutCount = 0;
+        size_t structOutSize = 0;
+
+        kern_return_t kr = IOConnectCallMethod(
+            m_connect,                                          // service handle
+            kDisplayXFBSelectorConnectMask,                     // selector
+            scalarInData,                                       // array of input values
+            scalarInCount,                                      // number of input values (pass actual)
+            NULL,                                               // input structure
+            0,                                                  // input structure size (pass actual)
+            NULL,                                               // array of output values
+            &scalarOutCount,                                    // number of output values (pass max, return actual)
+            NULL,                                               // output structure
+            &structOutSize                                      // output structure size (pass max, return actual)
+            );
+
+        return (kr == KERN_SUCCESS);
+    }
+
+
     bool DisplayXFBInterface::userMap(unsigned displayIndex, unsigned mapType, bool readOnly, DisplayXFBMap* map)
     {
         assert(map);
@@ -453,12 +782,100 @@ namespace ts
     }
 
 
-    /** IOService callback on a notification from the driver.
+    bool DisplayXFBInterface::userSetNotificationMask(unsigned displayMask, unsigned eventMask)
+    {
+        assert(isOpen());
+        assert(m_connect);
+
+        uint64_t scalarInData[2] = { displayMask, eventMask };
+        uint32_t scalarInCount = (uint32_t) (sizeof scalarInData / sizeof scalarInData[0]);
+        uint32_t scalarOutCount = 0;
+        size_t structOutSize = 0;
+
+        kern_return_t kr = IOConnectCallMethod(
+            m_connect,                                          // service handle
+            kDisplayXFBSelectorSetNotificationMask,             // selector
+            scalarInData,                                       // array of input values
+            scalarInCount,                                      // number of input values (pass actual)
+            NULL,                                               // input structure
+            0,                                                  // input structure size (pass actual)
+            NULL,                                               // array of output values
+            &scalarOutCount,                                    // number of output values (pass max, return actual)
+            NULL,                                               // output structure
+            &structOutSize                                      // output structure size (pass max, return actual)
+            );
+
+        return (kr == KERN_SUCCESS);
+    }
+
+
+    bool DisplayXFBInterface::userGetStatistics(DisplayXFBClientStatistics* stats)
+    {
+        assert(stats);
+        assert(isOpen());
+        assert(m_connect);
+
+        size_t structOutSize = sizeof *stats;
+
+        kern_return_t kr = IOConnectCallMethod(
+            m_connect,                                          // service handle
+            kDisplayXFBSelectorGetStatistics,                   // selector
+            NULL,                                               // array of input values
+            0,                                                  // number of input values (pass actual)
+            NULL,                                               // input structure
+            0,                                                  // input structure size (pass actual)
+            NULL,                                               // array of output values
+            0,                                                  // number of output values (pass max, return actual)
+            (void*)stats,                                       // output structure
+            &structOutSize                                      // output structure size (pass max, return actual)
+            );
+
+        return (structOutSize == sizeof *stats) && (KERN_SUCCESS == kr);
+    }
+
+
+    bool DisplayXFBInterface::userSetNotificationPort(mach_port_t port)
+    {
+        assert(isOpen());
+        assert(m_connect);
+
+        kern_return_t kr;
+        if (MACH_PORT_NULL == port)
+        {
+            // A synchronous call passes no wake port, which the user client treats as a request to unregister.
+            kr = IOConnectCallScalarMethod(m_connect, kDisplayXFBSelectorSetNotificationPort, NULL, 0, NULL, NULL);
+        }
+        else
+        {
+            uint64_t asyncRef[kOSAsyncRef64Count] = { 0 };
+            asyncRef[kIOAsyncCalloutFuncIndex] = (uint64_t)(uintptr_t)&notificationCallback;
+            asyncRef[kIOAsyncCalloutRefconIndex] = (uint64_t)(uintptr_t)this;
+
+            kr = IOConnectCallAsyncScalarMethod(
+                m_connect,                                      // service handle
+                kDisplayXFBSelectorSetNotificationPort,         // selector
+                port,                                           // wake port
+                asyncRef,                                       // async reference
+                kOSAsyncRef64Count,                             // async reference count
+                NULL,                                           // array of input values
+                0,                                              // number of input values
+                NULL,                                           // array of output values
+                NULL                                            // number of output values
+                );
+        }
+
+        return (kr == KERN_SUCCESS);
+    }
+
+
+    /** Async callback on a notification from the user client. The arguments are {messageType, displayIndex}.
      */
-    void DisplayXFBInterface::interestCallback(void* refcon, io_service_t service, natural_t messageType, void* messageArgument)
+    void DisplayXFBInterface::notificationCallback(void* refcon, IOReturn result, void** args, uint32_t numArgs)
     {
         DisplayXFBInterface& interface = *((DisplayXFBInterface*)refcon);
-        unsigned arg = (unsigned)((uint64_t)messageArgument);
+        if (kIOReturnSuccess != result || numArgs < 2) return;
+        natural_t messageType = (natural_t)((uintptr_t)args[0]);
+        unsigned arg = (unsigned)((uintptr_t)args[1]);
 
         if (!interface.m_notificationHandler)
         {
@@ -476,6 +893,14 @@ namespace ts
         {
             interface.m_notificationHandler(kNotificationDisplayState, arg, interface.m_notificationHandlerContext);
         }
+        else if (kDisplayXFBNotificationDisplayMode == messageType)
+        {
+            interface.m_notificationHandler(kNotificationDisplayMode, arg, interface.m_notificationHandlerContext);
+        }
+        else if (kDisplayXFBNotificationFrameChanged == messageType)
+        {
+            interface.m_notificationHandler(kNotificationFrameChanged, arg, interface.m_notificationHandlerContext);
+        }
         else
         {
             /* Unknown notification */
@@ -483,6 +908,88 @@ namespace ts
     }
 
 
+    void DisplayXFBInterface::reconfigurationCallback(CGDirectDisplayID displayID, CGDisplayChangeSummaryFlags flags, void* context)
+    {
+        (void)displayID;
+        if (0 != (flags & kCGDisplayBeginConfigurationFlag)) return;    // Wait for the reconfiguration to finish
+        DisplayXFBInterface* interface = (DisplayXFBInterface*)context;
+        dispatch_async_f(interface->m_asyncQueue, interface, asyncCheckFunction);
+    }
+
+
+    void DisplayXFBInterface::asyncIssueFunction(void* context)
+    {
+        AsyncRequest* request = (AsyncRequest*)context;
+        DisplayXFBInterface* interface = request->m_owner;
+
+        bool ok = interface->isOpen();
+        switch (request->m_command)
+        {
+            case AsyncRequest::kCommandConnect:             ok = ok && interface->userDisplayConnect(request->m_displayIndex);                                  break;
+            case AsyncRequest::kCommandDisconnect:          ok = ok && interface->userDisplayDisconnect(request->m_displayIndex);                               break;
+            case AsyncRequest::kCommandSetConfiguration:    ok = ok && interface->userDisplaySetConfiguration(&request->m_configuration, request->m_displayIndex); break;
+            default:                                        ok = false;                                                                                         break;
+        }
+
+        if (!ok || AsyncRequest::kCommandSetConfiguration == request->m_command)
+        {
+            interface->asyncComplete(request, ok);
+            return;
+        }
+
+        // Wait for Quartz to catch up, with a time limit.
+        request->m_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, interface->m_asyncQueue);
+        if (request->m_timer)
+        {
+            dispatch_set_context(request->m_timer, request);
+            dispatch_source_set_event_handler_f(request->m_timer, asyncTimeoutFunction);
+            dispatch_source_set_cancel_handler_f(request->m_timer, asyncReleaseFunction);
+            dispatch_source_set_timer(request->m_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)request->m_timeoutMS * NSEC_PER_MSEC), DISPATCH_TIME_FOREVER, 10 * NSEC_PER_MSEC);
+            dispatch_resume(request->m_timer);
+        }
+        request->m_isPending = true;
+        request->m_next = interface->m_asyncPending;
+        interface->m_asyncPending = request;
+
+        interface->asyncCheckPending();     // The display may already be in the requested state
+    }
+
+
+    void DisplayXFBInterface::asyncCheckFunction(void* context)
+    {
+        ((DisplayXFBInterface*)context)->asyncCheckPending();
+    }
+
+
+    void DisplayXFBInterface::asyncTimeoutFunction(void* context)
+    {
+        AsyncRequest* request = (AsyncRequest*)context;
+        if (request->m_isPending) request->m_owner->asyncComplete(request, request->isSatisfied());
+    }
+
+
+    void DisplayXFBInterface::asyncReleaseFunction(void* context)
+    {
+        AsyncRequest* request = (AsyncRequest*)context;
+        dispatch_release(request->m_timer);
+        delete request;
+    }
+
+
+    void DisplayXFBInterface::asyncCancelFunction(void* context)
+    {
+        ((DisplayXFBInterface*)context)->asyncCancelAll();
+    }
+
+
+    void DisplayXFBInterface::asyncCompletionFunction(void* context)
+    {
+        DisplayXFBInterfaceAsyncCompletion* completion = (DisplayXFBInterfaceAsyncCompletion*)context;
+        completion->m_handler(completion->m_success, completion->m_displayIndex, completion->m_context);
+        delete completion;
+    }
+
+
 #pragma mark    -
 #pragma mark    Class Methods
 
@@ -11,6 +11,7 @@
 #include <CoreGraphics/CoreGraphics.h>
 #include <IOKit/IOKitLib.h>
 #include <IOKit/IOMessage.h>
+#include <dispatch/dispatch.h>
 #include "DisplayXFBShared.h"
 
 namespace ts
@@ -32,6 +33,8 @@ namespace ts
             kNotificationDisplayState       =   1,      //! A display's state has been changed by the user
             kNotificationCursorState        =   2,      //! The cursor has changed state
             kNotificationCursorImage        =   3,      //! The cursor image has changed
+            kNotificationDisplayMode        =   4,      //! A display's mode has changed (see displayGetStatus()), followed by kNotificationDisplayState
+            kNotificationFrameChanged       =   5,      //! A display's content has probably changed (see displayGetFrameChange())
         };
 
 
@@ -44,6 +47,18 @@ namespace ts
         typedef void (*NotificationHandler)(enum Notification notification, unsigned displayIndex, void* context);
 
 
+        /** The prototype for a c-function callback signalling the completion of an asynchronous request.
+         *
+         *  @param  success         Logical true if the request completed, false if it failed or timed out.
+         *  @param  displayIndex    The display to which the request applied.
+         *  @param  context         The client specific context handle.
+         */
+        typedef void (*CompletionHandler)(bool success, unsigned displayIndex, void* context);
+
+
+        static const unsigned kAsyncTimeoutMS = 10000;      //! The default time limit for asynchronous requests
+
+
         /** Test if the driver is installed.
          *
          *  @return     true if a compatible driver is present, false otherwise.
@@ -160,6 +175,64 @@ namespace ts
         bool displayDisconnect(unsigned displayIndex);
 
 
+        /** Connect several displays at once.
+         *
+         *  @param  displayMask         Bit mask of the displays to connect (bit n set for display n).
+         *  @return                     Logical true for success, false for failure.
+         *
+         *  The driver changes the state of all of the displays before signalling any of them, so the system
+         *  reconfigures once for the whole set rather than once per display. Displays that are already connected
+         *  are left unchanged.
+         */
+        bool displayConnectMask(unsigned displayMask);
+
+
+        /** Disconnect several displays at once.
+         *
+         *  @param  displayMask         Bit mask of the displays to disconnect (bit n set for display n).
+         *  @return                     Logical true for success, false for failure.
+         */
+        bool displayDisconnectMask(unsigned displayMask);
+
+
+        /** Connect a display without waiting for the system to reconfigure.
+         *
+         *  @param  displayIndex        The display number.
+         *  @param  handler             The function to call on completion (may be zero).
+         *  @param  context             The client-specific context to pass to the handler.
+         *  @param  queue               The queue on which to call the handler. If NULL, the main queue is used.
+         *  @param  timeoutMS           The time limit, in milliseconds.
+         *  @return                     Logical true if the request was started, false if it could not be issued (in
+         *                              which case the handler is not called).
+         *
+         *  The handler is called once the display has been added to Quartz's active display list, or with a failure
+         *  status if the driver rejected the request or the display did not appear within the time limit. Any number
+         *  of requests, for different displays, may be outstanding at once. Quartz reconfiguration callbacks are
+         *  delivered via the main run-loop, which must therefore be running.
+         */
+        bool displayConnectAsync(unsigned displayIndex, CompletionHandler handler, void* context, dispatch_queue_t queue=0, unsigned timeoutMS=kAsyncTimeoutMS);
+
+
+        /** Disconnect a display without waiting for the system to reconfigure.
+         *
+         *  As for displayConnectAsync(), except that the handler is called once the display has been removed from
+         *  Quartz's active display list.
+         */
+        bool displayDisconnectAsync(unsigned displayIndex, CompletionHandler handler, void* context, dispatch_queue_t queue=0, unsigned timeoutMS=kAsyncTimeoutMS);
+
+
+        /** Set a display configuration without blocking the caller.
+         *
+         *  @param  configuration       Specifies the configuration (copied - need not persist after the call).
+         *  @param  displayIndex        The display number.
+         *  @param  handler             The function to call on completion (may be zero).
+         *  @param  context             The client-specific context to pass to the handler.
+         *  @param  queue               The queue on which to call the handler. If NULL, the main queue is used.
+         *  @return                     Logical true if the request was started, false if it could not be issued.
+         */
+        bool displaySetConfigurationAsync(const DisplayXFBConfiguration& configuration, unsigned displayIndex, CompletionHandler handler, void* context, dispatch_queue_t queue=0);
+
+
 
         /** Map the framebuffer memory for a display in to the current task's address space.
          *
@@ -167,6 +240,10 @@ namespace ts
          *  @param  displayIndex        The display number.
          *  @param  readOnly            Logical true if the mapping should be read-only (recommended).
          *  @return                     Logical true for success, false for failure.
+         *
+         *  Mappings are cached: repeated calls return the existing mapping without a driver round trip unless the
+         *  display's status page (see displayMapStatus()) reports that the display memory has been reallocated. The
+         *  status page is itself mapped on first use, which takes one round trip.
          */
         bool displayMapFramebuffer(DisplayXFBMap& map, unsigned displayIndex, bool readOnly=true);
 
@@ -177,10 +254,71 @@ namespace ts
          *  @param  displayIndex        The display number.
          *  @param  readOnly            Logical true if the mapping should be read-only (recommended).
          *  @return                     Logical true for success, false for failure.
+         *
+         *  Mappings are cached in the same way as for displayMapFramebuffer().
          */
         bool displayMapCursor(DisplayXFBMap& map, unsigned displayIndex, bool readOnly=true);
 
 
+        /** Map the status page for a display in to the current task's address space (read-only).
+         *
+         *  @param  map                 Returns the address mapping information (the address of a DisplayXFBStatus).
+         *  @param  displayIndex        The display number.
+         *  @return                     Logical true for success, false for failure.
+         */
+        bool displayMapStatus(DisplayXFBMap& map, unsigned displayIndex);
+
+
+        /** Get a display's current state from the shared status page. Only the first call for a display makes a
+         *  driver round trip, to map the page.
+         *
+         *  @param  state               Returns the state information.
+         *  @param  modeGeneration      Returns the mode generation, which changes on each mode switch.
+         *  @param  displayIndex        The display number.
+         *  @return                     Logical true for success, false for failure.
+         *
+         *  A mode switch (kNotificationDisplayMode) reuses the display's VRAM: existing framebuffer mappings remain
+         *  valid, and a client need only pick up the new size and stride from here.
+         */
+        bool displayGetStatus(DisplayXFBState& state, unsigned& modeGeneration, unsigned displayIndex);
+
+
+        /** Get the most recent content change for a display from the shared status page.
+         *
+         *  @param  frameSequence       Returns the frame sequence number, which advances on each detected change.
+         *  @param  x                   Returns the left edge of the changed area (pixels).
+         *  @param  y                   Returns the top edge of the changed area (pixels).
+         *  @param  width               Returns the width of the changed area (pixels).
+         *  @param  height              Returns the height of the changed area (pixels).
+         *  @param  displayIndex        The display number.
+         *  @return                     Logical true for success, false for failure.
+         *
+         *  Changes are detected by sampling, so the bounds are coarse and very small changes may be missed. A client
+         *  that may miss updates should use displayGetFrameChangesSince() instead. kNotificationFrameChanged events
+         *  are only delivered if requested via setNotificationMask().
+         */
+        bool displayGetFrameChange(unsigned& frameSequence, unsigned& x, unsigned& y, unsigned& width, unsigned& height, unsigned displayIndex);
+
+
+        /** Get the area changed since a client's last update from the shared status page.
+         *
+         *  @param  since               The frame sequence number of the client's last update.
+         *  @param  frameSequence       Returns the current frame sequence number.
+         *  @param  x                   Returns the left edge of the accumulated changed area (pixels).
+         *  @param  y                   Returns the top edge of the accumulated changed area (pixels).
+         *  @param  width               Returns the width of the accumulated changed area (pixels).
+         *  @param  height              Returns the height of the accumulated changed area (pixels).
+         *  @param  displayIndex        The display number.
+         *  @return                     Logical true for success, false for failure.
+         *
+         *  The result is the union of the bounds of every change after @a since, or the whole frame if the client has
+         *  fallen more than DisplayXFBStatus::kChangeHistory changes behind. The width and height are zero if nothing
+         *  has changed. Changes are detected by sampling, so a client that must be exact should still verify its copy
+         *  occasionally.
+         */
+        bool displayGetFrameChangesSince(unsigned since, unsigned& frameSequence, unsigned& x, unsigned& y, unsigned& width, unsigned& height, unsigned displayIndex);
+
+
         /** Set the notification callback handler.
          *
          *  @param  handler             The function to call with notifications.
@@ -198,6 +336,26 @@ namespace ts
          */
         void clearNotificationHandler();
 
+
+        /** Restrict the notifications delivered to this client.
+         *
+         *  @param  displayMask         Bit mask of the displays of interest (bit n set for display n).
+         *  @param  eventMask           Bit mask of the events of interest (kDisplayXFBNotificationMaskXyz).
+         *  @return                     Logical true for success, false for failure.
+         *
+         *  Notifications that do not match both masks are discarded by the driver without waking the client.
+         *  By default a client receives all notifications for all displays, except kNotificationFrameChanged.
+         */
+        bool setNotificationMask(unsigned displayMask, unsigned eventMask=kDisplayXFBNotificationMaskDefault);
+
+
+        /** Get the driver's statistics for this client.
+         *
+         *  @param  stats               Returns the statistics.
+         *  @return                     Logical true for success, false for failure.
+         */
+        bool getStatistics(DisplayXFBClientStatistics& stats);
+
     private:
 
         bool m_isOpen;                                                              //!< Logical true if the interface is bound
@@ -207,8 +365,24 @@ namespace ts
         NotificationHandler m_notificationHandler;                                  //!< The registered notification handler, or zero if none
         void* m_notificationHandlerContext;                                         //!< Client supplied context for notification callbacks
         IONotificationPortRef m_notificationHandlerNotificationPort;                //!< What it says
-        io_object_t m_notificationObject;                                           //!< Notification context.
+        bool m_notificationRegistered;                                              //!< Logical true if the port is registered with the user client
         CFRunLoopRef m_notificationRunloop;                                         //!< The runloop where notifications are posted
+        DisplayXFBMap m_maps[kDisplayXFBMaxDisplays][kDisplayXFBMaxMapTypes];       //!< Cached mappings (invalid if not yet mapped)
+        bool m_mapsReadOnly[kDisplayXFBMaxDisplays][kDisplayXFBMaxMapTypes];        //!< Logical true if the cached mapping is read-only
+
+        bool cachedMap(DisplayXFBMap& map, unsigned displayIndex, unsigned mapType, bool readOnly);
+        bool statusMapGeneration(unsigned& generation, unsigned displayIndex);
+
+        // Asynchronous request support. The pending list is accessed only from m_asyncQueue.
+        struct AsyncRequest;
+        dispatch_queue_t m_asyncQueue;                                              //!< Serial queue for asynchronous requests
+        AsyncRequest* m_asyncPending;                                               //!< Requests awaiting a Quartz reconfiguration
+        bool m_asyncReconfigurationRegistered;                                      //!< Logical true if the Quartz callback is installed
+
+        bool asyncStart(AsyncRequest* request, unsigned timeoutMS);
+        void asyncCheckPending();
+        void asyncComplete(AsyncRequest* request, bool success);
+        void asyncCancelAll();
 
         // Methods implementing the RPC. These ultimately map directly to the methods in com_tsoniq_driver_DisplayXFB via the user-client.
         bool userOpen(DisplayXFBInfo* info);
@@ -218,10 +392,21 @@ namespace ts
         bool userDisplayGetState(DisplayXFBState* state, unsigned displayIndex);
         bool userDisplayConnect(unsigned displayIndex);
         bool userDisplayDisconnect(unsigned displayIndex);
+        bool userDisplayConnectMask(unsigned displayMask, bool connect);
         bool userMap(unsigned displayIndex, unsigned mapType, bool readOnly, DisplayXFBMap* map);
+        bool userSetNotificationMask(unsigned displayMask, unsigned eventMask);
+        bool userGetStatistics(DisplayXFBClientStatistics* stats);
+        bool userSetNotificationPort(mach_port_t port);
 
         // Class methods
-        static void interestCallback(void* refcon, io_service_t service, natural_t messageType, void* messageArgument);
+        static void notificationCallback(void* refcon, IOReturn result, void** args, uint32_t numArgs);
+        static void reconfigurationCallback(CGDirectDisplayID displayID, CGDisplayChangeSummaryFlags flags, void* context);
+        static void asyncIssueFunction(void* context);
+        static void asyncCheckFunction(void* context);
+        static void asyncTimeoutFunction(void* context);
+        static void asyncReleaseFunction(void* context);
+        static void asyncCancelFunction(void* context);
+        static void asyncCompletionFunction(void* context);
     };
 
 }   // namespace
@@ -0,0 +1,108 @@
+/** @file   DisplayXFBPageAllocator.cc
+ *  @brief  Allocation of large frame buffers, using huge pages where available.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBPageAllocator.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__APPLE__)
+#include <mach/vm_statistics.h>
+#endif
+
+namespace ts
+{
+    static volatile bool g_hugePagesEnabled = true;         //!< Cleared to force regular pages (eg for comparison)
+
+
+    /** Return the size actually mapped for a request (the size passed to mmap and munmap).
+     *
+     *  @param  size        The requested size (bytes).
+     *  @return             The mapped size (bytes).
+     */
+    size_t DisplayXFBPageAllocator::allocationSize(size_t size)
+    {
+        size_t unit = (size >= kHugePageSize / 2) ? kHugePageSize : (size_t)getpagesize();
+        return (size + unit - 1) & ~(unit - 1);
+    }
+
+
+    /** Enable or disable the use of huge pages for subsequent allocations.
+     */
+    void DisplayXFBPageAllocator::setHugePagesEnabled(bool enable)
+    {
+        g_hugePagesEnabled = enable;
+    }
+
+
+    /** Allocate a buffer.
+     *
+     *  @param  size        The buffer size (bytes).
+     *  @param  backing     If non-zero, returns how the buffer is backed.
+     *  @return             The buffer, or zero if no memory is available.
+     */
+    void* DisplayXFBPageAllocator::allocate(size_t size, Backing* backing)
+    {
+        if (backing) *backing = kBackingNone;
+        if (0 == size) return 0;
+
+        size_t length = allocationSize(size);
+        void* ptr = MAP_FAILED;
+
+        if (g_hugePagesEnabled && length >= kHugePageSize)
+        {
+#if defined(__APPLE__) && defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+            // For anonymous memory the fd argument carries the VM flags.
+            ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+            if (MAP_FAILED != ptr)
+            {
+                if (backing) *backing = kBackingHuge;
+                return ptr;
+            }
+#elif defined(__linux__)
+#if defined(MAP_HUGETLB)
+            ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+            if (MAP_FAILED != ptr)
+            {
+                if (backing) *backing = kBackingHuge;
+                return ptr;
+            }
+#endif
+#if defined(MADV_HUGEPAGE)
+            // Transparent huge pages need a huge page aligned range: over-allocate, then trim both ends.
+            uint8_t* raw = (uint8_t*)mmap(0, length + kHugePageSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            if (MAP_FAILED != (void*)raw)
+            {
+                uint8_t* aligned = (uint8_t*)(((uintptr_t)raw + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1));
+                if (aligned != raw) munmap(raw, aligned - raw);
+                size_t tail = (raw + length + kHugePageSize) - (aligned + length);
+                if (tail) munmap(aligned + length, tail);
+                madvise(aligned, length, MADV_HUGEPAGE);
+                if (backing) *backing = kBackingTransparent;
+                return aligned;
+            }
+#endif
+#endif
+        }
+
+        ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+        if (MAP_FAILED == ptr) return 0;
+        if (backing) *backing = kBackingRegular;
+        return ptr;
+    }
+
+
+    /** Release a buffer.
+     *
+     *  @param  ptr         The buffer (may be zero).
+     *  @param  size        The size passed to allocate().
+     */
+    void DisplayXFBPageAllocator::release(void* ptr, size_t size)
+    {
+        if (ptr) munmap(ptr, allocationSize(size));
+    }
+
+}   // namespace
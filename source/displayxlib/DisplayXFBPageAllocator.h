@@ -0,0 +1,51 @@
+/** @file   DisplayXFBPageAllocator.h
+ *  @brief  Allocation of large frame buffers, using huge pages where available.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBPageAllocator_H
+#define COM_TSONIQ_DisplayXFBPageAllocator_H   (1)
+
+#include <stddef.h>
+
+namespace ts
+{
+    /** Class used to allocate buffers for whole frames.
+     *
+     *  Buffers of kHugePageSize / 2 or more are rounded up to a multiple of kHugePageSize and backed by huge pages
+     *  if the OS will provide them, which greatly reduces TLB misses when copying or converting a large frame. The
+     *  order of preference is:
+     *
+     *      OS X        superpages (VM_FLAGS_SUPERPAGE_SIZE_2MB), then regular pages.
+     *      Linux       explicit huge pages (MAP_HUGETLB), then transparent huge pages (madvise), then regular pages.
+     *
+     *  Smaller buffers, and any request that the huge page paths can not satisfy, fall back to ordinary anonymous
+     *  memory. Memory is always page aligned and zero filled. Buffers must be returned via release() with the size
+     *  used to allocate them.
+     */
+    class DisplayXFBPageAllocator
+    {
+    public:
+
+        static const size_t kHugePageSize = 2 * 1024 * 1024;    //!< The huge page size used (bytes)
+
+        /** How an allocation is backed.
+         */
+        enum Backing
+        {
+            kBackingNone,                                       //!< Allocation failed
+            kBackingRegular,                                    //!< Regular pages
+            kBackingTransparent,                                //!< Eligible for transparent huge pages (Linux)
+            kBackingHuge                                        //!< Explicit huge pages
+        };
+
+        static void* allocate(size_t size, Backing* backing=0);
+        static void release(void* ptr, size_t size);
+        static size_t allocationSize(size_t size);
+        static void setHugePagesEnabled(bool enable);
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBPageAllocator_H
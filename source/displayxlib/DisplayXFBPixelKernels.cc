@@ -0,0 +1,689 @@
+/** @file   DisplayXFBPixelKernels.cc
+ *  @brief  Pixel copy, compare, convert and blend kernels, specialised at compile time and chosen at run time.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBPixelKernels.h"
+
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || defined(__GNUC__))
+#include <tmmintrin.h>
+#include <cpuid.h>
+#define DISPLAYXFB_HAVE_SSSE3   (1)
+#endif
+
+namespace ts
+{
+    typedef DisplayXFBPixelKernels PK;
+
+    static const size_t kDefaultLastLevelCache = 8 * 1024 * 1024;      //!< Assumed cache size if it can not be read
+    static const size_t kPrefetchDistance = 512;                        //!< Streaming copy read-ahead (bytes)
+    static size_t gStreamingThreshold = 0;                              //!< Zero until first use
+
+    /** Scalar conversions of one BGRA pixel.
+     */
+    static inline uint32_t swapRedBlue(uint32_t p)
+    {
+        return (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+    }
+
+    static inline uint8_t luma(uint32_t p)
+    {
+        return (uint8_t)(((77 * ((p >> 16) & 0xff)) + (150 * ((p >> 8) & 0xff)) + (29 * (p & 0xff))) >> 8);
+    }
+
+    static inline uint32_t blendPixel(uint32_t s, uint32_t d)
+    {
+        uint32_t a = s >> 24;
+        uint32_t result = 0xff000000u;
+        for (unsigned shift = 0; shift < 24; shift += 8)
+        {
+            uint32_t t = (((s >> shift) & 0xff) * a) + (((d >> shift) & 0xff) * (255 - a)) + 128;
+            result |= ((t + (t >> 8)) >> 8) << shift;       // Exact round(x / 255) for x <= 65025
+        }
+        return result;
+    }
+
+
+    /** Per-position keys for the area hash: one set of four words for each 16 byte block of a 64 pixel row.
+     */
+    static const uint32_t kHashKeys[16][4] =
+    {
+        { 0x9e3779b9u, 0x7f4a7c15u, 0xf39cc060u, 0x5cedc834u }, { 0x1082276bu, 0xf3a27251u, 0xf86c6a11u, 0xd0c18e95u },
+        { 0x2767f0b1u, 0x53a4e3f4u, 0x8bb8b1a6u, 0x6ab4e2e7u }, { 0xc2b2ae35u, 0x27d4eb2fu, 0x165667b1u, 0x85ebca77u },
+        { 0xa0761d64u, 0xe7037ed1u, 0x8ebc6af0u, 0x589965ccu }, { 0x1d8e4e27u, 0xc2b2ae3du, 0x27d4eb4fu, 0x165667c5u },
+        { 0x61c88647u, 0x9e3779b1u, 0x7feb352du, 0x846ca68bu }, { 0xbf58476du, 0x94d049bbu, 0x2545f491u, 0x4f6cdd1du },
+        { 0xd6e8feb8u, 0x6658f36bu, 0x3c6ef372u, 0xa54ff53au }, { 0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u },
+        { 0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u }, { 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u },
+        { 0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u }, { 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u },
+        { 0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu }, { 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau }
+    };
+
+    static inline uint64_t rotl64(uint64_t v, unsigned n)
+    {
+        return (v << n) | (v >> (64 - n));
+    }
+
+    /** Fold one row's product sums in to the area hash.
+     */
+    static inline uint64_t hashRow(uint64_t h, uint64_t lane0, uint64_t lane1)
+    {
+        h = rotl64((h ^ lane0) * 0x9e3779b97f4a7c15ull, 31);
+        return rotl64((h ^ lane1) * 0xc2b2ae3d27d4eb4full, 29);
+    }
+
+    /** Finish the area hash (MurmurHash3 finaliser).
+     */
+    static inline uint64_t hashFinish(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        return h ^ (h >> 33);
+    }
+
+    /** Add one 16 byte block (four pixels, zero padded at the end of a row) to the row sums.
+     */
+    static inline void hashBlock(const uint32_t* w, unsigned block, uint64_t& lane0, uint64_t& lane1)
+    {
+        const uint32_t* k = kHashKeys[block & 15];
+        lane0 += (uint64_t)(uint32_t)(w[0] + k[0]) * (uint32_t)(w[1] + k[1]);
+        lane1 += (uint64_t)(uint32_t)(w[2] + k[2]) * (uint32_t)(w[3] + k[3]);
+    }
+
+
+    /** Fill in a content description from the fused pass's accumulators.
+     *
+     *  The colour estimate is linear counting over a 128 bit bitmap of hashed colours: exact for one colour, close
+     *  for tens of colours and saturating at a few hundred.
+     */
+    static void describe(DisplayXFBTileContent* content, uint32_t first, bool solid, const uint64_t colourBits[2],
+                         uint64_t lumaSum, uint64_t lumaSquares, unsigned pixels)
+    {
+        unsigned zeros = 128 - (unsigned)(__builtin_popcountll(colourBits[0]) + __builtin_popcountll(colourBits[1]));
+        unsigned colours;
+        if (solid) colours = 1;
+        else if (0 == zeros) colours = DisplayXFBTileContent::kManyColours;
+        else
+        {
+            double estimate = -128.0 * log(zeros / 128.0) + 0.5;
+            colours = (estimate < 2.0) ? 2 : (unsigned)estimate;
+            if (colours > pixels) colours = pixels;
+            if (colours > DisplayXFBTileContent::kManyColours) colours = DisplayXFBTileContent::kManyColours;
+        }
+
+        uint64_t n = pixels;
+        uint64_t spread = (n * lumaSquares) - (lumaSum * lumaSum);
+        content->m_colour = first;
+        content->m_colours = (uint16_t)colours;
+        content->m_lumaMean = (uint8_t)(lumaSum / pixels);
+        content->m_solid = (solid) ? 1 : 0;
+        content->m_lumaVariance = (uint16_t)(spread / (n * n));
+        content->m_reserved = 0;
+    }
+
+
+#if defined(DISPLAYXFB_HAVE_SSSE3)
+    /** Swap red and blue for a row using SSSE3 byte shuffles. Kept out of the templates so that only this function
+     *  is compiled for SSSE3: the caller checks the processor first.
+     */
+    __attribute__((target("ssse3")))
+    static void swapRedBlueRowSSSE3(uint32_t* dst, const uint32_t* src, unsigned count)
+    {
+        const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+        unsigned x = 0;
+        for (; x + 4 <= count; x += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_shuffle_epi8(v, order));
+        }
+        for (; x < count; x++) dst[x] = swapRedBlue(src[x]);
+    }
+#endif
+
+
+    /** The kernel family.
+     *
+     *  @tparam Format  The output format for convert().
+     *  @tparam Tile    The width specialised for (pixels), or zero for any width.
+     *  @tparam Aligned Logical true if source rows (and so every fourth pixel) are 16 byte aligned.
+     *  @tparam Isa     The instruction set.
+     */
+    template <unsigned Format, unsigned Tile, bool Aligned, unsigned Isa>
+    struct Kernels
+    {
+        typedef Kernels<Format, 0, false, Isa> Fallback;
+
+        /** Return true if the specialisation applies to an area, so the fixed width path may be used.
+         */
+        static inline bool applies(const void* src, size_t srcBytesPerRow, unsigned width)
+        {
+            if (Tile && width != Tile) return false;
+            if (Aligned && (((uintptr_t)src | srcBytesPerRow) & 15)) return false;
+            return true;
+        }
+
+#if defined(__SSE2__)
+        static inline __m128i load(const void* p)
+        {
+            return (Aligned) ? _mm_load_si128((const __m128i*)p) : _mm_loadu_si128((const __m128i*)p);
+        }
+#endif
+
+        /** Copy pixels.
+         */
+        static void copy(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+        {
+            if ((Tile || Aligned) && !applies(src, srcBytesPerRow, width))
+            {
+                Fallback::copy(dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+                return;
+            }
+            const unsigned count = (Tile) ? Tile : width;
+            const uint8_t* s = (const uint8_t*)src;
+            uint8_t* d = (uint8_t*)dst;
+            // The library memcpy is already vectorised; a constant size lets the compiler inline it for tiles.
+            for (unsigned y = 0; y < height; y++, s += srcBytesPerRow, d += dstBytesPerRow) memcpy(d, s, (size_t)count * 4);
+        }
+
+        /** Compare pixels, stopping at the first row that differs.
+         */
+        static bool diff(const void* a, size_t aBytesPerRow, const void* b, size_t bBytesPerRow, unsigned width, unsigned height)
+        {
+            if ((Tile || Aligned) && !applies(a, aBytesPerRow, width))
+            {
+                return Fallback::diff(a, aBytesPerRow, b, bBytesPerRow, width, height);
+            }
+            const unsigned count = (Tile) ? Tile : width;
+            const uint8_t* pa = (const uint8_t*)a;
+            const uint8_t* pb = (const uint8_t*)b;
+            for (unsigned y = 0; y < height; y++, pa += aBytesPerRow, pb += bBytesPerRow)
+            {
+                unsigned x = 0;
+#if defined(__SSE2__)
+                if (Isa >= PK::kIsaSSE2)
+                {
+                    __m128i acc = _mm_setzero_si128();
+                    for (; x + 4 <= count; x += 4)
+                    {
+                        acc = _mm_or_si128(acc, _mm_xor_si128(load(pa + (x * 4)), _mm_loadu_si128((const __m128i*)(pb + (x * 4)))));
+                    }
+                    if (0xffff != _mm_movemask_epi8(_mm_cmpeq_epi32(acc, _mm_setzero_si128()))) return true;
+                }
+#endif
+                if (x < count && 0 != memcmp(pa + (x * 4), pb + (x * 4), (count - x) * 4)) return true;
+            }
+            return false;
+        }
+
+        /** Convert pixels to the output format.
+         */
+        static void convert(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+        {
+            if (PK::kFormatBGRA32 == Format)
+            {
+                copy(dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+                return;
+            }
+            if ((Tile || Aligned) && !applies(src, srcBytesPerRow, width))
+            {
+                Fallback::convert(dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+                return;
+            }
+            const unsigned count = (Tile) ? Tile : width;
+            const uint8_t* s = (const uint8_t*)src;
+            uint8_t* d = (uint8_t*)dst;
+            for (unsigned y = 0; y < height; y++, s += srcBytesPerRow, d += dstBytesPerRow)
+            {
+                const uint32_t* in = (const uint32_t*)s;
+                unsigned x = 0;
+                if (PK::kFormatRGBA32 == Format)
+                {
+                    uint32_t* out = (uint32_t*)d;
+#if defined(DISPLAYXFB_HAVE_SSSE3)
+                    if (Isa >= PK::kIsaSSSE3)
+                    {
+                        swapRedBlueRowSSSE3(out, in, count);
+                        continue;
+                    }
+#endif
+#if defined(__SSE2__)
+                    if (Isa >= PK::kIsaSSE2)
+                    {
+                        const __m128i keep = _mm_set1_epi32((int)0xff00ff00);
+                        const __m128i low = _mm_set1_epi32(0xff);
+                        for (; x + 4 <= count; x += 4)
+                        {
+                            __m128i v = load(in + x);
+                            __m128i r = _mm_or_si128(_mm_and_si128(v, keep),
+                                                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low),
+                                                                  _mm_slli_epi32(_mm_and_si128(v, low), 16)));
+                            _mm_storeu_si128((__m128i*)(out + x), r);
+                        }
+                    }
+#endif
+                    for (; x < count; x++) out[x] = swapRedBlue(in[x]);
+                }
+                else
+                {
+#if defined(__SSE2__)
+                    if (Isa >= PK::kIsaSSE2)
+                    {
+                        const __m128i low = _mm_set1_epi32(0xff);
+                        const __m128i kb = _mm_set1_epi32(29);
+                        const __m128i kg = _mm_set1_epi32(150);
+                        const __m128i kr = _mm_set1_epi32(77);
+                        for (; x + 8 <= count; x += 8)
+                        {
+                            __m128i l[2];
+                            for (unsigned h = 0; h < 2; h++)
+                            {
+                                __m128i v = load(in + x + (h * 4));
+                                __m128i sum = _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(v, low), kb),
+                                              _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), low), kg),
+                                                            _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 16), low), kr)));
+                                l[h] = _mm_srli_epi32(sum, 8);
+                            }
+                            __m128i words = _mm_packs_epi32(l[0], l[1]);
+                            _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(words, words));
+                        }
+                    }
+#endif
+                    for (; x < count; x++) d[x] = luma(in[x]);
+                }
+            }
+        }
+
+        /** Alpha blend source pixels over the destination.
+         */
+        static void blend(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+        {
+            if ((Tile || Aligned) && !applies(src, srcBytesPerRow, width))
+            {
+                Fallback::blend(dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+                return;
+            }
+            const unsigned count = (Tile) ? Tile : width;
+            const uint8_t* s = (const uint8_t*)src;
+            uint8_t* d = (uint8_t*)dst;
+            for (unsigned y = 0; y < height; y++, s += srcBytesPerRow, d += dstBytesPerRow)
+            {
+                const uint32_t* in = (const uint32_t*)s;
+                uint32_t* out = (uint32_t*)d;
+                unsigned x = 0;
+#if defined(__SSE2__)
+                if (Isa >= PK::kIsaSSE2)
+                {
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128i full = _mm_set1_epi16(255);
+                    const __m128i round = _mm_set1_epi16(128);
+                    const __m128i opaque = _mm_set1_epi32((int)0xff000000);
+                    for (; x + 4 <= count; x += 4)
+                    {
+                        __m128i sv = load(in + x);
+                        __m128i dv = _mm_loadu_si128((const __m128i*)(out + x));
+                        __m128i half[2];
+                        for (unsigned h = 0; h < 2; h++)
+                        {
+                            __m128i s16 = (h) ? _mm_unpackhi_epi8(sv, zero) : _mm_unpacklo_epi8(sv, zero);
+                            __m128i d16 = (h) ? _mm_unpackhi_epi8(dv, zero) : _mm_unpacklo_epi8(dv, zero);
+                            __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+                            __m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(s16, a), _mm_mullo_epi16(d16, _mm_sub_epi16(full, a))), round);
+                            half[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+                        }
+                        _mm_storeu_si128((__m128i*)(out + x), _mm_or_si128(_mm_packus_epi16(half[0], half[1]), opaque));
+                    }
+                }
+#endif
+                for (; x < count; x++) out[x] = blendPixel(in[x], out[x]);
+            }
+        }
+
+        /** Copy the source to the shadow where it differs, and hash it. Optionally describe the content as well.
+         *
+         *  @return     Logical true if any pixel differed.
+         */
+        static bool copyDiffHash(void* shadow, size_t shadowBytesPerRow, const void* src, size_t srcBytesPerRow,
+                                 unsigned width, unsigned height, uint64_t* hash, DisplayXFBTileContent* content)
+        {
+            if ((Tile || Aligned) && !applies(src, srcBytesPerRow, width))
+            {
+                return Fallback::copyDiffHash(shadow, shadowBytesPerRow, src, srcBytesPerRow, width, height, hash, content);
+            }
+            return (content) ? fused<true, true>(shadow, shadowBytesPerRow, src, srcBytesPerRow, width, height, hash, content)
+                             : fused<false, true>(shadow, shadowBytesPerRow, src, srcBytesPerRow, width, height, hash, content);
+        }
+
+        /** Hash (and optionally describe) the source without a shadow copy.
+         */
+        static void hash(const void* src, size_t srcBytesPerRow, unsigned width, unsigned height, uint64_t* hash, DisplayXFBTileContent* content)
+        {
+            if ((Tile || Aligned) && !applies(src, srcBytesPerRow, width))
+            {
+                Fallback::hash(src, srcBytesPerRow, width, height, hash, content);
+            }
+            else if (content)
+            {
+                fused<true, false>(0, 0, src, srcBytesPerRow, width, height, hash, content);
+            }
+            else
+            {
+                fused<false, false>(0, 0, src, srcBytesPerRow, width, height, hash, content);
+            }
+        }
+
+        template <bool Content, bool Shadow>
+        static bool fused(void* shadow, size_t shadowBytesPerRow, const void* src, size_t srcBytesPerRow,
+                          unsigned width, unsigned height, uint64_t* hash, DisplayXFBTileContent* content)
+        {
+            const unsigned count = (Tile) ? Tile : width;
+            const uint8_t* s = (const uint8_t*)src;
+            uint8_t* d = (uint8_t*)shadow;
+            const uint32_t first = *(const uint32_t*)src & 0x00ffffffu;
+            uint64_t h = ((uint64_t)width << 32) | height;
+            uint64_t colourBits[2] = { 0, 0 };
+            uint64_t lumaSum = 0;
+            uint64_t lumaSquares = 0;
+            bool solid = true;
+            bool changed = false;
+            for (unsigned y = 0; y < height; y++, s += srcBytesPerRow, d += shadowBytesPerRow)
+            {
+                const uint32_t* in = (const uint32_t*)s;
+                uint32_t* out = (uint32_t*)d;
+                uint64_t lane0 = 0;
+                uint64_t lane1 = 0;
+                unsigned x = 0;
+#if defined(__SSE2__)
+                if (Isa >= PK::kIsaSSE2)
+                {
+                    const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+                    const __m128i low = _mm_set1_epi32(0xff);
+                    const __m128i reference = _mm_set1_epi32((int)first);
+                    __m128i lanes = _mm_setzero_si128();
+                    __m128i same = _mm_set1_epi32(-1);
+                    __m128i sums = _mm_setzero_si128();
+                    __m128i squares = _mm_setzero_si128();
+                    for (; x + 4 <= count; x += 4)
+                    {
+                        __m128i v = load(in + x);
+                        if (Shadow && 0xffff != _mm_movemask_epi8(_mm_cmpeq_epi32(v, _mm_loadu_si128((const __m128i*)(out + x)))))
+                        {
+                            _mm_storeu_si128((__m128i*)(out + x), v);
+                            changed = true;
+                        }
+                        __m128i k = _mm_add_epi32(v, _mm_loadu_si128((const __m128i*)kHashKeys[(x / 4) & 15]));
+                        lanes = _mm_add_epi64(lanes, _mm_mul_epu32(k, _mm_srli_epi64(k, 32)));
+                        if (Content)
+                        {
+                            same = _mm_and_si128(same, _mm_cmpeq_epi32(_mm_and_si128(v, rgb), reference));
+                            __m128i l = _mm_srli_epi32(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(v, low), _mm_set1_epi32(29)),
+                                                       _mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 8), low), _mm_set1_epi32(150)),
+                                                                     _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_set1_epi32(77)))), 8);
+                            sums = _mm_add_epi32(sums, l);
+                            squares = _mm_add_epi32(squares, _mm_madd_epi16(l, l));
+                            for (unsigned i = 0; i < 4; i++)
+                            {
+                                unsigned bit = ((in[x + i] & 0x00ffffffu) * 0x9e3779b1u) >> 25;
+                                colourBits[bit >> 6] |= 1ull << (bit & 63);
+                            }
+                        }
+                    }
+                    uint64_t words[2];
+                    _mm_storeu_si128((__m128i*)words, lanes);
+                    lane0 = words[0];
+                    lane1 = words[1];
+                    if (Content)
+                    {
+                        uint32_t parts[4];
+                        solid = solid && (0xffff == _mm_movemask_epi8(same));
+                        _mm_storeu_si128((__m128i*)parts, sums);
+                        lumaSum += (uint64_t)parts[0] + parts[1] + parts[2] + parts[3];
+                        _mm_storeu_si128((__m128i*)parts, squares);
+                        lumaSquares += (uint64_t)parts[0] + parts[1] + parts[2] + parts[3];
+                    }
+                }
+#endif
+                for (; x < count; x += 4)
+                {
+                    uint32_t w[4] = { 0, 0, 0, 0 };
+                    unsigned n = (count - x < 4) ? count - x : 4;
+                    for (unsigned i = 0; i < n; i++)
+                    {
+                        w[i] = in[x + i];
+                        if (Shadow && out[x + i] != w[i])
+                        {
+                            out[x + i] = w[i];
+                            changed = true;
+                        }
+                        if (Content)
+                        {
+                            uint32_t l = luma(w[i]);
+                            unsigned bit = ((w[i] & 0x00ffffffu) * 0x9e3779b1u) >> 25;
+                            colourBits[bit >> 6] |= 1ull << (bit & 63);
+                            solid = solid && ((w[i] & 0x00ffffffu) == first);
+                            lumaSum += l;
+                            lumaSquares += l * l;
+                        }
+                    }
+                    hashBlock(w, x / 4, lane0, lane1);
+                }
+                h = hashRow(h, lane0, lane1);
+            }
+            *hash = hashFinish(h);
+            if (Content) describe(content, first, solid, colourBits, lumaSum, lumaSquares, count * height);
+            return changed;
+        }
+
+        static DisplayXFBPixelKernelTable table()
+        {
+            DisplayXFBPixelKernelTable t = { &copy, &diff, &convert, &blend, &copyDiffHash, &hash, Format, Tile, Isa, Aligned };
+            return t;
+        }
+    };
+
+
+    /** Map run time parameters on to template arguments.
+     */
+    template <unsigned Format, unsigned Tile, bool Aligned>
+    static DisplayXFBPixelKernelTable selectIsa(unsigned isa)
+    {
+        switch (isa)
+        {
+            case PK::kIsaSSSE3:     return Kernels<Format, Tile, Aligned, PK::kIsaSSSE3>::table();
+            case PK::kIsaSSE2:      return Kernels<Format, Tile, Aligned, PK::kIsaSSE2>::table();
+            default:                return Kernels<Format, Tile, Aligned, PK::kIsaScalar>::table();
+        }
+    }
+
+    template <unsigned Format, unsigned Tile>
+    static DisplayXFBPixelKernelTable selectAligned(bool aligned, unsigned isa)
+    {
+        return (aligned) ? selectIsa<Format, Tile, true>(isa) : selectIsa<Format, Tile, false>(isa);
+    }
+
+    template <unsigned Format>
+    static DisplayXFBPixelKernelTable selectTile(unsigned tileSize, bool aligned, unsigned isa)
+    {
+        switch (tileSize)
+        {
+            case 16:                return selectAligned<Format, 16>(aligned, isa);
+            case 32:                return selectAligned<Format, 32>(aligned, isa);
+            case 64:                return selectAligned<Format, 64>(aligned, isa);
+            default:                return selectAligned<Format, 0>(aligned, isa);
+        }
+    }
+
+
+    /** Return the best instruction set supported by the processor (and by this build).
+     */
+    DisplayXFBPixelKernels::Isa DisplayXFBPixelKernels::cpuIsa()
+    {
+#if defined(DISPLAYXFB_HAVE_SSSE3)
+        static int cached = -1;
+        if (cached < 0)
+        {
+            unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+            int isa = kIsaSSE2;                                     // Implied by the build flags
+            if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 9))) isa = kIsaSSSE3;
+            cached = isa;
+        }
+        return (Isa)cached;
+#elif defined(__SSE2__)
+        return kIsaSSE2;
+#else
+        return kIsaScalar;
+#endif
+    }
+
+
+    /** Return the kernels for a display.
+     *
+     *  @param  state       The display state. Tile rows are aligned if the first pixel and the stride are.
+     *  @param  format      The output format.
+     *  @param  tileSize    The width of the areas that will be processed (16, 32 or 64), or zero for any width.
+     *  @return             The kernel table.
+     */
+    DisplayXFBPixelKernelTable DisplayXFBPixelKernels::select(const DisplayXFBState& state, Format format, unsigned tileSize)
+    {
+        bool aligned = (0 == (state.offset() & 15)) && (0 == (state.bytesPerRow() & 15)) && (0 == ((tileSize * 4) & 15));
+        return select(format, tileSize, aligned, cpuIsa());
+    }
+
+
+    /** Return the kernels for explicit parameters.
+     *
+     *  @param  format      The output format.
+     *  @param  tileSize    The width specialised for (16, 32 or 64), or zero for any width.
+     *  @param  aligned     Logical true if the source areas will be 16 byte aligned.
+     *  @param  isa         The instruction set (capped at the processor's).
+     *  @return             The kernel table.
+     */
+    DisplayXFBPixelKernelTable DisplayXFBPixelKernels::select(Format format, unsigned tileSize, bool aligned, Isa isa)
+    {
+        unsigned level = (isa < cpuIsa()) ? isa : cpuIsa();
+        switch (format)
+        {
+            case kFormatRGBA32:     return selectTile<kFormatRGBA32>(tileSize, aligned, level);
+            case kFormatGray8:      return selectTile<kFormatGray8>(tileSize, aligned, level);
+            default:                return selectTile<kFormatBGRA32>(tileSize, aligned, level);
+        }
+    }
+
+
+    /** Return the portable any-width kernels.
+     */
+    DisplayXFBPixelKernelTable DisplayXFBPixelKernels::generic(Format format)
+    {
+        return select(format, 0, false, kIsaScalar);
+    }
+
+
+    /** Copy a 32 bit frame, choosing between memcpy and a streaming copy by size.
+     *
+     *  @param  dst             The destination.
+     *  @param  dstBytesPerRow  The destination stride (bytes).
+     *  @param  src             The source.
+     *  @param  srcBytesPerRow  The source stride (bytes).
+     *  @param  width           The width (pixels).
+     *  @param  height          The height (pixels).
+     */
+    void DisplayXFBPixelKernels::copyFrame(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+    {
+        size_t rowBytes = (size_t)width * 4;
+        if (rowBytes * height >= streamingThreshold())
+        {
+            copyFrameStreaming(dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+        }
+        else if (rowBytes == dstBytesPerRow && rowBytes == srcBytesPerRow)
+        {
+            memcpy(dst, src, rowBytes * height);
+        }
+        else
+        {
+            for (unsigned y = 0; y < height; y++) memcpy((uint8_t*)dst + (y * dstBytesPerRow), (const uint8_t*)src + (y * srcBytesPerRow), rowBytes);
+        }
+    }
+
+
+    /** Copy a 32 bit frame with software prefetch and non-temporal stores, whatever its size. Falls back to memcpy
+     *  without SSE2.
+     */
+    void DisplayXFBPixelKernels::copyFrameStreaming(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+    {
+        size_t rowBytes = (size_t)width * 4;
+        for (unsigned y = 0; y < height; y++)
+        {
+            const uint8_t* s = (const uint8_t*)src + (y * srcBytesPerRow);
+            uint8_t* d = (uint8_t*)dst + (y * dstBytesPerRow);
+            size_t n = rowBytes;
+#if defined(__SSE2__)
+            // Pixels are 4 byte aligned, so a scalar head reaches a 16 byte aligned destination within 3 pixels.
+            while (n >= 4 && ((uintptr_t)d & 15))
+            {
+                *(uint32_t*)d = *(const uint32_t*)s;
+                d += 4;
+                s += 4;
+                n -= 4;
+            }
+            for (; n >= 64; n -= 64, s += 64, d += 64)
+            {
+                _mm_prefetch((const char*)s + kPrefetchDistance, _MM_HINT_T0);
+                __m128i v0 = _mm_loadu_si128((const __m128i*)s);
+                __m128i v1 = _mm_loadu_si128((const __m128i*)(s + 16));
+                __m128i v2 = _mm_loadu_si128((const __m128i*)(s + 32));
+                __m128i v3 = _mm_loadu_si128((const __m128i*)(s + 48));
+                _mm_stream_si128((__m128i*)d, v0);
+                _mm_stream_si128((__m128i*)(d + 16), v1);
+                _mm_stream_si128((__m128i*)(d + 32), v2);
+                _mm_stream_si128((__m128i*)(d + 48), v3);
+            }
+#endif
+            memcpy(d, s, n);
+        }
+#if defined(__SSE2__)
+        _mm_sfence();                                               // Order the streaming stores before later writes
+#endif
+    }
+
+
+    /** Return the frame size (bytes) from which copyFrame() uses streaming stores.
+     */
+    size_t DisplayXFBPixelKernels::streamingThreshold()
+    {
+        if (0 == gStreamingThreshold)
+        {
+            size_t cache = 0;
+#if defined(__APPLE__)
+            uint64_t value = 0;
+            size_t length = sizeof value;
+            if (0 == sysctlbyname("hw.l3cachesize", &value, &length, 0, 0) && value) cache = (size_t)value;
+            else if (0 == sysctlbyname("hw.l2cachesize", &value, &length, 0, 0) && value) cache = (size_t)value;
+#elif defined(_SC_LEVEL3_CACHE_SIZE)
+            long value = sysconf(_SC_LEVEL3_CACHE_SIZE);
+            if (value <= 0) value = sysconf(_SC_LEVEL2_CACHE_SIZE);
+            if (value > 0) cache = (size_t)value;
+#endif
+            gStreamingThreshold = ((cache) ? cache : kDefaultLastLevelCache) / 2;
+        }
+        return gStreamingThreshold;
+    }
+
+
+    /** Change the streaming threshold (bytes). Zero restores the default.
+     */
+    void DisplayXFBPixelKernels::setStreamingThreshold(size_t bytes)
+    {
+        gStreamingThreshold = bytes;
+    }
+
+}   // namespace
@@ -0,0 +1,124 @@
+/** @file   DisplayXFBPixelKernels.h
+ *  @brief  Pixel copy, compare, convert and blend kernels, specialised at compile time and chosen at run time.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBPixelKernels_H
+#define COM_TSONIQ_DisplayXFBPixelKernels_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DisplayXFBShared.h"
+
+namespace ts
+{
+    /** A compact description of the content of a tile, produced by the fused copyDiffHash kernel.
+     */
+    struct DisplayXFBTileContent
+    {
+        static const unsigned kManyColours = 0xffff;   //!< m_colours value for too many colours to estimate
+
+        uint32_t m_colour;                              //!< The first pixel's colour (BGR, alpha zero): the tile colour if solid
+        uint16_t m_colours;                             //!< Approximate number of distinct colours (1 if solid)
+        uint8_t m_lumaMean;                             //!< Mean luma (0 to 255)
+        uint8_t m_solid;                                //!< Non-zero if every pixel has the same colour (alpha ignored)
+        uint16_t m_lumaVariance;                        //!< Luma variance
+        uint16_t m_reserved;                            //!< Zero
+    };
+
+
+    /** A set of kernels for one output format, tile size, alignment and instruction set.
+     *
+     *  All kernels take 32 bit BGRA source pixels (the framebuffer format) and operate on a width x height area,
+     *  with independent row strides (bytes) for each buffer.
+     */
+    struct DisplayXFBPixelKernelTable
+    {
+        typedef void (*Copy)(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height);
+        typedef bool (*Diff)(const void* a, size_t aBytesPerRow, const void* b, size_t bBytesPerRow, unsigned width, unsigned height);
+        typedef void (*Convert)(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height);
+        typedef void (*Blend)(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height);
+        typedef bool (*CopyDiffHash)(void* shadow, size_t shadowBytesPerRow, const void* src, size_t srcBytesPerRow,
+                                     unsigned width, unsigned height, uint64_t* hash, DisplayXFBTileContent* content);
+        typedef void (*Hash)(const void* src, size_t srcBytesPerRow, unsigned width, unsigned height, uint64_t* hash, DisplayXFBTileContent* content);
+
+        Copy m_copy;                                    //!< Copy BGRA pixels
+        Diff m_diff;                                    //!< Return true if two BGRA areas differ
+        Convert m_convert;                              //!< Convert BGRA pixels to the table's output format
+        Blend m_blend;                                  //!< Alpha blend (non-premultiplied) BGRA over BGRA, result opaque
+        CopyDiffHash m_copyDiffHash;                    //!< Update a shadow copy, hash (and optionally describe) the source, in one pass
+        Hash m_hash;                                    //!< Hash (and optionally describe) the source, as copyDiffHash without a shadow
+        unsigned m_format;                              //!< The output format (DisplayXFBPixelKernels::Format)
+        unsigned m_tileSize;                            //!< The width specialised for (pixels), or zero for any width
+        unsigned m_isa;                                 //!< The instruction set (DisplayXFBPixelKernels::Isa)
+        bool m_aligned;                                 //!< Logical true if the source is read with aligned loads
+    };
+
+
+    /** Dispatcher for the pixel kernels.
+     *
+     *  Each kernel is a template instantiated for every combination of output format, tile width (16, 32, 64 or any),
+     *  source alignment and instruction set (scalar, SSE2, SSSE3). The fixed width variants have constant trip counts
+     *  that the compiler unrolls, and the aligned variants read the source with aligned vector loads. select() picks
+     *  the variant for a display from its state (row stride and offset decide whether tile rows are 16 byte aligned)
+     *  and the processor's features. A specialised kernel called with a different width, or with a source that is not
+     *  actually aligned, falls back to the any-width unaligned variant of the same instruction set, so a table is
+     *  always safe to use for edge tiles.
+     *
+     *  generic() returns the scalar any-width kernels, which are the reference results: all variants produce
+     *  identical output.
+     *
+     *  The fused copyDiffHash kernel reads each source pixel once: it compares it with a shadow copy, writes it to the
+     *  shadow only where a 16 byte block differs, and folds it in to a 64 bit hash of the area. The hash is an NH
+     *  style sum of 32x32 bit products (which SSE2 computes with pmuludq) mixed once per row, so the vector and scalar
+     *  variants give the same value. If asked, the same pass also fills in a DisplayXFBTileContent (solid colour
+     *  flag, approximate colour count and luma mean and variance) for encoder decisions.
+     *
+     *  copyFrame() is for whole frame copies out of the mapped framebuffer. Above streamingThreshold() bytes (half
+     *  the last level cache) it prefetches the source and writes with non-temporal stores, so that a large copy does
+     *  not evict the working set of other threads (such as an encoder). Smaller copies use memcpy, since the data
+     *  is likely to be read again soon.
+     */
+    class DisplayXFBPixelKernels
+    {
+    public:
+
+        /** Output pixel formats.
+         */
+        enum Format
+        {
+            kFormatBGRA32,                              //!< 32 bit BGRA (the framebuffer format)
+            kFormatRGBA32,                              //!< 32 bit RGBA
+            kFormatGray8,                               //!< 8 bit luma
+            kFormats                                    //!< The number of formats
+        };
+
+        /** Instruction set levels.
+         */
+        enum Isa
+        {
+            kIsaScalar,                                 //!< Portable C++
+            kIsaSSE2,                                   //!< SSE2
+            kIsaSSSE3,                                  //!< SSE2 plus SSSE3 byte shuffles
+            kIsas                                       //!< The number of levels
+        };
+
+        static Isa cpuIsa();
+        static DisplayXFBPixelKernelTable select(const DisplayXFBState& state, Format format, unsigned tileSize);
+        static DisplayXFBPixelKernelTable select(Format format, unsigned tileSize, bool aligned, Isa isa);
+        static DisplayXFBPixelKernelTable generic(Format format);
+
+        static void copyFrame(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height);
+        static void copyFrameStreaming(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height);
+        static size_t streamingThreshold();
+        static void setStreamingThreshold(size_t bytes);
+
+    private:
+
+        DisplayXFBPixelKernels();                                           // Not instantiated
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBPixelKernels_H
@@ -0,0 +1,176 @@
+/** @file   DisplayXFBRateController.cc
+ *  @brief  Frame rate and quality control for a bandwidth limited stream.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBRateController.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace ts
+{
+    static const double kQualitySlope = 0.03;           //!< Encoded size grows by about exp(kQualitySlope) per quality step
+    static const double kRecoveryStep = 2.0;            //!< Largest quality increase per frame
+    static const double kModelWeight = 0.25;            //!< Weight of each new sample in the size model
+
+
+    /** Return the relative encoded size at a quality.
+     */
+    static inline double qualityScale(double quality)
+    {
+        return exp(kQualitySlope * quality);
+    }
+
+
+    DisplayXFBRateController::DisplayXFBRateController()
+        :
+        m_config(),
+        m_statistics(),
+        m_pixels(0),
+        m_quality(0),
+        m_lastTimeUS(0),
+        m_firstTimeUS(0),
+        m_started(false),
+        m_modelValid(false)
+    {
+        configure(Config(), 0, 0);
+    }
+
+
+    /** Set the configuration and frame size, and reset the controller.
+     *
+     *  @param  config          The configuration.
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     */
+    void DisplayXFBRateController::configure(const Config& config, unsigned width, unsigned height)
+    {
+        m_config = config;
+        if (0 == m_config.m_frameRate) m_config.m_frameRate = 1;
+        if (m_config.m_minQuality < 1) m_config.m_minQuality = 1;
+        if (m_config.m_maxQuality > 100) m_config.m_maxQuality = 100;
+        if (m_config.m_maxQuality < m_config.m_minQuality) m_config.m_maxQuality = m_config.m_minQuality;
+        m_pixels = (double)width * height;
+        reset();
+    }
+
+
+    /** Forget all history and clear the counters.
+     */
+    void DisplayXFBRateController::reset()
+    {
+        unsigned initial = m_config.m_initialQuality;
+        if (initial < m_config.m_minQuality) initial = m_config.m_minQuality;
+        if (initial > m_config.m_maxQuality) initial = m_config.m_maxQuality;
+
+        memset(&m_statistics, 0, sizeof m_statistics);
+        m_statistics.m_quality = initial;
+        m_quality = initial;
+        m_lastTimeUS = 0;
+        m_firstTimeUS = 0;
+        m_started = false;
+        m_modelValid = false;
+    }
+
+
+    /** Decide what to do with a captured frame.
+     *
+     *  @param  timeUS          The capture time (microseconds, any monotonic origin).
+     *  @param  dirtyFraction   The fraction of the frame changed since the last frame sent (0 to 1). The changes in
+     *                          a skipped frame must be carried in to the next one.
+     *  @return                 The decision. If m_send is set, encode at m_quality and call report().
+     */
+    DisplayXFBRateController::Decision DisplayXFBRateController::decide(uint64_t timeUS, double dirtyFraction)
+    {
+        double burstBits = (double)m_config.m_targetBitsPerSecond * m_config.m_burstMS / 1000.0;
+        if (!m_started)
+        {
+            m_started = true;
+            m_firstTimeUS = timeUS;
+            m_lastTimeUS = timeUS;
+            m_statistics.m_bucketBits = (int64_t)burstBits;
+        }
+        else if (timeUS > m_lastTimeUS)
+        {
+            double bucket = (double)m_statistics.m_bucketBits;
+            bucket += (double)m_config.m_targetBitsPerSecond * (double)(timeUS - m_lastTimeUS) / 1000000.0;
+            if (bucket > burstBits) bucket = burstBits;
+            m_statistics.m_bucketBits = (int64_t)bucket;
+            m_lastTimeUS = timeUS;
+        }
+        m_statistics.m_framesOffered ++;
+
+        Decision decision;
+        decision.m_send = false;
+        decision.m_quality = m_statistics.m_quality;
+
+        if (dirtyFraction <= 0.0)
+        {
+            m_statistics.m_framesSkippedUnchanged ++;
+            return decision;
+        }
+        if (m_statistics.m_bucketBits < 0)
+        {
+            m_statistics.m_framesSkippedBacklog ++;
+            return decision;
+        }
+
+        if (m_modelValid && m_pixels > 0)
+        {
+            // The frame may use its share of the bandwidth plus part of any credit in the bucket.
+            double allowance = ((double)m_config.m_targetBitsPerSecond / m_config.m_frameRate) + (m_statistics.m_bucketBits / 4.0);
+            double unitBits = m_statistics.m_bitsPerDirtyPixel * dirtyFraction * m_pixels;
+            double wanted = (unitBits > 0) ? log(allowance / unitBits) / kQualitySlope : m_config.m_maxQuality;
+
+            if (wanted < m_quality) m_quality = wanted;
+            else if (wanted > m_quality + kRecoveryStep) m_quality += kRecoveryStep;
+            else m_quality = wanted;
+            if (m_quality < m_config.m_minQuality) m_quality = m_config.m_minQuality;
+            if (m_quality > m_config.m_maxQuality) m_quality = m_config.m_maxQuality;
+        }
+
+        unsigned quality = (unsigned)(m_quality + 0.5);
+        if (quality < m_statistics.m_quality) m_statistics.m_qualityDecreases ++;
+        if (quality > m_statistics.m_quality) m_statistics.m_qualityIncreases ++;
+        m_statistics.m_quality = quality;
+
+        decision.m_send = true;
+        decision.m_quality = quality;
+        return decision;
+    }
+
+
+    /** Report the encoded size of a frame that decide() chose to send.
+     *
+     *  @param  encodedBytes    The encoded size (bytes).
+     *  @param  dirtyFraction   The dirty fraction passed to decide().
+     */
+    void DisplayXFBRateController::report(size_t encodedBytes, double dirtyFraction)
+    {
+        double bits = (double)encodedBytes * 8.0;
+        m_statistics.m_framesSent ++;
+        m_statistics.m_bytesSent += encodedBytes;
+        m_statistics.m_bucketBits -= (int64_t)bits;
+
+        if (dirtyFraction > 0.0 && m_pixels > 0)
+        {
+            // Normalise the sample to quality zero, so that one model serves every quality.
+            double sample = bits / (dirtyFraction * m_pixels * qualityScale(m_statistics.m_quality));
+            if (m_modelValid) m_statistics.m_bitsPerDirtyPixel += kModelWeight * (sample - m_statistics.m_bitsPerDirtyPixel);
+            else m_statistics.m_bitsPerDirtyPixel = sample;
+            m_modelValid = true;
+        }
+    }
+
+
+    /** Return the mean bitrate sent since the first decision (bits per second).
+     */
+    double DisplayXFBRateController::averageBitsPerSecond() const
+    {
+        if (!m_started || m_lastTimeUS <= m_firstTimeUS) return 0.0;
+        return (double)m_statistics.m_bytesSent * 8.0 * 1000000.0 / (double)(m_lastTimeUS - m_firstTimeUS);
+    }
+
+}   // namespace
@@ -0,0 +1,95 @@
+/** @file   DisplayXFBRateController.h
+ *  @brief  Frame rate and quality control for a bandwidth limited stream.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBRateController_H
+#define COM_TSONIQ_DisplayXFBRateController_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ts
+{
+    /** Class used to choose, for each captured frame, whether to send it and at what encoder quality, so that the
+     *  stream stays within a target bitrate without building up latency on the link.
+     *
+     *  The link is modelled as a token bucket that fills at the target bitrate and holds at most m_burstMS worth of
+     *  data. Each frame sent drains it by its encoded size. While the bucket is empty (the link is backlogged) frames
+     *  are skipped; frames with no changed area are always skipped. Quality is steered by a model of encoded bits
+     *  per changed pixel, learned from the reported output sizes. The model predicts the size of the next frame
+     *  from its dirty fraction. Quality drops quickly when that prediction exceeds the frame's share of the
+     *  bandwidth, and recovers slowly when there is headroom.
+     *
+     *  Times are supplied by the caller, so the controller can be driven from a replayed trace as well as live. The
+     *  class is not thread safe.
+     */
+    class DisplayXFBRateController
+    {
+    public:
+
+        /** Configuration.
+         */
+        struct Config
+        {
+            uint64_t m_targetBitsPerSecond;             //!< The link budget
+            unsigned m_frameRate;                       //!< The nominal capture rate (frames per second)
+            unsigned m_burstMS;                         //!< Bucket depth (milliseconds at the target rate)
+            unsigned m_minQuality;                      //!< Lowest quality to use (1 to 100)
+            unsigned m_maxQuality;                      //!< Highest quality to use (1 to 100)
+            unsigned m_initialQuality;                  //!< Quality before any frame has been reported
+
+            Config() : m_targetBitsPerSecond(20000000), m_frameRate(60), m_burstMS(100), m_minQuality(20), m_maxQuality(90), m_initialQuality(75) { }
+        };
+
+        /** The decision for one frame.
+         */
+        struct Decision
+        {
+            bool m_send;                                //!< Logical true to encode and send the frame
+            unsigned m_quality;                         //!< The encoder quality to use
+        };
+
+        /** Counters, accumulated since the last configure() or reset().
+         */
+        struct Statistics
+        {
+            uint64_t m_framesOffered;                   //!< Calls to decide()
+            uint64_t m_framesSent;                      //!< Frames reported as sent
+            uint64_t m_framesSkippedUnchanged;          //!< Frames skipped because nothing changed
+            uint64_t m_framesSkippedBacklog;            //!< Frames skipped because the link was backlogged
+            uint64_t m_bytesSent;                       //!< Encoded bytes reported
+            uint64_t m_qualityDecreases;                //!< Decisions that lowered the quality
+            uint64_t m_qualityIncreases;                //!< Decisions that raised the quality
+            unsigned m_quality;                         //!< The most recent quality
+            int64_t m_bucketBits;                       //!< The bucket level (negative if in debt)
+            double m_bitsPerDirtyPixel;                 //!< The current size model
+        };
+
+        DisplayXFBRateController();
+
+        void configure(const Config& config, unsigned width, unsigned height);
+        void reset();
+        Decision decide(uint64_t timeUS, double dirtyFraction);
+        void report(size_t encodedBytes, double dirtyFraction);
+
+        const Config& config() const { return m_config; }                       //!< Return the configuration
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+        double averageBitsPerSecond() const;
+
+    private:
+
+        Config m_config;                                //!< The configuration
+        Statistics m_statistics;                        //!< The counters
+        double m_pixels;                                //!< Frame area (pixels)
+        double m_quality;                               //!< The working quality (fractional, for slow recovery)
+        uint64_t m_lastTimeUS;                          //!< Time of the previous decide() call
+        uint64_t m_firstTimeUS;                         //!< Time of the first decide() call
+        bool m_started;                                 //!< Logical true once decide() has been called
+        bool m_modelValid;                              //!< Logical true once a sent frame has been reported
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBRateController_H
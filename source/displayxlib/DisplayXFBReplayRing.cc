@@ -0,0 +1,448 @@
+/** @file   DisplayXFBReplayRing.cc
+ *  @brief  Bounded ring of compressed frames, for "last N seconds" instant replay.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBReplayRing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+namespace ts
+{
+    static const size_t kMinimumCapacity = 256 * 1024;                  //!< Smallest useful byte ring
+    static const unsigned kDumpAttempts = 4;                            //!< Retries if the recorder overtakes a dump
+
+    static uint64_t microseconds()
+    {
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return ((uint64_t)tv.tv_sec * 1000000u) + (uint64_t)tv.tv_usec;
+    }
+
+
+    DisplayXFBReplayRing::DisplayXFBReplayRing()
+        :
+        m_config(),
+        m_region(0),
+        m_regionSize(0),
+        m_mapped(false),
+        m_control(0),
+        m_index(0),
+        m_ring(0),
+        m_codec(),
+        m_scratch(0),
+        m_scratchSize(0),
+        m_lastWidth(0),
+        m_lastHeight(0),
+        m_lastKeyframeUS(0),
+        m_forceKeyframe(true),
+        m_statistics()
+    {
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    DisplayXFBReplayRing::~DisplayXFBReplayRing()
+    {
+        close();
+    }
+
+
+    /** Allocate the recording region.
+     *
+     *  @param  config      The configuration. If a path is given, the file is created (or truncated) to the budget size.
+     *  @return             Logical true for success, false if the budget is too small or the region can not be created.
+     */
+    bool DisplayXFBReplayRing::open(const Config& config)
+    {
+        close();
+
+        size_t indexBytes = (size_t)config.m_maxRecords * sizeof (Record);
+        size_t overhead = sizeof (Control) + indexBytes;
+        if (config.m_maxRecords < 2 || config.m_budget < overhead + kMinimumCapacity) return false;
+
+        size_t regionSize = config.m_budget & ~(size_t)7;
+        void* region = MAP_FAILED;
+        if (config.m_path)
+        {
+            int fd = ::open(config.m_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) return false;
+            if (0 == ftruncate(fd, (off_t)regionSize))
+            {
+                region = mmap(0, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+        }
+        else
+        {
+            region = mmap(0, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        }
+        if (MAP_FAILED == region) return false;
+
+        memset(region, 0, overhead);
+        Control* control = (Control*)region;
+        control->m_maxRecords = config.m_maxRecords;
+        control->m_capacity = regionSize - overhead;
+        __sync_synchronize();
+        control->m_magic = kFileMagic;
+
+        attach(config, region, regionSize);
+        return true;
+    }
+
+
+    /** Attach to a file backed recording left by an earlier open() (for example, by a process that crashed). The
+     *  file is not truncated. Records that are not intact are discarded, and recording continues with a keyframe.
+     *
+     *  @param  config      The configuration. The path must be given; the budget and index size are taken from the file.
+     *  @return             Logical true for success, false if the file can not be mapped or is not a valid recording.
+     */
+    bool DisplayXFBReplayRing::recover(const Config& config)
+    {
+        close();
+        if (!config.m_path) return false;
+
+        int fd = ::open(config.m_path, O_RDWR);
+        if (fd < 0) return false;
+        struct stat info;
+        size_t regionSize = 0;
+        void* region = MAP_FAILED;
+        if (0 == fstat(fd, &info) && (size_t)info.st_size >= sizeof (Control))
+        {
+            regionSize = (size_t)info.st_size & ~(size_t)7;
+            region = mmap(0, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (MAP_FAILED == region) return false;
+
+        m_region = region;
+        m_regionSize = regionSize;
+        m_mapped = true;
+        if (!validate(regionSize))
+        {
+            close();
+            return false;
+        }
+
+        Config recovered = config;
+        recovered.m_budget = regionSize;
+        recovered.m_maxRecords = ((const Control*)region)->m_maxRecords;
+        attach(recovered, region, regionSize);
+        return true;
+    }
+
+
+    /** Check the control block of a mapped region (m_region) and trim the index to the records that are intact.
+     *
+     *  @return             Logical true if the region holds a recording made with the same layout.
+     */
+    bool DisplayXFBReplayRing::validate(size_t regionSize)
+    {
+        Control* control = (Control*)m_region;
+        if (kFileMagic != control->m_magic || control->m_maxRecords < 2) return false;
+
+        size_t overhead = sizeof (Control) + ((size_t)control->m_maxRecords * sizeof (Record));
+        if (regionSize < overhead + kMinimumCapacity || control->m_capacity != regionSize - overhead) return false;
+
+        uint64_t head = control->m_recordHead;
+        uint64_t tail = control->m_recordTail;
+        uint64_t byteHead = control->m_byteHead;
+        uint64_t capacity = control->m_capacity;
+        if (tail > head || (head - tail) > control->m_maxRecords) return false;
+
+        // Records are written back to back, so each must start where the previous one ended, and the whole run must
+        // fit in the byte ring behind the write position. Keep the intact records from the oldest onwards.
+        const Record* index = (const Record*)(control + 1);
+        uint64_t end = (tail < head) ? index[tail % control->m_maxRecords].m_offset : byteHead;
+        uint64_t valid = tail;
+        while (valid < head)
+        {
+            const Record& entry = index[valid % control->m_maxRecords];
+            if (entry.m_offset != end || 0 == entry.m_size || 0 == entry.m_frameWidth || 0 == entry.m_frameHeight ||
+                entry.m_x + entry.m_width > entry.m_frameWidth || entry.m_y + entry.m_height > entry.m_frameHeight) break;
+            end += entry.m_size;
+            valid ++;
+        }
+        if (tail < valid && (end > byteHead || byteHead - index[tail % control->m_maxRecords].m_offset > capacity)) valid = tail;
+
+        // The byte head may be past the last kept record (a crash between the byte and record head stores, or records
+        // dropped above). Move it back so that the next record follows on, or a later recover() would see a gap.
+        if (tail < valid) control->m_byteHead = end;
+        __sync_synchronize();
+        control->m_recordHead = valid;
+        __sync_synchronize();
+        return true;
+    }
+
+
+    /** Set up the pointers and recorder state for a mapped, initialised region.
+     */
+    void DisplayXFBReplayRing::attach(const Config& config, void* region, size_t regionSize)
+    {
+        m_config = config;
+        m_region = region;
+        m_regionSize = regionSize;
+        m_mapped = (0 != config.m_path);
+        m_control = (Control*)region;
+        m_index = (Record*)(m_control + 1);
+        m_ring = (uint8_t*)region + sizeof (Control) + ((size_t)m_control->m_maxRecords * sizeof (Record));
+
+        m_codec.setQuality(config.m_quality);
+        m_lastWidth = 0;
+        m_lastHeight = 0;
+        m_lastKeyframeUS = 0;
+        m_forceKeyframe = true;
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    /** Release the recording region. A file backed recording is left on disk.
+     */
+    void DisplayXFBReplayRing::close()
+    {
+        if (m_region)
+        {
+            if (m_mapped) msync(m_region, m_regionSize, MS_ASYNC);
+            munmap(m_region, m_regionSize);
+        }
+        free(m_scratch);
+        m_region = 0;
+        m_regionSize = 0;
+        m_mapped = false;
+        m_control = 0;
+        m_index = 0;
+        m_ring = 0;
+        m_scratch = 0;
+        m_scratchSize = 0;
+    }
+
+
+    /** Return the size of the byte ring (bytes).
+     */
+    size_t DisplayXFBReplayRing::capacity() const
+    {
+        return (m_control) ? (size_t)m_control->m_capacity : 0;
+    }
+
+
+    /** Add a frame to the recording. A keyframe is written if one is due (or the frame size has changed); otherwise
+     *  only the tile aligned dirty area is encoded, and nothing is written if it is empty.
+     *
+     *  @param  pixels          The frame (32 bit BGRA).
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  bytesPerRow     The frame row stride (bytes).
+     *  @param  dirtyX          The changed area since the previous call.
+     *  @param  dirtyY          ...
+     *  @param  dirtyWidth      ...
+     *  @param  dirtyHeight     ...
+     *  @param  timeUS          The capture time (microseconds).
+     *  @return                 Logical true if the frame was recorded (or had no change), false if it was dropped.
+     */
+    bool DisplayXFBReplayRing::record(const void* pixels, unsigned width, unsigned height, size_t bytesPerRow,
+                                      unsigned dirtyX, unsigned dirtyY, unsigned dirtyWidth, unsigned dirtyHeight, uint64_t timeUS)
+    {
+        if (!m_control || !pixels || 0 == width || 0 == height) return false;
+        uint64_t start = microseconds();
+
+        bool keyframe = m_forceKeyframe || width != m_lastWidth || height != m_lastHeight ||
+                        (timeUS - m_lastKeyframeUS) >= m_config.m_keyframeIntervalUS;
+        unsigned x0 = 0, y0 = 0, x1 = width, y1 = height;
+        if (!keyframe)
+        {
+            const unsigned t = DisplayXFBTileCodec::kTileSize;
+            if (dirtyX >= width || dirtyY >= height || 0 == dirtyWidth || 0 == dirtyHeight) return true;
+            x0 = dirtyX - (dirtyX % t);
+            y0 = dirtyY - (dirtyY % t);
+            x1 = (dirtyWidth > width - dirtyX) ? width : dirtyX + dirtyWidth;
+            y1 = (dirtyHeight > height - dirtyY) ? height : dirtyY + dirtyHeight;
+            x1 = (x1 + t - 1) - ((x1 + t - 1) % t);
+            y1 = (y1 + t - 1) - ((y1 + t - 1) % t);
+            if (x1 > width) x1 = width;
+            if (y1 > height) y1 = height;
+        }
+
+        // The scratch buffer is sized for a keyframe, so it is only reallocated when the frame size changes.
+        size_t needed = DisplayXFBTileCodec::maxEncodedSize(width, height);
+        if (m_scratchSize < needed)
+        {
+            free(m_scratch);
+            m_scratch = (uint8_t*)malloc(needed);
+            m_scratchSize = (m_scratch) ? needed : 0;
+        }
+        const uint8_t* origin = (const uint8_t*)pixels + ((size_t)y0 * bytesPerRow) + ((size_t)x0 * 4);
+        size_t size = (m_scratch) ? m_codec.encode(origin, x1 - x0, y1 - y0, bytesPerRow, m_scratch, m_scratchSize) : 0;
+
+        Control* control = m_control;
+        if (0 == size || size > control->m_capacity)
+        {
+            m_statistics.m_dropped ++;
+            m_forceKeyframe = true;                     // Later deltas would be relative to a missing frame
+            return false;
+        }
+
+        // Evict until both the index and the byte ring have room. The new tail is published before anything is
+        // overwritten, so a concurrent dump() can tell which of the records it copied are still intact.
+        uint64_t head = control->m_recordHead;
+        uint64_t tail = control->m_recordTail;
+        uint64_t byteHead = control->m_byteHead;
+        while (tail < head && ((head - tail) >= control->m_maxRecords ||
+                               (byteHead + size - m_index[tail % control->m_maxRecords].m_offset) > control->m_capacity))
+        {
+            tail ++;
+            m_statistics.m_evictions ++;
+        }
+        if (tail != control->m_recordTail)
+        {
+            control->m_recordTail = tail;
+            __sync_synchronize();
+        }
+
+        copyIn(byteHead, m_scratch, size);
+        Record& entry = m_index[head % control->m_maxRecords];
+        entry.m_timeUS = timeUS;
+        entry.m_offset = byteHead;
+        entry.m_size = (uint32_t)size;
+        entry.m_flags = (keyframe) ? kFlagKeyframe : 0;
+        entry.m_frameWidth = width;
+        entry.m_frameHeight = height;
+        entry.m_x = x0;
+        entry.m_y = y0;
+        entry.m_width = x1 - x0;
+        entry.m_height = y1 - y0;
+        __sync_synchronize();
+        control->m_byteHead = byteHead + size;
+        control->m_recordHead = head + 1;
+
+        if (keyframe)
+        {
+            m_lastKeyframeUS = timeUS;
+            m_forceKeyframe = false;
+            m_statistics.m_keyframes ++;
+        }
+        m_lastWidth = width;
+        m_lastHeight = height;
+        m_statistics.m_records ++;
+        m_statistics.m_bytes += size;
+        m_statistics.m_inputBytes += (uint64_t)(x1 - x0) * (y1 - y0) * 4;
+        m_statistics.m_encodeMicroseconds += microseconds() - start;
+        return true;
+    }
+
+
+    /** Write the last part of the recording to a replay file. The file starts at the latest keyframe at or before
+     *  the requested start time (or the oldest keyframe held, if that is later).
+     *
+     *  @param  path            The file to write.
+     *  @param  seconds         The length of recording wanted.
+     *  @param  nowUS           The current time (microseconds), on the same clock as passed to record().
+     *  @return                 Logical true for success, false if there is no keyframe or the file can not be written.
+     */
+    bool DisplayXFBReplayRing::dump(const char* path, unsigned seconds, uint64_t nowUS)
+    {
+        if (!m_control || !path) return false;
+
+        const Control* control = m_control;
+        unsigned maxRecords = control->m_maxRecords;
+        uint64_t cutoff = ((uint64_t)seconds * 1000000u < nowUS) ? nowUS - ((uint64_t)seconds * 1000000u) : 0;
+
+        Record* records = (Record*)malloc(maxRecords * sizeof records[0]);
+        uint8_t* payload = (uint8_t*)malloc((size_t)control->m_capacity);
+        unsigned count = 0;
+        unsigned first = 0;
+        bool ok = false;
+        for (unsigned attempt = 0; attempt < kDumpAttempts && records && payload && !ok; attempt++)
+        {
+            uint64_t head = control->m_recordHead;
+            __sync_synchronize();
+            uint64_t tail = control->m_recordTail;
+            if (head == tail) break;
+
+            count = (unsigned)(head - tail);
+            for (unsigned i = 0; i < count; i++) records[i] = m_index[(tail + i) % maxRecords];
+
+            // Start from the newest keyframe that is no later than the cutoff, or else the oldest keyframe.
+            unsigned want = 0;
+            while (want < count && records[want].m_timeUS < cutoff) want ++;
+            if (want == count) want = count - 1;
+            first = want;
+            while (first > 0 && !(records[first].m_flags & kFlagKeyframe)) first --;
+            if (!(records[first].m_flags & kFlagKeyframe))
+            {
+                first = want;
+                while (first < count && !(records[first].m_flags & kFlagKeyframe)) first ++;
+                if (first == count) break;
+            }
+
+            uint64_t base = records[first].m_offset;
+            uint64_t end = records[count - 1].m_offset + records[count - 1].m_size;
+            copyOut(base, payload, (size_t)(end - base));
+            for (unsigned i = first; i < count; i++) records[i].m_offset -= base;
+
+            // Anything evicted while copying may have been overwritten: retry if that reached the start record.
+            __sync_synchronize();
+            ok = (control->m_recordTail <= tail + first);
+        }
+
+        if (ok)
+        {
+            FILE* file = fopen(path, "wb");
+            ok = (0 != file);
+            if (ok)
+            {
+                FileHeader header;
+                memset(&header, 0, sizeof header);
+                header.m_magic = kFileMagic;
+                header.m_version = kFileVersion;
+                header.m_recordCount = count - first;
+                header.m_startUS = records[first].m_timeUS;
+                header.m_endUS = records[count - 1].m_timeUS;
+                ok = (1 == fwrite(&header, sizeof header, 1, file));
+                for (unsigned i = first; ok && i < count; i++)
+                {
+                    ok = (1 == fwrite(&records[i], sizeof records[i], 1, file)) &&
+                         (1 == fwrite(payload + records[i].m_offset, records[i].m_size, 1, file));
+                }
+                ok = (0 == fclose(file)) && ok;
+            }
+        }
+
+        free(records);
+        free(payload);
+        if (ok) __sync_fetch_and_add(&m_statistics.m_dumps, 1);
+        return ok;
+    }
+
+
+    /** Copy data in to the byte ring at a logical position, wrapping at the end.
+     */
+    void DisplayXFBReplayRing::copyIn(uint64_t offset, const void* data, size_t size)
+    {
+        size_t capacity = (size_t)m_control->m_capacity;
+        size_t position = (size_t)(offset % capacity);
+        size_t part = (size < capacity - position) ? size : capacity - position;
+        memcpy(m_ring + position, data, part);
+        if (part < size) memcpy(m_ring, (const uint8_t*)data + part, size - part);
+    }
+
+
+    /** Copy data out of the byte ring from a logical position, wrapping at the end.
+     */
+    void DisplayXFBReplayRing::copyOut(uint64_t offset, void* data, size_t size) const
+    {
+        size_t capacity = (size_t)m_control->m_capacity;
+        size_t position = (size_t)(offset % capacity);
+        size_t part = (size < capacity - position) ? size : capacity - position;
+        memcpy(data, m_ring + position, part);
+        if (part < size) memcpy((uint8_t*)data + part, m_ring, size - part);
+    }
+
+}   // namespace
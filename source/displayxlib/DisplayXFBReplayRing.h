@@ -0,0 +1,157 @@
+/** @file   DisplayXFBReplayRing.h
+ *  @brief  Bounded ring of compressed frames, for "last N seconds" instant replay.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBReplayRing_H
+#define COM_TSONIQ_DisplayXFBReplayRing_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DisplayXFBTileCodec.h"
+
+namespace ts
+{
+    /** Class used to keep a continuously updated recording of one display, so that the last few seconds can be
+     *  written out after an incident.
+     *
+     *  Frames are compressed with DisplayXFBTileCodec: a keyframe holds the whole image, and a delta holds only the
+     *  tile aligned changed area. The recording lives in a single preallocated region - either anonymous memory or a
+     *  file mapped in to memory. The region holds a control block, a fixed size record index and a byte ring for the
+     *  encoded data. When either the index or the byte ring is full, the oldest records are evicted.
+     *
+     *  open() always starts a new recording, truncating any existing file. A file backed recording survives a crash
+     *  of the recording process: recover() maps the file again without truncating it, checks the control block and
+     *  the index, and discards any records that are not intact, after which the recording can be dumped or
+     *  continued. The recorder publishes a record only after its data is written, so at most the frame being
+     *  recorded at the time of the crash is lost. recover() must not be used while another process is still
+     *  recording to the file.
+     *
+     *  record() must be called from one thread only. dump() may be called concurrently from any thread without
+     *  blocking the recorder: the writer advances the eviction point before it overwrites anything, and the reader
+     *  copies what it needs and then discards any record that was evicted while it was copying.
+     *
+     *  A replay file is a FileHeader followed by Record/payload pairs in time order, starting at a keyframe.
+     */
+    class DisplayXFBReplayRing
+    {
+    public:
+
+        static const uint32_t kFileMagic = 0x50525844;                  //!< Replay file magic ('DXRP')
+        static const uint32_t kFileVersion = 1;                         //!< Replay file version
+        static const uint32_t kFlagKeyframe = 0x00000001;               //!< Record holds the whole frame
+
+        /** Configuration.
+         */
+        struct Config
+        {
+            size_t m_budget;                            //!< Total memory (or file size) to use (bytes)
+            const char* m_path;                         //!< File to map, or zero to use anonymous memory
+            unsigned m_maxRecords;                      //!< Index size (the most records held)
+            unsigned m_keyframeIntervalUS;              //!< Longest time between keyframes (microseconds)
+            unsigned m_quality;                         //!< Encoder quality (1 to 100)
+
+            Config() : m_budget(64 * 1024 * 1024), m_path(0), m_maxRecords(16384), m_keyframeIntervalUS(2000000), m_quality(60) { }
+        };
+
+        /** The description of one record, as held in the index and written to replay files.
+         */
+        struct Record
+        {
+            uint64_t m_timeUS;                          //!< Capture time (microseconds)
+            uint64_t m_offset;                          //!< Logical byte position of the payload in the ring
+            uint32_t m_size;                            //!< Encoded payload size (bytes)
+            uint32_t m_flags;                           //!< kFlagXXX values
+            uint32_t m_frameWidth;                      //!< Frame width (pixels)
+            uint32_t m_frameHeight;                     //!< Frame height (pixels)
+            uint32_t m_x;                               //!< Encoded area left edge (pixels)
+            uint32_t m_y;                               //!< Encoded area top edge (pixels)
+            uint32_t m_width;                           //!< Encoded area width (pixels)
+            uint32_t m_height;                          //!< Encoded area height (pixels)
+        };
+
+        /** The start of a replay file.
+         */
+        struct FileHeader
+        {
+            uint32_t m_magic;                           //!< kFileMagic
+            uint32_t m_version;                         //!< kFileVersion
+            uint32_t m_recordCount;                     //!< The number of records that follow
+            uint32_t m_reserved;                        //!< Zero
+            uint64_t m_startUS;                         //!< Time of the first record
+            uint64_t m_endUS;                           //!< Time of the last record
+        };
+
+        /** Counters, accumulated since open() or recover().
+         */
+        struct Statistics
+        {
+            uint64_t m_records;                         //!< Records written
+            uint64_t m_keyframes;                       //!< Keyframes written
+            uint64_t m_bytes;                           //!< Encoded bytes written
+            uint64_t m_inputBytes;                      //!< Pixel bytes encoded
+            uint64_t m_evictions;                       //!< Records evicted to make space
+            uint64_t m_dropped;                         //!< Frames not recorded (too large for the ring)
+            uint64_t m_encodeMicroseconds;              //!< Wall clock time spent in record()
+            uint64_t m_dumps;                           //!< Replay files written
+        };
+
+        DisplayXFBReplayRing();
+        ~DisplayXFBReplayRing();
+
+        bool open(const Config& config);
+        bool recover(const Config& config);
+        void close();
+        bool isOpen() const { return 0 != m_control; }                      //!< Return true if open() succeeded
+
+        bool record(const void* pixels, unsigned width, unsigned height, size_t bytesPerRow,
+                    unsigned dirtyX, unsigned dirtyY, unsigned dirtyWidth, unsigned dirtyHeight, uint64_t timeUS);
+        void requestKeyframe() { m_forceKeyframe = true; }                  //!< Make the next record a keyframe
+        bool dump(const char* path, unsigned seconds, uint64_t nowUS);
+
+        size_t capacity() const;
+        const Statistics& statistics() const { return m_statistics; }      //!< Return the counters
+
+    private:
+
+        /** The control block at the start of the region.
+         */
+        struct Control
+        {
+            uint32_t m_magic;                           //!< kFileMagic, marking an initialised region
+            uint32_t m_maxRecords;                      //!< Index entries
+            uint64_t m_capacity;                        //!< Byte ring size
+            volatile uint64_t m_recordHead;             //!< Number of the next record to write
+            volatile uint64_t m_recordTail;             //!< Number of the oldest valid record
+            volatile uint64_t m_byteHead;               //!< Logical byte position of the next write
+        };
+
+        Config m_config;                                //!< The configuration
+        void* m_region;                                 //!< The mapped region
+        size_t m_regionSize;                            //!< The region size (bytes)
+        bool m_mapped;                                  //!< Logical true if the region is a file mapping
+        Control* m_control;                             //!< The control block (in the region)
+        Record* m_index;                                //!< The record index (in the region)
+        uint8_t* m_ring;                                //!< The byte ring (in the region)
+        DisplayXFBTileCodec m_codec;                    //!< The encoder
+        uint8_t* m_scratch;                             //!< Encoder output buffer
+        size_t m_scratchSize;                           //!< Size of m_scratch (bytes)
+        unsigned m_lastWidth;                           //!< Frame width at the last record
+        unsigned m_lastHeight;                          //!< Frame height at the last record
+        uint64_t m_lastKeyframeUS;                      //!< Time of the last keyframe
+        bool m_forceKeyframe;                           //!< Logical true to make the next record a keyframe
+        Statistics m_statistics;                        //!< The counters
+
+        bool validate(size_t regionSize);
+        void attach(const Config& config, void* region, size_t regionSize);
+        void copyIn(uint64_t offset, const void* data, size_t size);
+        void copyOut(uint64_t offset, void* data, size_t size) const;
+
+        DisplayXFBReplayRing(const DisplayXFBReplayRing&);                  // Prevent copy constructor
+        DisplayXFBReplayRing& operator=(const DisplayXFBReplayRing&);       // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBReplayRing_H
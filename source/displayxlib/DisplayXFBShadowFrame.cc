@@ -0,0 +1,212 @@
+/** @file   DisplayXFBShadowFrame.cc
+ *  @brief  Shadow copy of a frame, updated with a single fused copy, compare and hash pass.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBShadowFrame.h"
+#include "DisplayXFBPageAllocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    DisplayXFBShadowFrame::DisplayXFBShadowFrame()
+        :
+        m_statistics(),
+        m_width(0),
+        m_height(0),
+        m_tileSize(0),
+        m_tilesX(0),
+        m_tilesY(0),
+        m_shadow(0),
+        m_hashes(0),
+        m_changed(0),
+        m_contents(0),
+        m_primed(false)
+    {
+    }
+
+
+    DisplayXFBShadowFrame::~DisplayXFBShadowFrame()
+    {
+        release();
+    }
+
+
+    /** Set the frame size and allocate the shadow.
+     *
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  tileSize        The tile width and height (pixels). 16, 32 and 64 use specialised kernels.
+     *  @param  describeContent Logical true to produce a DisplayXFBTileContent for each tile read.
+     *  @return                 Logical true for success, false if the parameters are invalid or no memory is available.
+     */
+    bool DisplayXFBShadowFrame::configure(unsigned width, unsigned height, unsigned tileSize, bool describeContent)
+    {
+        release();
+
+        if (0 == width || 0 == height || 0 == tileSize) return false;
+
+        m_width = width;
+        m_height = height;
+        m_tileSize = tileSize;
+        m_tilesX = (width + tileSize - 1) / tileSize;
+        m_tilesY = (height + tileSize - 1) / tileSize;
+
+        size_t tileCount = (size_t)m_tilesX * m_tilesY;
+        m_shadow = (uint32_t*)DisplayXFBPageAllocator::allocate((size_t)width * height * sizeof m_shadow[0]);
+        m_hashes = (uint64_t*)calloc(tileCount, sizeof m_hashes[0]);
+        m_changed = (uint8_t*)calloc(tileCount, sizeof m_changed[0]);
+        if (describeContent) m_contents = (DisplayXFBTileContent*)calloc(tileCount, sizeof m_contents[0]);
+        if (!m_shadow || !m_hashes || !m_changed || (describeContent && !m_contents))
+        {
+            release();
+            return false;
+        }
+
+        reset();
+        return true;
+    }
+
+
+    /** Discard the shadow contents and counters. The next update reports every tile it covers as changed.
+     */
+    void DisplayXFBShadowFrame::reset()
+    {
+        m_statistics = Statistics();
+        m_primed = false;
+        if (m_changed) memset(m_changed, 0, (size_t)m_tilesX * m_tilesY);
+    }
+
+
+    /** Update the whole frame.
+     *
+     *  @param  pixels          The frame (32 bit BGRA).
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @return                 The number of changed tiles (see isTileChanged() and changedBounds()).
+     */
+    unsigned DisplayXFBShadowFrame::update(const void* pixels, size_t bytesPerRow)
+    {
+        return update(pixels, bytesPerRow, 0, 0, m_width, m_height);
+    }
+
+
+    /** Update an area of the frame, typically the driver's dirty rectangle. Tiles outside the area are assumed not
+     *  to have changed and keep their hashes.
+     *
+     *  @param  pixels          The frame (32 bit BGRA).
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @param  x               The area to read (expanded to whole tiles).
+     *  @param  y               ...
+     *  @param  width           ...
+     *  @param  height          ...
+     *  @return                 The number of changed tiles (see isTileChanged() and changedBounds()).
+     */
+    unsigned DisplayXFBShadowFrame::update(const void* pixels, size_t bytesPerRow, unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        if (!m_shadow || !pixels) return 0;
+
+        m_statistics.m_updates ++;
+        memset(m_changed, 0, (size_t)m_tilesX * m_tilesY);
+
+        // Until the shadow holds a frame, every tile in the area counts as changed, whatever the old contents were.
+        if (!m_primed)
+        {
+            x = 0;
+            y = 0;
+            width = m_width;
+            height = m_height;
+        }
+        if (x >= m_width || y >= m_height || 0 == width || 0 == height) return 0;
+        unsigned tx0 = x / m_tileSize;
+        unsigned ty0 = y / m_tileSize;
+        unsigned tx1 = (width > m_width - x) ? m_tilesX : (x + width + m_tileSize - 1) / m_tileSize;
+        unsigned ty1 = (height > m_height - y) ? m_tilesY : (y + height + m_tileSize - 1) / m_tileSize;
+
+        const uint8_t* base = (const uint8_t*)pixels;
+        bool aligned = 0 == (((uintptr_t)base | bytesPerRow | (m_tileSize * 4)) & 15);
+        DisplayXFBPixelKernelTable kernels =
+            DisplayXFBPixelKernels::select(DisplayXFBPixelKernels::kFormatBGRA32, m_tileSize, aligned, DisplayXFBPixelKernels::cpuIsa());
+
+        size_t shadowStride = (size_t)m_width * 4;
+        unsigned changed = 0;
+        for (unsigned ty = ty0; ty < ty1; ty++)
+        {
+            unsigned py = ty * m_tileSize;
+            unsigned rows = (py + m_tileSize > m_height) ? m_height - py : m_tileSize;
+            for (unsigned tx = tx0; tx < tx1; tx++)
+            {
+                unsigned px = tx * m_tileSize;
+                unsigned columns = (px + m_tileSize > m_width) ? m_width - px : m_tileSize;
+                unsigned tile = (ty * m_tilesX) + tx;
+                bool differs = kernels.m_copyDiffHash((uint8_t*)m_shadow + ((size_t)py * shadowStride) + ((size_t)px * 4), shadowStride,
+                                                      base + ((size_t)py * bytesPerRow) + ((size_t)px * 4), bytesPerRow,
+                                                      columns, rows, &m_hashes[tile], (m_contents) ? &m_contents[tile] : 0);
+                if (differs || !m_primed)
+                {
+                    m_changed[tile] = 1;
+                    changed ++;
+                }
+                m_statistics.m_bytesRead += (uint64_t)columns * rows * 4;
+            }
+        }
+
+        m_statistics.m_tilesScanned += (uint64_t)(tx1 - tx0) * (ty1 - ty0);
+        m_statistics.m_tilesChanged += changed;
+        m_primed = true;
+        return changed;
+    }
+
+
+    /** Return the bounding box of the tiles that changed in the last update.
+     *
+     *  @return             Logical true if any tile changed, false otherwise.
+     */
+    bool DisplayXFBShadowFrame::changedBounds(unsigned& x, unsigned& y, unsigned& width, unsigned& height) const
+    {
+        unsigned minX = m_tilesX, maxX = 0, minY = m_tilesY, maxY = 0;
+        for (unsigned ty = 0; ty < m_tilesY; ty++)
+        {
+            for (unsigned tx = 0; tx < m_tilesX; tx++)
+            {
+                if (!m_changed[(ty * m_tilesX) + tx]) continue;
+                if (tx < minX) minX = tx;
+                if (tx > maxX) maxX = tx;
+                if (ty < minY) minY = ty;
+                if (ty > maxY) maxY = ty;
+            }
+        }
+        if (minX > maxX) return false;
+
+        x = minX * m_tileSize;
+        y = minY * m_tileSize;
+        unsigned x1 = (maxX + 1) * m_tileSize;
+        unsigned y1 = (maxY + 1) * m_tileSize;
+        width = ((x1 > m_width) ? m_width : x1) - x;
+        height = ((y1 > m_height) ? m_height : y1) - y;
+        return true;
+    }
+
+
+    /** Free the buffers.
+     */
+    void DisplayXFBShadowFrame::release()
+    {
+        if (m_shadow) DisplayXFBPageAllocator::release(m_shadow, (size_t)m_width * m_height * sizeof m_shadow[0]);
+        free(m_hashes);
+        free(m_changed);
+        free(m_contents);
+        m_shadow = 0;
+        m_hashes = 0;
+        m_changed = 0;
+        m_contents = 0;
+        m_width = 0;
+        m_height = 0;
+        m_tilesX = 0;
+        m_tilesY = 0;
+        m_primed = false;
+    }
+
+}   // namespace
@@ -0,0 +1,92 @@
+/** @file   DisplayXFBShadowFrame.h
+ *  @brief  Shadow copy of a frame, updated with a single fused copy, compare and hash pass.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBShadowFrame_H
+#define COM_TSONIQ_DisplayXFBShadowFrame_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DisplayXFBPixelKernels.h"
+
+namespace ts
+{
+    /** Class used to keep a private copy of a frame, the set of tiles that changed at the last update and a 64 bit
+     *  hash of every tile.
+     *
+     *  Capturing a frame usually means copying it out of the mapped framebuffer, comparing it with the previous
+     *  frame and hashing the tiles that changed (for example for a tile cache): three reads of the framebuffer. An
+     *  update here does all three in one pass with the copyDiffHash kernel from DisplayXFBPixelKernels, so each
+     *  source byte is read once and written to the shadow only if it changed. The kernel is specialised for the tile
+     *  width (16, 32 or 64) and uses aligned loads when the source allows.
+     *
+     *  Optionally, the same pass also describes the content of each tile it reads (see DisplayXFBTileContent), so
+     *  that an encoder can skip solid tiles or choose between palette and DCT coding without another read. The
+     *  descriptions are held in a compact array indexed like the hashes.
+     *
+     *  Tiles are square. Hashes cover whole tiles (clipped to the frame), so an update area is expanded to tile
+     *  boundaries. The class is not thread safe.
+     */
+    class DisplayXFBShadowFrame
+    {
+    public:
+
+        /** Counters, accumulated since the last configure() or reset().
+         */
+        struct Statistics
+        {
+            uint64_t m_updates;                         //!< Number of update() calls
+            uint64_t m_tilesScanned;                    //!< Tiles read and hashed
+            uint64_t m_tilesChanged;                    //!< Tiles that differed from the shadow
+            uint64_t m_bytesRead;                       //!< Source bytes read
+
+            Statistics() : m_updates(0), m_tilesScanned(0), m_tilesChanged(0), m_bytesRead(0) { }
+        };
+
+        DisplayXFBShadowFrame();
+        ~DisplayXFBShadowFrame();
+
+        bool configure(unsigned width, unsigned height, unsigned tileSize=32, bool describeContent=false);
+        void reset();
+        unsigned update(const void* pixels, size_t bytesPerRow);
+        unsigned update(const void* pixels, size_t bytesPerRow, unsigned x, unsigned y, unsigned width, unsigned height);
+
+        unsigned width() const { return m_width; }                              //!< Return the frame width (pixels)
+        unsigned height() const { return m_height; }                            //!< Return the frame height (pixels)
+        unsigned tileSize() const { return m_tileSize; }                        //!< Return the tile width and height (pixels)
+        unsigned tilesX() const { return m_tilesX; }                            //!< Return the number of tile columns
+        unsigned tilesY() const { return m_tilesY; }                            //!< Return the number of tile rows
+        const uint32_t* pixels() const { return m_shadow; }                     //!< Return the shadow copy (packed rows)
+        size_t bytesPerRow() const { return (size_t)m_width * 4; }              //!< Return the shadow stride (bytes)
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+        bool isTileChanged(unsigned tx, unsigned ty) const { return 0 != m_changed[(ty * m_tilesX) + tx]; }    //!< Test a tile in the last update
+        uint64_t tileHash(unsigned tx, unsigned ty) const { return m_hashes[(ty * m_tilesX) + tx]; }          //!< Return a tile's hash
+        const DisplayXFBTileContent* tileContents() const { return m_contents; }    //!< Return the content array, or zero if not enabled
+        const DisplayXFBTileContent& tileContent(unsigned tx, unsigned ty) const { return m_contents[(ty * m_tilesX) + tx]; }  //!< Return a tile's content (if enabled)
+        bool changedBounds(unsigned& x, unsigned& y, unsigned& width, unsigned& height) const;
+
+    private:
+
+        Statistics m_statistics;                        //!< The counters
+        unsigned m_width;                               //!< Frame width (pixels)
+        unsigned m_height;                              //!< Frame height (pixels)
+        unsigned m_tileSize;                            //!< Tile width and height (pixels)
+        unsigned m_tilesX;                              //!< Number of tile columns
+        unsigned m_tilesY;                              //!< Number of tile rows
+        uint32_t* m_shadow;                             //!< Copy of the frame, m_width * m_height pixels
+        uint64_t* m_hashes;                             //!< Per-tile hashes
+        uint8_t* m_changed;                             //!< Per-tile flags for the last update
+        DisplayXFBTileContent* m_contents;              //!< Per-tile content descriptions, or zero if not enabled
+        bool m_primed;                                  //!< Logical true once m_shadow holds a frame
+
+        void release();
+
+        DisplayXFBShadowFrame(const DisplayXFBShadowFrame&);            // Prevent copy constructor
+        DisplayXFBShadowFrame& operator=(const DisplayXFBShadowFrame&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBShadowFrame_H
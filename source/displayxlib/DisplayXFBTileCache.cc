@@ -0,0 +1,226 @@
+/** @file   DisplayXFBTileCache.cc
+ *  @brief  Bounded LRU cache of tiles keyed by content hash, mirrored by stream sender and receiver.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBTileCache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    DisplayXFBTileCache::DisplayXFBTileCache()
+        :
+        m_statistics(),
+        m_slots(0),
+        m_table(0),
+        m_pixels(0),
+        m_tileBytes(0),
+        m_capacity(0),
+        m_tableSize(0),
+        m_count(0),
+        m_newest(kNoSlot),
+        m_oldest(kNoSlot)
+    {
+    }
+
+
+    DisplayXFBTileCache::~DisplayXFBTileCache()
+    {
+        release();
+    }
+
+
+    /** Allocate the cache.
+     *
+     *  @param  capacity        The number of tiles to hold. Sender and receiver must use the same value.
+     *  @param  tileBytes       Pixel storage per tile (bytes), or zero if only hashes are needed (the sender).
+     *  @return                 Logical true for success, false if the parameters are invalid or no memory is available.
+     */
+    bool DisplayXFBTileCache::configure(unsigned capacity, size_t tileBytes)
+    {
+        release();
+        if (0 == capacity || capacity >= kNoSlot / 4) return false;
+
+        // Keep the table at most half full, so that probe sequences stay short.
+        unsigned tableSize = 4;
+        while (tableSize < capacity * 2) tableSize <<= 1;
+
+        m_slots = (Slot*)calloc(capacity, sizeof m_slots[0]);
+        m_table = (unsigned*)malloc(tableSize * sizeof m_table[0]);
+        if (tileBytes) m_pixels = (uint8_t*)calloc(capacity, tileBytes);
+        if (!m_slots || !m_table || (tileBytes && !m_pixels))
+        {
+            release();
+            return false;
+        }
+        m_capacity = capacity;
+        m_tableSize = tableSize;
+        m_tileBytes = tileBytes;
+        reset();
+        return true;
+    }
+
+
+    /** Empty the cache and clear the counters. Both ends of a stream must reset together.
+     */
+    void DisplayXFBTileCache::reset()
+    {
+        m_statistics = Statistics();
+        m_count = 0;
+        m_newest = kNoSlot;
+        m_oldest = kNoSlot;
+        if (m_table) memset(m_table, 0xff, m_tableSize * sizeof m_table[0]);
+    }
+
+
+    /** Look up a tile.
+     *
+     *  @param  hash            The tile hash.
+     *  @return                 The slot holding the tile, or kNoSlot. The LRU order is not changed: call touch()
+     *                          to record a use.
+     */
+    unsigned DisplayXFBTileCache::find(uint64_t hash)
+    {
+        unsigned index = locate(hash);
+        unsigned slot = (index < m_tableSize) ? m_table[index] : kNoSlot;
+        if (kNoSlot == slot) m_statistics.m_misses ++;
+        else m_statistics.m_hits ++;
+        return slot;
+    }
+
+
+    /** Mark a slot as the most recently used.
+     */
+    void DisplayXFBTileCache::touch(unsigned slot)
+    {
+        if (slot >= m_count || slot == m_newest) return;
+        unlink(slot);
+        linkNewest(slot);
+    }
+
+
+    /** Add a tile, replacing the least recently used one if the cache is full.
+     *
+     *  @param  hash            The tile hash. The caller should have checked that it is not already present.
+     *  @return                 The slot used (its pixel storage is for the caller to fill), or kNoSlot if not configured.
+     */
+    unsigned DisplayXFBTileCache::insert(uint64_t hash)
+    {
+        if (!m_slots) return kNoSlot;
+
+        unsigned slot;
+        if (m_count < m_capacity)
+        {
+            slot = m_count++;
+        }
+        else
+        {
+            slot = m_oldest;
+            unlink(slot);
+            removeFromTable(locate(m_slots[slot].m_hash));
+            m_statistics.m_evictions ++;
+        }
+
+        m_slots[slot].m_hash = hash;
+        linkNewest(slot);
+
+        unsigned mask = m_tableSize - 1;
+        unsigned index = home(hash);
+        while (kNoSlot != m_table[index]) index = (index + 1) & mask;
+        m_table[index] = slot;
+        m_statistics.m_inserts ++;
+        return slot;
+    }
+
+
+    /** Find the table entry for a hash.
+     *
+     *  @return                 The entry index, or m_tableSize if the hash is not present.
+     */
+    unsigned DisplayXFBTileCache::locate(uint64_t hash) const
+    {
+        if (!m_table) return m_tableSize;
+
+        unsigned mask = m_tableSize - 1;
+        unsigned index = home(hash);
+        while (kNoSlot != m_table[index])
+        {
+            if (m_slots[m_table[index]].m_hash == hash) return index;
+            index = (index + 1) & mask;
+        }
+        return m_tableSize;
+    }
+
+
+    /** Remove a table entry, moving any following entries that are displaced from their home in to the hole.
+     */
+    void DisplayXFBTileCache::removeFromTable(unsigned index)
+    {
+        if (index >= m_tableSize) return;
+
+        unsigned mask = m_tableSize - 1;
+        unsigned hole = index;
+        unsigned next = (hole + 1) & mask;
+        while (kNoSlot != m_table[next])
+        {
+            unsigned want = home(m_slots[m_table[next]].m_hash);
+            if (((next - want) & mask) >= ((next - hole) & mask))
+            {
+                m_table[hole] = m_table[next];
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        m_table[hole] = kNoSlot;
+    }
+
+
+    /** Remove a slot from the LRU list.
+     */
+    void DisplayXFBTileCache::unlink(unsigned slot)
+    {
+        Slot& s = m_slots[slot];
+        if (kNoSlot != s.m_older) m_slots[s.m_older].m_newer = s.m_newer;
+        else m_oldest = s.m_newer;
+        if (kNoSlot != s.m_newer) m_slots[s.m_newer].m_older = s.m_older;
+        else m_newest = s.m_older;
+        s.m_older = kNoSlot;
+        s.m_newer = kNoSlot;
+    }
+
+
+    /** Add a slot at the most recently used end of the LRU list.
+     */
+    void DisplayXFBTileCache::linkNewest(unsigned slot)
+    {
+        Slot& s = m_slots[slot];
+        s.m_older = m_newest;
+        s.m_newer = kNoSlot;
+        if (kNoSlot != m_newest) m_slots[m_newest].m_newer = slot;
+        else m_oldest = slot;
+        m_newest = slot;
+    }
+
+
+    /** Free the buffers.
+     */
+    void DisplayXFBTileCache::release()
+    {
+        free(m_slots);
+        free(m_table);
+        free(m_pixels);
+        m_slots = 0;
+        m_table = 0;
+        m_pixels = 0;
+        m_tileBytes = 0;
+        m_capacity = 0;
+        m_tableSize = 0;
+        m_count = 0;
+        m_newest = kNoSlot;
+        m_oldest = kNoSlot;
+    }
+
+}   // namespace
@@ -0,0 +1,96 @@
+/** @file   DisplayXFBTileCache.h
+ *  @brief  Bounded LRU cache of tiles keyed by content hash, mirrored by stream sender and receiver.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBTileCache_H
+#define COM_TSONIQ_DisplayXFBTileCache_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ts
+{
+    /** Class used to remember recently sent tiles, so that a repeated tile can be sent as a slot number.
+     *
+     *  The cache holds a fixed number of slots, each with a tile hash and (on the receiving side) the tile's pixels.
+     *  Slots are kept in least recently used order; insert() reuses the least recently used slot once the cache is
+     *  full. Slot choice depends only on the sequence of insert() and touch() calls, so a sender and a receiver that
+     *  make the same calls in the same order hold the same tiles in the same slots, without the slot numbers ever
+     *  being negotiated.
+     *
+     *  Lookup is an open-addressed hash (linear probing, backward-shift deletion) from tile hash to slot, and the
+     *  LRU order is a doubly linked list through the slots, so every operation is constant time. The class is not
+     *  thread safe.
+     */
+    class DisplayXFBTileCache
+    {
+    public:
+
+        static const unsigned kNoSlot = 0xffffffffu;    //!< find() result for a tile not in the cache
+
+        /** Counters, accumulated since the last configure() or reset().
+         */
+        struct Statistics
+        {
+            uint64_t m_hits;                            //!< find() calls that found the tile
+            uint64_t m_misses;                          //!< find() calls that did not
+            uint64_t m_inserts;                         //!< insert() calls
+            uint64_t m_evictions;                       //!< insert() calls that replaced a tile
+
+            Statistics() : m_hits(0), m_misses(0), m_inserts(0), m_evictions(0) { }
+        };
+
+        DisplayXFBTileCache();
+        ~DisplayXFBTileCache();
+
+        bool configure(unsigned capacity, size_t tileBytes);
+        void reset();
+
+        unsigned find(uint64_t hash);
+        void touch(unsigned slot);
+        unsigned insert(uint64_t hash);
+
+        unsigned capacity() const { return m_capacity; }                        //!< Return the number of slots
+        unsigned count() const { return m_count; }                              //!< Return the number of slots in use
+        void* pixels(unsigned slot) const { return (m_pixels) ? m_pixels + (slot * m_tileBytes) : 0; }  //!< Return a slot's pixel storage
+        size_t tileBytes() const { return m_tileBytes; }                        //!< Return the pixel storage per slot (bytes)
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+
+    private:
+
+        /** One cache entry.
+         */
+        struct Slot
+        {
+            uint64_t m_hash;                            //!< The tile hash
+            unsigned m_older;                           //!< The next less recently used slot, or kNoSlot
+            unsigned m_newer;                           //!< The next more recently used slot, or kNoSlot
+        };
+
+        Statistics m_statistics;                        //!< The counters
+        Slot* m_slots;                                  //!< The slots (m_capacity entries)
+        unsigned* m_table;                              //!< Hash table of slot numbers (kNoSlot if empty)
+        uint8_t* m_pixels;                              //!< Pixel storage (m_capacity * m_tileBytes), or zero
+        size_t m_tileBytes;                             //!< Pixel storage per slot (bytes)
+        unsigned m_capacity;                            //!< The number of slots
+        unsigned m_tableSize;                           //!< The number of hash table entries (a power of two)
+        unsigned m_count;                               //!< The number of slots in use
+        unsigned m_newest;                              //!< The most recently used slot, or kNoSlot
+        unsigned m_oldest;                              //!< The least recently used slot, or kNoSlot
+
+        unsigned home(uint64_t hash) const { return (unsigned)(hash >> 32) & (m_tableSize - 1); }  //!< Return a hash's preferred table entry
+        unsigned locate(uint64_t hash) const;
+        void unlink(unsigned slot);
+        void linkNewest(unsigned slot);
+        void removeFromTable(unsigned index);
+        void release();
+
+        DisplayXFBTileCache(const DisplayXFBTileCache&);                // Prevent copy constructor
+        DisplayXFBTileCache& operator=(const DisplayXFBTileCache&);     // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBTileCache_H
@@ -0,0 +1,894 @@
+/** @file   DisplayXFBTileCodec.cc
+ *  @brief  Tile based frame codec with a per-tile choice of lossless or lossy coding.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBTileCodec.h"
+#include "DisplayXFBWorkerGroup.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace ts
+{
+    static const uint8_t kMagic[4] = { 'x', 'T', 'C', '1' };   //!< Stream identifier
+    static const size_t kHeaderSize = 16;                       //!< Stream header size (bytes)
+    static const unsigned kTilePixels = DisplayXFBTileCodec::kTileSize * DisplayXFBTileCodec::kTileSize;
+    static const size_t kMaxTileBytes = 1 + (kTilePixels * 3); //!< Worst case coded tile (raw)
+    static const unsigned kSmoothThreshold = 32;                //!< Largest channel difference counted as a gradient
+    static const unsigned kSharpThreshold = 96;                 //!< Smallest channel difference counted as an edge
+
+    /** Tile codings (the first byte of each coded tile).
+     */
+    enum Coding
+    {
+        kCodingFlat = 0,                                        //!< One BGR colour
+        kCodingPalette = 1,                                     //!< Colour count - 1, BGR palette, packed indices
+        kCodingRaw = 2,                                         //!< BGR per pixel
+        kCodingDCT = 3                                          //!< Y, Cb and Cr 8x8 blocks, each a count and varints
+    };
+
+    /** Zig-zag scan order for an 8x8 block.
+     */
+    static const uint8_t kZigZag[64] =
+    {
+         0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+    };
+
+    /** The JPEG (Annex K) luminance and chrominance quantisation tables, for quality 50.
+     */
+    static const uint8_t kBaseQuant[2][64] =
+    {
+        {
+            16, 11, 10, 16,  24,  40,  51,  61,     12, 12, 14, 19,  26,  58,  60,  55,
+            14, 13, 16, 24,  40,  57,  69,  56,     14, 17, 22, 29,  51,  87,  80,  62,
+            18, 22, 37, 56,  68, 109, 103,  77,     24, 35, 55, 64,  81, 104, 113,  92,
+            49, 64, 78, 87, 103, 121, 120, 101,     72, 92, 95, 98, 112, 100, 103,  99
+        },
+        {
+            17, 18, 24, 47, 99, 99, 99, 99,         18, 21, 26, 66, 99, 99, 99, 99,
+            24, 26, 56, 99, 99, 99, 99, 99,         47, 66, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,         99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,         99, 99, 99, 99, 99, 99, 99, 99
+        }
+    };
+
+    static float g_forward[64];                                 //!< Orthonormal DCT-II basis, C[u][x]
+    static float g_inverse[64];                                 //!< Its transpose
+    static pthread_once_t g_basisOnce = PTHREAD_ONCE_INIT;      //!< Guards the basis initialisation
+
+
+    /** Fill in the DCT basis.
+     */
+    static void initialiseBasis()
+    {
+        for (unsigned u = 0; u < 8; u++)
+        {
+            double scale = (0 == u) ? sqrt(1.0 / 8.0) : sqrt(2.0 / 8.0);
+            for (unsigned x = 0; x < 8; x++)
+            {
+                float value = (float)(scale * cos((2 * x + 1) * u * M_PI / 16.0));
+                g_forward[(u * 8) + x] = value;
+                g_inverse[(x * 8) + u] = value;
+            }
+        }
+    }
+
+
+    /** One pass of the separable transform: out = transpose(matrix * in). Applying it twice with the forward
+     *  basis gives C X C', and with the inverse basis gives C' Y C.
+     */
+    static void transformPass(const float* in, float* out, const float* matrix)
+    {
+#if defined(__SSE2__)
+        __m128 lo[8], hi[8];
+        for (unsigned x = 0; x < 8; x++)
+        {
+            lo[x] = _mm_loadu_ps(in + (x * 8));
+            hi[x] = _mm_loadu_ps(in + (x * 8) + 4);
+        }
+
+        __m128 tlo[8], thi[8];
+        for (unsigned u = 0; u < 8; u++)
+        {
+            __m128 accLo = _mm_setzero_ps();
+            __m128 accHi = _mm_setzero_ps();
+            for (unsigned x = 0; x < 8; x++)
+            {
+                __m128 m = _mm_set1_ps(matrix[(u * 8) + x]);
+                accLo = _mm_add_ps(accLo, _mm_mul_ps(m, lo[x]));
+                accHi = _mm_add_ps(accHi, _mm_mul_ps(m, hi[x]));
+            }
+            tlo[u] = accLo;
+            thi[u] = accHi;
+        }
+
+        // Transpose as four 4x4 quadrants: the top right and bottom left quadrants swap places.
+        _MM_TRANSPOSE4_PS(tlo[0], tlo[1], tlo[2], tlo[3]);
+        _MM_TRANSPOSE4_PS(thi[0], thi[1], thi[2], thi[3]);
+        _MM_TRANSPOSE4_PS(tlo[4], tlo[5], tlo[6], tlo[7]);
+        _MM_TRANSPOSE4_PS(thi[4], thi[5], thi[6], thi[7]);
+        for (unsigned i = 0; i < 4; i++)
+        {
+            _mm_storeu_ps(out + (i * 8), tlo[i]);
+            _mm_storeu_ps(out + (i * 8) + 4, tlo[i + 4]);
+            _mm_storeu_ps(out + ((i + 4) * 8), thi[i]);
+            _mm_storeu_ps(out + ((i + 4) * 8) + 4, thi[i + 4]);
+        }
+#else
+        for (unsigned u = 0; u < 8; u++)
+        {
+            for (unsigned v = 0; v < 8; v++)
+            {
+                float sum = 0.0f;
+                for (unsigned x = 0; x < 8; x++) sum += matrix[(u * 8) + x] * in[(x * 8) + v];
+                out[(v * 8) + u] = sum;
+            }
+        }
+#endif
+    }
+
+
+#if defined(__SSE2__)
+    /** Return floor(x + 0.5) for four values, matching the scalar rounding (ties round up, not to even).
+     */
+    static inline __m128i roundHalfUp(__m128 x)
+    {
+        __m128 t = _mm_add_ps(x, _mm_set1_ps(0.5f));
+        __m128i i = _mm_cvttps_epi32(t);                                    // Truncates towards zero
+        __m128 above = _mm_cmpgt_ps(_mm_cvtepi32_ps(i), t);                 // Negative non-integers truncated upwards
+        return _mm_add_epi32(i, _mm_castps_si128(above));                   // Subtract one where so
+    }
+#endif
+
+
+    /** Quantise a block of coefficients: q = floor(coefficient * reciprocal + 0.5).
+     */
+    static void quantise(const float* coefficients, const float* reciprocal, int16_t* q)
+    {
+#if defined(__SSE2__)
+        for (unsigned i = 0; i < 64; i += 8)
+        {
+            __m128i a = roundHalfUp(_mm_mul_ps(_mm_loadu_ps(coefficients + i), _mm_loadu_ps(reciprocal + i)));
+            __m128i b = roundHalfUp(_mm_mul_ps(_mm_loadu_ps(coefficients + i + 4), _mm_loadu_ps(reciprocal + i + 4)));
+            _mm_storeu_si128((__m128i*)(q + i), _mm_packs_epi32(a, b));
+        }
+#else
+        for (unsigned i = 0; i < 64; i++) q[i] = (int16_t)floorf((coefficients[i] * reciprocal[i]) + 0.5f);
+#endif
+    }
+
+
+    /** Return the largest per-channel difference between two pixels.
+     */
+    static inline unsigned channelDifference(uint32_t a, uint32_t b)
+    {
+        unsigned result = 0;
+        for (unsigned shift = 0; shift < 24; shift += 8)
+        {
+            int d = (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+            unsigned m = (unsigned)((d < 0) ? -d : d);
+            if (m > result) result = m;
+        }
+        return result;
+    }
+
+
+    static inline uint8_t clampByte(float value)
+    {
+        int i = (int)(value + 0.5f);
+        return (uint8_t)((i < 0) ? 0 : (i > 255) ? 255 : i);
+    }
+
+
+    static inline void putBGR(uint8_t*& p, uint32_t pixel)
+    {
+        *p++ = (uint8_t)pixel;
+        *p++ = (uint8_t)(pixel >> 8);
+        *p++ = (uint8_t)(pixel >> 16);
+    }
+
+
+    static inline void putU32(uint8_t* p, uint32_t value)
+    {
+        p[0] = (uint8_t)value;
+        p[1] = (uint8_t)(value >> 8);
+        p[2] = (uint8_t)(value >> 16);
+        p[3] = (uint8_t)(value >> 24);
+    }
+
+
+    static inline uint32_t getU32(const uint8_t* p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+
+    /** Bounds checked reader for the decoder.
+     */
+    struct Reader
+    {
+        const uint8_t* m_ptr;                                   //!< The next byte
+        const uint8_t* m_end;                                   //!< The end of the data
+        bool m_ok;                                              //!< Cleared if a read overruns
+
+        uint8_t byte()
+        {
+            if (m_ptr >= m_end) { m_ok = false; return 0; }
+            return *m_ptr++;
+        }
+
+        uint32_t bgr()
+        {
+            uint32_t b = byte();
+            uint32_t g = byte();
+            uint32_t r = byte();
+            return 0xff000000u | (r << 16) | (g << 8) | b;
+        }
+
+        int16_t varint()
+        {
+            unsigned value = 0;
+            for (unsigned shift = 0; shift < 21; shift += 7)
+            {
+                uint8_t b = byte();
+                value |= (unsigned)(b & 0x7f) << shift;
+                if (0 == (b & 0x80)) return (int16_t)((value >> 1) ^ (0u - (value & 1)));
+            }
+            m_ok = false;
+            return 0;
+        }
+    };
+
+
+    /** Encode one tile.
+     *
+     *  @param  px              The tile pixels (row stride kTileSize).
+     *  @param  tw              The tile width (pixels).
+     *  @param  th              The tile height (pixels).
+     *  @param  reciprocal      The quantiser reciprocals.
+     *  @param  out             The output (at least kMaxTileBytes).
+     *  @param  tileClass       Returns the tile class.
+     *  @return                 The number of bytes written.
+     */
+    static size_t encodeTile(const uint32_t* px, unsigned tw, unsigned th, const float reciprocal[2][64],
+                             uint8_t* out, DisplayXFBTileCodec::TileClass& tileClass)
+    {
+        const unsigned S = DisplayXFBTileCodec::kTileSize;
+        uint8_t* p = out;
+        unsigned colours = 0;
+        tileClass = DisplayXFBTileCodec::classify(px, tw, th, &colours);
+
+        if (DisplayXFBTileCodec::kTileFlat == tileClass)
+        {
+            *p++ = kCodingFlat;
+            putBGR(p, px[0]);
+            return (size_t)(p - out);
+        }
+
+        if (DisplayXFBTileCodec::kTileText == tileClass && colours <= DisplayXFBTileCodec::kMaxPaletteColours)
+        {
+            uint32_t palette[DisplayXFBTileCodec::kMaxPaletteColours];
+            unsigned count = 0;
+            *p++ = kCodingPalette;
+            uint8_t* countByte = p++;
+            unsigned bits = (colours <= 2) ? 1 : (colours <= 4) ? 2 : 4;
+
+            // Build the palette in first-use order while packing the indices (palette first, indices after).
+            uint8_t indices[kTilePixels];
+            unsigned n = 0;
+            for (unsigned y = 0; y < th; y++)
+            {
+                for (unsigned x = 0; x < tw; x++)
+                {
+                    uint32_t c = px[(y * S) + x] & 0x00ffffff;
+                    unsigned i = 0;
+                    while (i < count && palette[i] != c) i++;
+                    if (i == count) palette[count++] = c;
+                    indices[n++] = (uint8_t)i;
+                }
+            }
+            *countByte = (uint8_t)(count - 1);
+            for (unsigned i = 0; i < count; i++) putBGR(p, palette[i]);
+
+            unsigned acc = 0, used = 0;
+            for (unsigned i = 0; i < n; i++)
+            {
+                acc |= (unsigned)indices[i] << used;
+                used += bits;
+                if (8 == used) { *p++ = (uint8_t)acc; acc = 0; used = 0; }
+            }
+            if (used) *p++ = (uint8_t)acc;
+            return (size_t)(p - out);
+        }
+
+        if (DisplayXFBTileCodec::kTilePhoto == tileClass)
+        {
+            // Convert to YCbCr planes, padding partial tiles by replicating the last row and column.
+            float planes[3][kTilePixels];
+            for (unsigned y = 0; y < S; y++)
+            {
+                unsigned sy = (y < th) ? y : th - 1;
+                for (unsigned x = 0; x < S; x++)
+                {
+                    unsigned sx = (x < tw) ? x : tw - 1;
+                    uint32_t c = px[(sy * S) + sx];
+                    float b = (float)(c & 0xff);
+                    float g = (float)((c >> 8) & 0xff);
+                    float r = (float)((c >> 16) & 0xff);
+                    planes[0][(y * S) + x] = (0.299f * r) + (0.587f * g) + (0.114f * b) - 128.0f;
+                    planes[1][(y * S) + x] = (-0.168736f * r) - (0.331264f * g) + (0.5f * b);
+                    planes[2][(y * S) + x] = (0.5f * r) - (0.418688f * g) - (0.081312f * b);
+                }
+            }
+
+            uint8_t coded[3 * 4 * (1 + (64 * 3))];
+            uint8_t* q = coded;
+            for (unsigned plane = 0; plane < 3; plane++)
+            {
+                unsigned table = (0 == plane) ? 0 : 1;
+                for (unsigned block = 0; block < 4; block++)
+                {
+                    float samples[64], pass[64], coefficients[64];
+                    const float* src = &planes[plane][((block >> 1) * 8 * S) + ((block & 1) * 8)];
+                    for (unsigned y = 0; y < 8; y++) memcpy(&samples[y * 8], &src[y * S], 8 * sizeof (float));
+                    transformPass(samples, pass, g_forward);
+                    transformPass(pass, coefficients, g_forward);
+
+                    int16_t levels[64];
+                    quantise(coefficients, reciprocal[table], levels);
+
+                    unsigned last = 64;
+                    while (last && 0 == levels[kZigZag[last - 1]]) last--;
+                    *q++ = (uint8_t)last;
+                    for (unsigned i = 0; i < last; i++)
+                    {
+                        int v = levels[kZigZag[i]];
+                        unsigned z = ((unsigned)v << 1) ^ (unsigned)(v >> 31);
+                        while (z >= 0x80) { *q++ = (uint8_t)(z | 0x80); z >>= 7; }
+                        *q++ = (uint8_t)z;
+                    }
+                }
+            }
+
+            size_t length = (size_t)(q - coded);
+            if (1 + length < 1 + (tw * th * 3))
+            {
+                *p++ = kCodingDCT;
+                memcpy(p, coded, length);
+                return 1 + length;
+            }
+        }
+
+        // Lossless fallback.
+        *p++ = kCodingRaw;
+        for (unsigned y = 0; y < th; y++)
+        {
+            for (unsigned x = 0; x < tw; x++) putBGR(p, px[(y * S) + x]);
+        }
+        return (size_t)(p - out);
+    }
+
+
+    /** Decode one tile.
+     *
+     *  @return                 Logical true for success, false if the data is malformed.
+     */
+    static bool decodeTile(Reader& in, uint32_t* px, unsigned tw, unsigned th, const float quant[2][64])
+    {
+        const unsigned S = DisplayXFBTileCodec::kTileSize;
+        uint8_t coding = in.byte();
+
+        if (kCodingFlat == coding)
+        {
+            uint32_t c = in.bgr();
+            for (unsigned y = 0; y < th; y++)
+            {
+                for (unsigned x = 0; x < tw; x++) px[(y * S) + x] = c;
+            }
+        }
+        else if (kCodingPalette == coding)
+        {
+            unsigned count = in.byte() + 1u;
+            if (count > DisplayXFBTileCodec::kMaxPaletteColours) return false;
+            uint32_t palette[DisplayXFBTileCodec::kMaxPaletteColours];
+            for (unsigned i = 0; i < count; i++) palette[i] = in.bgr();
+
+            unsigned bits = (count <= 2) ? 1 : (count <= 4) ? 2 : 4;
+            unsigned mask = (1u << bits) - 1;
+            unsigned acc = 0, available = 0;
+            for (unsigned y = 0; y < th; y++)
+            {
+                for (unsigned x = 0; x < tw; x++)
+                {
+                    if (0 == available) { acc = in.byte(); available = 8; }
+                    unsigned index = acc & mask;
+                    acc >>= bits;
+                    available -= bits;
+                    if (index >= count) return false;
+                    px[(y * S) + x] = palette[index];
+                }
+            }
+        }
+        else if (kCodingRaw == coding)
+        {
+            for (unsigned y = 0; y < th; y++)
+            {
+                for (unsigned x = 0; x < tw; x++) px[(y * S) + x] = in.bgr();
+            }
+        }
+        else if (kCodingDCT == coding)
+        {
+            float planes[3][kTilePixels];
+            for (unsigned plane = 0; plane < 3; plane++)
+            {
+                unsigned table = (0 == plane) ? 0 : 1;
+                for (unsigned block = 0; block < 4; block++)
+                {
+                    float coefficients[64], pass[64], samples[64];
+                    memset(coefficients, 0, sizeof coefficients);
+                    unsigned last = in.byte();
+                    if (last > 64) return false;
+                    for (unsigned i = 0; i < last; i++)
+                    {
+                        unsigned k = kZigZag[i];
+                        coefficients[k] = (float)in.varint() * quant[table][k];
+                    }
+                    transformPass(coefficients, pass, g_inverse);
+                    transformPass(pass, samples, g_inverse);
+
+                    float* dst = &planes[plane][((block >> 1) * 8 * S) + ((block & 1) * 8)];
+                    for (unsigned y = 0; y < 8; y++) memcpy(&dst[y * S], &samples[y * 8], 8 * sizeof (float));
+                }
+            }
+            for (unsigned y = 0; y < th; y++)
+            {
+                for (unsigned x = 0; x < tw; x++)
+                {
+                    unsigned i = (y * S) + x;
+                    float l = planes[0][i] + 128.0f;
+                    float cb = planes[1][i];
+                    float cr = planes[2][i];
+                    uint32_t r = clampByte(l + (1.402f * cr));
+                    uint32_t g = clampByte(l - (0.344136f * cb) - (0.714136f * cr));
+                    uint32_t b = clampByte(l + (1.772f * cb));
+                    px[i] = 0xff000000u | (r << 16) | (g << 8) | b;
+                }
+            }
+        }
+        else
+        {
+            return false;
+        }
+        return in.m_ok;
+    }
+
+
+    /** State shared by the row workers of one encode() or decode().
+     */
+    struct DisplayXFBTileCodec::RowContext
+    {
+        const float (*m_quant)[64];                             //!< Decode: the quantiser steps
+        const float (*m_reciprocal)[64];                        //!< The quantiser reciprocals (encode only)
+        uint8_t* m_pixels;                                      //!< The frame
+        size_t m_bytesPerRow;                                   //!< The frame stride
+        unsigned m_width;                                       //!< The frame width (pixels)
+        unsigned m_height;                                      //!< The frame height (pixels)
+        unsigned m_tilesX;                                      //!< Tiles per row
+        uint8_t* m_stream;                                      //!< Encode: row scratch base. Decode: the stream
+        size_t m_rowCapacity;                                   //!< Encode: scratch bytes per row
+        size_t* m_rowOffset;                                    //!< Decode: offset of each row's tile data
+        size_t* m_rowSize;                                      //!< Size of each row's tile data
+        uint64_t (*m_rowTiles)[2][kTileClasses];                //!< Encode: per-row tile and byte counts
+        bool* m_rowOK;                                          //!< Decode: per-row result
+    };
+
+
+    DisplayXFBTileCodec::DisplayXFBTileCodec(unsigned quality)
+        :
+        m_quality(0),
+        m_parallel(true),
+        m_quant(),
+        m_reciprocal(),
+        m_statistics()
+    {
+        pthread_once(&g_basisOnce, initialiseBasis);
+        resetStatistics();
+        setQuality(quality);
+    }
+
+
+    /** Set the DCT quality.
+     *
+     *  @param  quality         The quality, from 1 (smallest) to 100 (best). Values are clamped to this range.
+     */
+    void DisplayXFBTileCodec::setQuality(unsigned quality)
+    {
+        m_quality = (quality < 1) ? 1 : (quality > 100) ? 100 : quality;
+        buildTables(m_quality, m_quant);
+        for (unsigned t = 0; t < 2; t++)
+        {
+            for (unsigned i = 0; i < 64; i++) m_reciprocal[t][i] = 1.0f / m_quant[t][i];
+        }
+    }
+
+
+    /** Clear the counters.
+     */
+    void DisplayXFBTileCodec::resetStatistics()
+    {
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    /** Return the output buffer size needed to encode a frame.
+     */
+    size_t DisplayXFBTileCodec::maxEncodedSize(unsigned width, unsigned height)
+    {
+        size_t tilesX = (width + kTileSize - 1) / kTileSize;
+        size_t tilesY = (height + kTileSize - 1) / kTileSize;
+        return kHeaderSize + (tilesY * (4 + (tilesX * kMaxTileBytes)));
+    }
+
+
+    /** Encode a frame.
+     *
+     *  @param  pixels          The frame (32 bit BGRA).
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @param  output          The output buffer.
+     *  @param  capacity        The output buffer size. Must be at least maxEncodedSize(width, height).
+     *  @return                 The encoded size, or zero if the parameters are invalid.
+     */
+    size_t DisplayXFBTileCodec::encode(const void* pixels, unsigned width, unsigned height, size_t bytesPerRow, void* output, size_t capacity)
+    {
+        if (!pixels || !output || 0 == width || 0 == height || bytesPerRow < width * 4) return 0;
+        if (capacity < maxEncodedSize(width, height)) return 0;
+
+        struct timeval start;
+        gettimeofday(&start, 0);
+
+        unsigned tilesX = (width + kTileSize - 1) / kTileSize;
+        unsigned tilesY = (height + kTileSize - 1) / kTileSize;
+        size_t* rowSize = (size_t*)malloc(tilesY * sizeof (size_t));
+        uint64_t (*rowTiles)[2][kTileClasses] = (uint64_t (*)[2][kTileClasses])calloc(tilesY, sizeof *rowTiles);
+        if (!rowSize || !rowTiles)
+        {
+            free(rowSize);
+            free(rowTiles);
+            return 0;
+        }
+
+        // Each row is encoded in to its own worst case slot of the output, then the rows are packed down.
+        uint8_t* out = (uint8_t*)output;
+        RowContext context;
+        memset(&context, 0, sizeof context);
+        context.m_reciprocal = m_reciprocal;
+        context.m_pixels = (uint8_t*)pixels;
+        context.m_bytesPerRow = bytesPerRow;
+        context.m_width = width;
+        context.m_height = height;
+        context.m_tilesX = tilesX;
+        context.m_stream = out + kHeaderSize;
+        context.m_rowCapacity = 4 + (tilesX * kMaxTileBytes);
+        context.m_rowSize = rowSize;
+        context.m_rowTiles = rowTiles;
+        // A caller that already runs a codec per core (such as a pinned capture worker) encodes on its own thread,
+        // keeping the work on its core set.
+        if (m_parallel) parallelFor(tilesY, &context, encodeRow);
+        else for (unsigned row = 0; row < tilesY; row++) encodeRow(&context, row);
+
+        memcpy(out, kMagic, sizeof kMagic);
+        putU32(out + 4, width);
+        putU32(out + 8, height);
+        out[12] = (uint8_t)kTileSize;
+        out[13] = (uint8_t)m_quality;
+        out[14] = 0;
+        out[15] = 0;
+
+        uint8_t* dst = out + kHeaderSize;
+        for (unsigned row = 0; row < tilesY; row++)
+        {
+            const uint8_t* src = context.m_stream + (row * context.m_rowCapacity);
+            putU32(dst, (uint32_t)rowSize[row]);
+            memmove(dst + 4, src + 4, rowSize[row]);
+            dst += 4 + rowSize[row];
+            for (unsigned c = 0; c < kTileClasses; c++)
+            {
+                m_statistics.m_tiles[c] += rowTiles[row][0][c];
+                m_statistics.m_tileBytes[c] += rowTiles[row][1][c];
+            }
+        }
+        free(rowSize);
+        free(rowTiles);
+
+        struct timeval end;
+        gettimeofday(&end, 0);
+        size_t length = (size_t)(dst - out);
+        m_statistics.m_frames ++;
+        m_statistics.m_inputBytes += (uint64_t)width * height * 4;
+        m_statistics.m_outputBytes += length;
+        m_statistics.m_encodeMicroseconds += (uint64_t)(((int64_t)(end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec));
+        return length;
+    }
+
+
+    /** Decode a frame.
+     *
+     *  @param  input           The encoded stream.
+     *  @param  size            The stream size (bytes).
+     *  @param  pixels          The output frame (32 bit BGRA).
+     *  @param  width           The frame width (pixels). Must match the stream.
+     *  @param  height          The frame height (pixels). Must match the stream.
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @return                 Logical true for success, false if the stream is malformed or does not match the frame.
+     */
+    bool DisplayXFBTileCodec::decode(const void* input, size_t size, void* pixels, unsigned width, unsigned height, size_t bytesPerRow)
+    {
+        const uint8_t* in = (const uint8_t*)input;
+        if (!in || !pixels || size < kHeaderSize || bytesPerRow < width * 4) return false;
+        if (0 != memcmp(in, kMagic, sizeof kMagic) || getU32(in + 4) != width || getU32(in + 8) != height) return false;
+        if (kTileSize != in[12] || 0 == in[13] || in[13] > 100 || 0 == width || 0 == height) return false;
+
+        pthread_once(&g_basisOnce, initialiseBasis);
+        float quant[2][64];
+        buildTables(in[13], quant);
+
+        unsigned tilesX = (width + kTileSize - 1) / kTileSize;
+        unsigned tilesY = (height + kTileSize - 1) / kTileSize;
+        size_t* rowOffset = (size_t*)malloc(tilesY * sizeof (size_t));
+        size_t* rowSize = (size_t*)malloc(tilesY * sizeof (size_t));
+        bool* rowOK = (bool*)malloc(tilesY * sizeof (bool));
+        bool ok = (0 != rowOffset && 0 != rowSize && 0 != rowOK);
+
+        size_t offset = kHeaderSize;
+        for (unsigned row = 0; ok && row < tilesY; row++)
+        {
+            if (size - offset < 4) { ok = false; break; }
+            rowSize[row] = getU32(in + offset);
+            rowOffset[row] = offset + 4;
+            if (size - rowOffset[row] < rowSize[row]) { ok = false; break; }
+            offset = rowOffset[row] + rowSize[row];
+        }
+
+        if (ok)
+        {
+            RowContext context;
+            memset(&context, 0, sizeof context);
+            context.m_quant = quant;
+            context.m_pixels = (uint8_t*)pixels;
+            context.m_bytesPerRow = bytesPerRow;
+            context.m_width = width;
+            context.m_height = height;
+            context.m_tilesX = tilesX;
+            context.m_stream = (uint8_t*)in;
+            context.m_rowOffset = rowOffset;
+            context.m_rowSize = rowSize;
+            context.m_rowOK = rowOK;
+            parallelFor(tilesY, &context, decodeRow);
+            for (unsigned row = 0; row < tilesY; row++) ok = ok && rowOK[row];
+        }
+
+        free(rowOffset);
+        free(rowSize);
+        free(rowOK);
+        return ok;
+    }
+
+
+    /** Classify a tile.
+     *
+     *  @param  tile            The tile pixels (row stride kTileSize).
+     *  @param  width           The tile width (pixels).
+     *  @param  height          The tile height (pixels).
+     *  @param  colours         If non-zero, returns the number of distinct colours, saturating at kMaxPaletteColours + 1.
+     *  @return                 The tile class.
+     */
+    DisplayXFBTileCodec::TileClass DisplayXFBTileCodec::classify(const uint32_t* tile, unsigned width, unsigned height, unsigned* colours)
+    {
+        uint32_t seen[kMaxPaletteColours + 1];
+        unsigned count = 0;
+        unsigned pairs = 0, smooth = 0, sharp = 0;
+        uint32_t previous = ~0u;
+
+        for (unsigned y = 0; y < height; y++)
+        {
+            for (unsigned x = 0; x < width; x++)
+            {
+                uint32_t c = tile[(y * kTileSize) + x] & 0x00ffffff;
+                if (c != previous && count <= kMaxPaletteColours)
+                {
+                    unsigned i = 0;
+                    while (i < count && seen[i] != c) i++;
+                    if (i == count) seen[count++] = c;
+                }
+                previous = c;
+
+                if (x + 1 < width)
+                {
+                    unsigned d = channelDifference(c, tile[(y * kTileSize) + x + 1]);
+                    pairs ++;
+                    if (d > kSharpThreshold) sharp ++;
+                    else if (d && d <= kSmoothThreshold) smooth ++;
+                }
+                if (y + 1 < height)
+                {
+                    unsigned d = channelDifference(c, tile[((y + 1) * kTileSize) + x]);
+                    pairs ++;
+                    if (d > kSharpThreshold) sharp ++;
+                    else if (d && d <= kSmoothThreshold) smooth ++;
+                }
+            }
+        }
+
+        if (colours) *colours = count;
+        if (count <= 1) return kTileFlat;
+        if (count <= kMaxPaletteColours) return kTileText;
+
+        // Many colours: gradients mean natural images, hard edges mean anti-aliased text or graphics.
+        if (smooth * 4 >= pairs && sharp * 4 <= smooth) return kTilePhoto;
+        return kTileText;
+    }
+
+
+    /** Encode one row of tiles in to its scratch slot (parallelFor callback).
+     */
+    void DisplayXFBTileCodec::encodeRow(void* context, size_t row)
+    {
+        RowContext* ctx = (RowContext*)context;
+        uint8_t* p = ctx->m_stream + (row * ctx->m_rowCapacity) + 4;
+        uint8_t* start = p;
+        unsigned y0 = (unsigned)row * kTileSize;
+        unsigned th = (ctx->m_height - y0 < kTileSize) ? ctx->m_height - y0 : kTileSize;
+
+        uint32_t px[kTilePixels];
+        for (unsigned tx = 0; tx < ctx->m_tilesX; tx++)
+        {
+            unsigned x0 = tx * kTileSize;
+            unsigned tw = (ctx->m_width - x0 < kTileSize) ? ctx->m_width - x0 : kTileSize;
+            for (unsigned y = 0; y < th; y++)
+            {
+                const uint8_t* src = ctx->m_pixels + ((y0 + y) * ctx->m_bytesPerRow) + (x0 * 4);
+                memcpy(&px[y * kTileSize], src, tw * 4);
+            }
+
+            TileClass tileClass;
+            size_t length = encodeTile(px, tw, th, ctx->m_reciprocal, p, tileClass);
+            p += length;
+            ctx->m_rowTiles[row][0][tileClass] ++;
+            ctx->m_rowTiles[row][1][tileClass] += length;
+        }
+        ctx->m_rowSize[row] = (size_t)(p - start);
+    }
+
+
+    /** Decode one row of tiles (parallelFor callback).
+     */
+    void DisplayXFBTileCodec::decodeRow(void* context, size_t row)
+    {
+        RowContext* ctx = (RowContext*)context;
+        Reader in;
+        in.m_ptr = ctx->m_stream + ctx->m_rowOffset[row];
+        in.m_end = in.m_ptr + ctx->m_rowSize[row];
+        in.m_ok = true;
+
+        unsigned y0 = (unsigned)row * kTileSize;
+        unsigned th = (ctx->m_height - y0 < kTileSize) ? ctx->m_height - y0 : kTileSize;
+
+        uint32_t px[kTilePixels];
+        bool ok = true;
+        for (unsigned tx = 0; ok && tx < ctx->m_tilesX; tx++)
+        {
+            unsigned x0 = tx * kTileSize;
+            unsigned tw = (ctx->m_width - x0 < kTileSize) ? ctx->m_width - x0 : kTileSize;
+            ok = decodeTile(in, px, tw, th, ctx->m_quant);
+            for (unsigned y = 0; ok && y < th; y++)
+            {
+                uint8_t* dst = ctx->m_pixels + ((y0 + y) * ctx->m_bytesPerRow) + (x0 * 4);
+                memcpy(dst, &px[y * kTileSize], tw * 4);
+            }
+        }
+        ctx->m_rowOK[row] = ok && in.m_ptr == in.m_end;
+    }
+
+
+    /** Build the quantiser steps for a quality, using the IJG scaling of the standard tables.
+     */
+    void DisplayXFBTileCodec::buildTables(unsigned quality, float quant[2][64])
+    {
+        unsigned scale = (quality < 50) ? (5000 / quality) : (200 - (quality * 2));
+        for (unsigned t = 0; t < 2; t++)
+        {
+            for (unsigned i = 0; i < 64; i++)
+            {
+                unsigned step = ((kBaseQuant[t][i] * scale) + 50) / 100;
+                quant[t][i] = (float)((step < 1) ? 1 : (step > 255) ? 255 : step);
+            }
+        }
+    }
+
+
+#if !defined(__APPLE__)
+    static const unsigned kMaxHelpers = 16;                     //!< Upper limit on parallelFor() helper threads
+    static DisplayXFBWorkerGroup* g_helpers = 0;                //!< Persistent helper threads (never destroyed)
+    static pthread_once_t g_helpersOnce = PTHREAD_ONCE_INIT;    //!< Guards the helper start-up
+
+
+    /** Start the helper threads used by parallelFor(), one per core other than the caller's.
+     */
+    static void startHelpers()
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned helpers = (cpus > 1) ? (unsigned)cpus - 1 : 0;
+        if (helpers > kMaxHelpers) helpers = kMaxHelpers;
+        if (0 == helpers) return;
+
+        DisplayXFBWorkerGroup* group = new DisplayXFBWorkerGroup;
+        if (group->start(helpers, false)) g_helpers = group;
+        else delete group;
+    }
+
+
+    /** Shared state for the worker implementation of parallelFor().
+     */
+    struct ParallelJob
+    {
+        volatile size_t m_next;                                 //!< The next index to run
+        size_t m_count;                                         //!< The number of indices
+        void* m_context;                                        //!< The callback context
+        void (*m_function)(void*, size_t);                      //!< The callback
+    };
+
+    static void parallelWork(void* arg)
+    {
+        ParallelJob* job = (ParallelJob*)arg;
+        size_t i;
+        while ((i = __sync_fetch_and_add(&job->m_next, 1)) < job->m_count) job->m_function(job->m_context, i);
+    }
+#endif
+
+
+    /** Call function(context, i) for i in [0, count), spread across the available cores. Returns when all calls
+     *  have completed.
+     *
+     *  On OS X this uses libdispatch. Elsewhere the work is shared between the caller and a persistent set of helper
+     *  threads (a DisplayXFBWorkerGroup started on first use), so no threads are created per call.
+     */
+    void DisplayXFBTileCodec::parallelFor(size_t count, void* context, void (*function)(void*, size_t))
+    {
+#if defined(__APPLE__)
+        dispatch_apply_f(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), context, function);
+#else
+        ParallelJob job;
+        job.m_next = 0;
+        job.m_count = count;
+        job.m_context = context;
+        job.m_function = function;
+
+        pthread_once(&g_helpersOnce, startHelpers);
+        unsigned helpers = (g_helpers) ? g_helpers->count() : 0;
+        if (helpers >= count) helpers = (count > 0) ? (unsigned)count - 1 : 0;
+
+        unsigned submitted = 0;
+        while (submitted < helpers && g_helpers->submit(submitted, parallelWork, &job)) submitted ++;
+        parallelWork(&job);
+        for (unsigned i = 0; i < submitted; i++) g_helpers->wait(i);
+#endif
+    }
+
+}   // namespace
@@ -0,0 +1,97 @@
+/** @file   DisplayXFBTileCodec.h
+ *  @brief  Tile based frame codec with a per-tile choice of lossless or lossy coding.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBTileCodec_H
+#define COM_TSONIQ_DisplayXFBTileCodec_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ts
+{
+    /** Class used to compress 32 bit BGRA frames for transmission.
+     *
+     *  The frame is divided in to 16x16 tiles and each tile is classified from cheap statistics (the number of
+     *  distinct colours and the distribution of neighbouring pixel differences):
+     *
+     *      kTileFlat       One colour. Coded as that colour.
+     *      kTileText       Few colours, or many colours with hard edges (text, line art, UI). Coded losslessly,
+     *                      as a palette and packed indices if there are at most kMaxPaletteColours, otherwise raw.
+     *      kTilePhoto      Mostly small gradients (photos, video). Coded as JPEG style 8x8 DCT blocks in YCbCr,
+     *                      quantised according to the quality setting. Falls back to raw if that is smaller.
+     *
+     *  Tile rows are encoded (unless disabled with setParallel()) and decoded in parallel, and the DCT and quantisation use SSE2 where available. The
+     *  alpha channel is not coded (decoded pixels are opaque).
+     *
+     *  The stream is a 16 byte header followed by one block per tile row, each prefixed with its length so that
+     *  rows can be located without decoding them. An instance is not thread safe, but separate instances may be
+     *  used concurrently. decode() is stateless.
+     */
+    class DisplayXFBTileCodec
+    {
+    public:
+
+        static const unsigned kTileSize = 16;                       //!< Tile width and height (pixels)
+        static const unsigned kMaxPaletteColours = 16;              //!< Largest palette for a lossless tile
+        static const unsigned kDefaultQuality = 75;                 //!< Default DCT quality (1 to 100)
+
+        /** Tile classes.
+         */
+        enum TileClass
+        {
+            kTileFlat,                                              //!< Single colour
+            kTileText,                                              //!< Coded losslessly
+            kTilePhoto,                                             //!< Coded with the DCT
+            kTileClasses                                            //!< The number of classes
+        };
+
+        /** Counters, accumulated since construction or the last resetStatistics().
+         */
+        struct Statistics
+        {
+            uint64_t m_frames;                                      //!< Frames encoded
+            uint64_t m_tiles[kTileClasses];                         //!< Tiles encoded, per class
+            uint64_t m_tileBytes[kTileClasses];                     //!< Encoded bytes, per class
+            uint64_t m_inputBytes;                                  //!< Frame bytes read (width * height * 4)
+            uint64_t m_outputBytes;                                 //!< Stream bytes written
+            uint64_t m_encodeMicroseconds;                          //!< Wall clock time spent in encode()
+        };
+
+        explicit DisplayXFBTileCodec(unsigned quality=kDefaultQuality);
+
+        void setQuality(unsigned quality);
+        unsigned quality() const { return m_quality; }                          //!< Return the DCT quality
+        void setParallel(bool parallel) { m_parallel = parallel; }              //!< Enable or disable parallel encoding
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+        void resetStatistics();
+
+        static size_t maxEncodedSize(unsigned width, unsigned height);
+        size_t encode(const void* pixels, unsigned width, unsigned height, size_t bytesPerRow, void* output, size_t capacity);
+        static bool decode(const void* input, size_t size, void* pixels, unsigned width, unsigned height, size_t bytesPerRow);
+        static TileClass classify(const uint32_t* tile, unsigned width, unsigned height, unsigned* colours=0);
+
+    private:
+
+        struct RowContext;
+
+        unsigned m_quality;                                         //!< DCT quality (1 to 100)
+        bool m_parallel;                                            //!< Logical true to encode rows in parallel
+        float m_quant[2][64];                                       //!< Luma and chroma quantiser steps (natural order)
+        float m_reciprocal[2][64];                                  //!< Reciprocals of m_quant
+        Statistics m_statistics;                                    //!< The counters
+
+        static void encodeRow(void* context, size_t row);
+        static void decodeRow(void* context, size_t row);
+        static void buildTables(unsigned quality, float quant[2][64]);
+        static void parallelFor(size_t count, void* context, void (*function)(void*, size_t));
+
+        DisplayXFBTileCodec(const DisplayXFBTileCodec&);            // Prevent copy constructor
+        DisplayXFBTileCodec& operator=(const DisplayXFBTileCodec&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBTileCodec_H
@@ -0,0 +1,514 @@
+/** @file   DisplayXFBTileDedup.cc
+ *  @brief  Stream coding that replaces solid and repeated tiles with references.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBTileDedup.h"
+#include "DisplayXFBPixelKernels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    static const uint8_t kMagic[4] = { 'x', 'T', 'D', '1' };   //!< Message identifier
+    static const size_t kHeaderSize = 16;                       //!< Message header size (bytes)
+    static const size_t kMaxVarint = 5;                         //!< Longest 32 bit varint (bytes)
+    static const size_t kTileBytes = DisplayXFBTileDedupEncoder::kTileSize * DisplayXFBTileDedupEncoder::kTileSize * 4;
+    static const size_t kMaxCodedTile = kTileBytes + 64;       //!< Buffer for one coded tile (codec header and raw coding)
+    static const uint8_t kPendingDeferred = 1;                  //!< Tile flag: encodeDirect() could not read it stably
+    static const uint8_t kPendingDirect = 2;                    //!< Tile flag: encodeDirect() sent it, unseen by the shadow frame
+
+    /** Tile operations.
+     */
+    enum Operation
+    {
+        kOpSolid = 0,                                           //!< BGR colour
+        kOpCached = 1,                                          //!< Varint cache slot
+        kOpCoded = 2                                            //!< Varint length and DisplayXFBTileCodec data
+    };
+
+
+    static inline void putU32(uint8_t* p, uint32_t value)
+    {
+        p[0] = (uint8_t)value;
+        p[1] = (uint8_t)(value >> 8);
+        p[2] = (uint8_t)(value >> 16);
+        p[3] = (uint8_t)(value >> 24);
+    }
+
+
+    static inline uint32_t getU32(const uint8_t* p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+
+    static inline void putVarint(uint8_t*& p, uint32_t value)
+    {
+        while (value >= 0x80)
+        {
+            *p++ = (uint8_t)(value | 0x80);
+            value >>= 7;
+        }
+        *p++ = (uint8_t)value;
+    }
+
+
+    static inline bool getVarint(const uint8_t*& p, const uint8_t* end, uint32_t& value)
+    {
+        value = 0;
+        for (unsigned shift = 0; shift < 35 && p < end; shift += 7)
+        {
+            uint8_t byte = *p++;
+            value |= (uint32_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+
+    /** Copy a tile between a frame and packed storage.
+     */
+    static void copyTile(uint8_t* dst, size_t dstBytesPerRow, const uint8_t* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+    {
+        for (unsigned y = 0; y < height; y++) memcpy(dst + (y * dstBytesPerRow), src + (y * srcBytesPerRow), (size_t)width * 4);
+    }
+
+
+#pragma mark    -
+
+
+    DisplayXFBTileDedupEncoder::DisplayXFBTileDedupEncoder()
+        :
+        m_width(0),
+        m_height(0),
+        m_cache(),
+        m_codec(),
+        m_pending(0),
+        m_deferredCount(0),
+        m_directCount(0),
+        m_statistics()
+    {
+    }
+
+
+    DisplayXFBTileDedupEncoder::~DisplayXFBTileDedupEncoder()
+    {
+        free(m_pending);
+    }
+
+
+    /** Set the frame size and allocate the cache.
+     *
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  cacheTiles      The cache capacity (tiles). The decoder must use the same value.
+     *  @param  quality         The tile codec quality.
+     *  @return                 Logical true for success, false if the parameters are invalid or no memory is available.
+     */
+    bool DisplayXFBTileDedupEncoder::configure(unsigned width, unsigned height, unsigned cacheTiles, unsigned quality)
+    {
+        free(m_pending);
+        m_pending = 0;
+        m_deferredCount = 0;
+        m_directCount = 0;
+        if (0 == width || 0 == height || !m_cache.configure(cacheTiles, 0)) return false;
+
+        size_t tiles = (size_t)((width + kTileSize - 1) / kTileSize) * ((height + kTileSize - 1) / kTileSize);
+        m_pending = (uint8_t*)calloc(tiles, sizeof m_pending[0]);
+        if (!m_pending) return false;
+        m_width = width;
+        m_height = height;
+        m_codec.setQuality(quality);
+        m_statistics = Statistics();
+        return true;
+    }
+
+
+    /** Empty the cache. The decoder must be reset at the same point in the stream.
+     */
+    void DisplayXFBTileDedupEncoder::reset()
+    {
+        m_cache.reset();
+        if (m_pending) memset(m_pending, 0, (size_t)((m_width + kTileSize - 1) / kTileSize) * ((m_height + kTileSize - 1) / kTileSize));
+        m_deferredCount = 0;
+        m_directCount = 0;
+        m_statistics = Statistics();
+    }
+
+
+    /** Return the largest message encode() can produce (bytes).
+     */
+    size_t DisplayXFBTileDedupEncoder::maxEncodedSize() const
+    {
+        size_t tiles = (size_t)((m_width + kTileSize - 1) / kTileSize) * ((m_height + kTileSize - 1) / kTileSize);
+        return kHeaderSize + (tiles * (kMaxVarint + 1 + kMaxVarint + DisplayXFBTileCodec::maxEncodedSize(kTileSize, kTileSize)));
+    }
+
+
+    /** Code the tiles that changed in the frame's last update, and any tiles deferred or sent by encodeDirect().
+     *
+     *  @param  frame           The frame. It must match the configured size, use kTileSize tiles and describe content.
+     *                          Tiles from encodeDirect() are sent from its copy, so it must have been updated at least
+     *                          once, and should be updated every frame when the two methods are mixed.
+     *  @param  output          The output buffer.
+     *  @param  capacity        The output buffer size (bytes). Must be at least maxEncodedSize(), so that the cache
+     *                          is never updated for a message that is not produced.
+     *  @return                 The message size (bytes), or zero on error.
+     */
+    size_t DisplayXFBTileDedupEncoder::encode(const DisplayXFBShadowFrame& frame, void* output, size_t capacity)
+    {
+        if (!output || capacity < maxEncodedSize() || 0 == m_cache.capacity()) return 0;
+        if (frame.width() != m_width || frame.height() != m_height || frame.tileSize() != kTileSize || !frame.tileContents()) return 0;
+
+        uint8_t* start = (uint8_t*)output;
+        uint8_t* p = start + kHeaderSize;
+        const uint8_t* pixels = (const uint8_t*)frame.pixels();
+        size_t stride = frame.bytesPerRow();
+        unsigned count = 0;
+        unsigned next = 0;
+        uint64_t referenceBytes = 0;
+        uint64_t references = 0;
+        uint8_t coded[kMaxCodedTile];
+        for (unsigned ty = 0; ty < frame.tilesY(); ty++)
+        {
+            for (unsigned tx = 0; tx < frame.tilesX(); tx++)
+            {
+                unsigned index = (ty * frame.tilesX()) + tx;
+                uint8_t pending = (m_deferredCount || m_directCount) ? m_pending[index] : 0;
+                if (!pending && !frame.isTileChanged(tx, ty)) continue;
+
+                const DisplayXFBTileContent& content = frame.tileContent(tx, ty);
+                uint64_t hash = frame.tileHash(tx, ty);
+                unsigned slot = (content.m_solid) ? DisplayXFBTileCache::kNoSlot : m_cache.find(hash);
+                size_t size = 0;
+                if (!content.m_solid && DisplayXFBTileCache::kNoSlot == slot)
+                {
+                    unsigned x = tx * kTileSize;
+                    unsigned y = ty * kTileSize;
+                    unsigned w = (x + kTileSize > m_width) ? m_width - x : kTileSize;
+                    unsigned h = (y + kTileSize > m_height) ? m_height - y : kTileSize;
+                    size = m_codec.encode(pixels + ((size_t)y * stride) + ((size_t)x * 4), w, h, stride, coded, sizeof coded);
+                    if (0 == size)
+                    {
+                        m_cache.reset();                // Unrecoverable: the stream must be restarted
+                        return 0;
+                    }
+                }
+                if (pending)
+                {
+                    if (pending & kPendingDeferred) m_deferredCount --;
+                    if (pending & kPendingDirect) m_directCount --;
+                    m_pending[index] = 0;
+                }
+                p = emitTile(p, index, next, content, slot, hash, coded, size, referenceBytes, references);
+                count ++;
+            }
+        }
+        return finish(start, p, count, referenceBytes, references);
+    }
+
+
+    /** Code the tiles in a dirty area directly from the framebuffer, re-reading any tile that changes while it is
+     *  being coded. Tiles deferred by the previous call are included as well. Each tile sent is
+     *  flagged so that the next encode() sends it again from the shadow frame (see the class description).
+     *
+     *  @param  pixels          The framebuffer mapping (32 bit BGRA), which may be changing.
+     *  @param  bytesPerRow     The framebuffer stride (bytes).
+     *  @param  x               The dirty area (expanded to whole tiles).
+     *  @param  y               ...
+     *  @param  width           ...
+     *  @param  height          ...
+     *  @param  output          The output buffer.
+     *  @param  capacity        The output buffer size (bytes). Must be at least maxEncodedSize().
+     *  @return                 The message size (bytes), or zero on error.
+     */
+    size_t DisplayXFBTileDedupEncoder::encodeDirect(const void* pixels, size_t bytesPerRow, unsigned x, unsigned y, unsigned width, unsigned height,
+                                                    void* output, size_t capacity)
+    {
+        if (!pixels || !output || capacity < maxEncodedSize() || 0 == m_cache.capacity() || !m_pending) return 0;
+
+        const unsigned tilesX = (m_width + kTileSize - 1) / kTileSize;
+        const unsigned tilesY = (m_height + kTileSize - 1) / kTileSize;
+        unsigned tx0 = tilesX, ty0 = tilesY, tx1 = 0, ty1 = 0;
+        if (x < m_width && y < m_height && width && height)
+        {
+            tx0 = x / kTileSize;
+            ty0 = y / kTileSize;
+            tx1 = (width > m_width - x) ? tilesX : (x + width + kTileSize - 1) / kTileSize;
+            ty1 = (height > m_height - y) ? tilesY : (y + height + kTileSize - 1) / kTileSize;
+        }
+
+        const uint8_t* base = (const uint8_t*)pixels;
+        bool aligned = 0 == (((uintptr_t)base | bytesPerRow) & 15);
+        DisplayXFBPixelKernelTable kernels =
+            DisplayXFBPixelKernels::select(DisplayXFBPixelKernels::kFormatBGRA32, kTileSize, aligned, DisplayXFBPixelKernels::cpuIsa());
+
+        uint8_t* start = (uint8_t*)output;
+        uint8_t* p = start + kHeaderSize;
+        unsigned count = 0;
+        unsigned next = 0;
+        uint64_t referenceBytes = 0;
+        uint64_t references = 0;
+        uint8_t coded[kMaxCodedTile];
+        for (unsigned ty = 0; ty < tilesY; ty++)
+        {
+            bool rowDirty = (ty >= ty0 && ty < ty1);
+            if (!rowDirty && 0 == m_deferredCount) continue;
+            for (unsigned tx = 0; tx < tilesX; tx++)
+            {
+                unsigned index = (ty * tilesX) + tx;
+                bool wasDeferred = (0 != (m_pending[index] & kPendingDeferred));
+                if (!wasDeferred && !(rowDirty && tx >= tx0 && tx < tx1)) continue;
+
+                unsigned px = tx * kTileSize;
+                unsigned py = ty * kTileSize;
+                unsigned w = (px + kTileSize > m_width) ? m_width - px : kTileSize;
+                unsigned h = (py + kTileSize > m_height) ? m_height - py : kTileSize;
+                const uint8_t* tile = base + ((size_t)py * bytesPerRow) + ((size_t)px * 4);
+
+                // Read, code, then read again: the coding is only used if the tile did not change in between.
+                bool stable = false;
+                DisplayXFBTileContent content;
+                uint64_t hash = 0;
+                unsigned slot = DisplayXFBTileCache::kNoSlot;
+                size_t size = 0;
+                for (unsigned attempt = 0; attempt < kDirectAttempts && !stable; attempt++)
+                {
+                    if (attempt) m_statistics.m_directRetries ++;
+                    kernels.m_hash(tile, bytesPerRow, w, h, &hash, &content);
+                    slot = (content.m_solid) ? DisplayXFBTileCache::kNoSlot : m_cache.find(hash);
+                    size = 0;
+                    if (!content.m_solid && DisplayXFBTileCache::kNoSlot == slot)
+                    {
+                        size = m_codec.encode(tile, w, h, bytesPerRow, coded, sizeof coded);
+                        if (0 == size)
+                        {
+                            m_cache.reset();            // Unrecoverable: the stream must be restarted
+                            return 0;
+                        }
+                    }
+                    uint64_t check = 0;
+                    kernels.m_hash(tile, bytesPerRow, w, h, &check, 0);
+                    stable = (check == hash);
+                }
+
+                if (!stable)
+                {
+                    if (!wasDeferred) m_deferredCount ++;
+                    m_pending[index] |= kPendingDeferred;
+                    m_statistics.m_directDeferred ++;
+                    continue;
+                }
+                if (wasDeferred)
+                {
+                    m_pending[index] &= (uint8_t)~kPendingDeferred;
+                    m_deferredCount --;
+                }
+                if (0 == (m_pending[index] & kPendingDirect))
+                {
+                    m_pending[index] |= kPendingDirect;
+                    m_directCount ++;
+                }
+                p = emitTile(p, index, next, content, slot, hash, coded, size, referenceBytes, references);
+                count ++;
+            }
+        }
+        return finish(start, p, count, referenceBytes, references);
+    }
+
+
+    /** Write one tile entry and update the cache to match what the decoder will do.
+     *
+     *  @param  p               The write position.
+     *  @param  index           The tile index.
+     *  @param  next            The index following the previous entry (updated).
+     *  @param  content         The tile's content description.
+     *  @param  slot            The cache slot holding the tile, or kNoSlot.
+     *  @param  hash            The tile hash.
+     *  @param  coded           The coded tile, used if the tile is neither solid nor cached.
+     *  @param  codedSize       The coded tile size (bytes).
+     *  @param  referenceBytes  Accumulates the bytes used by solid and cached entries.
+     *  @param  references      Accumulates the number of solid and cached entries.
+     *  @return                 The new write position.
+     */
+    uint8_t* DisplayXFBTileDedupEncoder::emitTile(uint8_t* p, unsigned index, unsigned& next, const DisplayXFBTileContent& content, unsigned slot,
+                                                  uint64_t hash, const uint8_t* coded, size_t codedSize, uint64_t& referenceBytes, uint64_t& references)
+    {
+        uint8_t* entry = p;
+        putVarint(p, index - next);
+        next = index + 1;
+
+        if (content.m_solid)
+        {
+            *p++ = kOpSolid;
+            *p++ = (uint8_t)content.m_colour;
+            *p++ = (uint8_t)(content.m_colour >> 8);
+            *p++ = (uint8_t)(content.m_colour >> 16);
+            m_statistics.m_solidTiles ++;
+        }
+        else if (DisplayXFBTileCache::kNoSlot != slot)
+        {
+            m_cache.touch(slot);
+            *p++ = kOpCached;
+            putVarint(p, slot);
+            m_statistics.m_cachedTiles ++;
+        }
+        else
+        {
+            *p++ = kOpCoded;
+            putVarint(p, (uint32_t)codedSize);
+            memcpy(p, coded, codedSize);
+            p += codedSize;
+            m_cache.insert(hash);
+            m_statistics.m_codedTiles ++;
+            m_statistics.m_codedBytes += codedSize;
+            return p;
+        }
+        referenceBytes += (uint64_t)(p - entry);
+        references ++;
+        return p;
+    }
+
+
+    /** Write the message header and update the counters.
+     *
+     *  @return                 The message size (bytes).
+     */
+    size_t DisplayXFBTileDedupEncoder::finish(uint8_t* start, uint8_t* end, unsigned count, uint64_t referenceBytes, uint64_t references)
+    {
+        memcpy(start, kMagic, sizeof kMagic);
+        putU32(start + 4, m_width);
+        putU32(start + 8, m_height);
+        putU32(start + 12, count);
+
+        size_t total = (size_t)(end - start);
+        m_statistics.m_frames ++;
+        m_statistics.m_tiles += count;
+        m_statistics.m_bytes += total;
+        if (m_statistics.m_codedTiles)
+        {
+            uint64_t mean = m_statistics.m_codedBytes / m_statistics.m_codedTiles;
+            uint64_t avoided = references * mean;
+            if (avoided > referenceBytes) m_statistics.m_savedBytes += avoided - referenceBytes;
+        }
+        return total;
+    }
+
+
+#pragma mark    -
+
+
+    DisplayXFBTileDedupDecoder::DisplayXFBTileDedupDecoder()
+        :
+        m_width(0),
+        m_height(0),
+        m_inserted(0),
+        m_cache()
+    {
+    }
+
+
+    /** Set the frame size and allocate the cache.
+     *
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @param  cacheTiles      The cache capacity (tiles). Must match the encoder.
+     *  @return                 Logical true for success, false if the parameters are invalid or no memory is available.
+     */
+    bool DisplayXFBTileDedupDecoder::configure(unsigned width, unsigned height, unsigned cacheTiles)
+    {
+        if (0 == width || 0 == height || !m_cache.configure(cacheTiles, kTileBytes)) return false;
+        m_width = width;
+        m_height = height;
+        m_inserted = 0;
+        return true;
+    }
+
+
+    /** Empty the cache, matching an encoder reset().
+     */
+    void DisplayXFBTileDedupDecoder::reset()
+    {
+        m_cache.reset();
+        m_inserted = 0;
+    }
+
+
+    /** Apply a message to a frame.
+     *
+     *  @param  input           The message.
+     *  @param  size            The message size (bytes).
+     *  @param  pixels          The frame (32 bit BGRA), holding the previous frame.
+     *  @param  bytesPerRow     The frame stride (bytes).
+     *  @return                 Logical true for success, false if the message is invalid (the frame and the cache
+     *                          are then inconsistent, and the stream must be restarted).
+     */
+    bool DisplayXFBTileDedupDecoder::decode(const void* input, size_t size, void* pixels, size_t bytesPerRow)
+    {
+        const uint8_t* p = (const uint8_t*)input;
+        const uint8_t* end = p + size;
+        if (!p || !pixels || size < kHeaderSize || 0 != memcmp(p, kMagic, sizeof kMagic)) return false;
+        if (getU32(p + 4) != m_width || getU32(p + 8) != m_height || 0 == m_cache.capacity()) return false;
+
+        const unsigned tileSize = DisplayXFBTileDedupEncoder::kTileSize;
+        const unsigned tilesX = (m_width + tileSize - 1) / tileSize;
+        const unsigned tileCount = tilesX * ((m_height + tileSize - 1) / tileSize);
+        const size_t packedStride = tileSize * 4;
+        unsigned count = getU32(p + 12);
+        unsigned next = 0;
+        p += kHeaderSize;
+        for (unsigned i = 0; i < count; i++)
+        {
+            uint32_t gap = 0;
+            if (!getVarint(p, end, gap) || gap >= tileCount - next || p >= end) return false;
+            unsigned index = next + gap;
+            next = index + 1;
+
+            unsigned x = (index % tilesX) * tileSize;
+            unsigned y = (index / tilesX) * tileSize;
+            unsigned w = (x + tileSize > m_width) ? m_width - x : tileSize;
+            unsigned h = (y + tileSize > m_height) ? m_height - y : tileSize;
+            uint8_t* tile = (uint8_t*)pixels + ((size_t)y * bytesPerRow) + ((size_t)x * 4);
+
+            uint8_t op = *p++;
+            if (kOpSolid == op)
+            {
+                if (end - p < 3) return false;
+                uint32_t colour = 0xff000000u | (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+                p += 3;
+                for (unsigned row = 0; row < h; row++)
+                {
+                    uint32_t* out = (uint32_t*)(tile + (row * bytesPerRow));
+                    for (unsigned col = 0; col < w; col++) out[col] = colour;
+                }
+            }
+            else if (kOpCached == op)
+            {
+                uint32_t slot = 0;
+                if (!getVarint(p, end, slot) || slot >= m_cache.count()) return false;
+                copyTile(tile, bytesPerRow, (const uint8_t*)m_cache.pixels(slot), packedStride, w, h);
+                m_cache.touch(slot);
+            }
+            else if (kOpCoded == op)
+            {
+                uint32_t length = 0;
+                if (!getVarint(p, end, length) || length > (size_t)(end - p)) return false;
+                if (!DisplayXFBTileCodec::decode(p, length, tile, w, h, bytesPerRow)) return false;
+                p += length;
+
+                // The key only has to be unique: slot choice depends on the call order, not the key.
+                unsigned slot = m_cache.insert(m_inserted++);
+                copyTile((uint8_t*)m_cache.pixels(slot), packedStride, tile, bytesPerRow, w, h);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+}   // namespace
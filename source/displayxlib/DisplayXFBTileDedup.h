@@ -0,0 +1,127 @@
+/** @file   DisplayXFBTileDedup.h
+ *  @brief  Stream coding that replaces solid and repeated tiles with references.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBTileDedup_H
+#define COM_TSONIQ_DisplayXFBTileDedup_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DisplayXFBShadowFrame.h"
+#include "DisplayXFBTileCache.h"
+#include "DisplayXFBTileCodec.h"
+
+namespace ts
+{
+    /** Class used to code the changed tiles of a frame, sending each one as the cheapest of:
+     *
+     *      Solid       A single colour (from the tile's content description). Three bytes.
+     *      Cached      A slot in the tile cache, for a tile sent earlier (matched by hash). Typically two bytes.
+     *      Coded       The tile, coded with DisplayXFBTileCodec. The tile is then added to the cache.
+     *
+     *  The encoder and the decoder each run a DisplayXFBTileCache of the same capacity and make the same calls to it
+     *  in the same order, so a slot number refers to the same tile at both ends. The encoder holds only hashes; the
+     *  decoder holds the decoded pixels. Tiles are matched by their 64 bit hash alone.
+     *
+     *  Input comes from a DisplayXFBShadowFrame configured with kTileSize tiles and content description enabled, so
+     *  changes, hashes and solid tiles all come from its single pass over the framebuffer. A message is a 16 byte
+     *  header (magic, width, height, tile count) followed by, for each changed tile, the varint gap from the previous
+     *  tile index, a one byte operation and its operand.
+     *
+     *  encodeDirect() is the zero copy alternative: it reads the tiles in a dirty area straight from the mapped
+     *  framebuffer, with no shadow frame. Because the window server may be drawing while a tile is read, each tile is
+     *  hashed, coded and hashed again; a tile whose hash changed is read again, up to kDirectAttempts times. A tile
+     *  that never reads the same twice is left out and sent with the next message, so the output never contains a
+     *  torn tile. The messages are the same as encode()'s, so the two methods may be mixed from one frame to the next.
+     *  encode() sends, from the shadow frame, every tile that encodeDirect() deferred or sent since the last encode():
+     *  the shadow frame never saw those, so its change flags can not say whether the decoder's copy matches.
+     */
+    class DisplayXFBTileDedupEncoder
+    {
+    public:
+
+        static const unsigned kTileSize = DisplayXFBTileCodec::kTileSize;  //!< Tile width and height (pixels)
+        static const unsigned kDefaultCacheTiles = 4096;                    //!< Default cache capacity (tiles)
+        static const unsigned kDirectAttempts = 3;                          //!< Reads of an unstable tile before it is deferred
+
+        /** Counters, accumulated since the last configure() or reset().
+         */
+        struct Statistics
+        {
+            uint64_t m_frames;                          //!< Messages produced
+            uint64_t m_tiles;                           //!< Changed tiles sent
+            uint64_t m_solidTiles;                      //!< Tiles sent as a colour
+            uint64_t m_cachedTiles;                     //!< Tiles sent as a cache reference
+            uint64_t m_codedTiles;                      //!< Tiles sent coded
+            uint64_t m_bytes;                           //!< Message bytes produced
+            uint64_t m_codedBytes;                      //!< Bytes of coded tile data
+            uint64_t m_savedBytes;                      //!< Estimated bytes saved: coded tiles at their mean size, less references
+            uint64_t m_directRetries;                   //!< Tiles read again by encodeDirect() because they changed
+            uint64_t m_directDeferred;                  //!< Tiles left for the next message because they kept changing
+
+            Statistics() : m_frames(0), m_tiles(0), m_solidTiles(0), m_cachedTiles(0), m_codedTiles(0), m_bytes(0), m_codedBytes(0), m_savedBytes(0),
+                           m_directRetries(0), m_directDeferred(0) { }
+        };
+
+        DisplayXFBTileDedupEncoder();
+        ~DisplayXFBTileDedupEncoder();
+
+        bool configure(unsigned width, unsigned height, unsigned cacheTiles=kDefaultCacheTiles, unsigned quality=DisplayXFBTileCodec::kDefaultQuality);
+        void reset();
+        size_t maxEncodedSize() const;
+        size_t encode(const DisplayXFBShadowFrame& frame, void* output, size_t capacity);
+        size_t encodeDirect(const void* pixels, size_t bytesPerRow, unsigned x, unsigned y, unsigned width, unsigned height,
+                            void* output, size_t capacity);
+
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+        const DisplayXFBTileCache& cache() const { return m_cache; }            //!< Return the tile cache
+
+    private:
+
+        unsigned m_width;                               //!< Frame width (pixels)
+        unsigned m_height;                              //!< Frame height (pixels)
+        DisplayXFBTileCache m_cache;                    //!< Hashes of the tiles the decoder holds
+        DisplayXFBTileCodec m_codec;                    //!< Coder for tiles not in the cache
+        uint8_t* m_pending;                             //!< Per-tile kPendingXyz flags, set by encodeDirect()
+        unsigned m_deferredCount;                       //!< The number of tiles with kPendingDeferred set
+        unsigned m_directCount;                         //!< The number of tiles with kPendingDirect set
+        Statistics m_statistics;                        //!< The counters
+
+        uint8_t* emitTile(uint8_t* p, unsigned index, unsigned& next, const DisplayXFBTileContent& content, unsigned slot,
+                          uint64_t hash, const uint8_t* coded, size_t codedSize, uint64_t& referenceBytes, uint64_t& references);
+        size_t finish(uint8_t* start, uint8_t* end, unsigned count, uint64_t referenceBytes, uint64_t references);
+
+        DisplayXFBTileDedupEncoder(const DisplayXFBTileDedupEncoder&);              // Prevent copy constructor
+        DisplayXFBTileDedupEncoder& operator=(const DisplayXFBTileDedupEncoder&);   // Prevent assignment
+    };
+
+
+    /** Class used to decode messages from DisplayXFBTileDedupEncoder in to a frame, which must hold the previous
+     *  frame (only changed tiles are written).
+     */
+    class DisplayXFBTileDedupDecoder
+    {
+    public:
+
+        DisplayXFBTileDedupDecoder();
+
+        bool configure(unsigned width, unsigned height, unsigned cacheTiles=DisplayXFBTileDedupEncoder::kDefaultCacheTiles);
+        void reset();
+        bool decode(const void* input, size_t size, void* pixels, size_t bytesPerRow);
+
+    private:
+
+        unsigned m_width;                               //!< Frame width (pixels)
+        unsigned m_height;                              //!< Frame height (pixels)
+        uint64_t m_inserted;                            //!< Insertion counter, used as the cache key
+        DisplayXFBTileCache m_cache;                    //!< Pixels of the tiles received
+
+        DisplayXFBTileDedupDecoder(const DisplayXFBTileDedupDecoder&);              // Prevent copy constructor
+        DisplayXFBTileDedupDecoder& operator=(const DisplayXFBTileDedupDecoder&);   // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBTileDedup_H
@@ -0,0 +1,299 @@
+/** @file   DisplayXFBTileScheduler.cc
+ *  @brief  Ordering of dirty tiles for encoding, with priority around the cursor.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBTileScheduler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    static const int64_t kTierStep = (int64_t)1 << 40;     //!< Separates the priority tiers in a sort key
+    static const int64_t kTierBias = (int64_t)1 << 32;     //!< Keeps keys within a tier positive
+
+
+    DisplayXFBTileScheduler::DisplayXFBTileScheduler()
+        :
+        m_config(),
+        m_statistics(),
+        m_width(0),
+        m_height(0),
+        m_tilesX(0),
+        m_tilesY(0),
+        m_dirtySince(0),
+        m_candidates(0),
+        m_dirtyCount(0),
+        m_call(0),
+        m_hasCursor(false),
+        m_cursorX(0),
+        m_cursorY(0),
+        m_cursorImage(0),
+        m_cursorPixelSequence(0),
+        m_hasHotspot(false),
+        m_hotspotX(0),
+        m_hotspotY(0),
+        m_hasFocus(false),
+        m_focus()
+    {
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    DisplayXFBTileScheduler::~DisplayXFBTileScheduler()
+    {
+        release();
+        free(m_cursorImage);
+    }
+
+
+    /** Set the configuration and frame size. All tiles start clean.
+     *
+     *  @param  config          The configuration.
+     *  @param  width           The frame width (pixels).
+     *  @param  height          The frame height (pixels).
+     *  @return                 Logical true for success, false if the parameters are invalid or no memory is available.
+     */
+    bool DisplayXFBTileScheduler::configure(const Config& config, unsigned width, unsigned height)
+    {
+        release();
+        if (0 == config.m_tileSize || 0 == width || 0 == height) return false;
+
+        m_config = config;
+        m_width = width;
+        m_height = height;
+        m_tilesX = (width + config.m_tileSize - 1) / config.m_tileSize;
+        m_tilesY = (height + config.m_tileSize - 1) / config.m_tileSize;
+
+        size_t tiles = (size_t)m_tilesX * m_tilesY;
+        m_dirtySince = (uint32_t*)calloc(tiles, sizeof (uint32_t));
+        m_candidates = (Candidate*)malloc(tiles * sizeof (Candidate));
+        if (!m_dirtySince || !m_candidates)
+        {
+            release();
+            return false;
+        }
+        reset();
+        return true;
+    }
+
+
+    /** Mark all tiles clean and clear the counters. The cursor and focus are kept.
+     */
+    void DisplayXFBTileScheduler::reset()
+    {
+        if (m_dirtySince) memset(m_dirtySince, 0, (size_t)m_tilesX * m_tilesY * sizeof (uint32_t));
+        memset(&m_statistics, 0, sizeof m_statistics);
+        m_dirtyCount = 0;
+        m_call = 0;
+    }
+
+
+    /** Update the cursor position from the driver's cursor record. The record is shared with the driver, so it is
+     *  read with readState() and readImage(). If no consistent copy of the position can be made, the previous
+     *  position is kept. The image is only read again when its sequence number changes, as only the hot spot is
+     *  needed from it.
+     */
+    void DisplayXFBTileScheduler::setCursor(const DisplayXFBCursor& cursor)
+    {
+        if (!cursor.isValid())
+        {
+            m_hasCursor = false;
+            return;
+        }
+
+        int x;
+        int y;
+        bool visible;
+        uint32_t sequence;
+        if (!cursor.readState(x, y, visible, sequence)) return;
+
+        if (!m_hasHotspot || cursor.sequencePixel() != m_cursorPixelSequence)
+        {
+            if (!m_cursorImage) m_cursorImage = (uint32_t*)malloc(DisplayXFBCursor::kMaxWidth * DisplayXFBCursor::kMaxHeight * sizeof (uint32_t));
+            unsigned width;
+            unsigned height;
+            int hotX;
+            int hotY;
+            if (m_cursorImage && cursor.readImage(m_cursorImage, width, height, hotX, hotY, sequence))
+            {
+                m_hotspotX = hotX;
+                m_hotspotY = hotY;
+                m_cursorPixelSequence = sequence;
+                m_hasHotspot = true;
+            }
+            else
+            {
+                // No image yet (or it is being replaced): use the position alone and try again next time.
+                m_hotspotX = 0;
+                m_hotspotY = 0;
+            }
+        }
+
+        m_hasCursor = visible;
+        m_cursorX = x + m_hotspotX;
+        m_cursorY = y + m_hotspotY;
+    }
+
+
+    /** Set a focus region (for example the active window). Tiles overlapping it are treated as region of interest.
+     */
+    void DisplayXFBTileScheduler::setFocus(unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        if (0 == width || 0 == height || x >= m_width || y >= m_height)
+        {
+            m_hasFocus = false;
+            return;
+        }
+        unsigned x1 = (width > m_width - x) ? m_width - 1 : x + width - 1;
+        unsigned y1 = (height > m_height - y) ? m_height - 1 : y + height - 1;
+        m_focus[0] = x / m_config.m_tileSize;
+        m_focus[1] = y / m_config.m_tileSize;
+        m_focus[2] = x1 / m_config.m_tileSize;
+        m_focus[3] = y1 / m_config.m_tileSize;
+        m_hasFocus = true;
+    }
+
+
+    /** Mark the tiles overlapping a rectangle as dirty.
+     */
+    void DisplayXFBTileScheduler::markDirty(unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        if (0 == width || 0 == height || x >= m_width || y >= m_height) return;
+
+        unsigned x1 = (width > m_width - x) ? m_width - 1 : x + width - 1;
+        unsigned y1 = (height > m_height - y) ? m_height - 1 : y + height - 1;
+        for (unsigned ty = y / m_config.m_tileSize; ty <= y1 / m_config.m_tileSize; ty++)
+        {
+            for (unsigned tx = x / m_config.m_tileSize; tx <= x1 / m_config.m_tileSize; tx++) markTileDirty(tx, ty);
+        }
+    }
+
+
+    /** Mark one tile as dirty. A tile that is already dirty keeps its original age.
+     */
+    void DisplayXFBTileScheduler::markTileDirty(unsigned tileX, unsigned tileY)
+    {
+        if (tileX >= m_tilesX || tileY >= m_tilesY) return;
+
+        uint32_t& since = m_dirtySince[(tileY * m_tilesX) + tileX];
+        if (0 == since)
+        {
+            since = m_call + 1;
+            m_dirtyCount ++;
+        }
+    }
+
+
+    /** Choose the tiles to encode now. The chosen tiles are marked clean.
+     *
+     *  @param  baseQuality     The quality for tiles outside the region of interest (eg from the rate controller).
+     *  @param  budget          The largest number of tiles to return.
+     *  @param  entries         Returns the tiles, highest priority first.
+     *  @param  capacity        The size of the entries array.
+     *  @return                 The number of entries written.
+     */
+    unsigned DisplayXFBTileScheduler::schedule(unsigned baseQuality, unsigned budget, Entry* entries, unsigned capacity)
+    {
+        if (!m_dirtySince) return 0;
+        if (budget > capacity) budget = capacity;
+
+        // Build the candidate list.
+        int tileSize = (int)m_config.m_tileSize;
+        int64_t radius2 = (int64_t)m_config.m_roiRadius * m_config.m_roiRadius;
+        unsigned count = 0;
+        for (unsigned ty = 0; ty < m_tilesY; ty++)
+        {
+            for (unsigned tx = 0; tx < m_tilesX; tx++)
+            {
+                unsigned index = (ty * m_tilesX) + tx;
+                if (0 == m_dirtySince[index]) continue;
+
+                Candidate& c = m_candidates[count++];
+                unsigned age = m_call - (m_dirtySince[index] - 1);
+                c.m_index = index;
+                c.m_roi = false;
+                c.m_forced = (age >= m_config.m_maxDeferFrames);
+
+                int64_t distance = 0;
+                if (m_hasCursor)
+                {
+                    // Distance from the hot spot to the nearest point of the tile.
+                    int x0 = (int)tx * tileSize, y0 = (int)ty * tileSize;
+                    int dx = (m_cursorX < x0) ? x0 - m_cursorX : (m_cursorX >= x0 + tileSize) ? m_cursorX - (x0 + tileSize - 1) : 0;
+                    int dy = (m_cursorY < y0) ? y0 - m_cursorY : (m_cursorY >= y0 + tileSize) ? m_cursorY - (y0 + tileSize - 1) : 0;
+                    c.m_roi = ((int64_t)dx * dx) + ((int64_t)dy * dy) <= radius2;
+                    distance = ((dx > dy) ? dx : dy) / tileSize;
+                }
+                if (m_hasFocus && tx >= m_focus[0] && tx <= m_focus[2] && ty >= m_focus[1] && ty <= m_focus[3]) c.m_roi = true;
+
+                if (c.m_forced) c.m_key = kTierBias - age;
+                else if (c.m_roi) c.m_key = kTierStep + distance;
+                else c.m_key = (2 * kTierStep) + kTierBias + distance - ((int64_t)age * m_config.m_ageWeight);
+            }
+        }
+        qsort(m_candidates, count, sizeof (Candidate), compareCandidates);
+
+        // Emit the highest priority tiles.
+        unsigned boosted = baseQuality + m_config.m_roiQualityBoost;
+        if (boosted > 100) boosted = 100;
+        unsigned n = (count < budget) ? count : budget;
+        for (unsigned i = 0; i < n; i++)
+        {
+            const Candidate& c = m_candidates[i];
+            unsigned delay = m_call - (m_dirtySince[c.m_index] - 1);
+            entries[i].m_tileX = c.m_index % m_tilesX;
+            entries[i].m_tileY = c.m_index / m_tilesX;
+            entries[i].m_roi = c.m_roi;
+            entries[i].m_quality = (c.m_roi) ? boosted : baseQuality;
+            m_dirtySince[c.m_index] = 0;
+
+            if (c.m_forced) m_statistics.m_forcedTiles ++;
+            if (c.m_roi)
+            {
+                m_statistics.m_roiTiles ++;
+                m_statistics.m_roiDelay += delay;
+            }
+            else
+            {
+                m_statistics.m_otherTiles ++;
+                m_statistics.m_otherDelay += delay;
+            }
+            if (delay > m_statistics.m_maxDelay) m_statistics.m_maxDelay = delay;
+        }
+
+        m_dirtyCount -= n;
+        m_statistics.m_deferredTiles += m_dirtyCount;
+        m_statistics.m_calls ++;
+        m_call ++;
+        return n;
+    }
+
+
+    /** Free the tile arrays.
+     */
+    void DisplayXFBTileScheduler::release()
+    {
+        free(m_dirtySince);
+        free(m_candidates);
+        m_dirtySince = 0;
+        m_candidates = 0;
+        m_tilesX = 0;
+        m_tilesY = 0;
+        m_dirtyCount = 0;
+    }
+
+
+    /** qsort comparison: ascending key, then tile index (so that the order is deterministic).
+     */
+    int DisplayXFBTileScheduler::compareCandidates(const void* a, const void* b)
+    {
+        const Candidate* ca = (const Candidate*)a;
+        const Candidate* cb = (const Candidate*)b;
+        if (ca->m_key != cb->m_key) return (ca->m_key < cb->m_key) ? -1 : 1;
+        return (ca->m_index < cb->m_index) ? -1 : (ca->m_index > cb->m_index) ? 1 : 0;
+    }
+
+}   // namespace
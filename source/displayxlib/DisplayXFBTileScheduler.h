@@ -0,0 +1,133 @@
+/** @file   DisplayXFBTileScheduler.h
+ *  @brief  Ordering of dirty tiles for encoding, with priority around the cursor.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBTileScheduler_H
+#define COM_TSONIQ_DisplayXFBTileScheduler_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include "DisplayXFBShared.h"
+
+namespace ts
+{
+    /** Class used to decide which dirty tiles to encode next, and at what quality, when not all of them can be
+     *  sent at once.
+     *
+     *  Tiles are marked dirty as changes are found and stay dirty until scheduled. Each call to schedule() returns
+     *  up to a budget of tiles in priority order:
+     *
+     *      1.  Tiles that have been deferred for m_maxDeferFrames or more (oldest first), so nothing starves.
+     *      2.  Tiles within m_roiRadius of the cursor hot spot, or overlapping the client's focus region. These
+     *          are given a quality boost.
+     *      3.  Other tiles, nearest the cursor first, with each frame of waiting counting as m_ageWeight tiles of
+     *          distance.
+     *
+     *  Tiles that do not fit in the budget remain dirty for the next call. The statistics record the delay, in
+     *  schedule() calls, between a tile becoming dirty and being scheduled, separately for region of interest tiles
+     *  and other tiles. The class is not thread safe.
+     */
+    class DisplayXFBTileScheduler
+    {
+    public:
+
+        /** Configuration.
+         */
+        struct Config
+        {
+            unsigned m_tileSize;                        //!< Tile width and height (pixels)
+            unsigned m_roiRadius;                       //!< Radius of the region around the cursor (pixels)
+            unsigned m_roiQualityBoost;                 //!< Quality added to region of interest tiles
+            unsigned m_maxDeferFrames;                  //!< Calls after which a deferred tile is forced out
+            unsigned m_ageWeight;                       //!< Distance (tiles) forgiven per call of waiting
+
+            Config() : m_tileSize(16), m_roiRadius(160), m_roiQualityBoost(15), m_maxDeferFrames(30), m_ageWeight(2) { }
+        };
+
+        /** A scheduled tile.
+         */
+        struct Entry
+        {
+            unsigned m_tileX;                           //!< Tile column
+            unsigned m_tileY;                           //!< Tile row
+            unsigned m_quality;                         //!< Encoder quality for the tile
+            bool m_roi;                                 //!< Logical true if the tile is in the region of interest
+        };
+
+        /** Counters, accumulated since the last configure() or reset().
+         */
+        struct Statistics
+        {
+            uint64_t m_calls;                           //!< Calls to schedule()
+            uint64_t m_roiTiles;                        //!< Region of interest tiles scheduled
+            uint64_t m_otherTiles;                      //!< Other tiles scheduled
+            uint64_t m_forcedTiles;                     //!< Tiles scheduled because of m_maxDeferFrames
+            uint64_t m_deferredTiles;                   //!< Sum over calls of the tiles left dirty
+            uint64_t m_roiDelay;                        //!< Sum of delays for region of interest tiles (calls)
+            uint64_t m_otherDelay;                      //!< Sum of delays for other tiles (calls)
+            unsigned m_maxDelay;                        //!< Longest delay seen (calls)
+        };
+
+        DisplayXFBTileScheduler();
+        ~DisplayXFBTileScheduler();
+
+        bool configure(const Config& config, unsigned width, unsigned height);
+        void reset();
+
+        void setCursor(const DisplayXFBCursor& cursor);
+        void setFocus(unsigned x, unsigned y, unsigned width, unsigned height);
+        void clearFocus() { m_hasFocus = false; }                               //!< Remove the focus region
+
+        void markDirty(unsigned x, unsigned y, unsigned width, unsigned height);
+        void markTileDirty(unsigned tileX, unsigned tileY);
+        unsigned dirtyCount() const { return m_dirtyCount; }                    //!< Return the number of dirty tiles
+
+        unsigned schedule(unsigned baseQuality, unsigned budget, Entry* entries, unsigned capacity);
+
+        unsigned tilesX() const { return m_tilesX; }                            //!< Return the number of tile columns
+        unsigned tilesY() const { return m_tilesY; }                            //!< Return the number of tile rows
+        const Statistics& statistics() const { return m_statistics; }           //!< Return the counters
+
+    private:
+
+        struct Candidate
+        {
+            int64_t m_key;                              //!< Sort key (lowest first)
+            unsigned m_index;                           //!< Tile index
+            bool m_roi;                                 //!< Region of interest tile
+            bool m_forced;                              //!< Deferred for too long
+        };
+
+        Config m_config;                                //!< The configuration
+        Statistics m_statistics;                        //!< The counters
+        unsigned m_width;                               //!< Frame width (pixels)
+        unsigned m_height;                              //!< Frame height (pixels)
+        unsigned m_tilesX;                              //!< Number of tile columns
+        unsigned m_tilesY;                              //!< Number of tile rows
+        uint32_t* m_dirtySince;                         //!< Per tile: call count when marked dirty + 1, or 0 if clean
+        Candidate* m_candidates;                        //!< Scratch for schedule()
+        unsigned m_dirtyCount;                          //!< Number of dirty tiles
+        uint32_t m_call;                                //!< Number of schedule() calls
+        bool m_hasCursor;                               //!< Logical true if the cursor is visible
+        int m_cursorX;                                  //!< Cursor hot spot (pixels)
+        int m_cursorY;                                  //!< Cursor hot spot (pixels)
+        uint32_t* m_cursorImage;                        //!< Scratch for reading the cursor image (allocated on first use)
+        uint32_t m_cursorPixelSequence;                 //!< Cursor image sequence number of m_hotspotX/Y
+        bool m_hasHotspot;                              //!< Logical true if m_hotspotX/Y are valid
+        int m_hotspotX;                                 //!< Cursor hot spot offset within the image (pixels)
+        int m_hotspotY;                                 //!< Cursor hot spot offset within the image (pixels)
+        bool m_hasFocus;                                //!< Logical true if a focus region is set
+        unsigned m_focus[4];                            //!< Focus region in tiles (x0, y0, x1, y1), inclusive
+
+        void release();
+        static int compareCandidates(const void* a, const void* b);
+
+        DisplayXFBTileScheduler(const DisplayXFBTileScheduler&);            // Prevent copy constructor
+        DisplayXFBTileScheduler& operator=(const DisplayXFBTileScheduler&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBTileScheduler_H
@@ -0,0 +1,340 @@
+/** @file   DisplayXFBWallCapture.cc
+ *  @brief  Capture of several displays in to one stitched frame.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#include "DisplayXFBWallCapture.h"
+#include "DisplayXFBCursorChannel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace ts
+{
+    DisplayXFBWallCapture::DisplayXFBWallCapture(DisplayXFBInterface& displayInterface)
+        :
+        m_interface(displayInterface),
+        m_output(0),
+        m_width(0),
+        m_height(0),
+        m_bytesPerRow(0),
+        m_drawCursor(true),
+        m_cursorImage((uint32_t*)malloc(DisplayXFBCursor::kMaxWidth * DisplayXFBCursor::kMaxHeight * sizeof (uint32_t))),
+        m_displays(),
+        m_statistics()
+    {
+        memset(m_displays, 0, sizeof m_displays);
+        memset(&m_statistics, 0, sizeof m_statistics);
+    }
+
+
+    DisplayXFBWallCapture::~DisplayXFBWallCapture()
+    {
+        free(m_cursorImage);
+    }
+
+
+    /** Set the output frame. The next capture copies every display in full.
+     *
+     *  @param  pixels          The output (32 bit BGRA), owned by the caller.
+     *  @param  width           The output width (pixels).
+     *  @param  height          The output height (pixels).
+     *  @param  bytesPerRow     The output stride (bytes).
+     *  @return                 Logical true for success, false if the parameters are invalid.
+     */
+    bool DisplayXFBWallCapture::setOutput(void* pixels, unsigned width, unsigned height, size_t bytesPerRow)
+    {
+        if (!pixels || 0 == width || 0 == height || bytesPerRow < width * 4) return false;
+        m_output = (uint8_t*)pixels;
+        m_width = width;
+        m_height = height;
+        m_bytesPerRow = bytesPerRow;
+        invalidate();
+        return true;
+    }
+
+
+    /** Place a display in the output.
+     *
+     *  @param  displayIndex    The display.
+     *  @param  x               The position of the display's top left in the output (pixels, may be negative).
+     *  @param  y               ..
+     */
+    void DisplayXFBWallCapture::setPlacement(unsigned displayIndex, int x, int y)
+    {
+        if (displayIndex >= kDisplayXFBMaxDisplays) return;
+        m_displays[displayIndex].m_placed = true;
+        m_displays[displayIndex].m_x = x;
+        m_displays[displayIndex].m_y = y;
+        m_displays[displayIndex].m_valid = false;
+    }
+
+
+    /** Remove a display from the output. Its area is left as it is.
+     */
+    void DisplayXFBWallCapture::clearPlacement(unsigned displayIndex)
+    {
+        if (displayIndex >= kDisplayXFBMaxDisplays) return;
+        m_displays[displayIndex].m_placed = false;
+    }
+
+
+    /** Place a set of displays as they are arranged in the Quartz global display space, with the top left of the
+     *  combined bounds at the origin of the output. Displays not in the set, and inactive displays, are removed.
+     *
+     *  @param  displayMask     Bit mask of the display indices to use.
+     *  @param  width           Returns the output size needed (pixels).
+     *  @param  height          ..
+     *  @return                 Logical true for success, false if none of the displays is active.
+     */
+    bool DisplayXFBWallCapture::arrangeFromQuartz(unsigned displayMask, unsigned& width, unsigned& height)
+    {
+        CGRect bounds[kDisplayXFBMaxDisplays];
+        bool active[kDisplayXFBMaxDisplays];
+        CGFloat minX = 0, minY = 0, maxX = 0, maxY = 0;
+        bool found = false;
+
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+        {
+            CGDirectDisplayID displayID;
+            active[i] = (0 != (displayMask & (1u << i))) && DisplayXFBInterface::displayIndexToID(displayID, i);
+            if (!active[i]) continue;
+
+            bounds[i] = CGDisplayBounds(displayID);
+            if (!found || CGRectGetMinX(bounds[i]) < minX) minX = CGRectGetMinX(bounds[i]);
+            if (!found || CGRectGetMinY(bounds[i]) < minY) minY = CGRectGetMinY(bounds[i]);
+            if (!found || CGRectGetMaxX(bounds[i]) > maxX) maxX = CGRectGetMaxX(bounds[i]);
+            if (!found || CGRectGetMaxY(bounds[i]) > maxY) maxY = CGRectGetMaxY(bounds[i]);
+            found = true;
+        }
+        if (!found) return false;
+
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+        {
+            if (active[i]) setPlacement(i, (int)(CGRectGetMinX(bounds[i]) - minX), (int)(CGRectGetMinY(bounds[i]) - minY));
+            else clearPlacement(i);
+        }
+        width = (unsigned)(maxX - minX);
+        height = (unsigned)(maxY - minY);
+        return true;
+    }
+
+
+    /** Force the next capture to copy every display in full.
+     */
+    void DisplayXFBWallCapture::invalidate()
+    {
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++) m_displays[i].m_valid = false;
+    }
+
+
+    /** Bring the output up to date.
+     *
+     *  @return                 The number of displays that were copied to (in part or in full).
+     */
+    unsigned DisplayXFBWallCapture::capture()
+    {
+        m_statistics.m_captures ++;
+        if (!m_output) return 0;
+
+        unsigned updated = 0;
+        for (unsigned i = 0; i < kDisplayXFBMaxDisplays; i++)
+        {
+            Display& display = m_displays[i];
+            if (!display.m_placed) continue;
+
+            DisplayXFBState state;
+            unsigned modeGeneration = 0;
+            DisplayXFBMap map;
+            if (!m_interface.displayGetStatus(state, modeGeneration, i) || !state.isConnected() ||
+                !m_interface.displayMapFramebuffer(map, i, true) || map.size() < state.offset() + state.bytesPerFrame())
+            {
+                display.m_valid = false;
+                display.m_cursorDrawn = false;
+                continue;
+            }
+            const uint8_t* framebuffer = (const uint8_t*)(uintptr_t)map.address() + state.offset();
+
+            unsigned sequence = 0, x = 0, y = 0, width = 0, height = 0;
+            bool haveChange = m_interface.displayGetFrameChangesSince(display.m_frameSequence, sequence, x, y, width, height, i);
+            bool full = !display.m_valid || modeGeneration != display.m_modeGeneration || !haveChange ||
+                        (width >= state.width() && height >= state.height());
+
+            bool copied = false;
+            if (full)
+            {
+                copied = copyArea(i, state, framebuffer, 0, 0, state.width(), state.height());
+                m_statistics.m_fullUpdates ++;
+            }
+            else
+            {
+                copied = copyArea(i, state, framebuffer, x, y, width, height);
+                if (display.m_cursorDrawn)
+                {
+                    // Restore the pixels under the cursor drawn last time.
+                    const unsigned* r = display.m_cursorRect;
+                    copied |= copyArea(i, state, framebuffer, r[0], r[1], r[2], r[3]);
+                }
+                copied |= verifyBand(i, state, framebuffer);
+            }
+            display.m_cursorDrawn = false;
+
+            display.m_valid = true;
+            display.m_modeGeneration = modeGeneration;
+            display.m_frameSequence = haveChange ? sequence : 0;
+            if (copied)
+            {
+                m_statistics.m_displayUpdates ++;
+                updated ++;
+            }
+
+            if (m_drawCursor) drawCursor(i, state);
+        }
+        return updated;
+    }
+
+
+    /** Round an area of a display out to whole tiles and clip it to the display and the output.
+     *
+     *  @param  x0              Returns the clipped area (display pixels, x0 and y0 inclusive, x1 and y1 exclusive).
+     *  @param  y0              ..
+     *  @param  x1              ..
+     *  @param  y1              ..
+     *  @return                 Logical true if anything is left after clipping.
+     */
+    bool DisplayXFBWallCapture::clipArea(const Display& display, const DisplayXFBState& state, unsigned x, unsigned y,
+                                         unsigned width, unsigned height, int& x0, int& y0, int& x1, int& y1) const
+    {
+        if (0 == width || 0 == height || x >= state.width() || y >= state.height()) return false;
+
+        // Display coordinates, tile aligned and clipped to the display.
+        x0 = (int)((x / kTileSize) * kTileSize);
+        y0 = (int)((y / kTileSize) * kTileSize);
+        x1 = (int)((((x + width) + kTileSize - 1) / kTileSize) * kTileSize);
+        y1 = (int)((((y + height) + kTileSize - 1) / kTileSize) * kTileSize);
+        if (x1 > (int)state.width()) x1 = (int)state.width();
+        if (y1 > (int)state.height()) y1 = (int)state.height();
+
+        // Clip to the output.
+        if (display.m_x + x0 < 0) x0 = -display.m_x;
+        if (display.m_y + y0 < 0) y0 = -display.m_y;
+        if (display.m_x + x1 > (int)m_width) x1 = (int)m_width - display.m_x;
+        if (display.m_y + y1 > (int)m_height) y1 = (int)m_height - display.m_y;
+        return x0 < x1 && y0 < y1;
+    }
+
+
+    /** Copy part of a display to the output, rounded out to whole tiles and clipped to the display and the output.
+     *
+     *  @return                 Logical true if anything was copied.
+     */
+    bool DisplayXFBWallCapture::copyArea(unsigned displayIndex, const DisplayXFBState& state, const uint8_t* framebuffer,
+                                         unsigned x, unsigned y, unsigned width, unsigned height)
+    {
+        const Display& display = m_displays[displayIndex];
+        int x0, y0, x1, y1;
+        if (!clipArea(display, state, x, y, width, height, x0, y0, x1, y1)) return false;
+
+        size_t rowBytes = (size_t)(x1 - x0) * 4;
+        size_t srcStride = state.bytesPerRow();
+        const uint8_t* src = framebuffer + ((size_t)y0 * srcStride) + ((size_t)x0 * 4);
+        uint8_t* dst = m_output + ((size_t)(display.m_y + y0) * m_bytesPerRow) + ((size_t)(display.m_x + x0) * 4);
+        for (int row = y0; row < y1; row++)
+        {
+            memcpy(dst, src, rowBytes);
+            src += srcStride;
+            dst += m_bytesPerRow;
+        }
+        m_statistics.m_bytesCopied += rowBytes * (size_t)(y1 - y0);
+        return true;
+    }
+
+
+    /** Compare the next band of tile rows of a display with the output, copying any rows that differ. This picks
+     *  up changes that the driver's sampling missed.
+     *
+     *  @return                 Logical true if anything was copied.
+     */
+    bool DisplayXFBWallCapture::verifyBand(unsigned displayIndex, const DisplayXFBState& state, const uint8_t* framebuffer)
+    {
+        Display& display = m_displays[displayIndex];
+        unsigned tileRows = (state.height() + kTileSize - 1) / kTileSize;
+        unsigned bandRows = (tileRows + kVerifyCaptures - 1) / kVerifyCaptures;
+        if (display.m_verifyRow >= tileRows) display.m_verifyRow = 0;
+        unsigned first = display.m_verifyRow;
+        unsigned last = (first + bandRows < tileRows) ? first + bandRows : tileRows;
+        display.m_verifyRow = last;
+
+        bool repaired = false;
+        size_t srcStride = state.bytesPerRow();
+        for (unsigned tileRow = first; tileRow < last; tileRow++)
+        {
+            int x0, y0, x1, y1;
+            if (!clipArea(display, state, 0, tileRow * kTileSize, state.width(), kTileSize, x0, y0, x1, y1)) continue;
+
+            size_t rowBytes = (size_t)(x1 - x0) * 4;
+            const uint8_t* src = framebuffer + ((size_t)y0 * srcStride) + ((size_t)x0 * 4);
+            const uint8_t* dst = m_output + ((size_t)(display.m_y + y0) * m_bytesPerRow) + ((size_t)(display.m_x + x0) * 4);
+            int row = y0;
+            while (row < y1 && 0 == memcmp(dst, src, rowBytes))
+            {
+                src += srcStride;
+                dst += m_bytesPerRow;
+                row ++;
+            }
+            if (row < y1) repaired |= copyArea(displayIndex, state, framebuffer, 0, tileRow * kTileSize, state.width(), kTileSize);
+        }
+        if (repaired) m_statistics.m_verifyRepairs ++;
+        return repaired;
+    }
+
+
+    /** Blend a display's cursor in to the output, if the display is currently showing it.
+     */
+    void DisplayXFBWallCapture::drawCursor(unsigned displayIndex, const DisplayXFBState& state)
+    {
+        DisplayXFBMap map;
+        if (!m_cursorImage || !m_interface.displayMapCursor(map, displayIndex, true) || map.size() < sizeof (DisplayXFBCursor)) return;
+
+        const DisplayXFBCursor* cursor = (const DisplayXFBCursor*)(uintptr_t)map.address();
+        int x = 0, y = 0, hotX = 0, hotY = 0;
+        bool visible = false;
+        unsigned width = 0, height = 0;
+        uint32_t sequence = 0;
+        if (!cursor->isValid() || !cursor->readState(x, y, visible, sequence) || !visible) return;
+        if (!cursor->readImage(m_cursorImage, width, height, hotX, hotY, sequence) || 0 == width || 0 == height) return;
+
+        // Clip the cursor to the display, so that it never overwrites a neighbouring display.
+        int x0 = (x < 0) ? 0 : x;
+        int y0 = (y < 0) ? 0 : y;
+        int x1 = x + (int)width;
+        int y1 = y + (int)height;
+        if (x1 > (int)state.width()) x1 = (int)state.width();
+        if (y1 > (int)state.height()) y1 = (int)state.height();
+        if (x0 >= x1 || y0 >= y1) return;
+
+        Display& display = m_displays[displayIndex];
+        int ox0 = display.m_x + x0, oy0 = display.m_y + y0;
+        int ox1 = display.m_x + x1, oy1 = display.m_y + y1;
+        if (ox0 < 0) ox0 = 0;
+        if (oy0 < 0) oy0 = 0;
+        if (ox1 > (int)m_width) ox1 = (int)m_width;
+        if (oy1 > (int)m_height) oy1 = (int)m_height;
+        if (ox0 >= ox1 || oy0 >= oy1) return;
+
+        // Blend in to the clipped output window. The image offset accounts for any part clipped off the top left.
+        const uint32_t* image = m_cursorImage + ((size_t)(oy0 - (display.m_y + y)) * width) + (ox0 - (display.m_x + x));
+        uint8_t* window = m_output + ((size_t)oy0 * m_bytesPerRow) + ((size_t)ox0 * 4);
+        DisplayXFBCursorOverlay::blend(image, (unsigned)(ox1 - ox0), (unsigned)(oy1 - oy0), width, 0, 0,
+                                       window, (unsigned)(ox1 - ox0), (unsigned)(oy1 - oy0), m_bytesPerRow);
+
+        display.m_cursorDrawn = true;
+        display.m_cursorRect[0] = (unsigned)(ox0 - display.m_x);
+        display.m_cursorRect[1] = (unsigned)(oy0 - display.m_y);
+        display.m_cursorRect[2] = (unsigned)(ox1 - ox0);
+        display.m_cursorRect[3] = (unsigned)(oy1 - oy0);
+        m_statistics.m_cursorDraws ++;
+    }
+
+}   // namespace
@@ -0,0 +1,101 @@
+/** @file   DisplayXFBWallCapture.h
+ *  @brief  Capture of several displays in to one stitched frame.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBWallCapture_H
+#define COM_TSONIQ_DisplayXFBWallCapture_H   (1)
+
+#include "DisplayXFBInterface.h"
+
+namespace ts
+{
+    /** Class used to capture a set of displays directly in to one large output frame (a video wall).
+     *
+     *  Each display is given an offset in the output, either explicitly or from the Quartz display arrangement.
+     *  capture() copies each display's changed area straight from the mapped framebuffer to its place in the
+     *  output. There are no intermediate buffers, so each changed pixel is copied exactly once. The changed area
+     *  is the union of the driver's dirty bounding boxes since the previous capture (see
+     *  DisplayXFBInterface::displayGetFrameChangesSince()) rounded out to kTileSize. The whole display is copied
+     *  after a mode change, after falling too far behind the driver's change history, and after invalidate().
+     *
+     *  The driver finds changes by sampling, so it can miss small ones. Each capture therefore also compares a
+     *  band of tile rows of the output with the framebuffer and copies any rows that differ, so that the whole of
+     *  each display is verified once every kVerifyCaptures captures.
+     *
+     *  The driver uses a hardware cursor, so framebuffers never contain it. If cursor drawing is enabled, the
+     *  cursor of whichever display currently shows it is blended in to the output. The pixels it covered are
+     *  copied again from the framebuffer on the next capture. The class is not thread safe.
+     */
+    class DisplayXFBWallCapture
+    {
+    public:
+
+        static const unsigned kTileSize = 16;                           //!< Granularity of partial copies (pixels)
+        static const unsigned kVerifyCaptures = 30;                     //!< Captures taken to verify a whole display
+
+        /** Counters, accumulated since construction.
+         */
+        struct Statistics
+        {
+            uint64_t m_captures;                                        //!< Calls to capture()
+            uint64_t m_displayUpdates;                                  //!< Displays copied (in part or in full)
+            uint64_t m_fullUpdates;                                     //!< Displays copied in full
+            uint64_t m_bytesCopied;                                     //!< Framebuffer bytes copied
+            uint64_t m_cursorDraws;                                     //!< Cursors blended in to the output
+            uint64_t m_verifyRepairs;                                   //!< Displays repaired after a missed change
+        };
+
+        explicit DisplayXFBWallCapture(DisplayXFBInterface& displayInterface);
+        ~DisplayXFBWallCapture();
+
+        bool setOutput(void* pixels, unsigned width, unsigned height, size_t bytesPerRow);
+        void setPlacement(unsigned displayIndex, int x, int y);
+        void clearPlacement(unsigned displayIndex);
+        bool arrangeFromQuartz(unsigned displayMask, unsigned& width, unsigned& height);
+        void setCursorEnabled(bool enable) { m_drawCursor = enable; }   //!< Enable or disable cursor drawing
+        void invalidate();
+
+        unsigned capture();
+        const Statistics& statistics() const { return m_statistics; }   //!< Return the counters
+
+    private:
+
+        struct Display
+        {
+            bool m_placed;                                              //!< Logical true if the display is in the wall
+            int m_x;                                                    //!< Offset of the display in the output
+            int m_y;                                                    //!< ..
+            bool m_valid;                                               //!< Logical true if the output holds a full copy
+            unsigned m_modeGeneration;                                  //!< Mode generation of that copy
+            unsigned m_frameSequence;                                   //!< Frame sequence of that copy
+            unsigned m_verifyRow;                                       //!< Next tile row to verify
+            bool m_cursorDrawn;                                         //!< Logical true if a cursor was drawn over the copy
+            unsigned m_cursorRect[4];                                   //!< Area it covered (display pixels: x, y, width, height)
+        };
+
+        DisplayXFBInterface& m_interface;                               //!< The driver connection
+        uint8_t* m_output;                                              //!< The output frame
+        unsigned m_width;                                               //!< Output width (pixels)
+        unsigned m_height;                                              //!< Output height (pixels)
+        size_t m_bytesPerRow;                                           //!< Output stride (bytes)
+        bool m_drawCursor;                                              //!< Logical true to draw the cursor
+        uint32_t* m_cursorImage;                                        //!< Scratch copy of a cursor image
+        Display m_displays[kDisplayXFBMaxDisplays];                     //!< Per display state
+        Statistics m_statistics;                                        //!< The counters
+
+        bool clipArea(const Display& display, const DisplayXFBState& state, unsigned x, unsigned y, unsigned width,
+                      unsigned height, int& x0, int& y0, int& x1, int& y1) const;
+        bool copyArea(unsigned displayIndex, const DisplayXFBState& state, const uint8_t* framebuffer,
+                      unsigned x, unsigned y, unsigned width, unsigned height);
+        bool verifyBand(unsigned displayIndex, const DisplayXFBState& state, const uint8_t* framebuffer);
+        void drawCursor(unsigned displayIndex, const DisplayXFBState& state);
+
+        DisplayXFBWallCapture(const DisplayXFBWallCapture&);            // Prevent copy constructor
+        DisplayXFBWallCapture& operator=(const DisplayXFBWallCapture&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBWallCapture_H
@@ -0,0 +1,410 @@
+/** @file   DisplayXFBWorkerGroup.cc
+ *  @brief  Per-display capture worker threads with core and memory node placement.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "DisplayXFBWorkerGroup.h"
+#include "DisplayXFBPageAllocator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace ts
+{
+    static const unsigned char kNoNode = 0xff;              //!< Marks a core that is not online
+
+
+    /** Arguments for touchPages().
+     */
+    struct TouchRequest
+    {
+        volatile uint8_t* m_ptr;                            //!< The buffer
+        size_t m_size;                                      //!< The buffer size (bytes)
+    };
+
+
+    /** Fault in every page of a buffer from the calling thread.
+     */
+    static void touchPages(void* context)
+    {
+        TouchRequest* request = (TouchRequest*)context;
+        size_t step = (size_t)getpagesize();
+        for (size_t offset = 0; offset < request->m_size; offset += step) request->m_ptr[offset] = 0;
+    }
+
+
+    DisplayXFBWorkerGroup::DisplayXFBWorkerGroup()
+        :
+        m_workers(),
+        m_workerCount(0),
+        m_nodeCount(0),
+        m_cpuNode()
+    {
+        for (unsigned i = 0; i < kMaxWorkers; i++) m_workers[i] = 0;
+        discoverTopology();
+    }
+
+
+    DisplayXFBWorkerGroup::~DisplayXFBWorkerGroup()
+    {
+        stop();
+    }
+
+
+    /** Create the workers.
+     *
+     *  @param  displayCount    The number of displays (one worker each).
+     *  @param  pin             Logical true to bind each worker to its core set, false to leave placement to the OS.
+     *  @return                 Logical true for success. Failure to bind is not an error (see placement()).
+     */
+    bool DisplayXFBWorkerGroup::start(unsigned displayCount, bool pin)
+    {
+        stop();
+        if (0 == displayCount || displayCount > kMaxWorkers) return false;
+
+        for (unsigned i = 0; i < displayCount; i++)
+        {
+            Worker* worker = new Worker;
+            worker->m_group = this;
+            pthread_mutex_init(&worker->m_lock, 0);
+            pthread_cond_init(&worker->m_wake, 0);
+            pthread_cond_init(&worker->m_idle, 0);
+            worker->m_head = 0;
+            worker->m_tail = 0;
+            worker->m_busy = true;                          // Cleared by the thread once it has bound itself
+            worker->m_stop = false;
+            memset(&worker->m_placement, 0, sizeof worker->m_placement);
+            worker->m_placement.m_displayIndex = i;
+            worker->m_placement.m_node = -1;
+            memset(worker->m_cpus, 0, sizeof worker->m_cpus);
+            m_workers[i] = worker;
+        }
+        if (pin) assign(displayCount);
+
+        for (unsigned i = 0; i < displayCount; i++)
+        {
+            if (0 != pthread_create(&m_workers[i]->m_thread, 0, threadEntry, m_workers[i]))
+            {
+                for (unsigned j = i; j < displayCount; j++)
+                {
+                    pthread_cond_destroy(&m_workers[j]->m_idle);
+                    pthread_cond_destroy(&m_workers[j]->m_wake);
+                    pthread_mutex_destroy(&m_workers[j]->m_lock);
+                    delete m_workers[j];
+                    m_workers[j] = 0;
+                }
+                m_workerCount = i;
+                stop();
+                return false;
+            }
+            m_workerCount = i + 1;
+        }
+        for (unsigned i = 0; i < displayCount; i++) wait(i);
+        return true;
+    }
+
+
+    /** Finish all queued work and end the workers.
+     */
+    void DisplayXFBWorkerGroup::stop()
+    {
+        for (unsigned i = 0; i < m_workerCount; i++)
+        {
+            Worker* worker = m_workers[i];
+            pthread_mutex_lock(&worker->m_lock);
+            worker->m_stop = true;
+            pthread_cond_signal(&worker->m_wake);
+            pthread_mutex_unlock(&worker->m_lock);
+            pthread_join(worker->m_thread, 0);
+
+            pthread_cond_destroy(&worker->m_idle);
+            pthread_cond_destroy(&worker->m_wake);
+            pthread_mutex_destroy(&worker->m_lock);
+            delete worker;
+            m_workers[i] = 0;
+        }
+        m_workerCount = 0;
+    }
+
+
+    /** Queue work to run on a display's worker. Work for one display runs in submission order.
+     *
+     *  @param  displayIndex    The display.
+     *  @param  work            The function to call.
+     *  @param  context         The function argument.
+     *  @return                 Logical true for success, false if there is no such worker or no memory.
+     */
+    bool DisplayXFBWorkerGroup::submit(unsigned displayIndex, Work work, void* context)
+    {
+        if (displayIndex >= m_workerCount || !work) return false;
+
+        Job* job = (Job*)malloc(sizeof (Job));
+        if (!job) return false;
+        job->m_work = work;
+        job->m_context = context;
+        job->m_next = 0;
+
+        Worker* worker = m_workers[displayIndex];
+        pthread_mutex_lock(&worker->m_lock);
+        if (worker->m_tail) worker->m_tail->m_next = job;
+        else worker->m_head = job;
+        worker->m_tail = job;
+        pthread_cond_signal(&worker->m_wake);
+        pthread_mutex_unlock(&worker->m_lock);
+        return true;
+    }
+
+
+    /** Wait until all work queued for a display has completed.
+     */
+    void DisplayXFBWorkerGroup::wait(unsigned displayIndex)
+    {
+        if (displayIndex >= m_workerCount) return;
+
+        Worker* worker = m_workers[displayIndex];
+        pthread_mutex_lock(&worker->m_lock);
+        while (worker->m_head || worker->m_busy) pthread_cond_wait(&worker->m_idle, &worker->m_lock);
+        pthread_mutex_unlock(&worker->m_lock);
+    }
+
+
+    /** Allocate a buffer resident on a display's memory node.
+     *
+     *  @param  displayIndex    The display.
+     *  @param  size            The buffer size (bytes).
+     *  @return                 The buffer (zero filled), or zero if no memory is available. Free with release().
+     */
+    void* DisplayXFBWorkerGroup::allocate(unsigned displayIndex, size_t size)
+    {
+        void* ptr = DisplayXFBPageAllocator::allocate(size);
+        if (ptr && displayIndex < m_workerCount)
+        {
+            // The pages are not yet backed; have the display's worker fault them in so they land on its node.
+            TouchRequest request;
+            request.m_ptr = (volatile uint8_t*)ptr;
+            request.m_size = size;
+            if (submit(displayIndex, touchPages, &request)) wait(displayIndex);
+        }
+        return ptr;
+    }
+
+
+    /** Free a buffer returned by allocate().
+     */
+    void DisplayXFBWorkerGroup::release(void* ptr, size_t size)
+    {
+        if (ptr) DisplayXFBPageAllocator::release(ptr, size);
+    }
+
+
+    /** Return a display's placement.
+     *
+     *  @param  placement       Returns the placement.
+     *  @param  displayIndex    The display.
+     *  @return                 Logical true for success, false if there is no such worker.
+     */
+    bool DisplayXFBWorkerGroup::placement(Placement& placement, unsigned displayIndex) const
+    {
+        if (displayIndex >= m_workerCount) return false;
+
+        Worker* worker = m_workers[displayIndex];
+        pthread_mutex_lock(&worker->m_lock);
+        placement = worker->m_placement;
+        pthread_mutex_unlock(&worker->m_lock);
+        return true;
+    }
+
+
+    /** Write a readable summary of the topology and of each worker's placement.
+     *
+     *  @param  buffer          The output buffer (always zero terminated if length is non-zero).
+     *  @param  length          The buffer size (bytes).
+     *  @return                 The length of the complete report, excluding the terminator. If this is not less
+     *                          than length, the output was truncated.
+     */
+    size_t DisplayXFBWorkerGroup::report(char* buffer, size_t length) const
+    {
+        size_t total = 0;
+        int n = snprintf(buffer, length, "%u node(s), %u worker(s)\n", m_nodeCount, m_workerCount);
+        if (n > 0) total += (size_t)n;
+
+        for (unsigned i = 0; i < m_workerCount; i++)
+        {
+            Placement p;
+            placement(p, i);
+            char* out = (total < length) ? buffer + total : 0;
+            size_t space = (total < length) ? length - total : 0;
+            if (p.m_cpuCount)
+            {
+                n = snprintf(out, space, "display %u: node %d, %u cpu(s) from cpu %u, %s, %llu job(s)\n",
+                             p.m_displayIndex, p.m_node, p.m_cpuCount, p.m_firstCpu,
+                             p.m_pinned ? "pinned" : "not pinned", (unsigned long long)p.m_completed);
+            }
+            else
+            {
+                n = snprintf(out, space, "display %u: unpinned, %llu job(s)\n",
+                             p.m_displayIndex, (unsigned long long)p.m_completed);
+            }
+            if (n > 0) total += (size_t)n;
+        }
+        return total;
+    }
+
+
+    /** Find the memory node of each online core.
+     */
+    void DisplayXFBWorkerGroup::discoverTopology()
+    {
+        memset(m_cpuNode, kNoNode, sizeof m_cpuNode);
+        m_nodeCount = 0;
+
+#if defined(__linux__)
+        for (unsigned node = 0; node < kMaxCpus && m_nodeCount < kNoNode; node++)
+        {
+            char path[64];
+            snprintf(path, sizeof path, "/sys/devices/system/node/node%u/cpulist", node);
+            FILE* file = fopen(path, "r");
+            if (!file) continue;
+
+            // The list has the form "0-7,16-23".
+            bool found = false;
+            unsigned first, last;
+            int c;
+            while (1 == fscanf(file, "%u", &first))
+            {
+                last = first;
+                c = fgetc(file);
+                if ('-' == c)
+                {
+                    if (1 != fscanf(file, "%u", &last)) break;
+                    c = fgetc(file);
+                }
+                for (unsigned cpu = first; cpu <= last && cpu < kMaxCpus; cpu++)
+                {
+                    m_cpuNode[cpu] = (unsigned char)m_nodeCount;
+                    found = true;
+                }
+                if (',' != c) break;
+            }
+            fclose(file);
+            if (found) m_nodeCount ++;
+        }
+#endif
+
+        if (0 == m_nodeCount)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            if (cpus < 1) cpus = 1;
+            for (long cpu = 0; cpu < cpus && cpu < (long)kMaxCpus; cpu++) m_cpuNode[cpu] = 0;
+            m_nodeCount = 1;
+        }
+    }
+
+
+    /** Choose a node and core set for each display. Displays are spread across nodes round robin, and each node's
+     *  cores are divided evenly between the displays on it (displays share cores if there are more displays than
+     *  cores).
+     */
+    void DisplayXFBWorkerGroup::assign(unsigned displayCount)
+    {
+        for (unsigned i = 0; i < displayCount; i++)
+        {
+            Worker* worker = m_workers[i];
+            unsigned node = i % m_nodeCount;
+            unsigned rank = i / m_nodeCount;
+            unsigned sharing = (displayCount - node + m_nodeCount - 1) / m_nodeCount;
+
+            unsigned cpus[kMaxCpus];
+            unsigned count = 0;
+            for (unsigned cpu = 0; cpu < kMaxCpus; cpu++)
+            {
+                if (m_cpuNode[cpu] == node) cpus[count++] = cpu;
+            }
+            if (0 == count) continue;
+
+            unsigned perDisplay = (count >= sharing) ? count / sharing : 1;
+            unsigned first = (rank * perDisplay) % count;
+            for (unsigned j = 0; j < perDisplay; j++) worker->m_cpus[cpus[(first + j) % count]] = 1;
+
+            worker->m_placement.m_node = (int)node;
+            worker->m_placement.m_firstCpu = cpus[first];
+            worker->m_placement.m_cpuCount = perDisplay;
+        }
+    }
+
+
+    /** Bind the calling thread to a worker's core set.
+     *
+     *  @return                 Logical true if the OS accepted the binding.
+     */
+    bool DisplayXFBWorkerGroup::bind(Worker* worker)
+    {
+        if (0 == worker->m_placement.m_cpuCount) return false;
+
+#if defined(__APPLE__)
+        thread_affinity_policy_data_t policy = { (integer_t)(worker->m_placement.m_displayIndex + 1) };
+        kern_return_t kr = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                                             (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT);
+        return KERN_SUCCESS == kr;
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned cpu = 0; cpu < kMaxCpus && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (worker->m_cpus[cpu]) CPU_SET(cpu, &set);
+        }
+        return 0 == pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#else
+        return false;
+#endif
+    }
+
+
+    /** Worker thread body.
+     */
+    void* DisplayXFBWorkerGroup::threadEntry(void* arg)
+    {
+        Worker* worker = (Worker*)arg;
+        bool pinned = bind(worker);
+
+        pthread_mutex_lock(&worker->m_lock);
+        worker->m_placement.m_pinned = pinned;
+        worker->m_busy = false;
+        pthread_cond_broadcast(&worker->m_idle);
+        while (true)
+        {
+            while (!worker->m_head && !worker->m_stop) pthread_cond_wait(&worker->m_wake, &worker->m_lock);
+            if (!worker->m_head) break;
+
+            Job* job = worker->m_head;
+            worker->m_head = job->m_next;
+            if (!worker->m_head) worker->m_tail = 0;
+            worker->m_busy = true;
+            pthread_mutex_unlock(&worker->m_lock);
+
+            job->m_work(job->m_context);
+            free(job);
+
+            pthread_mutex_lock(&worker->m_lock);
+            worker->m_busy = false;
+            worker->m_placement.m_completed ++;
+            if (!worker->m_head) pthread_cond_broadcast(&worker->m_idle);
+        }
+        pthread_mutex_unlock(&worker->m_lock);
+        return 0;
+    }
+
+}   // namespace
@@ -0,0 +1,110 @@
+/** @file   DisplayXFBWorkerGroup.h
+ *  @brief  Per-display capture worker threads with core and memory node placement.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ */
+
+#ifndef COM_TSONIQ_DisplayXFBWorkerGroup_H
+#define COM_TSONIQ_DisplayXFBWorkerGroup_H   (1)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+namespace ts
+{
+    /** Class used to run the capture stages for a set of displays, one worker thread per display.
+     *
+     *  When pinning is enabled each display is assigned to a memory node (round robin) and to a contiguous set of
+     *  that node's cores, and its worker is bound to that set. Work submitted for a display always runs on its
+     *  worker, so the convert and encode stages for one frame share a cache hierarchy. Buffers obtained with
+     *  allocate() are first touched by the display's worker, so under the default first-touch policy they are
+     *  resident on the worker's node.
+     *
+     *      Linux       Nodes are read from /sys/devices/system/node and workers are bound with
+     *                  pthread_setaffinity_np.
+     *      OS X        There is no node or binding API, so all cores are treated as one node and each worker is
+     *                  given its own THREAD_AFFINITY_POLICY tag (a scheduling hint only).
+     *
+     *  Starting the group unpinned uses the same threads and queues with no binding, for comparison.
+     */
+    class DisplayXFBWorkerGroup
+    {
+    public:
+
+        static const unsigned kMaxWorkers = 32;                         //!< Maximum number of displays
+        static const unsigned kMaxCpus = 256;                           //!< Highest CPU number considered
+
+        typedef void (*Work)(void* context);                            //!< A unit of work
+
+        /** Where a display's worker was placed.
+         */
+        struct Placement
+        {
+            unsigned m_displayIndex;                                    //!< The display
+            int m_node;                                                 //!< The memory node (-1 if unpinned)
+            unsigned m_firstCpu;                                        //!< The first core in the set
+            unsigned m_cpuCount;                                        //!< The number of cores in the set (0 if unpinned)
+            bool m_pinned;                                              //!< Logical true if the binding succeeded
+            uint64_t m_completed;                                       //!< The number of work items completed
+        };
+
+        DisplayXFBWorkerGroup();
+        ~DisplayXFBWorkerGroup();
+
+        bool start(unsigned displayCount, bool pin=true);
+        void stop();
+        bool isRunning() const { return 0 != m_workerCount; }           //!< Return true if the workers are running
+        unsigned count() const { return m_workerCount; }                //!< Return the number of workers
+
+        bool submit(unsigned displayIndex, Work work, void* context);
+        void wait(unsigned displayIndex);
+
+        void* allocate(unsigned displayIndex, size_t size);
+        void release(void* ptr, size_t size);
+
+        bool placement(Placement& placement, unsigned displayIndex) const;
+        size_t report(char* buffer, size_t length) const;
+        unsigned nodeCount() const { return m_nodeCount; }              //!< Return the number of memory nodes found
+
+    private:
+
+        struct Job
+        {
+            Work m_work;                                                //!< The function to call
+            void* m_context;                                            //!< The function argument
+            Job* m_next;                                                //!< The next job in the queue
+        };
+
+        struct Worker
+        {
+            DisplayXFBWorkerGroup* m_group;                             //!< The owner
+            pthread_t m_thread;                                         //!< The thread
+            pthread_mutex_t m_lock;                                     //!< Protects the queue
+            pthread_cond_t m_wake;                                      //!< Signalled when work is queued or stopping
+            pthread_cond_t m_idle;                                      //!< Signalled when the queue drains
+            Job* m_head;                                                //!< The first queued job
+            Job* m_tail;                                                //!< The last queued job
+            bool m_busy;                                                //!< Logical true while running a job
+            bool m_stop;                                                //!< Set to end the thread
+            Placement m_placement;                                      //!< Where the worker runs
+            unsigned char m_cpus[kMaxCpus];                             //!< The cores the worker is bound to (non-zero)
+        };
+
+        Worker* m_workers[kMaxWorkers];                                 //!< The workers, indexed by display
+        unsigned m_workerCount;                                         //!< The number of workers running
+        unsigned m_nodeCount;                                           //!< The number of memory nodes
+        unsigned char m_cpuNode[kMaxCpus];                              //!< Node of each online core, or 0xff
+
+        void discoverTopology();
+        void assign(unsigned displayCount);
+        static bool bind(Worker* worker);
+        static void* threadEntry(void* arg);
+
+        DisplayXFBWorkerGroup(const DisplayXFBWorkerGroup&);            // Prevent copy constructor
+        DisplayXFBWorkerGroup& operator=(const DisplayXFBWorkerGroup&); // Prevent assignment
+    };
+
+}   // namespace
+
+#endif      // COM_TSONIQ_DisplayXFBWorkerGroup_H
@@ -0,0 +1,2308 @@
+/** @file   DXBenchMain.cc
+ *  @brief  Command line benchmarks and round trip checks for the DisplayX capture library.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ *
+ *  The tests run on synthetic frames and do not need the driver, so they can be run on any machine. Build with:
+ *
+ *      clang++ -O2 -Isource/displayxfb -Isource/displayxlib source/displayxstress/DXBenchMain.cc \
+ *          source/displayxlib/DisplayXFBPixelKernels.cc source/displayxlib/DisplayXFBShadowFrame.cc \
+ *          source/displayxlib/DisplayXFBTileCache.cc source/displayxlib/DisplayXFBTileCodec.cc \
+ *          source/displayxlib/DisplayXFBTileDedup.cc source/displayxlib/DisplayXFBWorkerGroup.cc \
+ *          source/displayxlib/DisplayXFBPageAllocator.cc source/displayxlib/DisplayXFBReplayRing.cc \
+ *          source/displayxlib/DisplayXFBRateController.cc source/displayxlib/DisplayXFBChangeProbe.cc \
+ *          source/displayxlib/DisplayXFBFramePool.cc -lpthread -o dxbench
+ *
+ *  Usage:
+ *
+ *      dxbench dedup [frames]
+ *
+ *          Code a changing frame with DisplayXFBTileDedupEncoder, choosing encode() or encodeDirect() at random for
+ *          each frame, and decode every message. Some changes put tiles back to content the shadow frame already
+ *          holds. The decoded frame must match the source after every message.
+ *
+ *      dxbench replay [seconds] [path]
+ *
+ *          Record a 1920x1080 display at 60 Hz with DisplayXFBReplayRing for the given number of seconds of display
+ *          time, first with desktop use (typing and an occasional window redraw), then with a 640x360 video playing.
+ *          Frames are generated as fast as possible, and the CPU time used is reported per second of recording:
+ *          this is the load the recorder adds to a live 60 Hz capture. The ring is file backed if a path is given.
+ *          The recording is dumped at the end, and must hold the last second.
+ *
+ *      dxbench rate [kbps] [seconds]
+ *
+ *          Drive DisplayXFBRateController from the desktop scene, then the scene with video, then the desktop again
+ *          (each phase for the given number of seconds), coding each frame the controller sends with the tile codec
+ *          at the chosen quality. The coded frames go through a simulated link of the target rate (default 8000
+ *          kbit/s). For the second half of each phase, the sent rate must be within 10% of the target (or below it),
+ *          the link delay must stay bounded, the quality must settle (and return to its first level once the video
+ *          stops) and the rate of frames sent (and so skipped) must be steady.
+ *
+ *      dxbench workers [displays] [seconds]
+ *
+ *          Run the capture stages of DisplayXFBCaptureBroker for several displays (default 4) on a
+ *          DisplayXFBWorkerGroup, once with the workers pinned and once without. Each display shows the scene with
+ *          video. For each 60 Hz frame, every display's worker converts the changed areas to RGBA and tile codes
+ *          them, and the frame ends when all the workers have finished. The placement report, the frame rate and
+ *          the CPU time are printed for both runs. Both runs do the same work, so their coded output must match.
+ *          The difference only shows on a host with several cores (and more so with several memory nodes).
+ *
+ *      dxbench copy [width] [height] [seconds] [workload MB]
+ *
+ *          Copy a strided frame (default 2560x1600) with memcpy and with DisplayXFBPixelKernels::copyFrameStreaming(),
+ *          reporting the throughput of each. Then run a cache sensitive workload (random reads over the given size,
+ *          by default a quarter of the last level cache up to 8 MB) on another thread: alone, while the frame is
+ *          copied 60 times a second with memcpy, and while it is copied with the streaming copy. The three are
+ *          interleaved in one second rounds for the given number of seconds each (default 5), and the median is
+ *          reported. The workload's time per read is measured in its own CPU time, so it shows the cache evictions
+ *          the copy causes rather than time spent waiting for a core. Both copies must reproduce the frame.
+ *
+ *      dxbench fused [width] [height] [frames]
+ *
+ *          Keep a shadow of a changing frame (default 2560x1600, 64 random 64x64 blocks redrawn per frame) with
+ *          DisplayXFBShadowFrame::update(), which copies, diffs and hashes 32x32 tiles in one pass, and with the
+ *          same kernels run as three passes over the frame (diff every tile, copy the changed ones, hash every
+ *          tile). The time per frame of each is reported. Both must find the same changed tiles and hashes and
+ *          leave the same shadow.
+ *
+ *      dxbench probe [frames]
+ *
+ *          Run DisplayXFBChangeProbe (64x64 tiles) over the desktop scene and the scene with video for the given
+ *          number of frames (default 600), for a range of samples per tile and verification periods. Each
+ *          configuration reports the bytes read as a share of a full diff, the share of changed tiles found on the
+ *          frame they changed, and the mean and worst delay (frames) for the rest, measured against a full compare
+ *          of every tile. The worst delay must not exceed the verification period.
+ *
+ *      dxbench pages [width] [height] [frames]
+ *
+ *          Copy and convert (to RGBA) a frame (default 3840x2160) in to a buffer from DisplayXFBPageAllocator with
+ *          huge pages enabled and in to one with them disabled, both in row order and tile by tile (32x32, as the
+ *          shadow frame and the capture broker work). The throughput of each is reported with the backing each
+ *          buffer got. The copies and conversions must match.
+ *
+ *      dxbench pool [threads] [frames]
+ *
+ *          Run a number of capture threads (default 4) that each keep two frames in flight: for each frame they
+ *          take a new buffer, fill it, and release the one before. Halfway through, the mode changes from 2560x1600
+ *          to 1920x1080. This is run with DisplayXFBFramePool and with posix_memalign() and free(), and the time
+ *          per frame of each is reported with the pool's hits, misses and resident size. The pool must allocate no
+ *          more than two buffers per thread for each mode, and must not issue a buffer that is still in use.
+ *
+ *      dxbench codec [frames]
+ *
+ *          Code the desktop scene and the scene with video with DisplayXFBTileCodec at several qualities for the
+ *          given number of frames (default 600), coding the areas that change in each frame as sendChanges() would,
+ *          after one full frame. For each, the size of the full frame, the bitrate of the changes at 60 Hz, the
+ *          encode time per frame, the share of tiles in each class and the PSNR of the decoded changes are reported.
+ *          Every message must decode, and the bitrate and PSNR must not fall as the quality rises.
+ *
+ *      dxbench kernels [frames]
+ *
+ *          Run the copy, diff, convert (to RGBA and to gray) and blend kernels of DisplayXFBPixelKernels tile by tile
+ *          over frames of several display modes, for each tile size the kernels are specialised for. Each is timed
+ *          with the generic (scalar, any width) kernel, the any-width kernel for the processor's instruction set and
+ *          the kernel specialised for the tile size and an aligned source. The three are timed in turn for five
+ *          rounds of the given number of frames (default 4), and the best round of each is reported. All three must
+ *          give the same result.
+ *
+ *      dxbench tiles [frames] [cache tiles]
+ *
+ *          Send the desktop scene, the scene with video, a desktop switching between two pages every half second,
+ *          and a page scrolling by one tile row a frame, for the given number of frames (default 600). Each frame is
+ *          sent with DisplayXFBTileDedupEncoder (solid colours, references to tiles in a cache of the given size,
+ *          by default 16384, and coded tiles) and, for comparison, as the bounds of the change coded with
+ *          DisplayXFBTileCodec alone. The bitrate of each at 60 Hz and the share of tiles sent each way are
+ *          reported. Every message must decode, and the decoded frame must match the source where it has no video
+ *          (which is coded lossily).
+ *
+ *      dxbench direct [frames]
+ *
+ *          Send the desktop scene and the scene with video for the given number of frames (default 600), once
+ *          through a shadow frame (DisplayXFBShadowFrame::update() over the bounds of each frame's changes, then
+ *          DisplayXFBTileDedupEncoder::encode()) and once straight from the frame with encodeDirect() over the same
+ *          bounds. The time per frame and the bitrate at 60 Hz of each are reported. Both must decode to the same
+ *          frame, which must match the source where it has no video. Then a thread repaints the frame continuously,
+ *          row by row, with four pages of text in turn while each path sends it in full, and the retries and
+ *          deferred tiles of encodeDirect() are reported. Once the thread stops, one more message from each path
+ *          must decode to the frame exactly: a tile coded from pixels other than those it was hashed from would
+ *          leave a wrong tile behind a later cache reference. On a single processor the thread only draws while the
+ *          encoder is preempted, so there are few retries.
+ *
+ *  The exit status is zero if every check passed.
+ */
+
+#include "DisplayXFBTileDedup.h"
+#include "DisplayXFBShadowFrame.h"
+#include "DisplayXFBReplayRing.h"
+#include "DisplayXFBRateController.h"
+#include "DisplayXFBTileCodec.h"
+#include "DisplayXFBPixelKernels.h"
+#include "DisplayXFBWorkerGroup.h"
+#include "DisplayXFBChangeProbe.h"
+#include "DisplayXFBPageAllocator.h"
+#include "DisplayXFBFramePool.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+
+using namespace ts;
+
+
+/** Return the time in seconds.
+ */
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + ((double)tv.tv_usec * 1e-6);
+}
+
+
+/** Return the CPU time used by the process in seconds (user and system, all threads).
+ */
+static double cpuTime()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + ((double)usage.ru_utime.tv_usec * 1e-6) +
+           (double)usage.ru_stime.tv_sec + ((double)usage.ru_stime.tv_usec * 1e-6);
+}
+
+
+/** Return the next value from a simple repeatable random sequence.
+ */
+static uint32_t random32(uint32_t& state)
+{
+    state = (state * 1664525u) + 1013904223u;
+    return state;
+}
+
+
+/** Fill a frame with a pattern that varies from tile to tile.
+ */
+static void fillPattern(uint32_t* pixels, unsigned width, unsigned height, uint32_t seed)
+{
+    for (unsigned y = 0; y < height; y++)
+    {
+        for (unsigned x = 0; x < width; x++) pixels[(y * width) + x] = 0xff000000u | (((x * 7) + (y * 13) + seed) * 2654435761u >> 8);
+    }
+}
+
+
+/** Copy a rectangle between two frames of the same size.
+ */
+static void copyRect(uint32_t* dst, const uint32_t* src, unsigned width, unsigned x, unsigned y, unsigned w, unsigned h)
+{
+    for (unsigned row = y; row < y + h; row++) memcpy(dst + (row * width) + x, src + (row * width) + x, w * sizeof (uint32_t));
+}
+
+
+/** A rectangle (pixels). A zero size means empty.
+ */
+struct Rect
+{
+    unsigned m_x;                                   //!< Left edge
+    unsigned m_y;                                   //!< Top edge
+    unsigned m_width;                               //!< Width
+    unsigned m_height;                              //!< Height
+};
+
+
+/** Extend a rectangle to include another.
+ */
+static void rectUnion(Rect& bounds, const Rect& rect)
+{
+    if (0 == rect.m_width || 0 == rect.m_height) return;
+    if (0 == bounds.m_width || 0 == bounds.m_height) { bounds = rect; return; }
+
+    unsigned x1 = (bounds.m_x + bounds.m_width > rect.m_x + rect.m_width) ? bounds.m_x + bounds.m_width : rect.m_x + rect.m_width;
+    unsigned y1 = (bounds.m_y + bounds.m_height > rect.m_y + rect.m_height) ? bounds.m_y + bounds.m_height : rect.m_y + rect.m_height;
+    if (rect.m_x < bounds.m_x) bounds.m_x = rect.m_x;
+    if (rect.m_y < bounds.m_y) bounds.m_y = rect.m_y;
+    bounds.m_width = x1 - bounds.m_x;
+    bounds.m_height = y1 - bounds.m_y;
+}
+
+
+/** Synthetic display content, changed a frame at a time like a desktop in use.
+ */
+struct Scene
+{
+    enum { kChangeText, kChangeWindow, kChangeVideo, kChangeKinds };
+    static const unsigned kWidth = 1920;            //!< Frame width (pixels)
+    static const unsigned kHeight = 1080;           //!< Frame height (pixels)
+    static const unsigned kVideoWidth = 640;        //!< Video area width (pixels)
+    static const unsigned kVideoHeight = 360;       //!< Video area height (pixels)
+
+    uint32_t* m_pixels;                             //!< The frame (kWidth * kHeight, packed rows)
+    uint32_t m_seed;                                //!< Random sequence state
+    unsigned m_frame;                               //!< Frames generated
+    unsigned m_caret;                               //!< Typing position (characters)
+    bool m_video;                                   //!< Logical true to play a video in the frame
+};
+
+
+static bool sceneCreate(Scene& scene, bool video)
+{
+    scene.m_pixels = (uint32_t*)malloc(Scene::kWidth * Scene::kHeight * sizeof (uint32_t));
+    scene.m_seed = 1;
+    scene.m_frame = 0;
+    scene.m_caret = 0;
+    scene.m_video = video;
+    if (!scene.m_pixels) return false;
+
+    // A light background with a darker title bar every 270 rows, so that tiles are not all the same.
+    for (unsigned y = 0; y < Scene::kHeight; y++)
+    {
+        uint32_t colour = (y % 270 < 24) ? 0xff404850u : 0xffe8e8e8u;
+        for (unsigned x = 0; x < Scene::kWidth; x++) scene.m_pixels[(y * Scene::kWidth) + x] = colour;
+    }
+    return true;
+}
+
+
+static void sceneDestroy(Scene& scene)
+{
+    free(scene.m_pixels);
+    scene.m_pixels = 0;
+}
+
+
+/** Advance the scene by one 60 Hz frame and return what changed, by kind (zero size if that kind did not change).
+ *
+ *  A character is typed every sixth frame, a 480x320 window is redrawn once a second and, if enabled, the video
+ *  area changes every other frame (30 fps).
+ */
+static void sceneStep(Scene& scene, Rect changes[Scene::kChangeKinds])
+{
+    memset(changes, 0, Scene::kChangeKinds * sizeof changes[0]);
+    uint32_t* pixels = scene.m_pixels;
+    const unsigned frame = scene.m_frame ++;
+
+    if (0 == frame % 6)
+    {
+        // Type a character: an 8x16 glyph of random strokes, on lines of 200 characters.
+        unsigned cx = 64 + (scene.m_caret % 200) * 8;
+        unsigned cy = 400 + ((scene.m_caret / 200) % 20) * 16;
+        uint32_t bits = random32(scene.m_seed);
+        for (unsigned row = 0; row < 16; row++)
+        {
+            for (unsigned col = 0; col < 8; col++)
+            {
+                bool ink = 0 != (bits & (1u << ((row * 2 + col) & 31))) && col < 7 && row > 2 && row < 14;
+                pixels[((cy + row) * Scene::kWidth) + cx + col] = (ink) ? 0xff202020u : 0xffe8e8e8u;
+            }
+        }
+        scene.m_caret ++;
+        Rect rect = { cx, cy, 8, 16 };
+        changes[Scene::kChangeText] = rect;
+    }
+
+    if (0 == frame % 60)
+    {
+        // Redraw a window: a frame, a title bar and rows of text like content.
+        unsigned wx = random32(scene.m_seed) % (Scene::kWidth - 480);
+        unsigned wy = random32(scene.m_seed) % (Scene::kHeight - 320);
+        uint32_t tint = random32(scene.m_seed) & 0x3f3f3f;
+        for (unsigned row = 0; row < 320; row++)
+        {
+            for (unsigned col = 0; col < 480; col++)
+            {
+                uint32_t colour = (row < 22) ? (0xff6070a0u ^ tint) : (0 == (row % 18) / 12 && ((col * 7 + row * 3) % 11) < 6) ? 0xff303030u : 0xfffcfcfcu;
+                pixels[((wy + row) * Scene::kWidth) + wx + col] = colour;
+            }
+        }
+        Rect rect = { wx, wy, 480, 320 };
+        changes[Scene::kChangeWindow] = rect;
+    }
+
+    if (scene.m_video && 0 == frame % 2)
+    {
+        // A moving gradient with noise, in a fixed area (like a video player).
+        unsigned vx = 1200, vy = 600;
+        unsigned phase = frame / 2;
+        for (unsigned row = 0; row < Scene::kVideoHeight; row++)
+        {
+            for (unsigned col = 0; col < Scene::kVideoWidth; col++)
+            {
+                uint32_t r = (col + phase * 3) & 0xff;
+                uint32_t g = (row + phase * 2) & 0xff;
+                uint32_t b = ((col ^ row) + phase + (random32(scene.m_seed) >> 29)) & 0xff;
+                pixels[((vy + row) * Scene::kWidth) + vx + col] = 0xff000000u | (r << 16) | (g << 8) | b;
+            }
+        }
+        Rect rect = { vx, vy, Scene::kVideoWidth, Scene::kVideoHeight };
+        changes[Scene::kChangeVideo] = rect;
+    }
+}
+
+
+#pragma mark    -
+#pragma mark    Tile Dedup
+
+
+/** Mix encode() and encodeDirect() on one stream and check that the decoder always holds the source frame.
+ *
+ *  @param  frames      The number of frames to code.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testDedup(unsigned frames)
+{
+    static const unsigned kWidth = 640;
+    static const unsigned kHeight = 480;
+    static const unsigned kTile = DisplayXFBTileDedupEncoder::kTileSize;
+
+    uint32_t* source = (uint32_t*)malloc(kWidth * kHeight * sizeof (uint32_t));
+    uint32_t* original = (uint32_t*)malloc(kWidth * kHeight * sizeof (uint32_t));
+    uint32_t* decoded = (uint32_t*)calloc(kWidth * kHeight, sizeof (uint32_t));
+    DisplayXFBShadowFrame shadow;
+    DisplayXFBTileDedupEncoder encoder;
+    DisplayXFBTileDedupDecoder decoder;
+    if (!source || !original || !decoded || !shadow.configure(kWidth, kHeight, kTile, true) ||
+        !encoder.configure(kWidth, kHeight, 512) || !decoder.configure(kWidth, kHeight, 512))
+    {
+        printf("FAIL: could not configure the coder\n");
+        free(source);
+        free(original);
+        free(decoded);
+        return false;
+    }
+    fillPattern(original, kWidth, kHeight, 0);
+    memcpy(source, original, kWidth * kHeight * sizeof (uint32_t));
+
+    size_t capacity = encoder.maxEncodedSize();
+    uint8_t* message = (uint8_t*)malloc(capacity);
+    uint32_t seed = 1;
+    unsigned direct = 0;
+    unsigned mismatches = 0;
+    uint64_t bytes = 0;
+    double start = now();
+
+    // The first message must come from encode(), which sends every tile.
+    shadow.update(source, kWidth * 4);
+    size_t size = encoder.encode(shadow, message, capacity);
+    bool passed = (0 != size && decoder.decode(message, size, decoded, kWidth * 4) && 0 == memcmp(source, decoded, kWidth * kHeight * 4));
+
+    for (unsigned frame = 0; passed && frame < frames; frame++)
+    {
+        // Change one tile aligned rectangle: either new content or the original content put back.
+        unsigned x = (random32(seed) % (kWidth / kTile)) * kTile;
+        unsigned y = (random32(seed) % (kHeight / kTile)) * kTile;
+        unsigned w = (1 + (random32(seed) % 4)) * kTile;
+        unsigned h = (1 + (random32(seed) % 4)) * kTile;
+        if (x + w > kWidth) w = kWidth - x;
+        if (y + h > kHeight) h = kHeight - y;
+        if (random32(seed) & 0x100) copyRect(source, original, kWidth, x, y, w, h);
+        else
+        {
+            uint32_t colour = random32(seed);
+            for (unsigned row = y; row < y + h; row++)
+            {
+                for (unsigned col = x; col < x + w; col++) source[(row * kWidth) + col] = 0xff000000u | ((colour ^ (col * row * 2654435761u)) & 0xffffff);
+            }
+        }
+
+        // encodeDirect() reads the framebuffer itself, so the shadow frame misses that frame's changes.
+        if (random32(seed) & 0x200)
+        {
+            size = encoder.encodeDirect(source, kWidth * 4, x, y, w, h, message, capacity);
+            direct ++;
+        }
+        else
+        {
+            shadow.update(source, kWidth * 4);
+            size = encoder.encode(shadow, message, capacity);
+        }
+
+        if (0 == size || !decoder.decode(message, size, decoded, kWidth * 4)) { printf("FAIL: frame %u could not be coded\n", frame); passed = false; }
+        else if (0 != memcmp(source, decoded, kWidth * kHeight * 4)) mismatches ++;
+        bytes += size;
+    }
+    double elapsed = now() - start;
+
+    printf("%u frames (%u direct) in %.3f s, %llu bytes, %u frames decoded wrongly\n",
+           frames, direct, elapsed, (unsigned long long)bytes, mismatches);
+    if (mismatches) { printf("FAIL: the decoded frame differs from the source\n"); passed = false; }
+
+    free(message);
+    free(source);
+    free(original);
+    free(decoded);
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Replay Recording
+
+
+/** Record one scene and report the CPU time per second of recording.
+ */
+static bool replayRun(const char* name, bool video, unsigned seconds, const char* path)
+{
+    Scene scene;
+    DisplayXFBReplayRing ring;
+    DisplayXFBReplayRing::Config config;
+    config.m_path = path;
+    if (path) unlink(path);
+    if (!sceneCreate(scene, video) || !ring.open(config))
+    {
+        printf("FAIL: could not open the recorder\n");
+        sceneDestroy(scene);
+        return false;
+    }
+
+    static const uint64_t kFrameUS = 16667;
+    unsigned frames = seconds * 60;
+    unsigned failed = 0;
+    double cpuStart = cpuTime();
+    double start = now();
+    for (unsigned frame = 0; frame < frames; frame++)
+    {
+        // The recorder takes one dirty area per frame.
+        Rect changes[Scene::kChangeKinds];
+        Rect dirty = { 0, 0, 0, 0 };
+        sceneStep(scene, changes);
+        for (unsigned i = 0; i < Scene::kChangeKinds; i++) rectUnion(dirty, changes[i]);
+        if (!ring.record(scene.m_pixels, Scene::kWidth, Scene::kHeight, Scene::kWidth * 4,
+                         dirty.m_x, dirty.m_y, dirty.m_width, dirty.m_height, frame * kFrameUS)) failed ++;
+    }
+    double cpu = cpuTime() - cpuStart;
+    double elapsed = now() - start;
+
+    const DisplayXFBReplayRing::Statistics& stats = ring.statistics();
+    printf("%-8s %u s at 60 Hz: %llu records (%llu keyframes), %.1f MB, %llu evicted, %llu dropped\n",
+           name, seconds, (unsigned long long)stats.m_records, (unsigned long long)stats.m_keyframes,
+           (double)stats.m_bytes / (1024.0 * 1024.0), (unsigned long long)stats.m_evictions, (unsigned long long)stats.m_dropped);
+    printf("%-8s cpu %.3f s in %.3f s: %.2f%% of one core per second recorded (record() %.2f%%)\n",
+           name, cpu, elapsed, 100.0 * cpu / seconds, 100.0 * ((double)stats.m_encodeMicroseconds * 1e-6) / seconds);
+
+    bool passed = (0 == failed);
+    if (failed) printf("FAIL: %u frames could not be recorded\n", failed);
+
+    // The last second must be available for replay.
+    char dumpPath[64];
+    snprintf(dumpPath, sizeof dumpPath, "/tmp/dxbench-replay-%d.dxr", (int)getpid());
+    if (!ring.dump(dumpPath, 1, frames * kFrameUS)) { printf("FAIL: the recording could not be dumped\n"); passed = false; }
+    unlink(dumpPath);
+
+    ring.close();
+    if (path) unlink(path);
+    sceneDestroy(scene);
+    return passed;
+}
+
+
+/** Measure the cost of continuous replay recording.
+ *
+ *  @param  seconds     The recording length (seconds of display time).
+ *  @param  path        The file to record to, or zero for anonymous memory.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testReplay(unsigned seconds, const char* path)
+{
+    bool passed = replayRun("desktop", false, seconds, path);
+    if (!replayRun("video", true, seconds, path)) passed = false;
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Rate Control
+
+
+/** Counters for one measurement window of the rate test.
+ */
+struct RateWindow
+{
+    unsigned m_frames;                              //!< Frames offered
+    unsigned m_sent;                                //!< Frames sent
+    unsigned m_skipped;                             //!< Frames skipped because the link was backlogged
+    double m_bits;                                  //!< Bits sent
+    double m_quality;                               //!< Sum of the quality of sent frames
+    double m_maxDelayMS;                            //!< Worst link queueing delay (milliseconds)
+    double m_maxFrameBits;                          //!< Largest frame sent (bits)
+};
+
+
+/** Run one phase of the rate test. Statistics are collected over the second half of the phase, split in two.
+ */
+static void ratePhase(Scene& scene, DisplayXFBRateController& controller, DisplayXFBTileCodec& codec, uint8_t* output, size_t capacity,
+                      unsigned seconds, double linkBitsPerSecond, uint64_t& timeUS, double& linkBits, RateWindow window[2])
+{
+    static const uint64_t kFrameUS = 16667;
+    const unsigned frames = seconds * 60;
+    Rect pending[Scene::kChangeKinds];
+    memset(pending, 0, sizeof pending);
+    memset(window, 0, 2 * sizeof window[0]);
+
+    for (unsigned frame = 0; frame < frames; frame++)
+    {
+        // The link drains at its rate; what is left is queued behind the next frame.
+        linkBits -= linkBitsPerSecond * (double)kFrameUS / 1000000.0;
+        if (linkBits < 0) linkBits = 0;
+
+        // Changes in skipped frames are carried in to the next frame sent. Each kind of change is coded as its own
+        // area, as a sender working from dirty rectangles would.
+        Rect changes[Scene::kChangeKinds];
+        sceneStep(scene, changes);
+        double area = 0;
+        for (unsigned i = 0; i < Scene::kChangeKinds; i++)
+        {
+            rectUnion(pending[i], changes[i]);
+            area += (double)pending[i].m_width * pending[i].m_height;
+        }
+        double fraction = area / ((double)Scene::kWidth * Scene::kHeight);
+        if (fraction > 1.0) fraction = 1.0;
+
+        DisplayXFBRateController::Decision decision = controller.decide(timeUS, fraction);
+        RateWindow* stats = (frame >= frames / 2) ? &window[(frame >= (frames * 3) / 4) ? 1 : 0] : 0;
+        if (stats)
+        {
+            stats->m_frames ++;
+            if (!decision.m_send && fraction > 0.0) stats->m_skipped ++;
+        }
+        if (decision.m_send)
+        {
+            size_t size = 0;
+            codec.setQuality(decision.m_quality);
+            for (unsigned i = 0; i < Scene::kChangeKinds; i++)
+            {
+                const Rect& rect = pending[i];
+                if (0 == rect.m_width || 0 == rect.m_height) continue;
+                const uint8_t* origin = (const uint8_t*)scene.m_pixels + (((size_t)rect.m_y * Scene::kWidth) + rect.m_x) * 4;
+                size += codec.encode(origin, rect.m_width, rect.m_height, Scene::kWidth * 4, output, capacity);
+            }
+            controller.report(size, fraction);
+            linkBits += (double)size * 8.0;
+            memset(pending, 0, sizeof pending);
+            if (stats)
+            {
+                stats->m_sent ++;
+                stats->m_bits += (double)size * 8.0;
+                stats->m_quality += decision.m_quality;
+                if ((double)size * 8.0 > stats->m_maxFrameBits) stats->m_maxFrameBits = (double)size * 8.0;
+            }
+        }
+        if (stats)
+        {
+            double delayMS = 1000.0 * linkBits / linkBitsPerSecond;
+            if (delayMS > stats->m_maxDelayMS) stats->m_maxDelayMS = delayMS;
+        }
+        timeUS += kFrameUS;
+    }
+}
+
+
+/** Check the controller against a simulated link, with a step up and down in the amount of change.
+ *
+ *  @param  kbps        The link rate (kbit/s).
+ *  @param  seconds     The length of each phase (seconds).
+ *  @return             Logical true if all checks passed.
+ */
+static bool testRate(unsigned kbps, unsigned seconds)
+{
+    static const char* const kPhaseNames[3] = { "desktop", "video", "desktop" };
+
+    Scene scene;
+    if (0 == kbps || seconds < 4 || !sceneCreate(scene, false)) { printf("FAIL: invalid arguments\n"); return false; }
+
+    DisplayXFBRateController::Config config;
+    config.m_targetBitsPerSecond = (uint64_t)kbps * 1000;
+    DisplayXFBRateController controller;
+    controller.configure(config, Scene::kWidth, Scene::kHeight);
+    DisplayXFBTileCodec codec;
+    size_t capacity = DisplayXFBTileCodec::maxEncodedSize(Scene::kWidth, Scene::kHeight);
+    uint8_t* output = (uint8_t*)malloc(capacity);
+
+    double target = (double)config.m_targetBitsPerSecond;
+    double frameMS = 1000.0 / config.m_frameRate;
+    uint64_t timeUS = 0;
+    double linkBits = 0;
+    bool passed = (0 != output);
+    double desktopQuality = 0;
+    for (unsigned phase = 0; passed && phase < 3; phase++)
+    {
+        RateWindow window[2];
+        scene.m_video = (1 == phase);
+        ratePhase(scene, controller, codec, output, capacity, seconds, target, timeUS, linkBits, window);
+
+        // Each figure is given for the third and the last quarter of the phase, which should agree once settled.
+        double span = seconds / 4.0;
+        double rate[2];
+        double quality[2];
+        for (unsigned i = 0; i < 2; i++)
+        {
+            rate[i] = window[i].m_bits / span;
+            quality[i] = (window[i].m_sent) ? window[i].m_quality / window[i].m_sent : 0.0;
+        }
+        double maxDelay = (window[0].m_maxDelayMS > window[1].m_maxDelayMS) ? window[0].m_maxDelayMS : window[1].m_maxDelayMS;
+        double maxFrame = (window[0].m_maxFrameBits > window[1].m_maxFrameBits) ? window[0].m_maxFrameBits : window[1].m_maxFrameBits;
+        printf("%-8s %.0f / %.0f kbit/s, %.1f / %.1f frames/s sent, %u / %u skipped, quality %.1f / %.1f, max delay %.0f ms, largest frame %.0f kbit\n",
+               kPhaseNames[phase], rate[0] / 1000.0, rate[1] / 1000.0, window[0].m_sent / span, window[1].m_sent / span,
+               window[0].m_skipped, window[1].m_skipped, quality[0], quality[1], maxDelay, maxFrame / 1000.0);
+
+        // A frame is sent while the bucket is not in debt, so the link may hold the burst plus one frame.
+        if (rate[0] > target * 1.1 || rate[1] > target * 1.1) { printf("FAIL: %s: sent rate exceeds the target\n", kPhaseNames[phase]); passed = false; }
+        if (maxDelay > config.m_burstMS + (1000.0 * maxFrame / target) + frameMS) { printf("FAIL: %s: link delay is not bounded\n", kPhaseNames[phase]); passed = false; }
+        if (fabs(quality[0] - quality[1]) > 5.0) { printf("FAIL: %s: quality does not settle\n", kPhaseNames[phase]); passed = false; }
+        // The skip count follows how many changes land between sends, which varies with the content; the send rate is
+        // what the controller sets.
+        double sent[2] = { window[0].m_sent / span, window[1].m_sent / span };
+        if (fabs(sent[0] - sent[1]) > 1.0 + 0.1 * ((sent[0] > sent[1]) ? sent[0] : sent[1])) { printf("FAIL: %s: frame skipping does not settle\n", kPhaseNames[phase]); passed = false; }
+        if (0 == phase) desktopQuality = (quality[0] + quality[1]) / 2.0;
+        if (2 == phase && (quality[0] + quality[1]) / 2.0 < desktopQuality - 5.0) { printf("FAIL: quality did not recover after the video\n"); passed = false; }
+    }
+
+    free(output);
+    sceneDestroy(scene);
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Worker Placement
+
+
+/** One display's stages for the placement benchmark. Everything here is set up and used by the display's worker.
+ */
+struct PlacementDisplay
+{
+    unsigned m_displayIndex;                        //!< The display (and its worker)
+    Scene m_scene;                                  //!< The display content
+    uint32_t* m_converted;                          //!< RGBA copy (allocated on the worker's node)
+    DisplayXFBPixelKernelTable m_kernels;           //!< Conversion kernels
+    DisplayXFBTileCodec* m_codec;                   //!< The encoder
+    uint8_t* m_output;                              //!< Encoder output
+    size_t m_capacity;                              //!< Size of m_output
+    uint64_t m_bytes;                               //!< Total encoded size
+    uint32_t m_checksum;                            //!< Hash of the encoded output
+};
+
+
+/** Set up a display on its worker, so that its buffers are first written there.
+ */
+static void placementSetup(void* context)
+{
+    PlacementDisplay* display = (PlacementDisplay*)context;
+    if (!sceneCreate(display->m_scene, true)) return;
+    display->m_scene.m_seed = 1 + display->m_displayIndex;
+    display->m_kernels = DisplayXFBPixelKernels::select(DisplayXFBPixelKernels::kFormatRGBA32, 0, false, DisplayXFBPixelKernels::cpuIsa());
+    display->m_codec = new DisplayXFBTileCodec;
+    display->m_codec->setParallel(false);
+    display->m_capacity = DisplayXFBTileCodec::maxEncodedSize(Scene::kWidth, Scene::kHeight);
+    display->m_output = (uint8_t*)malloc(display->m_capacity);
+}
+
+
+/** Advance a display by one frame and run its stages on the changed areas.
+ */
+static void placementFrame(void* context)
+{
+    PlacementDisplay* display = (PlacementDisplay*)context;
+    Rect changes[Scene::kChangeKinds];
+    sceneStep(display->m_scene, changes);
+    for (unsigned i = 0; i < Scene::kChangeKinds; i++)
+    {
+        const Rect& rect = changes[i];
+        if (0 == rect.m_width || 0 == rect.m_height) continue;
+
+        size_t offset = ((size_t)rect.m_y * Scene::kWidth) + rect.m_x;
+        display->m_kernels.m_convert(display->m_converted + offset, Scene::kWidth * 4,
+                                     display->m_scene.m_pixels + offset, Scene::kWidth * 4, rect.m_width, rect.m_height);
+        size_t size = display->m_codec->encode(display->m_scene.m_pixels + offset, rect.m_width, rect.m_height,
+                                               Scene::kWidth * 4, display->m_output, display->m_capacity);
+        display->m_bytes += size;
+        for (size_t j = 0; j < size; j++) display->m_checksum = (display->m_checksum ^ display->m_output[j]) * 16777619u;
+    }
+}
+
+
+/** Run the stages for a set of displays on a worker group.
+ *
+ *  @param  checksums       Returns the hash of each display's coded output.
+ *  @return                 Logical true for success.
+ */
+static bool placementRun(unsigned displays, unsigned seconds, bool pin, uint32_t* checksums)
+{
+    DisplayXFBWorkerGroup group;
+    if (!group.start(displays, pin))
+    {
+        printf("FAIL: could not start %u workers\n", displays);
+        return false;
+    }
+
+    const size_t frameBytes = (size_t)Scene::kWidth * Scene::kHeight * 4;
+    PlacementDisplay* state = (PlacementDisplay*)calloc(displays, sizeof (PlacementDisplay));
+    bool ready = (0 != state);
+    for (unsigned d = 0; ready && d < displays; d++)
+    {
+        state[d].m_displayIndex = d;
+        state[d].m_checksum = 2166136261u;
+        state[d].m_converted = (uint32_t*)group.allocate(d, frameBytes);
+        if (group.submit(d, placementSetup, &state[d])) group.wait(d);
+        ready = state[d].m_converted && state[d].m_scene.m_pixels && state[d].m_output;
+    }
+
+    double elapsed = 0;
+    double cpu = 0;
+    unsigned frames = seconds * 60;
+    if (ready)
+    {
+        double cpuStart = cpuTime();
+        double start = now();
+        for (unsigned frame = 0; frame < frames; frame++)
+        {
+            for (unsigned d = 0; d < displays; d++)
+            {
+                if (!group.submit(d, placementFrame, &state[d])) placementFrame(&state[d]);
+            }
+            for (unsigned d = 0; d < displays; d++) group.wait(d);
+        }
+        elapsed = now() - start;
+        cpu = cpuTime() - cpuStart;
+    }
+
+    char report[4096];
+    group.report(report, sizeof report);
+    printf("%s", report);
+    if (ready)
+    {
+        uint64_t bytes = 0;
+        for (unsigned d = 0; d < displays; d++) bytes += state[d].m_bytes;
+        printf("%-8s %u displays x %u frames in %.3f s: %.1f frames/s per display, cpu %.3f s, %.1f MB coded\n",
+               pin ? "pinned" : "unpinned", displays, frames, elapsed, frames / elapsed, cpu, bytes / 1e6);
+    }
+    else
+    {
+        printf("FAIL: could not set up the displays\n");
+    }
+
+    for (unsigned d = 0; state && d < displays; d++)
+    {
+        checksums[d] = state[d].m_checksum;
+        sceneDestroy(state[d].m_scene);
+        delete state[d].m_codec;
+        free(state[d].m_output);
+        group.release(state[d].m_converted, frameBytes);
+    }
+    free(state);
+    group.stop();
+    return ready;
+}
+
+
+/** Compare pinned and unpinned workers.
+ */
+static bool testWorkers(unsigned displays, unsigned seconds)
+{
+    if (0 == displays || displays > DisplayXFBWorkerGroup::kMaxWorkers)
+    {
+        printf("FAIL: between 1 and %u displays are supported\n", DisplayXFBWorkerGroup::kMaxWorkers);
+        return false;
+    }
+
+    uint32_t pinned[DisplayXFBWorkerGroup::kMaxWorkers];
+    uint32_t unpinned[DisplayXFBWorkerGroup::kMaxWorkers];
+    if (!placementRun(displays, seconds, true, pinned) || !placementRun(displays, seconds, false, unpinned)) return false;
+    if (0 != memcmp(pinned, unpinned, displays * sizeof pinned[0]))
+    {
+        printf("FAIL: pinned and unpinned runs coded different output\n");
+        return false;
+    }
+    return true;
+}
+
+
+#pragma mark    -
+#pragma mark    Frame Copy
+
+
+/** Return the CPU time used by the calling thread in seconds.
+ */
+static double threadCpuTime()
+{
+#if defined(__APPLE__)
+    mach_port_t thread = mach_thread_self();
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    kern_return_t kr = thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+    mach_port_deallocate(mach_task_self(), thread);
+    if (KERN_SUCCESS != kr) return 0;
+    return (double)info.user_time.seconds + ((double)info.user_time.microseconds * 1e-6) +
+           (double)info.system_time.seconds + ((double)info.system_time.microseconds * 1e-6);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec * 1e-9);
+#endif
+}
+
+
+/** A cache sensitive workload: a chase through a random cycle of cache lines, so each read depends on the last.
+ */
+struct CopyVictim
+{
+    uint32_t* m_lines;                              //!< One 64 byte line per entry; the first word is the next line
+    size_t m_count;                                 //!< The number of lines
+    volatile bool m_stop;                           //!< Set to end the thread
+    uint64_t m_reads;                               //!< Returns the number of reads made
+    double m_cpu;                                   //!< Returns the thread's CPU time (seconds)
+    uint32_t m_sink;                                //!< Returns the last line read (keeps the chase live)
+};
+
+
+static void* copyVictimThread(void* context)
+{
+    CopyVictim* victim = (CopyVictim*)context;
+    uint32_t line = 0;
+    uint64_t reads = 0;
+    double start = threadCpuTime();
+    while (!victim->m_stop)
+    {
+        for (unsigned i = 0; i < 4096; i++) line = victim->m_lines[(size_t)line * 16];
+        reads += 4096;
+    }
+    victim->m_cpu = threadCpuTime() - start;
+    victim->m_reads = reads;
+    victim->m_sink = line;
+    return 0;
+}
+
+
+/** Copy a frame row by row with memcpy.
+ */
+static void copyRows(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+{
+    for (unsigned y = 0; y < height; y++) memcpy((uint8_t*)dst + (y * dstBytesPerRow), (const uint8_t*)src + (y * srcBytesPerRow), (size_t)width * 4);
+}
+
+
+typedef void (*FrameCopy)(void* dst, size_t dstBytesPerRow, const void* src, size_t srcBytesPerRow, unsigned width, unsigned height);
+
+
+/** Run the workload for a number of seconds, copying a frame at 60 Hz meanwhile if a copy is given.
+ *
+ *  @return                 The workload's CPU time per read (nanoseconds).
+ */
+static double copyInterference(CopyVictim& victim, FrameCopy copy, uint8_t* dst, size_t dstBytesPerRow, const uint8_t* src,
+                               size_t srcBytesPerRow, unsigned width, unsigned height, unsigned seconds)
+{
+    pthread_t thread;
+    victim.m_stop = false;
+    if (0 != pthread_create(&thread, 0, copyVictimThread, &victim)) return 0;
+
+    double start = now();
+    for (unsigned frame = 1; frame <= seconds * 60; frame++)
+    {
+        if (copy) copy(dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+        double wait = start + (frame / 60.0) - now();
+        if (wait > 0) usleep((useconds_t)(wait * 1e6));
+    }
+    victim.m_stop = true;
+    pthread_join(thread, 0);
+    return (victim.m_reads) ? (victim.m_cpu * 1e9) / victim.m_reads : 0.0;
+}
+
+
+/** Measure copy throughput and the effect of each copy on a concurrent workload.
+ */
+static bool testCopy(unsigned width, unsigned height, unsigned seconds, unsigned workloadMB)
+{
+    // The source has padded rows, as a framebuffer may.
+    const size_t srcBytesPerRow = ((size_t)width * 4) + 256;
+    const size_t dstBytesPerRow = (size_t)width * 4;
+    const size_t frameBytes = dstBytesPerRow * height;
+    size_t cache = DisplayXFBPixelKernels::streamingThreshold() * 2;
+    size_t workingSet = (cache / 4 < 8 * 1024 * 1024) ? cache / 4 : 8 * 1024 * 1024;
+    if (workloadMB) workingSet = (size_t)workloadMB * 1024 * 1024;
+
+    uint8_t* src = (uint8_t*)malloc(srcBytesPerRow * height);
+    uint8_t* dst = (uint8_t*)malloc(frameBytes);
+    CopyVictim victim;
+    memset(&victim, 0, sizeof victim);
+    victim.m_count = workingSet / 64;
+    victim.m_lines = (uint32_t*)malloc(victim.m_count * 64);
+    if (0 == width || 0 == height || !src || !dst || !victim.m_lines || victim.m_count < 2)
+    {
+        printf("FAIL: could not allocate the buffers\n");
+        free(src);
+        free(dst);
+        free(victim.m_lines);
+        return false;
+    }
+    for (unsigned y = 0; y < height; y++) fillPattern((uint32_t*)(src + (y * srcBytesPerRow)), width, 1, y);
+
+    // Sattolo's shuffle gives a single cycle through every line.
+    uint32_t seed = 1;
+    for (size_t i = 0; i < victim.m_count; i++) victim.m_lines[i * 16] = (uint32_t)i;
+    for (size_t i = victim.m_count - 1; i > 0; i--)
+    {
+        size_t j = random32(seed) % i;
+        uint32_t t = victim.m_lines[i * 16];
+        victim.m_lines[i * 16] = victim.m_lines[j * 16];
+        victim.m_lines[j * 16] = t;
+    }
+
+    printf("%ux%u frame (%.1f MB), last level cache %.1f MB, copyFrame() streams from %.1f MB, workload %.1f MB\n",
+           width, height, frameBytes / 1048576.0, cache / 1048576.0, DisplayXFBPixelKernels::streamingThreshold() / 1048576.0,
+           workingSet / 1048576.0);
+
+    static const char* const kNames[] = { "memcpy", "streaming" };
+    const FrameCopy copies[] = { copyRows, DisplayXFBPixelKernels::copyFrameStreaming };
+    bool passed = true;
+    for (unsigned c = 0; c < 2; c++)
+    {
+        memset(dst, 0, frameBytes);
+        unsigned count = 0;
+        double start = now();
+        double elapsed = 0;
+        while (elapsed < 1.0)
+        {
+            copies[c](dst, dstBytesPerRow, src, srcBytesPerRow, width, height);
+            count ++;
+            elapsed = now() - start;
+        }
+        bool same = true;
+        for (unsigned y = 0; same && y < height; y++) same = (0 == memcmp(dst + (y * dstBytesPerRow), src + (y * srcBytesPerRow), dstBytesPerRow));
+        printf("%-9s  %.2f GB/s (%u frames in %.2f s)\n", kNames[c], (frameBytes * (double)count) / elapsed / 1e9, count, elapsed);
+        if (!same) { printf("FAIL: the %s copy does not match the frame\n", kNames[c]); passed = false; }
+    }
+
+    // Rounds of each condition are interleaved, so that drift in the machine's load affects them all alike.
+    static const unsigned kMaxRounds = 64;
+    unsigned rounds = (seconds < 1) ? 1 : (seconds > kMaxRounds) ? kMaxRounds : seconds;
+    double perRead[3][kMaxRounds];
+    for (unsigned r = 0; r < rounds; r++)
+    {
+        for (unsigned c = 0; c < 3; c++)
+        {
+            FrameCopy copy = (c) ? copies[c - 1] : 0;
+            perRead[c][r] = copyInterference(victim, copy, dst, dstBytesPerRow, src, srcBytesPerRow, width, height, 1);
+        }
+    }
+    double median[3];
+    for (unsigned c = 0; c < 3; c++)
+    {
+        double* v = perRead[c];
+        for (unsigned i = 1; i < rounds; i++)
+        {
+            for (unsigned j = i; j > 0 && v[j - 1] > v[j]; j--)
+            {
+                double t = v[j];
+                v[j] = v[j - 1];
+                v[j - 1] = t;
+            }
+        }
+        median[c] = v[rounds / 2];
+    }
+    printf("workload alone             %.2f ns per read (median of %u)\n", median[0], rounds);
+    for (unsigned c = 0; c < 2; c++)
+    {
+        printf("workload with %-9s    %.2f ns per read (%+.1f%%)\n", kNames[c], median[c + 1],
+               (median[0] > 0) ? ((median[c + 1] / median[0]) - 1.0) * 100.0 : 0.0);
+    }
+
+    free(src);
+    free(dst);
+    free(victim.m_lines);
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Fused Shadow Update
+
+
+/** Update a shadow frame with separate diff, copy and hash passes over the frame.
+ *
+ *  @return                 The number of changed tiles.
+ */
+static unsigned threePassUpdate(const DisplayXFBPixelKernelTable& kernels, unsigned tileSize, uint32_t* shadow, uint64_t* hashes,
+                                uint8_t* changed, const uint8_t* src, size_t srcBytesPerRow, unsigned width, unsigned height)
+{
+    unsigned tilesX = (width + tileSize - 1) / tileSize;
+    unsigned tilesY = (height + tileSize - 1) / tileSize;
+    size_t shadowBytesPerRow = (size_t)width * 4;
+    unsigned count = 0;
+    for (unsigned pass = 0; pass < 3; pass++)
+    {
+        for (unsigned ty = 0; ty < tilesY; ty++)
+        {
+            unsigned py = ty * tileSize;
+            unsigned rows = (py + tileSize > height) ? height - py : tileSize;
+            for (unsigned tx = 0; tx < tilesX; tx++)
+            {
+                unsigned px = tx * tileSize;
+                unsigned columns = (px + tileSize > width) ? width - px : tileSize;
+                unsigned tile = (ty * tilesX) + tx;
+                uint8_t* dst = (uint8_t*)shadow + ((size_t)py * shadowBytesPerRow) + ((size_t)px * 4);
+                const uint8_t* from = src + ((size_t)py * srcBytesPerRow) + ((size_t)px * 4);
+                if (0 == pass)
+                {
+                    changed[tile] = kernels.m_diff(dst, shadowBytesPerRow, from, srcBytesPerRow, columns, rows) ? 1 : 0;
+                    count += changed[tile];
+                }
+                else if (1 == pass)
+                {
+                    if (changed[tile]) kernels.m_copy(dst, shadowBytesPerRow, from, srcBytesPerRow, columns, rows);
+                }
+                else
+                {
+                    kernels.m_hash(from, srcBytesPerRow, columns, rows, &hashes[tile], 0);
+                }
+            }
+        }
+    }
+    return count;
+}
+
+
+/** Compare the fused shadow update with three separate passes.
+ */
+static bool testFused(unsigned width, unsigned height, unsigned frames)
+{
+    static const unsigned kTileSize = 32;
+    static const unsigned kBlockSize = 64;
+    static const unsigned kBlocksPerFrame = 64;
+
+    // The source has padded rows, as a framebuffer may, keeping rows 16 byte aligned.
+    const size_t srcBytesPerRow = ((size_t)width * 4) + 256;
+    uint8_t* src = (uint8_t*)malloc(srcBytesPerRow * height);
+    unsigned tilesX = (width + kTileSize - 1) / kTileSize;
+    unsigned tilesY = (height + kTileSize - 1) / kTileSize;
+    unsigned tiles = tilesX * tilesY;
+    uint32_t* shadow = (uint32_t*)calloc((size_t)width * height, 4);
+    uint64_t* hashes = (uint64_t*)calloc(tiles, sizeof (uint64_t));
+    uint8_t* changed = (uint8_t*)calloc(tiles, 1);
+    DisplayXFBShadowFrame fused;
+    if (width < kBlockSize || height < kBlockSize || !src || !shadow || !hashes || !changed || !fused.configure(width, height, kTileSize))
+    {
+        printf("FAIL: could not allocate the buffers\n");
+        free(src);
+        free(shadow);
+        free(hashes);
+        free(changed);
+        return false;
+    }
+    for (unsigned y = 0; y < height; y++) fillPattern((uint32_t*)(src + (y * srcBytesPerRow)), width, 1, y);
+
+    bool aligned = 0 == (((uintptr_t)src | srcBytesPerRow | (kTileSize * 4)) & 15);
+    DisplayXFBPixelKernelTable kernels =
+        DisplayXFBPixelKernels::select(DisplayXFBPixelKernels::kFormatBGRA32, kTileSize, aligned, DisplayXFBPixelKernels::cpuIsa());
+
+    // Prime both shadows with the first frame.
+    fused.update(src, srcBytesPerRow);
+    threePassUpdate(kernels, kTileSize, shadow, hashes, changed, src, srcBytesPerRow, width, height);
+
+    uint32_t seed = 1;
+    double fusedTime = 0;
+    double threePassTime = 0;
+    uint64_t changedTiles = 0;
+    unsigned mismatches = 0;
+    for (unsigned frame = 0; frame < frames; frame++)
+    {
+        for (unsigned b = 0; b < kBlocksPerFrame; b++)
+        {
+            unsigned x = random32(seed) % (width - kBlockSize + 1);
+            unsigned y = random32(seed) % (height - kBlockSize + 1);
+            uint32_t colour = random32(seed);
+            for (unsigned row = 0; row < kBlockSize; row++) fillPattern((uint32_t*)(src + ((y + row) * srcBytesPerRow)) + x, kBlockSize, 1, colour + row);
+        }
+
+        // Alternate which runs first, so that neither gains from the source the other left in cache.
+        for (unsigned i = 0; i < 2; i++)
+        {
+            double start = now();
+            if ((frame + i) & 1)
+            {
+                changedTiles += fused.update(src, srcBytesPerRow);
+                fusedTime += now() - start;
+            }
+            else
+            {
+                threePassUpdate(kernels, kTileSize, shadow, hashes, changed, src, srcBytesPerRow, width, height);
+                threePassTime += now() - start;
+            }
+        }
+
+        for (unsigned t = 0; t < tiles; t++)
+        {
+            unsigned tx = t % tilesX, ty = t / tilesX;
+            if (fused.isTileChanged(tx, ty) != (0 != changed[t]) || fused.tileHash(tx, ty) != hashes[t]) mismatches ++;
+        }
+    }
+    bool sameShadow = 0 == memcmp(fused.pixels(), shadow, (size_t)width * height * 4);
+
+    double frameBytes = (double)width * height * 4;
+    printf("%ux%u frame, %u frames, %.1f%% of tiles changed per frame\n", width, height, frames,
+           (frames) ? (100.0 * changedTiles) / ((double)frames * tiles) : 0.0);
+    printf("fused         %.3f ms per frame (%.2f GB/s of frame)\n", fusedTime * 1000.0 / frames, frameBytes * frames / fusedTime / 1e9);
+    printf("three passes  %.3f ms per frame (%.2f GB/s of frame)\n", threePassTime * 1000.0 / frames, frameBytes * frames / threePassTime / 1e9);
+    printf("fused update takes %.2f times as long as three passes\n", fusedTime / threePassTime);
+
+    bool passed = true;
+    if (mismatches) { printf("FAIL: %u tile results differ between the fused and three pass updates\n", mismatches); passed = false; }
+    if (!sameShadow) { printf("FAIL: the shadows differ\n"); passed = false; }
+
+    free(src);
+    free(shadow);
+    free(hashes);
+    free(changed);
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Change Probe
+
+
+/** Run the change probe over a scene and check its detection delay against a full compare.
+ */
+static bool probeRun(bool video, unsigned samples, unsigned verifyFrames, unsigned frames)
+{
+    DisplayXFBChangeProbe::Config config;
+    config.m_samplesPerTile = samples;
+    config.m_verifyFrames = verifyFrames;
+    DisplayXFBChangeProbe probe;
+    Scene scene;
+    uint32_t* reference = (uint32_t*)malloc((size_t)Scene::kWidth * Scene::kHeight * 4);
+    if (!sceneCreate(scene, video) || !reference || !probe.configure(config, Scene::kWidth, Scene::kHeight))
+    {
+        printf("FAIL: could not set up the probe\n");
+        sceneDestroy(scene);
+        free(reference);
+        return false;
+    }
+
+    // The reference holds what the probe has reported; a tile that differs from it has a change not yet found.
+    const unsigned tilesX = probe.tilesX();
+    const unsigned tiles = tilesX * probe.tilesY();
+    int* pendingSince = (int*)malloc(tiles * sizeof (int));
+    for (unsigned t = 0; pendingSince && t < tiles; t++) pendingSince[t] = -1;
+    probe.probe(scene.m_pixels, Scene::kWidth * 4);
+    memcpy(reference, scene.m_pixels, (size_t)Scene::kWidth * Scene::kHeight * 4);
+    uint64_t primingBytes = probe.statistics().m_bytesRead;
+
+    uint64_t found = 0, foundAtOnce = 0, delaySum = 0;
+    unsigned maxDelay = 0;
+    for (int frame = 0; pendingSince && frame < (int)frames; frame++)
+    {
+        Rect changes[Scene::kChangeKinds];
+        sceneStep(scene, changes);
+        probe.probe(scene.m_pixels, Scene::kWidth * 4);
+        for (unsigned t = 0; t < tiles; t++)
+        {
+            unsigned tx = t % tilesX, ty = t / tilesX;
+            unsigned x = tx * config.m_tileWidth, y = ty * config.m_tileHeight;
+            unsigned w = (x + config.m_tileWidth > Scene::kWidth) ? Scene::kWidth - x : config.m_tileWidth;
+            unsigned h = (y + config.m_tileHeight > Scene::kHeight) ? Scene::kHeight - y : config.m_tileHeight;
+            if (probe.isTileChanged(tx, ty))
+            {
+                unsigned delay = (pendingSince[t] >= 0) ? (unsigned)(frame - pendingSince[t]) : 0;
+                found ++;
+                if (0 == delay) foundAtOnce ++;
+                delaySum += delay;
+                if (delay > maxDelay) maxDelay = delay;
+                pendingSince[t] = -1;
+                copyRect(reference, scene.m_pixels, Scene::kWidth, x, y, w, h);
+                continue;
+            }
+            if (pendingSince[t] >= 0) continue;
+            for (unsigned row = 0; row < h; row++)
+            {
+                size_t offset = ((size_t)(y + row) * Scene::kWidth) + x;
+                if (0 != memcmp(reference + offset, scene.m_pixels + offset, (size_t)w * 4)) { pendingSince[t] = frame; break; }
+            }
+        }
+    }
+
+    // A change still pending at the end has waited at least this long.
+    for (unsigned t = 0; pendingSince && t < tiles; t++)
+    {
+        if (pendingSince[t] >= 0 && frames - 1 - pendingSince[t] > maxDelay) maxDelay = frames - 1 - pendingSince[t];
+    }
+
+    const DisplayXFBChangeProbe::Statistics& statistics = probe.statistics();
+    double fullDiff = (double)Scene::kWidth * Scene::kHeight * 4 * frames;
+    printf("%-8s %2u samples, verify %3u: reads %5.1f%% of a full diff, %5.1f%% of %llu changed tiles found at once, delay mean %.2f max %u\n",
+           video ? "video" : "desktop", samples, verifyFrames, (100.0 * (statistics.m_bytesRead - primingBytes)) / fullDiff,
+           (found) ? (100.0 * foundAtOnce) / found : 100.0, (unsigned long long)found, (found) ? (double)delaySum / found : 0.0, maxDelay);
+
+    bool passed = (0 != pendingSince);
+    if (maxDelay > verifyFrames) { printf("FAIL: a change waited longer than the verification period\n"); passed = false; }
+    free(pendingSince);
+    free(reference);
+    sceneDestroy(scene);
+    return passed;
+}
+
+
+/** Measure the change probe's cost and detection delay across its settings.
+ */
+static bool testProbe(unsigned frames)
+{
+    static const unsigned kSamples[] = { 1, 4, 16 };
+    static const unsigned kVerifyFrames[] = { 10, 30, 120 };
+    bool passed = true;
+    for (unsigned video = 0; video < 2; video++)
+    {
+        for (unsigned i = 0; i < sizeof kSamples / sizeof kSamples[0]; i++)
+        {
+            for (unsigned j = 0; j < sizeof kVerifyFrames / sizeof kVerifyFrames[0]; j++)
+            {
+                if (!probeRun(0 != video, kSamples[i], kVerifyFrames[j], frames)) passed = false;
+            }
+        }
+    }
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Huge Pages
+
+
+/** Run a kernel over a frame in row order, or tile by tile.
+ */
+static void pagesPass(DisplayXFBPixelKernelTable::Convert kernel, uint8_t* dst, const uint8_t* src, size_t bytesPerRow,
+                      unsigned width, unsigned height, unsigned tileSize)
+{
+    if (0 == tileSize)
+    {
+        kernel(dst, bytesPerRow, src, bytesPerRow, width, height);
+        return;
+    }
+    for (unsigned y = 0; y < height; y += tileSize)
+    {
+        unsigned rows = (y + tileSize > height) ? height - y : tileSize;
+        for (unsigned x = 0; x < width; x += tileSize)
+        {
+            unsigned columns = (x + tileSize > width) ? width - x : tileSize;
+            size_t offset = ((size_t)y * bytesPerRow) + ((size_t)x * 4);
+            kernel(dst + offset, bytesPerRow, src + offset, bytesPerRow, columns, rows);
+        }
+    }
+}
+
+
+/** Compare copy and convert throughput in to huge page and regular page buffers.
+ */
+static bool testPages(unsigned width, unsigned height, unsigned frames)
+{
+    static const char* const kBackingNames[] = { "none", "regular", "transparent huge", "huge" };
+    const size_t bytesPerRow = (size_t)width * 4;
+    const size_t size = bytesPerRow * height;
+
+    DisplayXFBPageAllocator::Backing backing[2] = { DisplayXFBPageAllocator::kBackingNone, DisplayXFBPageAllocator::kBackingNone };
+    uint8_t* src = (uint8_t*)malloc(size);
+    DisplayXFBPageAllocator::setHugePagesEnabled(true);
+    uint8_t* huge = (uint8_t*)DisplayXFBPageAllocator::allocate(size, &backing[0]);
+    DisplayXFBPageAllocator::setHugePagesEnabled(false);
+    uint8_t* regular = (uint8_t*)DisplayXFBPageAllocator::allocate(size, &backing[1]);
+    DisplayXFBPageAllocator::setHugePagesEnabled(true);
+    if (0 == width || 0 == height || !src || !huge || !regular)
+    {
+        printf("FAIL: could not allocate the buffers\n");
+        free(src);
+        DisplayXFBPageAllocator::release(huge, size);
+        DisplayXFBPageAllocator::release(regular, size);
+        return false;
+    }
+    fillPattern((uint32_t*)src, width, height, 1);
+    printf("%ux%u frame (%.1f MB): huge page buffer is %s, regular buffer is %s\n", width, height, size / 1048576.0,
+           kBackingNames[backing[0]], kBackingNames[backing[1]]);
+
+    DisplayXFBPixelKernels::Isa isa = DisplayXFBPixelKernels::cpuIsa();
+    DisplayXFBPixelKernelTable copy = DisplayXFBPixelKernels::select(DisplayXFBPixelKernels::kFormatBGRA32, 0, false, isa);
+    DisplayXFBPixelKernelTable convert = DisplayXFBPixelKernels::select(DisplayXFBPixelKernels::kFormatRGBA32, 0, false, isa);
+    static const char* const kOperationNames[] = { "copy", "convert" };
+    const DisplayXFBPixelKernelTable::Convert kernels[] = { copy.m_copy, convert.m_convert };
+    bool passed = true;
+    for (unsigned op = 0; op < 2; op++)
+    {
+        for (unsigned order = 0; order < 2; order++)
+        {
+            unsigned tileSize = (order) ? 32 : 0;
+            double seconds[2] = { 0, 0 };
+
+            // Alternate the buffers frame by frame, so that both see the same conditions.
+            for (unsigned frame = 0; frame < frames; frame++)
+            {
+                for (unsigned b = 0; b < 2; b++)
+                {
+                    double start = now();
+                    pagesPass(kernels[op], (b) ? regular : huge, src, bytesPerRow, width, height, tileSize);
+                    seconds[b] += now() - start;
+                }
+            }
+            printf("%-7s %-5s  huge %6.2f GB/s   regular %6.2f GB/s   (%+.1f%%)\n", kOperationNames[op], (order) ? "tiles" : "rows",
+                   (size * (double)frames) / seconds[0] / 1e9, (size * (double)frames) / seconds[1] / 1e9,
+                   ((seconds[1] / seconds[0]) - 1.0) * 100.0);
+            if (0 != memcmp(huge, regular, size)) { printf("FAIL: the %s results differ\n", kOperationNames[op]); passed = false; }
+        }
+    }
+
+    free(src);
+    DisplayXFBPageAllocator::release(huge, size);
+    DisplayXFBPageAllocator::release(regular, size);
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Frame Pool
+
+
+/** State for one capture thread.
+ */
+struct PoolThread
+{
+    DisplayXFBFramePool* m_pool;                    //!< The pool to use, or zero for posix_memalign() and free()
+    unsigned m_index;                               //!< The thread's index
+    unsigned m_frames;                              //!< Frames to run (the mode changes halfway)
+    unsigned m_failures;                            //!< Returns the number of failed or corrupt acquisitions
+};
+
+
+static void* poolThread(void* context)
+{
+    static const unsigned kModes[2][2] = { { 2560, 1600 }, { 1920, 1080 } };
+    PoolThread* thread = (PoolThread*)context;
+    DisplayXFBFramePool::Frame* previousFrame = 0;
+    uint32_t* previous = 0;
+    uint32_t previousTag = 0;
+    for (unsigned frame = 0; frame < thread->m_frames; frame++)
+    {
+        const unsigned* mode = kModes[(frame < thread->m_frames / 2) ? 0 : 1];
+        size_t size = (size_t)mode[0] * mode[1] * 4;
+        DisplayXFBFramePool::Frame* currentFrame = 0;
+        uint32_t* current = 0;
+        if (thread->m_pool)
+        {
+            currentFrame = thread->m_pool->acquire(mode[0], mode[1]);
+            if (currentFrame) current = (uint32_t*)currentFrame->data();
+        }
+        else
+        {
+            void* data = 0;
+            if (0 == posix_memalign(&data, 64, size)) current = (uint32_t*)data;
+        }
+        if (!current) { thread->m_failures++; continue; }
+
+        // Fill the frame as a capture would, tagging it so that a buffer issued twice shows up.
+        uint32_t tag = (thread->m_index << 24) | frame;
+        memset(current, (int)(frame & 0xff), size);
+        current[0] = tag;
+        if (previous)
+        {
+            if (previous[0] != previousTag) thread->m_failures++;
+            if (previousFrame) thread->m_pool->release(previousFrame);
+            else free(previous);
+        }
+        previousFrame = currentFrame;
+        previous = current;
+        previousTag = tag;
+    }
+    if (previous)
+    {
+        if (previousFrame) thread->m_pool->release(previousFrame);
+        else free(previous);
+    }
+    return 0;
+}
+
+
+/** Run the capture threads.
+ *
+ *  @return                 The time per frame per thread (milliseconds), or zero on failure.
+ */
+static double poolRun(DisplayXFBFramePool* pool, unsigned threads, unsigned frames)
+{
+    PoolThread state[64];
+    pthread_t handles[64];
+    unsigned started = 0;
+    double start = now();
+    for (unsigned i = 0; i < threads; i++)
+    {
+        state[i].m_pool = pool;
+        state[i].m_index = i;
+        state[i].m_frames = frames;
+        state[i].m_failures = 0;
+        if (0 == pthread_create(&handles[i], 0, poolThread, &state[i])) started++;
+    }
+    unsigned failures = (started == threads) ? 0 : 1;
+    for (unsigned i = 0; i < started; i++)
+    {
+        pthread_join(handles[i], 0);
+        failures += state[i].m_failures;
+    }
+    double elapsed = now() - start;
+    if (0 != failures)
+    {
+        printf("FAIL: %u failed or corrupt acquisitions\n", failures);
+        return 0;
+    }
+    return (elapsed * 1000.0) / frames;
+}
+
+
+/** Compare the frame pool with posix_memalign() and free().
+ */
+static bool testPool(unsigned threads, unsigned frames)
+{
+    if (0 == threads || threads > 64 || frames < 2) return false;
+
+    double heapTime = poolRun(0, threads, frames);
+    DisplayXFBFramePool pool;
+    double poolTime = poolRun(&pool, threads, frames);
+    DisplayXFBFramePool::Statistics statistics = pool.statistics();
+    pool.trim();
+    DisplayXFBFramePool::Statistics trimmed = pool.statistics();
+    if (0 == heapTime || 0 == poolTime) return false;
+
+    printf("%u threads, %u frames each: posix_memalign %.3f ms/frame, pool %.3f ms/frame (%.2fx)\n", threads, frames,
+           heapTime, poolTime, heapTime / poolTime);
+    printf("pool: %llu hits (%llu from thread caches), %llu misses, %llu failures, %.1f MB resident (%.1f MB after trim)\n",
+           (unsigned long long)statistics.m_hits, (unsigned long long)statistics.m_threadHits,
+           (unsigned long long)statistics.m_misses, (unsigned long long)statistics.m_failures,
+           statistics.m_residentBytes / 1048576.0, trimmed.m_residentBytes / 1048576.0);
+
+    bool passed = true;
+    if (statistics.m_misses > (uint64_t)threads * 4)
+    {
+        printf("FAIL: %llu misses, expected at most %u\n", (unsigned long long)statistics.m_misses, threads * 4);
+        passed = false;
+    }
+    if (0 != statistics.m_failures) { printf("FAIL: the pool refused requests\n"); passed = false; }
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Tile Codec
+
+
+/** Results from one codec run.
+ */
+struct CodecResult
+{
+    size_t m_keyBytes;                              //!< Size of the full frame
+    double m_kbps;                                  //!< Bitrate of the changes at 60 Hz (kbit/s)
+    double m_encodeMs;                              //!< Encode time per frame, including the full frame (milliseconds)
+    double m_psnr;                                  //!< PSNR of the decoded changes (dB, 99 if lossless)
+    double m_tileShare[DisplayXFBTileCodec::kTileClasses];  //!< Share of tiles in each class
+};
+
+
+/** Code one rectangle of the scene, decode it, and add the squared error to the totals.
+ */
+static size_t codecRect(DisplayXFBTileCodec& codec, const Scene& scene, const Rect& rect, uint8_t* output, size_t capacity,
+                        uint32_t* decoded, double& squaredError, uint64_t& samples, bool& passed)
+{
+    const uint32_t* origin = scene.m_pixels + (rect.m_y * Scene::kWidth) + rect.m_x;
+    size_t size = codec.encode(origin, rect.m_width, rect.m_height, Scene::kWidth * 4, output, capacity);
+    if (0 == size || !DisplayXFBTileCodec::decode(output, size, decoded, rect.m_width, rect.m_height, rect.m_width * 4))
+    {
+        passed = false;
+        return size;
+    }
+    for (unsigned y = 0; y < rect.m_height; y++)
+    {
+        for (unsigned x = 0; x < rect.m_width; x++)
+        {
+            uint32_t a = origin[(y * Scene::kWidth) + x];
+            uint32_t b = decoded[(y * rect.m_width) + x];
+            for (unsigned shift = 0; shift < 24; shift += 8)
+            {
+                int d = (int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff);
+                squaredError += d * d;
+            }
+        }
+    }
+    samples += (uint64_t)rect.m_width * rect.m_height * 3;
+    return size;
+}
+
+
+static bool codecRun(bool video, unsigned quality, unsigned frames, CodecResult& result)
+{
+    Scene scene;
+    const size_t capacity = DisplayXFBTileCodec::maxEncodedSize(Scene::kWidth, Scene::kHeight);
+    uint8_t* output = (uint8_t*)malloc(capacity);
+    uint32_t* decoded = (uint32_t*)malloc(Scene::kWidth * Scene::kHeight * sizeof (uint32_t));
+    bool passed = sceneCreate(scene, video) && output && decoded;
+    if (passed)
+    {
+        DisplayXFBTileCodec codec(quality);
+        double squaredError = 0;
+        uint64_t samples = 0;
+        uint64_t changeBytes = 0;
+        Rect full = { 0, 0, Scene::kWidth, Scene::kHeight };
+        result.m_keyBytes = codecRect(codec, scene, full, output, capacity, decoded, squaredError, samples, passed);
+        squaredError = 0;
+        samples = 0;
+        for (unsigned frame = 0; frame < frames && passed; frame++)
+        {
+            Rect changes[Scene::kChangeKinds];
+            sceneStep(scene, changes);
+            for (unsigned kind = 0; kind < Scene::kChangeKinds; kind++)
+            {
+                if (0 == changes[kind].m_width || 0 == changes[kind].m_height) continue;
+                changeBytes += codecRect(codec, scene, changes[kind], output, capacity, decoded, squaredError, samples, passed);
+            }
+        }
+
+        const DisplayXFBTileCodec::Statistics& statistics = codec.statistics();
+        uint64_t tiles = 0;
+        for (unsigned i = 0; i < DisplayXFBTileCodec::kTileClasses; i++) tiles += statistics.m_tiles[i];
+        for (unsigned i = 0; i < DisplayXFBTileCodec::kTileClasses; i++) result.m_tileShare[i] = (tiles) ? (double)statistics.m_tiles[i] / tiles : 0.0;
+        result.m_kbps = (changeBytes * 8.0 * 60.0) / (frames * 1000.0);
+        result.m_encodeMs = statistics.m_encodeMicroseconds / (1000.0 * frames);
+        double mse = (samples) ? squaredError / samples : 0.0;
+        result.m_psnr = (mse > 0) ? 10.0 * log10((255.0 * 255.0) / mse) : 99.0;
+    }
+    sceneDestroy(scene);
+    free(output);
+    free(decoded);
+    if (!passed) printf("FAIL: a message did not decode\n");
+    return passed;
+}
+
+
+/** Measure the codec's bitrate, encode time and quality on the synthetic scenes.
+ */
+static bool testCodec(unsigned frames)
+{
+    static const unsigned kQualities[] = { 30, 50, 75, 95 };
+    static const unsigned kQualityCount = sizeof kQualities / sizeof kQualities[0];
+    if (0 == frames) return false;
+
+    bool passed = true;
+    for (unsigned video = 0; video < 2; video++)
+    {
+        printf("%s, %u frames:\n", (video) ? "desktop with video" : "desktop", frames);
+        printf("  quality   full frame   changes (kbit/s)   encode (ms/frame)   flat/text/photo tiles   PSNR (dB)\n");
+        CodecResult last = { 0, 0, 0, 0, { 0, 0, 0 } };
+        for (unsigned q = 0; q < kQualityCount; q++)
+        {
+            CodecResult result;
+            if (!codecRun(0 != video, kQualities[q], frames, result)) return false;
+            char psnr[16];
+            if (result.m_psnr >= 99.0) snprintf(psnr, sizeof psnr, "lossless");
+            else snprintf(psnr, sizeof psnr, "%.1f", result.m_psnr);
+            printf("  %7u   %7.1f KB   %16.1f   %17.3f   %5.1f%% %5.1f%% %5.1f%%   %9s\n", kQualities[q], result.m_keyBytes / 1024.0,
+                   result.m_kbps, result.m_encodeMs, result.m_tileShare[0] * 100.0, result.m_tileShare[1] * 100.0,
+                   result.m_tileShare[2] * 100.0, psnr);
+            if (0 != q && (result.m_kbps < last.m_kbps * 0.98 || result.m_psnr < last.m_psnr - 0.1))
+            {
+                printf("FAIL: the bitrate or PSNR fell as the quality rose\n");
+                passed = false;
+            }
+            last = result;
+        }
+    }
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Pixel Kernels
+
+
+enum { kKernelCopy, kKernelDiff, kKernelConvert, kKernelBlend };
+static const unsigned kKernelRounds = 5;            //!< Timed rounds per kernel (the best is reported)
+
+
+/** Run a kernel over a frame tile by tile.
+ *
+ *  @return                 For kKernelDiff, logical true if any tile differed.
+ */
+static bool kernelPass(const DisplayXFBPixelKernelTable& table, unsigned kernel, uint8_t* dst, size_t dstBytesPerRow, unsigned dstPixelBytes,
+                       const uint8_t* src, size_t srcBytesPerRow, unsigned width, unsigned height, unsigned tileSize)
+{
+    bool differs = false;
+    for (unsigned y = 0; y < height; y += tileSize)
+    {
+        unsigned rows = (y + tileSize > height) ? height - y : tileSize;
+        for (unsigned x = 0; x < width; x += tileSize)
+        {
+            unsigned columns = (x + tileSize > width) ? width - x : tileSize;
+            uint8_t* d = dst + ((size_t)y * dstBytesPerRow) + ((size_t)x * dstPixelBytes);
+            const uint8_t* s = src + ((size_t)y * srcBytesPerRow) + ((size_t)x * 4);
+            switch (kernel)
+            {
+                case kKernelCopy:       table.m_copy(d, dstBytesPerRow, s, srcBytesPerRow, columns, rows); break;
+                case kKernelDiff:       differs |= table.m_diff(d, dstBytesPerRow, s, srcBytesPerRow, columns, rows); break;
+                case kKernelConvert:    table.m_convert(d, dstBytesPerRow, s, srcBytesPerRow, columns, rows); break;
+                case kKernelBlend:      table.m_blend(d, dstBytesPerRow, s, srcBytesPerRow, columns, rows); break;
+            }
+        }
+    }
+    return differs;
+}
+
+
+/** Compare the generic, any-width and specialised kernels over a range of display modes and tile sizes.
+ */
+static bool testKernels(unsigned frames)
+{
+    static const unsigned kModes[][2] = { { 1280, 800 }, { 1920, 1080 }, { 2560, 1600 }, { 3840, 2160 } };
+    static const unsigned kModeCount = sizeof kModes / sizeof kModes[0];
+    static const unsigned kTileSizes[] = { 16, 32, 64 };
+    static const unsigned kTileSizeCount = sizeof kTileSizes / sizeof kTileSizes[0];
+    static const struct { const char* m_name; unsigned m_kernel; DisplayXFBPixelKernels::Format m_format; } kCases[] =
+    {
+        { "copy", kKernelCopy, DisplayXFBPixelKernels::kFormatBGRA32 },
+        { "diff", kKernelDiff, DisplayXFBPixelKernels::kFormatBGRA32 },
+        { "to RGBA", kKernelConvert, DisplayXFBPixelKernels::kFormatRGBA32 },
+        { "to gray", kKernelConvert, DisplayXFBPixelKernels::kFormatGray8 },
+        { "blend", kKernelBlend, DisplayXFBPixelKernels::kFormatBGRA32 }
+    };
+    static const unsigned kCaseCount = sizeof kCases / sizeof kCases[0];
+    static const char* const kIsaNames[] = { "scalar", "SSE2", "SSSE3" };
+    if (0 == frames) return false;
+
+    const DisplayXFBPixelKernels::Isa isa = DisplayXFBPixelKernels::cpuIsa();
+    const size_t maxSize = (size_t)3840 * 2160 * 4;
+    void* buffers[4] = { 0, 0, 0, 0 };
+    for (unsigned i = 0; i < 4; i++) if (0 != posix_memalign(&buffers[i], 64, maxSize)) buffers[i] = 0;
+    uint8_t* src = (uint8_t*)buffers[0];
+    uint8_t* base = (uint8_t*)buffers[1];
+    uint8_t* reference = (uint8_t*)buffers[2];
+    uint8_t* dst = (uint8_t*)buffers[3];
+    bool passed = src && base && reference && dst;
+    printf("instruction set: %s; Mpixel/s for generic, %s any width and %s specialised kernels\n", kIsaNames[isa], kIsaNames[isa], kIsaNames[isa]);
+
+    for (unsigned m = 0; m < kModeCount && passed; m++)
+    {
+        const unsigned width = kModes[m][0];
+        const unsigned height = kModes[m][1];
+        const size_t srcBytesPerRow = (size_t)width * 4;
+        const double pixels = (double)width * height * frames;
+
+        // The source has varying alpha (for blend); the destination starts as a different frame, or a copy for diff.
+        fillPattern((uint32_t*)src, width, height, 1);
+        for (size_t i = 0; i < (size_t)width * height; i++) ((uint32_t*)src)[i] = (((uint32_t*)src)[i] & 0xffffffu) | (uint32_t)((i * 37) & 0xff) << 24;
+        printf("%ux%u:\n", width, height);
+        for (unsigned t = 0; t < kTileSizeCount && passed; t++)
+        {
+            const unsigned tileSize = kTileSizes[t];
+            for (unsigned c = 0; c < kCaseCount && passed; c++)
+            {
+                const unsigned kernel = kCases[c].m_kernel;
+                const unsigned dstPixelBytes = (DisplayXFBPixelKernels::kFormatGray8 == kCases[c].m_format) ? 1 : 4;
+                const size_t dstBytesPerRow = (size_t)width * dstPixelBytes;
+                const size_t dstSize = dstBytesPerRow * height;
+                if (kKernelDiff == kernel) memcpy(base, src, dstSize);
+                else fillPattern((uint32_t*)base, (unsigned)(dstSize / 4), 1, 2);
+
+                DisplayXFBPixelKernelTable tables[3];
+                tables[0] = DisplayXFBPixelKernels::generic(kCases[c].m_format);
+                tables[1] = DisplayXFBPixelKernels::select(kCases[c].m_format, 0, false, isa);
+                tables[2] = DisplayXFBPixelKernels::select(kCases[c].m_format, tileSize, true, isa);
+                for (unsigned k = 0; k < 3; k++)
+                {
+                    // One pass from the starting destination to check the result.
+                    uint8_t* out = (0 == k) ? reference : dst;
+                    memcpy(out, base, dstSize);
+                    bool differs = kernelPass(tables[k], kernel, out, dstBytesPerRow, dstPixelBytes, src, srcBytesPerRow, width, height, tileSize);
+                    if (differs || (0 != k && 0 != memcmp(out, reference, dstSize)))
+                    {
+                        printf("FAIL: %s with %u pixel tiles gives a different result\n", kCases[c].m_name, tileSize);
+                        passed = false;
+                    }
+                }
+
+                // Then the timed passes, interleaved in rounds, keeping the best round of each.
+                double best[3] = { 0, 0, 0 };
+                for (unsigned round = 0; round < kKernelRounds; round++)
+                {
+                    for (unsigned k = 0; k < 3; k++)
+                    {
+                        double start = now();
+                        for (unsigned frame = 0; frame < frames; frame++)
+                        {
+                            kernelPass(tables[k], kernel, dst, dstBytesPerRow, dstPixelBytes, src, srcBytesPerRow, width, height, tileSize);
+                        }
+                        double elapsed = now() - start;
+                        if (0 == round || elapsed < best[k]) best[k] = elapsed;
+                    }
+                }
+                double rates[3];
+                for (unsigned k = 0; k < 3; k++) rates[k] = pixels / best[k] / 1e6;
+                printf("  %2u pixel tiles  %-8s %8.0f %8.0f %8.0f   (%.2fx generic, %.2fx any width)\n", tileSize, kCases[c].m_name,
+                       rates[0], rates[1], rates[2], rates[2] / rates[0], rates[2] / rates[1]);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < 4; i++) free(buffers[i]);
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Tile References
+
+
+enum { kTilesDesktop, kTilesVideo, kTilesSwitch, kTilesScroll, kTilesScenes };
+
+
+/** Draw a page of text like content, for the page switching scene.
+ */
+static void tilesPage(uint32_t* pixels)
+{
+    for (unsigned y = 0; y < Scene::kHeight; y++)
+    {
+        for (unsigned x = 0; x < Scene::kWidth; x++)
+        {
+            bool ink = (y % 20) < 14 && x >= 96 && x < Scene::kWidth - 96 && (((x * 7) + (y * 3) + ((x / 8) * (y / 20))) % 11) < 4;
+            pixels[(y * Scene::kWidth) + x] = (ink) ? 0xff202020u : 0xfffcfcfcu;
+        }
+    }
+}
+
+
+/** Scroll the scene up by one tile row, and draw a new line of text at the bottom.
+ */
+static void tilesScroll(Scene& scene)
+{
+    const unsigned rows = DisplayXFBTileDedupEncoder::kTileSize;
+    uint32_t* pixels = scene.m_pixels;
+    memmove(pixels, pixels + (rows * Scene::kWidth), (Scene::kHeight - rows) * Scene::kWidth * sizeof (uint32_t));
+    uint32_t* line = pixels + ((Scene::kHeight - rows) * Scene::kWidth);
+    for (unsigned i = 0; i < rows * Scene::kWidth; i++) line[i] = 0xffe8e8e8u;
+    unsigned characters = 20 + (random32(scene.m_seed) % 200);
+    for (unsigned c = 0; c < characters; c++)
+    {
+        uint32_t bits = random32(scene.m_seed);
+        for (unsigned row = 3; row < 14; row++)
+        {
+            for (unsigned col = 0; col < 7; col++)
+            {
+                if (bits & (1u << ((row * 2 + col) & 31))) line[(row * Scene::kWidth) + 64 + (c * 8) + col] = 0xff202020u;
+            }
+        }
+    }
+    scene.m_frame ++;
+}
+
+
+/** Results from one scene.
+ */
+struct TilesResult
+{
+    double m_codecKbps;                             //!< Bitrate of the change bounds coded with the codec alone (kbit/s)
+    double m_dedupKbps;                             //!< Bitrate of the dedup messages (kbit/s)
+    double m_codecMs;                               //!< Encode time per frame with the codec alone (milliseconds)
+    double m_dedupMs;                               //!< Encode time per frame with the dedup encoder (milliseconds)
+    DisplayXFBTileDedupEncoder::Statistics m_statistics;    //!< The dedup encoder's tile counters, less the initial frame
+};
+
+
+static bool tilesRun(unsigned kind, unsigned frames, unsigned cacheTiles, TilesResult& result)
+{
+    const unsigned width = Scene::kWidth;
+    const unsigned height = Scene::kHeight;
+    const size_t frameBytes = (size_t)width * height * 4;
+    Scene scene;
+    DisplayXFBShadowFrame shadow;
+    DisplayXFBTileDedupEncoder encoder;
+    DisplayXFBTileDedupDecoder decoder;
+    DisplayXFBTileCodec codec;
+    uint32_t* other = (uint32_t*)malloc(frameBytes);
+    uint32_t* decoded = (uint32_t*)calloc(1, frameBytes);
+    uint8_t* message = 0;
+    uint8_t* coded = 0;
+    bool passed = sceneCreate(scene, kTilesVideo == kind) && other && decoded &&
+                  shadow.configure(width, height, DisplayXFBTileDedupEncoder::kTileSize, true) &&
+                  encoder.configure(width, height, cacheTiles) && decoder.configure(width, height, cacheTiles);
+    if (passed)
+    {
+        message = (uint8_t*)malloc(encoder.maxEncodedSize());
+        coded = (uint8_t*)malloc(DisplayXFBTileCodec::maxEncodedSize(width, height));
+        passed = message && coded;
+    }
+    if (!passed) printf("FAIL: could not configure the coder\n");
+    if (passed && kTilesSwitch == kind) tilesPage(other);
+
+    uint64_t codecBytes = 0;
+    uint64_t dedupBytes = 0;
+    double codecTime = 0;
+    double dedupTime = 0;
+    DisplayXFBTileDedupEncoder::Statistics initial = encoder.statistics();
+    for (unsigned frame = 0; passed && frame <= frames; frame++)
+    {
+        // Frame zero is the initial frame, sent in full and not counted.
+        if (0 != frame)
+        {
+            if (kTilesScroll == kind) tilesScroll(scene);
+            else
+            {
+                if (kTilesSwitch == kind && 0 == frame % 30)
+                {
+                    uint32_t* pixels = scene.m_pixels;
+                    scene.m_pixels = other;
+                    other = pixels;
+                }
+                Rect changes[Scene::kChangeKinds];
+                sceneStep(scene, changes);
+            }
+        }
+        if (0 == shadow.update(scene.m_pixels, width * 4)) continue;
+
+        double start = now();
+        size_t size = encoder.encode(shadow, message, encoder.maxEncodedSize());
+        double middle = now();
+        unsigned x, y, w, h;
+        size_t codecSize = 0;
+        if (shadow.changedBounds(x, y, w, h))
+        {
+            codecSize = codec.encode(shadow.pixels() + (y * width) + x, w, h, shadow.bytesPerRow(), coded, DisplayXFBTileCodec::maxEncodedSize(width, height));
+        }
+        double end = now();
+
+        if (0 == size || !decoder.decode(message, size, decoded, width * 4) ||
+            (kTilesVideo != kind && 0 != memcmp(decoded, scene.m_pixels, frameBytes)))
+        {
+            printf("FAIL: frame %u did not decode to the source\n", frame);
+            passed = false;
+        }
+        if (0 == frame)
+        {
+            initial = encoder.statistics();
+            continue;
+        }
+        dedupBytes += size;
+        codecBytes += codecSize;
+        dedupTime += middle - start;
+        codecTime += end - middle;
+    }
+
+    if (passed)
+    {
+        result.m_codecKbps = (codecBytes * 8.0 * 60.0) / (frames * 1000.0);
+        result.m_dedupKbps = (dedupBytes * 8.0 * 60.0) / (frames * 1000.0);
+        result.m_codecMs = (codecTime * 1000.0) / frames;
+        result.m_dedupMs = (dedupTime * 1000.0) / frames;
+        result.m_statistics = encoder.statistics();
+        result.m_statistics.m_tiles -= initial.m_tiles;
+        result.m_statistics.m_solidTiles -= initial.m_solidTiles;
+        result.m_statistics.m_cachedTiles -= initial.m_cachedTiles;
+        result.m_statistics.m_codedTiles -= initial.m_codedTiles;
+    }
+    sceneDestroy(scene);
+    free(other);
+    free(decoded);
+    free(message);
+    free(coded);
+    return passed;
+}
+
+
+/** Compare the bandwidth of tile references with coding the changes alone.
+ */
+static bool testTiles(unsigned frames, unsigned cacheTiles)
+{
+    static const char* const kNames[kTilesScenes] = { "desktop", "video", "switch", "scroll" };
+    if (0 == frames || 0 == cacheTiles) return false;
+
+    printf("%u frames at 1920x1080, cache of %u tiles; kbit/s at 60 Hz and encode ms/frame\n", frames, cacheTiles);
+    printf("  scene      codec alone          references          saving   solid/cached/coded tiles\n");
+    for (unsigned kind = 0; kind < kTilesScenes; kind++)
+    {
+        TilesResult result;
+        if (!tilesRun(kind, frames, cacheTiles, result)) return false;
+        const DisplayXFBTileDedupEncoder::Statistics& statistics = result.m_statistics;
+        double tiles = (statistics.m_tiles) ? (double)statistics.m_tiles : 1.0;
+        printf("  %-8s %9.1f (%6.2f ms)  %9.1f (%6.2f ms)   %5.1f%%   %5.1f%% %5.1f%% %5.1f%%\n", kNames[kind],
+               result.m_codecKbps, result.m_codecMs, result.m_dedupKbps, result.m_dedupMs,
+               (result.m_codecKbps > 0) ? (1.0 - (result.m_dedupKbps / result.m_codecKbps)) * 100.0 : 0.0,
+               statistics.m_solidTiles * 100.0 / tiles, statistics.m_cachedTiles * 100.0 / tiles, statistics.m_codedTiles * 100.0 / tiles);
+    }
+    return true;
+}
+
+
+#pragma mark    -
+#pragma mark    Direct Encoding
+
+
+/** Time per frame and bytes sent by each path.
+ */
+struct DirectResult
+{
+    double m_shadowMs;                              //!< Shadow frame update and encode() time per frame (milliseconds)
+    double m_directMs;                              //!< encodeDirect() time per frame (milliseconds)
+    uint64_t m_shadowBytes;                         //!< Message bytes through the shadow frame
+    uint64_t m_directBytes;                         //!< Message bytes from encodeDirect()
+};
+
+
+/** Send a scene through a shadow frame and directly, and check both decode to the same frame.
+ */
+static bool directRun(bool video, unsigned frames, DirectResult& result)
+{
+    const unsigned width = Scene::kWidth;
+    const unsigned height = Scene::kHeight;
+    const size_t frameBytes = (size_t)width * height * 4;
+    Scene scene;
+    DisplayXFBShadowFrame shadow;
+    DisplayXFBTileDedupEncoder shadowEncoder, directEncoder;
+    DisplayXFBTileDedupDecoder shadowDecoder, directDecoder;
+    uint32_t* shadowDecoded = (uint32_t*)calloc(1, frameBytes);
+    uint32_t* directDecoded = (uint32_t*)calloc(1, frameBytes);
+    uint8_t* message = 0;
+    bool passed = sceneCreate(scene, video) && shadowDecoded && directDecoded &&
+                  shadow.configure(width, height, DisplayXFBTileDedupEncoder::kTileSize, true) &&
+                  shadowEncoder.configure(width, height) && directEncoder.configure(width, height) &&
+                  shadowDecoder.configure(width, height) && directDecoder.configure(width, height);
+    if (passed) passed = 0 != (message = (uint8_t*)malloc(shadowEncoder.maxEncodedSize()));
+    if (!passed) printf("FAIL: could not configure the coders\n");
+
+    memset(&result, 0, sizeof result);
+    double shadowTime = 0;
+    double directTime = 0;
+    const size_t capacity = (passed) ? shadowEncoder.maxEncodedSize() : 0;
+    for (unsigned frame = 0; passed && frame <= frames; frame++)
+    {
+        // Frame zero is the initial frame, sent in full and not counted.
+        Rect dirty = { 0, 0, width, height };
+        if (0 != frame)
+        {
+            Rect changes[Scene::kChangeKinds];
+            sceneStep(scene, changes);
+            memset(&dirty, 0, sizeof dirty);
+            for (unsigned i = 0; i < Scene::kChangeKinds; i++) rectUnion(dirty, changes[i]);
+            if (0 == dirty.m_width) continue;
+        }
+
+        double start = now();
+        shadow.update(scene.m_pixels, width * 4, dirty.m_x, dirty.m_y, dirty.m_width, dirty.m_height);
+        size_t shadowSize = shadowEncoder.encode(shadow, message, capacity);
+        double middle = now();
+        bool decoded = 0 != shadowSize && shadowDecoder.decode(message, shadowSize, shadowDecoded, width * 4);
+        double directStart = now();
+        size_t directSize = directEncoder.encodeDirect(scene.m_pixels, width * 4, dirty.m_x, dirty.m_y, dirty.m_width, dirty.m_height, message, capacity);
+        double end = now();
+        decoded = decoded && 0 != directSize && directDecoder.decode(message, directSize, directDecoded, width * 4);
+
+        if (!decoded || 0 != memcmp(shadowDecoded, directDecoded, frameBytes) ||
+            (!video && 0 != memcmp(directDecoded, scene.m_pixels, frameBytes)))
+        {
+            printf("FAIL: frame %u did not decode to the same frame from both paths\n", frame);
+            passed = false;
+        }
+        if (0 == frame) continue;
+        shadowTime += middle - start;
+        directTime += end - directStart;
+        result.m_shadowBytes += shadowSize;
+        result.m_directBytes += directSize;
+    }
+
+    if (passed)
+    {
+        result.m_shadowMs = (shadowTime * 1000.0) / frames;
+        result.m_directMs = (directTime * 1000.0) / frames;
+    }
+    sceneDestroy(scene);
+    free(shadowDecoded);
+    free(directDecoded);
+    free(message);
+    return passed;
+}
+
+
+/** A thread repainting a frame row by row, like a window server drawing while the frame is read.
+ */
+struct DirectPainter
+{
+    uint32_t* m_pixels;                             //!< The frame being painted
+    const uint32_t* m_pages[4];                     //!< The pages painted in turn
+    volatile bool m_stop;                           //!< Set to end the thread
+    uint64_t m_passes;                              //!< Returns the number of pages painted
+};
+
+
+static void* directPainterThread(void* context)
+{
+    DirectPainter* painter = (DirectPainter*)context;
+    uint64_t passes = 0;
+    while (!painter->m_stop)
+    {
+        const uint32_t* page = painter->m_pages[passes % 4];
+        for (unsigned y = 0; y < Scene::kHeight && !painter->m_stop; y++)
+        {
+            memcpy(painter->m_pixels + (y * Scene::kWidth), page + (y * Scene::kWidth), Scene::kWidth * sizeof (uint32_t));
+        }
+        passes ++;
+    }
+    painter->m_passes = passes;
+    return 0;
+}
+
+
+/** Draw a page of text like content; each variant shifts the text and tints the background.
+ */
+static void directPage(uint32_t* pixels, unsigned variant)
+{
+    const uint32_t background = 0xfff8f8f8u - (variant * 0x080808u);
+    for (unsigned y = 0; y < Scene::kHeight; y++)
+    {
+        for (unsigned x = 0; x < Scene::kWidth; x++)
+        {
+            unsigned u = x + (variant * 5);
+            bool ink = (y % 20) < 14 && x >= 96 && x < Scene::kWidth - 96 && (((u * 7) + (y * 3) + ((u / 8) * (y / 20))) % 11) < 4;
+            pixels[(y * Scene::kWidth) + x] = (ink) ? 0xff202020u : background;
+        }
+    }
+}
+
+
+/** Send a frame in full from each path while a thread repaints it, then check a final message decodes exactly.
+ */
+static bool directContended(unsigned messages)
+{
+    const unsigned width = Scene::kWidth;
+    const unsigned height = Scene::kHeight;
+    const size_t frameBytes = (size_t)width * height * 4;
+    uint32_t* pages[4] = { 0, 0, 0, 0 };
+    uint32_t* pixels = (uint32_t*)malloc(frameBytes);
+    uint32_t* decoded = (uint32_t*)calloc(1, frameBytes);
+    DisplayXFBShadowFrame shadow;
+    DisplayXFBTileDedupEncoder encoder;
+    DisplayXFBTileDedupDecoder decoder;
+    uint8_t* message = 0;
+    bool passed = pixels && decoded && shadow.configure(width, height, DisplayXFBTileDedupEncoder::kTileSize, true) &&
+                  encoder.configure(width, height);
+    for (unsigned i = 0; i < 4; i++)
+    {
+        pages[i] = (uint32_t*)malloc(frameBytes);
+        if (pages[i]) directPage(pages[i], i);
+        else passed = false;
+    }
+    if (passed) passed = 0 != (message = (uint8_t*)malloc(encoder.maxEncodedSize()));
+    if (!passed) printf("FAIL: could not allocate the frames\n");
+
+    printf("  contended (%u full frame messages while a thread repaints the frame)\n", messages);
+    for (unsigned path = 0; passed && path < 2; path++)
+    {
+        const bool direct = 1 == path;
+        passed = encoder.configure(width, height) && decoder.configure(width, height);
+        if (!passed) break;
+        const size_t capacity = encoder.maxEncodedSize();
+        memcpy(pixels, pages[0], frameBytes);
+
+        DirectPainter painter;
+        painter.m_pixels = pixels;
+        for (unsigned i = 0; i < 4; i++) painter.m_pages[i] = pages[i];
+        painter.m_stop = false;
+        painter.m_passes = 0;
+        pthread_t thread;
+        if (0 != pthread_create(&thread, 0, directPainterThread, &painter))
+        {
+            printf("FAIL: could not start the painter\n");
+            passed = false;
+            break;
+        }
+
+        double elapsed = 0;
+        for (unsigned m = 0; passed && m <= messages; m++)
+        {
+            // The last message is sent once the painter has stopped, and must decode to the frame exactly.
+            if (m == messages)
+            {
+                painter.m_stop = true;
+                pthread_join(thread, 0);
+            }
+            double start = now();
+            size_t size;
+            if (direct) size = encoder.encodeDirect(pixels, width * 4, 0, 0, width, height, message, capacity);
+            else
+            {
+                shadow.update(pixels, width * 4);
+                size = encoder.encode(shadow, message, capacity);
+            }
+            if (m < messages) elapsed += now() - start;
+            if (0 == size || !decoder.decode(message, size, decoded, width * 4))
+            {
+                printf("FAIL: message %u did not decode\n", m);
+                passed = false;
+            }
+        }
+        if (!painter.m_stop)
+        {
+            painter.m_stop = true;
+            pthread_join(thread, 0);
+        }
+        if (passed && 0 != memcmp(decoded, pixels, frameBytes))
+        {
+            printf("FAIL: the %s path did not decode to the frame once it stopped changing\n", (direct) ? "direct" : "shadow");
+            passed = false;
+        }
+        if (!passed) break;
+
+        const DisplayXFBTileDedupEncoder::Statistics& statistics = encoder.statistics();
+        printf("  %-8s %6.2f ms/message, %llu pages painted", (direct) ? "direct" : "shadow",
+               (messages) ? (elapsed * 1000.0) / messages : 0.0, (unsigned long long)painter.m_passes);
+        if (direct)
+        {
+            printf(", %llu tiles read again, %llu deferred", (unsigned long long)statistics.m_directRetries,
+                   (unsigned long long)statistics.m_directDeferred);
+        }
+        printf("\n");
+    }
+
+    for (unsigned i = 0; i < 4; i++) free(pages[i]);
+    free(pixels);
+    free(decoded);
+    free(message);
+    return passed;
+}
+
+
+/** Compare encoding straight from the frame with copying it to a shadow frame first.
+ */
+static bool testDirect(unsigned frames)
+{
+    if (0 == frames) return false;
+
+    printf("%u frames at 1920x1080; encode ms/frame and kbit/s at 60 Hz\n", frames);
+    printf("  scene      shadow frame            direct               time saved\n");
+    for (unsigned video = 0; video < 2; video++)
+    {
+        DirectResult result;
+        if (!directRun(0 != video, frames, result)) return false;
+        double shadowKbps = (result.m_shadowBytes * 8.0 * 60.0) / (frames * 1000.0);
+        double directKbps = (result.m_directBytes * 8.0 * 60.0) / (frames * 1000.0);
+        printf("  %-8s %6.2f ms %9.1f kbit/s   %6.2f ms %9.1f kbit/s   %5.1f%%\n", (video) ? "video" : "desktop",
+               result.m_shadowMs, shadowKbps, result.m_directMs, directKbps,
+               (result.m_shadowMs > 0) ? (1.0 - (result.m_directMs / result.m_shadowMs)) * 100.0 : 0.0);
+    }
+    return directContended((frames + 3) / 4);
+}
+
+
+#pragma mark    -
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: dxbench dedup [frames]\n"
+                    "       dxbench replay [seconds] [path]\n"
+                    "       dxbench rate [kbps] [seconds]\n"
+                    "       dxbench workers [displays] [seconds]\n"
+                    "       dxbench copy [width] [height] [seconds] [workload MB]\n"
+                    "       dxbench fused [width] [height] [frames]\n"
+                    "       dxbench probe [frames]\n"
+                    "       dxbench pages [width] [height] [frames]\n"
+                    "       dxbench pool [threads] [frames]\n"
+                    "       dxbench codec [frames]\n"
+                    "       dxbench kernels [frames]\n"
+                    "       dxbench tiles [frames] [cache tiles]\n"
+                    "       dxbench direct [frames]\n");
+}
+
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2) { usage(); return 2; }
+
+    bool passed;
+    if (0 == strcmp(argv[1], "dedup"))
+    {
+        unsigned frames = (argc > 2) ? (unsigned)atoi(argv[2]) : 2000;
+        passed = testDedup(frames);
+    }
+    else if (0 == strcmp(argv[1], "replay"))
+    {
+        unsigned seconds = (argc > 2) ? (unsigned)atoi(argv[2]) : 30;
+        const char* path = (argc > 3) ? argv[3] : 0;
+        passed = testReplay(seconds, path);
+    }
+    else if (0 == strcmp(argv[1], "rate"))
+    {
+        unsigned kbps = (argc > 2) ? (unsigned)atoi(argv[2]) : 8000;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 20;
+        passed = testRate(kbps, seconds);
+    }
+    else if (0 == strcmp(argv[1], "workers"))
+    {
+        unsigned displays = (argc > 2) ? (unsigned)atoi(argv[2]) : 4;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 10;
+        passed = testWorkers(displays, seconds);
+    }
+    else if (0 == strcmp(argv[1], "copy"))
+    {
+        unsigned width = (argc > 2) ? (unsigned)atoi(argv[2]) : 2560;
+        unsigned height = (argc > 3) ? (unsigned)atoi(argv[3]) : 1600;
+        unsigned seconds = (argc > 4) ? (unsigned)atoi(argv[4]) : 5;
+        unsigned workloadMB = (argc > 5) ? (unsigned)atoi(argv[5]) : 0;
+        passed = testCopy(width, height, seconds, workloadMB);
+    }
+    else if (0 == strcmp(argv[1], "fused"))
+    {
+        unsigned width = (argc > 2) ? (unsigned)atoi(argv[2]) : 2560;
+        unsigned height = (argc > 3) ? (unsigned)atoi(argv[3]) : 1600;
+        unsigned frames = (argc > 4) ? (unsigned)atoi(argv[4]) : 300;
+        passed = testFused(width, height, frames);
+    }
+    else if (0 == strcmp(argv[1], "probe"))
+    {
+        unsigned frames = (argc > 2) ? (unsigned)atoi(argv[2]) : 600;
+        passed = testProbe(frames);
+    }
+    else if (0 == strcmp(argv[1], "pages"))
+    {
+        unsigned width = (argc > 2) ? (unsigned)atoi(argv[2]) : 3840;
+        unsigned height = (argc > 3) ? (unsigned)atoi(argv[3]) : 2160;
+        unsigned frames = (argc > 4) ? (unsigned)atoi(argv[4]) : 100;
+        passed = testPages(width, height, frames);
+    }
+    else if (0 == strcmp(argv[1], "pool"))
+    {
+        unsigned threads = (argc > 2) ? (unsigned)atoi(argv[2]) : 4;
+        unsigned frames = (argc > 3) ? (unsigned)atoi(argv[3]) : 600;
+        passed = testPool(threads, frames);
+    }
+    else if (0 == strcmp(argv[1], "codec"))
+    {
+        unsigned frames = (argc > 2) ? (unsigned)atoi(argv[2]) : 600;
+        passed = testCodec(frames);
+    }
+    else if (0 == strcmp(argv[1], "kernels"))
+    {
+        unsigned frames = (argc > 2) ? (unsigned)atoi(argv[2]) : 4;
+        passed = testKernels(frames);
+    }
+    else if (0 == strcmp(argv[1], "tiles"))
+    {
+        unsigned frames = (argc > 2) ? (unsigned)atoi(argv[2]) : 600;
+        unsigned cacheTiles = (argc > 3) ? (unsigned)atoi(argv[3]) : 16384;
+        passed = testTiles(frames, cacheTiles);
+    }
+    else if (0 == strcmp(argv[1], "direct"))
+    {
+        unsigned frames = (argc > 2) ? (unsigned)atoi(argv[2]) : 600;
+        passed = testDirect(frames);
+    }
+    else
+    {
+        usage();
+        return 2;
+    }
+
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}
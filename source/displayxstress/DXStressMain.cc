@@ -0,0 +1,1409 @@
+/** @file   DXStressMain.cc
+ *  @brief  Command line load and stress tests for the DisplayX driver.
+ *
+ *  Copyright (c) 2014 tSoniq. All rights reserved.
+ *
+ *  The tests run against the installed driver. Build with:
+ *
+ *      clang++ -O2 -Isource/displayxfb -Isource/displayxlib source/displayxstress/DXStressMain.cc \
+ *          source/displayxlib/DisplayXFBInterface.cc source/displayxlib/DisplayXFBCaptureBroker.cc \
+ *          source/displayxlib/DisplayXFBFramePool.cc source/displayxlib/DisplayXFBPageAllocator.cc \
+ *          source/displayxlib/DisplayXFBPixelKernels.cc source/displayxlib/DisplayXFBTileCodec.cc \
+ *          source/displayxlib/DisplayXFBWorkerGroup.cc -framework IOKit -framework CoreFoundation \
+ *          -framework ApplicationServices -o dxstress
+ *
+ *  Usage:
+ *
+ *      dxstress clients [count] [seconds]
+ *
+ *          Open count clients (default kDisplayXFBMaxClients), less any already open, and make method calls on all of
+ *          them from several threads. Checks that the driver's per-client counters match the calls made, that the
+ *          client table reports the expected count, and that a client beyond the limit is refused.
+ *
+ *      dxstress state [display] [seconds]
+ *
+ *          Connect and disconnect a display, re-apply its configuration and open and close clients, all concurrently,
+ *          while other threads read the display state with displayGetState() and displayGetStatus(). Every state read
+ *          must be complete and consistent (a mode from the configuration, with matching size and index). The display
+ *          is left in its original connection state.
+ *
+ *      dxstress notify [display] [seconds]
+ *
+ *          Open one client subscribed to kNotificationFrameChanged for the display and one with the default mask,
+ *          then repeatedly invert a band of rows in the (connected) display's framebuffer. The subscribed client must
+ *          receive frame change events and the other client none, and each client's delivered and filtered
+ *          counters must agree with what it saw. The framebuffer band is restored afterwards.
+ *
+ *      dxstress broker [display] [seconds]
+ *
+ *          Measure the CPU cost of DisplayXFBCaptureBroker as subscribers are added to a (connected) display, while
+ *          a band of the framebuffer changes every frame. Subscribers cycle through a recorder (native pixels, 60
+ *          fps), an encoder (tile codec, 30 fps), a thumbnailer (gray at quarter scale, 10 fps) and a converter
+ *          (RGBA at half scale, 30 fps). Each count runs for the given number of seconds (default 2) at 60 ticks
+ *          per second, once with all subscribers on one broker and once with a broker per subscriber (each consumer
+ *          doing its own capture and conversion). Once there are more subscribers than kinds, so that they share
+ *          stages, the shared broker must cost less than separate ones, and its cost must stop growing with the
+ *          subscriber count: at 32 subscribers it must cost less than twice as much as at 4. The framebuffer band
+ *          is restored afterwards.
+ *
+ *      dxstress wakeups [displays] [seconds]
+ *
+ *          Connect the first few displays (default 4) and open eight clients, each for one display in turn. The first
+ *          client for each display is a recorder (every event); the others are controllers (the default events,
+ *          without frame changes). For the given number of seconds (default 5), 60 times a second, invert a band of
+ *          the next display's framebuffer and move the cursor to that display. This is done once with every client
+ *          subscribed to all events from all displays, as every client was before notification masks, and once with
+ *          each client subscribed to its own display and events. The notifications (wake-ups) each client receives
+ *          are reported for both. With the masks, no client may receive an event it did not ask for, and there must
+ *          be fewer wake-ups in total. Displays connected for the test are disconnected afterwards, and the
+ *          framebuffer bands are restored.
+ *
+ *      dxstress maps [display] [count]
+ *
+ *          Time the ways a client can map a (connected) display's framebuffer, each the given number of times
+ *          (default 1000). The first is displayMapFramebuffer() called again on a client that has mapped it, as a client
+ *          that remaps defensively on each notification does. The second maps from a new client while another client
+ *          in the task holds the mapping, so that the driver's per-task cache can supply it. The third maps from a new
+ *          client with no other mapping, which makes a new memory map. The cost of opening and closing a client is
+ *          timed separately and taken off the last two. Repeated calls must return the same address and generation,
+ *          and clients in one task must share the mapping.
+ *
+ *      dxstress bringup [displays] [rounds]
+ *
+ *          Time the bring-up of the first few displays (default 4), from disconnected until all of them are active in
+ *          Quartz, connecting them one call at a time with displayConnect() and all at once with displayConnectMask().
+ *          The number of window server reconfiguration passes is counted from Quartz's reconfiguration callbacks.
+ *          The two are alternated for the given number of rounds (default 5), and the mean of each is reported. Every
+ *          bring-up must complete, and the batched one must take no more reconfiguration passes than the other.
+ *          The displays are returned to their original connection state afterwards.
+ *
+ *      dxstress modeswitch [display] [rounds]
+ *
+ *          Measure client downtime when a (connected) display changes resolution, switching between its current mode
+ *          and another for the given number of rounds (default 5). Two clients on another thread each hold a mapping
+ *          of the framebuffer. One follows kNotificationDisplayMode and takes the new geometry from the status page,
+ *          keeping its mapping. The other follows kNotificationDisplayState and rebuilds its session (a new
+ *          connection, state and mapping), as clients did before mode switches were signalled separately. Each
+ *          client's downtime runs from the start of the switch until it has read a pixel of the new frame; the mean
+ *          and worst of each are reported. Every switch must reach both clients, and the first client's mapping must
+ *          stay valid (same address and generation) with the new size in the status page. The original mode is
+ *          restored afterwards.
+ *
+ *  The exit status is zero if every check passed.
+ */
+
+#include "DisplayXFBInterface.h"
+#include "DisplayXFBCaptureBroker.h"
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreGraphics/CoreGraphics.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace ts;
+
+
+static const unsigned kThreads = 8;                 //!< The number of load threads
+
+
+/** Return the time in seconds.
+ */
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (double)tv.tv_sec + ((double)tv.tv_usec * 1e-6);
+}
+
+
+/** Return the CPU time used by the process (user and system) in seconds.
+ */
+static double cpuTime()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)usage.ru_utime.tv_sec + ((double)usage.ru_utime.tv_usec * 1e-6) +
+           (double)usage.ru_stime.tv_sec + ((double)usage.ru_stime.tv_usec * 1e-6);
+}
+
+
+/** Run the current run loop until a set of displays is active in Quartz (or none of them is), or time runs out.
+ *
+ *  @param  displayMask     The displays to wait for (bit n set for display n).
+ *  @param  active          Logical true to wait for all of the displays to be active, false for none of them.
+ *  @param  timeout         The time limit (seconds).
+ *  @return                 Logical true if the displays reached the state in time.
+ */
+static bool waitForDisplays(unsigned displayMask, bool active, double timeout)
+{
+    double stopTime = now() + timeout;
+    for (;;)
+    {
+        bool done = true;
+        for (unsigned display = 0; display < kDisplayXFBMaxDisplays && done; display++)
+        {
+            CGDirectDisplayID displayID;
+            if (displayMask & (1u << display)) done = (active == DisplayXFBInterface::displayIndexToID(displayID, display));
+        }
+        if (done) return true;
+        if (now() >= stopTime) return false;
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.005, false);
+    }
+}
+
+
+#pragma mark    -
+#pragma mark    Client Load
+
+
+/** Shared state for the client load test.
+ */
+struct ClientLoad
+{
+    DisplayXFBInterface* m_clients;                 //!< The clients
+    unsigned m_count;                               //!< The number of open clients
+    uint64_t* m_calls;                              //!< Calls made per client (each entry written by one thread)
+    double m_stopTime;                              //!< The time at which to stop
+    volatile unsigned m_failures;                   //!< The number of failed calls
+};
+
+
+struct ClientLoadThread
+{
+    ClientLoad* m_load;                             //!< The test
+    unsigned m_index;                               //!< The thread number
+};
+
+
+/** Make method calls on every client owned by a thread (those with index % kThreads == thread) until time runs out.
+ */
+static void* clientLoadThread(void* context)
+{
+    ClientLoadThread* thread = (ClientLoadThread*)context;
+    ClientLoad* load = thread->m_load;
+    DisplayXFBClientStatistics stats;
+    unsigned pass = 0;
+    while (now() < load->m_stopTime)
+    {
+        for (unsigned i = thread->m_index; i < load->m_count; i += kThreads)
+        {
+            bool ok;
+            if (pass & 1) ok = load->m_clients[i].setNotificationMask(kDisplayXFBNotificationMaskAll);
+            else ok = load->m_clients[i].getStatistics(stats);
+            if (ok) load->m_calls[i] ++;
+            else __sync_fetch_and_add(&load->m_failures, 1u);
+        }
+        pass ++;
+    }
+    return 0;
+}
+
+
+/** Open many clients and load them from several threads.
+ *
+ *  @param  count       The number of clients to try to open.
+ *  @param  seconds     The duration of the load phase.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testClients(unsigned count, unsigned seconds)
+{
+    bool passed = true;
+    DisplayXFBInterface* clients = new DisplayXFBInterface[count + 1];
+    uint64_t* calls = new uint64_t[count + 1];
+    memset(calls, 0, (count + 1) * sizeof calls[0]);
+
+    // Open until either count clients are open or the driver refuses. Other processes (the window server and any
+    // running application) may already hold clients, so fewer than count may open.
+    double openStart = now();
+    unsigned opened = 0;
+    while (opened < count && clients[opened].open()) opened ++;
+    double openTime = now() - openStart;
+    printf("opened %u of %u clients in %.3f s\n", opened, count, openTime);
+    if (0 == opened)
+    {
+        printf("FAIL: no client could be opened\n");
+        delete [] clients;
+        delete [] calls;
+        return false;
+    }
+
+    DisplayXFBClientStatistics stats;
+    unsigned othersOpen = 0;
+    if (!clients[0].getStatistics(stats)) { printf("FAIL: no statistics\n"); passed = false; }
+    else
+    {
+        othersOpen = stats.clientCount() - opened;
+        calls[0] ++;
+        if (stats.clientCount() < opened) { printf("FAIL: driver reports %u clients, %u opened\n", stats.clientCount(), opened); passed = false; }
+    }
+
+    // With the table full, one more client must be refused.
+    if (opened < count) printf("note: stopped at the driver limit (%u clients held elsewhere)\n", othersOpen);
+    else if (count + othersOpen >= kDisplayXFBMaxClients)
+    {
+        if (clients[count].open()) { printf("FAIL: client %u opened beyond the limit\n", count + othersOpen + 1); passed = false; clients[count].close(); }
+    }
+
+    // Load phase.
+    ClientLoad load;
+    load.m_clients = clients;
+    load.m_count = opened;
+    load.m_calls = calls;
+    load.m_stopTime = now() + seconds;
+    load.m_failures = 0;
+
+    pthread_t threads[kThreads];
+    ClientLoadThread contexts[kThreads];
+    double loadStart = now();
+    for (unsigned i = 0; i < kThreads; i++)
+    {
+        contexts[i].m_load = &load;
+        contexts[i].m_index = i;
+        pthread_create(&threads[i], 0, clientLoadThread, &contexts[i]);
+    }
+    for (unsigned i = 0; i < kThreads; i++) pthread_join(threads[i], 0);
+    double loadTime = now() - loadStart;
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < opened; i++) total += calls[i];
+    printf("%llu calls in %.3f s (%.0f calls/s, %u threads), %u failed\n",
+           (unsigned long long)total, loadTime, (double)total / loadTime, kThreads, load.m_failures);
+    if (load.m_failures) passed = false;
+
+    // Each client's method count covers the calls made above plus the getStatistics() call that reads it.
+    unsigned mismatches = 0;
+    for (unsigned i = 0; i < opened; i++)
+    {
+        if (!clients[i].getStatistics(stats)) { mismatches ++; continue; }
+        if (stats.m_methodCalls != calls[i] + 1)
+        {
+            if (mismatches < 8) printf("client %u: driver counted %llu calls, made %llu\n", i, (unsigned long long)stats.m_methodCalls, (unsigned long long)(calls[i] + 1));
+            mismatches ++;
+        }
+    }
+    if (mismatches) { printf("FAIL: %u clients with wrong method counts\n", mismatches); passed = false; }
+
+    double closeStart = now();
+    for (unsigned i = 0; i < opened; i++) clients[i].close();
+    printf("closed %u clients in %.3f s\n", opened, now() - closeStart);
+
+    delete [] clients;
+    delete [] calls;
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    State Stress
+
+
+/** Shared state for the state stress test.
+ */
+struct StateStress
+{
+    unsigned m_display;                             //!< The display under test
+    DisplayXFBConfiguration m_configuration;        //!< The display's configuration (re-applied, never changed)
+    double m_stopTime;                              //!< The time at which to stop
+    volatile unsigned m_torn;                       //!< The number of inconsistent state reads
+    volatile unsigned m_failures;                   //!< The number of calls that failed unexpectedly
+    volatile uint64_t m_reads;                      //!< The number of state reads
+    volatile uint64_t m_changes;                    //!< The number of connect, disconnect and configuration calls made
+    volatile uint64_t m_opens;                      //!< The number of client open and close cycles
+};
+
+
+/** Check that a state read describes one of the configuration's modes.
+ */
+static bool stateIsConsistent(const StateStress* stress, const DisplayXFBState& state)
+{
+    const DisplayXFBConfiguration& config = stress->m_configuration;
+    if (!state.isValid() || state.modeIndex() >= config.m_modeCount) return false;
+
+    const DisplayXFBMode& mode = config.m_modes[state.modeIndex()];
+    return state.width() == mode.width() && state.height() == mode.height() && state.bytesPerRow() >= state.width() * state.bytesPerPixel();
+}
+
+
+/** Read the display state, from the user-client and from the status page, until time runs out.
+ */
+static void* stateReadThread(void* context)
+{
+    StateStress* stress = (StateStress*)context;
+    DisplayXFBInterface client;
+    if (!client.open()) { __sync_fetch_and_add(&stress->m_failures, 1u); return 0; }
+
+    while (now() < stress->m_stopTime)
+    {
+        DisplayXFBState state;
+        unsigned modeGeneration;
+        if (!client.displayGetState(state, stress->m_display)) __sync_fetch_and_add(&stress->m_failures, 1u);
+        else if (!stateIsConsistent(stress, state)) __sync_fetch_and_add(&stress->m_torn, 1u);
+
+        if (!client.displayGetStatus(state, modeGeneration, stress->m_display)) __sync_fetch_and_add(&stress->m_failures, 1u);
+        else if (!stateIsConsistent(stress, state)) __sync_fetch_and_add(&stress->m_torn, 1u);
+
+        __sync_fetch_and_add(&stress->m_reads, 2ull);
+    }
+    client.close();
+    return 0;
+}
+
+
+/** Connect and disconnect the display until time runs out. Two of these run at once, so either call may be refused
+ *  because the display is already in the requested state: only the driver's consistency is checked.
+ */
+static void* stateConnectThread(void* context)
+{
+    StateStress* stress = (StateStress*)context;
+    DisplayXFBInterface client;
+    if (!client.open()) { __sync_fetch_and_add(&stress->m_failures, 1u); return 0; }
+
+    for (unsigned pass = 0; now() < stress->m_stopTime; pass++)
+    {
+        if (pass & 1) client.displayDisconnect(stress->m_display);
+        else client.displayConnect(stress->m_display);
+        __sync_fetch_and_add(&stress->m_changes, 1ull);
+    }
+    client.close();
+    return 0;
+}
+
+
+/** Re-apply the display configuration until time runs out. The driver refuses this while the display is connected.
+ */
+static void* stateConfigureThread(void* context)
+{
+    StateStress* stress = (StateStress*)context;
+    DisplayXFBInterface client;
+    if (!client.open()) { __sync_fetch_and_add(&stress->m_failures, 1u); return 0; }
+
+    while (now() < stress->m_stopTime)
+    {
+        client.displaySetConfiguration(stress->m_configuration, stress->m_display);
+        __sync_fetch_and_add(&stress->m_changes, 1ull);
+    }
+    client.close();
+    return 0;
+}
+
+
+/** Open and close clients until time runs out.
+ */
+static void* stateOpenThread(void* context)
+{
+    StateStress* stress = (StateStress*)context;
+    while (now() < stress->m_stopTime)
+    {
+        DisplayXFBInterface client;
+        if (!client.open()) __sync_fetch_and_add(&stress->m_failures, 1u);
+        client.close();
+        __sync_fetch_and_add(&stress->m_opens, 1ull);
+    }
+    return 0;
+}
+
+
+/** Change the display's state from several threads while reading it from others.
+ *
+ *  @param  display     The display to use.
+ *  @param  seconds     The duration of the test.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testState(unsigned display, unsigned seconds)
+{
+    DisplayXFBInterface control;
+    if (!control.open()) { printf("FAIL: could not open the driver\n"); return false; }
+    if (display >= control.displayCount()) { printf("FAIL: no display %u\n", display); return false; }
+
+    StateStress stress;
+    stress.m_display = display;
+    stress.m_torn = 0;
+    stress.m_failures = 0;
+    stress.m_reads = 0;
+    stress.m_changes = 0;
+    stress.m_opens = 0;
+    if (!control.displayGetConfiguration(stress.m_configuration, display) || 0 == stress.m_configuration.m_modeCount)
+    {
+        printf("FAIL: could not read the configuration of display %u\n", display);
+        return false;
+    }
+    bool wasConnected = control.displayIsConnected(display);
+
+    static const unsigned kReaders = 4;
+    pthread_t threads[kReaders + 4];
+    unsigned threadCount = 0;
+    stress.m_stopTime = now() + seconds;
+    for (unsigned i = 0; i < kReaders; i++) pthread_create(&threads[threadCount++], 0, stateReadThread, &stress);
+    pthread_create(&threads[threadCount++], 0, stateConnectThread, &stress);
+    pthread_create(&threads[threadCount++], 0, stateConnectThread, &stress);
+    pthread_create(&threads[threadCount++], 0, stateConfigureThread, &stress);
+    pthread_create(&threads[threadCount++], 0, stateOpenThread, &stress);
+    for (unsigned i = 0; i < threadCount; i++) pthread_join(threads[i], 0);
+
+    // Restore the original connection state.
+    if (wasConnected != control.displayIsConnected(display))
+    {
+        bool ok = (wasConnected) ? control.displayConnect(display) : control.displayDisconnect(display);
+        if (!ok) { printf("FAIL: could not restore the connection state\n"); stress.m_failures ++; }
+    }
+    control.close();
+
+    printf("%llu state reads, %llu state changes, %llu client open/close cycles in %u s\n",
+           (unsigned long long)stress.m_reads, (unsigned long long)stress.m_changes, (unsigned long long)stress.m_opens, seconds);
+    printf("%u inconsistent reads, %u failed calls\n", stress.m_torn, stress.m_failures);
+    return 0 == stress.m_torn && 0 == stress.m_failures;
+}
+
+
+#pragma mark    -
+#pragma mark    Notification Delivery
+
+
+/** Per-client record of the notifications received.
+ */
+struct NotifyCounts
+{
+    unsigned m_frameChanged;                        //!< kNotificationFrameChanged events for the display under test
+    unsigned m_total;                               //!< All events received
+    unsigned m_display;                             //!< The display under test
+};
+
+
+static void notifyHandler(DisplayXFBInterface::Notification notification, unsigned displayIndex, void* context)
+{
+    NotifyCounts* counts = (NotifyCounts*)context;
+    if (DisplayXFBInterface::kNotificationFrameChanged == notification && displayIndex == counts->m_display) counts->m_frameChanged ++;
+    counts->m_total ++;
+}
+
+
+/** Check that frame change notifications reach a subscribed client and only that client.
+ *
+ *  @param  display     The display to use (must be connected).
+ *  @param  seconds     The duration of the test.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testNotify(unsigned display, unsigned seconds)
+{
+    DisplayXFBInterface subscribed;
+    DisplayXFBInterface other;
+    if (!subscribed.open() || !other.open()) { printf("FAIL: could not open the driver\n"); return false; }
+    if (display >= subscribed.displayCount() || !subscribed.displayIsConnected(display))
+    {
+        printf("FAIL: display %u is not connected\n", display);
+        return false;
+    }
+
+    DisplayXFBState state;
+    DisplayXFBMap map;
+    if (!subscribed.displayGetState(state, display) || !subscribed.displayMapFramebuffer(map, display, false) ||
+        map.size() < state.offset() + state.bytesPerFrame())
+    {
+        printf("FAIL: could not map the framebuffer of display %u\n", display);
+        return false;
+    }
+
+    NotifyCounts subscribedCounts = { 0, 0, display };
+    NotifyCounts otherCounts = { 0, 0, display };
+    bool ok = subscribed.setNotificationHandler(notifyHandler, &subscribedCounts, CFRunLoopGetCurrent()) &&
+              subscribed.setNotificationMask(1u << display, kDisplayXFBNotificationMaskFrameChanged) &&
+              other.setNotificationHandler(notifyHandler, &otherCounts, CFRunLoopGetCurrent());
+    if (!ok) { printf("FAIL: could not install the notification handlers\n"); return false; }
+
+    // Invert a band across the middle of the display, twice per pass so that the content ends as it started.
+    uint8_t* band = (uint8_t*)(uintptr_t)map.address() + state.offset() + (state.height() / 2) * state.bytesPerRow();
+    unsigned bandBytes = 16 * state.bytesPerRow();
+    unsigned passes = 0;
+    double stopTime = now() + seconds;
+    while (now() < stopTime)
+    {
+        for (unsigned i = 0; i < bandBytes; i++) band[i] ^= 0xff;
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, false);
+        passes ++;
+    }
+    if (passes & 1) for (unsigned i = 0; i < bandBytes; i++) band[i] ^= 0xff;
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.2, false);             // Drain anything still queued
+
+    DisplayXFBClientStatistics subscribedStats;
+    DisplayXFBClientStatistics otherStats;
+    bool passed = true;
+    if (!subscribed.getStatistics(subscribedStats) || !other.getStatistics(otherStats)) { printf("FAIL: no statistics\n"); passed = false; }
+    else
+    {
+        printf("%u frame changes made: subscribed client saw %u (%llu delivered, %llu filtered), "
+               "other client saw %u events (%llu delivered, %llu filtered)\n",
+               passes, subscribedCounts.m_frameChanged,
+               (unsigned long long)subscribedStats.notificationsDelivered(), (unsigned long long)subscribedStats.notificationsFiltered(),
+               otherCounts.m_frameChanged,
+               (unsigned long long)otherStats.notificationsDelivered(), (unsigned long long)otherStats.notificationsFiltered());
+        if (0 == subscribedCounts.m_frameChanged) { printf("FAIL: the subscribed client received no frame changes\n"); passed = false; }
+        if (0 != otherCounts.m_frameChanged) { printf("FAIL: the unsubscribed client received frame changes\n"); passed = false; }
+        if (subscribedStats.notificationsDelivered() != subscribedCounts.m_total)
+        {
+            printf("FAIL: the subscribed client received %u of %llu delivered events\n", subscribedCounts.m_total, (unsigned long long)subscribedStats.notificationsDelivered());
+            passed = false;
+        }
+        if (0 == otherStats.notificationsFiltered()) { printf("FAIL: no frame changes were filtered for the other client\n"); passed = false; }
+    }
+
+    subscribed.clearNotificationHandler();
+    other.clearNotificationHandler();
+    subscribed.close();
+    other.close();
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Broker Fan-out
+
+
+/** The subscriptions used by the fan-out test, taken in turn.
+ */
+struct BrokerConsumer
+{
+    DisplayXFBCaptureBroker::Format m_format;       //!< The output format
+    unsigned m_scale;                               //!< The downscale factor
+    unsigned m_frameRate;                           //!< The frame rate
+};
+
+static const BrokerConsumer kBrokerConsumers[] =
+{
+    { DisplayXFBCaptureBroker::kFormatBGRA32, 1, 60 },      // Recorder
+    { DisplayXFBCaptureBroker::kFormatTileCodec, 1, 30 },   // Remote desktop encoder
+    { DisplayXFBCaptureBroker::kFormatGray8, 4, 10 },       // Thumbnailer
+    { DisplayXFBCaptureBroker::kFormatRGBA32, 2, 30 }       // Format converter
+};
+static const unsigned kBrokerConsumerCount = sizeof kBrokerConsumers / sizeof kBrokerConsumers[0];
+
+
+static void brokerHandler(const DisplayXFBCaptureBroker::Frame& frame, void* context)
+{
+    *(uint64_t*)context += frame.m_size;
+}
+
+
+/** Run the brokers for a number of subscribers and return the CPU time used per tick.
+ *
+ *  @param  shared      Logical true to put every subscriber on one broker, false to give each its own.
+ *  @param  stages      Returns the number of conversion stages in use.
+ *  @return             The CPU time per tick (milliseconds), or a negative value if a subscription failed.
+ */
+static double brokerRun(DisplayXFBInterface& displayInterface, unsigned display, unsigned subscribers, bool shared,
+                        unsigned seconds, uint8_t* band, unsigned bandBytes, unsigned& passes, unsigned& stages)
+{
+    DisplayXFBCaptureBroker* brokers[DisplayXFBCaptureBroker::kMaxSubscribers];
+    unsigned brokerCount = (shared || 0 == subscribers) ? 1 : subscribers;
+    for (unsigned i = 0; i < brokerCount; i++) brokers[i] = new DisplayXFBCaptureBroker(displayInterface);
+
+    uint64_t bytes = 0;
+    bool ok = true;
+    for (unsigned i = 0; i < subscribers; i++)
+    {
+        const BrokerConsumer& consumer = kBrokerConsumers[i % kBrokerConsumerCount];
+        DisplayXFBCaptureBroker::Subscription subscription;
+        subscription.m_displayIndex = display;
+        subscription.m_format = consumer.m_format;
+        subscription.m_scale = consumer.m_scale;
+        subscription.m_frameRate = consumer.m_frameRate;
+        if (brokers[(shared) ? 0 : i]->subscribe(subscription, brokerHandler, &bytes) < 0) ok = false;
+    }
+
+    // The first tick copies and converts the whole display; it is not counted.
+    double start = now();
+    for (unsigned i = 0; i < brokerCount; i++) brokers[i]->tick(0);
+
+    unsigned ticks = seconds * 60;
+    double cpuStart = cpuTime();
+    for (unsigned tick = 1; ok && tick <= ticks; tick++)
+    {
+        double wait = start + (tick / 60.0) - now();
+        if (wait > 0) usleep((useconds_t)(wait * 1e6));
+
+        // The brokers are given nominal tick times, so that the subscribers due on each tick do not depend on how
+        // far a slow run falls behind.
+        for (unsigned i = 0; i < bandBytes; i++) band[i] ^= 0xff;
+        passes ++;
+        for (unsigned i = 0; i < brokerCount; i++) brokers[i]->tick((tick * 1000000ull) / 60);
+    }
+    double cpu = cpuTime() - cpuStart;
+
+    stages = 0;
+    for (unsigned i = 0; i < brokerCount; i++)
+    {
+        stages += brokers[i]->stageCount();
+        delete brokers[i];
+    }
+    return (ok) ? (cpu * 1000.0) / ticks : -1.0;
+}
+
+
+/** Measure how the broker's cost grows with its subscriber count.
+ *
+ *  @param  display     The display to use (must be connected).
+ *  @param  seconds     The duration of each measurement.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testBroker(unsigned display, unsigned seconds)
+{
+    DisplayXFBInterface displayInterface;
+    if (!displayInterface.open()) { printf("FAIL: could not open the driver\n"); return false; }
+    if (display >= displayInterface.displayCount() || !displayInterface.displayIsConnected(display))
+    {
+        printf("FAIL: display %u is not connected\n", display);
+        return false;
+    }
+
+    DisplayXFBState state;
+    DisplayXFBMap map;
+    if (!displayInterface.displayGetState(state, display) || !displayInterface.displayMapFramebuffer(map, display, false) ||
+        map.size() < state.offset() + state.bytesPerFrame())
+    {
+        printf("FAIL: could not map the framebuffer of display %u\n", display);
+        return false;
+    }
+
+    // A 64 row band across the middle of the display is inverted every tick.
+    uint8_t* band = (uint8_t*)(uintptr_t)map.address() + state.offset() + (state.height() / 2) * state.bytesPerRow();
+    unsigned bandBytes = 64 * state.bytesPerRow();
+    unsigned passes = 0;
+
+    static const unsigned kCounts[] = { 0, 1, 2, 4, 8, 16, 32 };
+    static const unsigned kCountCount = sizeof kCounts / sizeof kCounts[0];
+    double sharedCost[kCountCount];
+    double separateCost[kCountCount];
+    bool passed = true;
+    printf("%ux%u display, %u s per run\n", state.width(), state.height(), seconds);
+    printf("subscribers   stages   shared ms/tick   separate ms/tick\n");
+    for (unsigned i = 0; passed && i < kCountCount; i++)
+    {
+        unsigned sharedStages = 0, separateStages = 0;
+        sharedCost[i] = brokerRun(displayInterface, display, kCounts[i], true, seconds, band, bandBytes, passes, sharedStages);
+        separateCost[i] = brokerRun(displayInterface, display, kCounts[i], false, seconds, band, bandBytes, passes, separateStages);
+        if (sharedCost[i] < 0 || separateCost[i] < 0) { printf("FAIL: could not subscribe\n"); passed = false; break; }
+        printf("%11u   %2u/%2u   %14.3f   %16.3f\n", kCounts[i], sharedStages, separateStages, sharedCost[i], separateCost[i]);
+    }
+    if (passes & 1) for (unsigned i = 0; i < bandBytes; i++) band[i] ^= 0xff;
+
+    if (passed)
+    {
+        // Costs are compared net of the run with no subscribers (the band update and the pacing).
+        double base = sharedCost[0];
+        for (unsigned i = 0; i < kCountCount; i++)
+        {
+            if (kCounts[i] > kBrokerConsumerCount && sharedCost[i] >= separateCost[i])
+            {
+                printf("FAIL: %u subscribers cost more on a shared broker\n", kCounts[i]);
+                passed = false;
+            }
+        }
+        double atFour = sharedCost[3] - base;
+        double atMax = sharedCost[kCountCount - 1] - base;
+        printf("shared cost at %u subscribers is %.2f times the cost at %u\n", kCounts[kCountCount - 1], (atFour > 0) ? atMax / atFour : 0.0, kCounts[3]);
+        if (atMax >= 2.0 * atFour) { printf("FAIL: the shared broker's cost grows with the subscriber count\n"); passed = false; }
+    }
+
+    displayInterface.close();
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Notification Wake-ups
+
+
+static const unsigned kWakeupClients = 8;           //!< Clients in the wake-up test (a recorder and a controller per display)
+
+
+/** Per-client record for the wake-up test.
+ */
+struct WakeupCounts
+{
+    unsigned m_displayMask;                         //!< The displays the client needs events for
+    unsigned m_eventMask;                           //!< The events the client needs (kDisplayXFBNotificationMaskXyz)
+    unsigned m_wakeups;                             //!< Events received
+    unsigned m_unwanted;                            //!< Events received that the client does not need
+};
+
+
+static void wakeupHandler(DisplayXFBInterface::Notification notification, unsigned displayIndex, void* context)
+{
+    WakeupCounts* counts = (WakeupCounts*)context;
+    unsigned eventBit = 1u << ((unsigned)notification - 1);
+    counts->m_wakeups ++;
+    if (0 == (counts->m_displayMask & (1u << displayIndex)) || 0 == (counts->m_eventMask & eventBit)) counts->m_unwanted ++;
+}
+
+
+/** Generate activity on each display in turn, with the clients subscribed to everything or to what they need.
+ *
+ *  @return                 Logical true if the masks could be set.
+ */
+static bool wakeupRun(DisplayXFBInterface* clients, WakeupCounts* counts, unsigned displays, bool filtered, uint8_t** bands,
+                      unsigned* bandBytes, unsigned seconds)
+{
+    const unsigned allDisplays = (1u << displays) - 1;
+    for (unsigned i = 0; i < kWakeupClients; i++)
+    {
+        counts[i].m_displayMask = 1u << (i % displays);
+        counts[i].m_eventMask = (i < displays) ? kDisplayXFBNotificationMaskAll : kDisplayXFBNotificationMaskDefault;
+        bool ok = (filtered) ? clients[i].setNotificationMask(counts[i].m_displayMask, counts[i].m_eventMask)
+                             : clients[i].setNotificationMask(allDisplays, kDisplayXFBNotificationMaskAll);
+        if (!ok) return false;
+    }
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.2, false);             // Drain events from before the masks changed
+    for (unsigned i = 0; i < kWakeupClients; i++) counts[i].m_wakeups = counts[i].m_unwanted = 0;
+
+    // Each band is inverted an even number of times, so that the content ends as it started.
+    unsigned passes = (((seconds * 60) + (2 * displays) - 1) / (2 * displays)) * (2 * displays);
+    double start = now();
+    for (unsigned pass = 0; pass < passes; pass++)
+    {
+        unsigned display = pass % displays;
+        for (unsigned i = 0; i < bandBytes[display]; i++) bands[display][i] ^= 0xff;
+        CGDirectDisplayID displayID;
+        if (DisplayXFBInterface::displayIndexToID(displayID, display))
+        {
+            CGRect bounds = CGDisplayBounds(displayID);
+            CGWarpMouseCursorPosition(CGPointMake(CGRectGetMidX(bounds), CGRectGetMidY(bounds)));
+        }
+        double wait = start + ((pass + 1) / 60.0) - now();
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, (wait > 0) ? wait : 0, false);
+    }
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.2, false);             // Drain anything still queued
+    return true;
+}
+
+
+/** Measure the wake-ups saved by per-client notification masks.
+ *
+ *  @param  displays    The number of displays to use (connected for the test if need be).
+ *  @param  seconds     The duration of each run.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testWakeups(unsigned displays, unsigned seconds)
+{
+    DisplayXFBInterface control;
+    DisplayXFBInterface clients[kWakeupClients];
+    if (!control.open()) { printf("FAIL: could not open the driver\n"); return false; }
+    if (0 == displays || displays > control.displayCount())
+    {
+        printf("FAIL: the driver has %u displays\n", control.displayCount());
+        return false;
+    }
+
+    const unsigned allDisplays = (1u << displays) - 1;
+    unsigned wasConnected = 0;
+    for (unsigned display = 0; display < displays; display++) if (control.displayIsConnected(display)) wasConnected |= 1u << display;
+    bool passed = true;
+    if (allDisplays != wasConnected && (!control.displayConnectMask(allDisplays & ~wasConnected) || !waitForDisplays(allDisplays, true, 10.0)))
+    {
+        printf("FAIL: could not connect %u displays\n", displays);
+        passed = false;
+    }
+
+    // Find a band across the middle of each display.
+    uint8_t* bands[kDisplayXFBMaxDisplays];
+    unsigned bandBytes[kDisplayXFBMaxDisplays];
+    for (unsigned display = 0; display < displays && passed; display++)
+    {
+        DisplayXFBState state;
+        DisplayXFBMap map;
+        if (!control.displayGetState(state, display) || !control.displayMapFramebuffer(map, display, false) ||
+            map.size() < state.offset() + state.bytesPerFrame())
+        {
+            printf("FAIL: could not map the framebuffer of display %u\n", display);
+            passed = false;
+            break;
+        }
+        bands[display] = (uint8_t*)(uintptr_t)map.address() + state.offset() + (state.height() / 2) * state.bytesPerRow();
+        bandBytes[display] = 16 * state.bytesPerRow();
+    }
+
+    WakeupCounts counts[kWakeupClients];
+    WakeupCounts results[2][kWakeupClients];
+    for (unsigned i = 0; i < kWakeupClients && passed; i++)
+    {
+        if (!clients[i].open() || !clients[i].setNotificationHandler(wakeupHandler, &counts[i], CFRunLoopGetCurrent()))
+        {
+            printf("FAIL: could not open client %u\n", i);
+            passed = false;
+        }
+    }
+    for (unsigned filtered = 0; filtered < 2 && passed; filtered++)
+    {
+        if (!wakeupRun(clients, counts, displays, 0 != filtered, bands, bandBytes, seconds))
+        {
+            printf("FAIL: could not set the notification masks\n");
+            passed = false;
+        }
+        memcpy(results[filtered], counts, sizeof counts);
+    }
+
+    if (passed)
+    {
+        unsigned total[2] = { 0, 0 };
+        unsigned wanted = 0;
+        unsigned unwanted = 0;
+        for (unsigned i = 0; i < kWakeupClients; i++)
+        {
+            printf("client %u (%s, display %u): %u wake-ups with every event, %u with its masks (%u unwanted)\n", i,
+                   (i < displays) ? "recorder" : "controller", i % displays, results[0][i].m_wakeups, results[1][i].m_wakeups,
+                   results[1][i].m_unwanted);
+            total[0] += results[0][i].m_wakeups;
+            total[1] += results[1][i].m_wakeups;
+            wanted += results[0][i].m_wakeups - results[0][i].m_unwanted;
+            unwanted += results[1][i].m_unwanted;
+        }
+        printf("%u clients, %u displays, %u s: %u wake-ups with every event (%u wanted), %u with masks (%.1f%% fewer)\n",
+               kWakeupClients, displays, seconds, total[0], wanted, total[1],
+               (total[0]) ? (1.0 - ((double)total[1] / total[0])) * 100.0 : 0.0);
+        if (0 != unwanted) { printf("FAIL: clients received %u events outside their masks\n", unwanted); passed = false; }
+        if (0 == total[1] || total[1] >= total[0]) { printf("FAIL: the masks did not reduce the wake-ups\n"); passed = false; }
+    }
+
+    for (unsigned i = 0; i < kWakeupClients; i++)
+    {
+        clients[i].clearNotificationHandler();
+        clients[i].close();
+    }
+    if (allDisplays != wasConnected && !control.displayDisconnectMask(allDisplays & ~wasConnected))
+    {
+        printf("FAIL: could not restore the connection state\n");
+        passed = false;
+    }
+    control.close();
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Mapping Cache
+
+
+/** Time opening a client, optionally mapping the framebuffer, and closing it.
+ *
+ *  @param  reference   If valid, the mapping every client must get.
+ *  @return             The time per cycle (microseconds), or a negative value if a call failed or a mapping differed.
+ */
+static double mapsOpenCycle(unsigned display, unsigned count, bool map, const DisplayXFBMap& reference)
+{
+    double start = now();
+    for (unsigned i = 0; i < count; i++)
+    {
+        DisplayXFBInterface client;
+        DisplayXFBMap clientMap;
+        if (!client.open()) return -1;
+        if (map && !client.displayMapFramebuffer(clientMap, display)) return -1;
+        if (map && reference.isValid() && clientMap.address() != reference.address()) return -1;
+        client.close();
+    }
+    return ((now() - start) * 1e6) / count;
+}
+
+
+/** Measure the cost of mapping a framebuffer again, with and without the mapping caches.
+ *
+ *  @param  display     The display to use (must be connected).
+ *  @param  count       The number of times to time each case.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testMaps(unsigned display, unsigned count)
+{
+    DisplayXFBInterface holder;
+    if (!holder.open()) { printf("FAIL: could not open the driver\n"); return false; }
+    if (display >= holder.displayCount() || !holder.displayIsConnected(display))
+    {
+        printf("FAIL: display %u is not connected\n", display);
+        return false;
+    }
+    if (0 == count) return false;
+
+    // A client with no other mapping in the task makes a new memory map each time.
+    DisplayXFBMap none;
+    double openClose = mapsOpenCycle(display, count, false, none);
+    double fresh = mapsOpenCycle(display, count, true, none);
+
+    // Remapping on a client that has the mapping.
+    DisplayXFBMap reference;
+    bool passed = holder.displayMapFramebuffer(reference, display);
+    double start = now();
+    for (unsigned i = 0; i < count && passed; i++)
+    {
+        DisplayXFBMap map;
+        passed = holder.displayMapFramebuffer(map, display) && map.address() == reference.address() &&
+                 map.size() == reference.size() && map.generation() == reference.generation();
+    }
+    double cached = ((now() - start) * 1e6) / count;
+    if (!passed) printf("FAIL: a repeated mapping differed from the first\n");
+
+    // A new client while the holder has the mapping: the driver hands back the task's existing map.
+    double shared = (passed) ? mapsOpenCycle(display, count, true, reference) : -1;
+    holder.close();
+    if (passed && shared < 0) { printf("FAIL: a second client in the task got a different mapping\n"); passed = false; }
+    if (openClose < 0 || fresh < 0) { printf("FAIL: a client could not open or map the display\n"); passed = false; }
+
+    if (passed)
+    {
+        printf("%u times each, display %u (%.1f MB): open and close %.1f us\n", count, display, reference.size() / 1048576.0, openClose);
+        printf("remap on the same client (client cache)          %8.2f us\n", cached);
+        printf("map from a new client, mapping held in the task  %8.2f us (less open and close)\n", shared - openClose);
+        printf("map from a new client, no mapping in the task    %8.2f us (less open and close)\n", fresh - openClose);
+    }
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Display Bring-up
+
+
+/** Counts of window server reconfiguration passes, from Quartz's reconfiguration callback.
+ */
+struct BringupPasses
+{
+    unsigned m_passes;                              //!< Reconfiguration passes started
+    bool m_inPass;                                  //!< Logical true between a pass's begin and end callbacks
+};
+
+
+static void bringupCallback(CGDirectDisplayID displayID, CGDisplayChangeSummaryFlags flags, void* context)
+{
+    // Each pass calls back for every display before it starts and again when it ends.
+    BringupPasses* passes = (BringupPasses*)context;
+    (void)displayID;
+    if (0 == (flags & kCGDisplayBeginConfigurationFlag)) passes->m_inPass = false;
+    else if (!passes->m_inPass)
+    {
+        passes->m_passes ++;
+        passes->m_inPass = true;
+    }
+}
+
+
+/** Disconnect a set of displays, then time connecting them.
+ *
+ *  @return             The time until all of the displays were active (seconds), or a negative value on failure.
+ */
+static double bringupRun(DisplayXFBInterface& control, unsigned displayMask, bool batched, BringupPasses& passes)
+{
+    if (!control.displayDisconnectMask(displayMask) || !waitForDisplays(displayMask, false, 30.0)) return -1;
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);             // Let the window server settle
+
+    passes.m_passes = 0;
+    passes.m_inPass = false;
+    double start = now();
+    bool ok = true;
+    if (batched) ok = control.displayConnectMask(displayMask);
+    else
+    {
+        for (unsigned display = 0; display < kDisplayXFBMaxDisplays && ok; display++)
+        {
+            if (displayMask & (1u << display)) ok = control.displayConnect(display);
+        }
+    }
+    if (!ok || !waitForDisplays(displayMask, true, 30.0)) return -1;
+    double elapsed = now() - start;
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);             // Count any passes still to come
+    return elapsed;
+}
+
+
+/** Compare bringing up several displays one at a time and in one batch.
+ *
+ *  @param  displays    The number of displays to use.
+ *  @param  rounds      The number of times to time each.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testBringup(unsigned displays, unsigned rounds)
+{
+    DisplayXFBInterface control;
+    if (!control.open()) { printf("FAIL: could not open the driver\n"); return false; }
+    if (0 == displays || displays > control.displayCount() || 0 == rounds)
+    {
+        printf("FAIL: the driver has %u displays\n", control.displayCount());
+        return false;
+    }
+
+    const unsigned allDisplays = (1u << displays) - 1;
+    unsigned wasConnected = 0;
+    for (unsigned display = 0; display < displays; display++) if (control.displayIsConnected(display)) wasConnected |= 1u << display;
+
+    BringupPasses passes = { 0, false };
+    if (kCGErrorSuccess != CGDisplayRegisterReconfigurationCallback(bringupCallback, &passes))
+    {
+        printf("FAIL: could not register for reconfiguration callbacks\n");
+        return false;
+    }
+
+    // Alternate which goes first, so that neither always follows the other.
+    double seconds[2] = { 0, 0 };
+    unsigned passCount[2] = { 0, 0 };
+    bool passed = true;
+    for (unsigned round = 0; round < rounds && passed; round++)
+    {
+        for (unsigned i = 0; i < 2 && passed; i++)
+        {
+            unsigned batched = (round + i) & 1;
+            double elapsed = bringupRun(control, allDisplays, 0 != batched, passes);
+            if (elapsed < 0)
+            {
+                printf("FAIL: %u displays did not come up %s\n", displays, (batched) ? "in a batch" : "one at a time");
+                passed = false;
+            }
+            seconds[batched] += elapsed;
+            passCount[batched] += passes.m_passes;
+        }
+    }
+    CGDisplayRemoveReconfigurationCallback(bringupCallback, &passes);
+
+    if (passed)
+    {
+        printf("%u displays, %u rounds:\n", displays, rounds);
+        printf("one at a time  %7.3f s, %.1f reconfiguration passes\n", seconds[0] / rounds, (double)passCount[0] / rounds);
+        printf("batched        %7.3f s, %.1f reconfiguration passes\n", seconds[1] / rounds, (double)passCount[1] / rounds);
+        if (passCount[1] > passCount[0]) { printf("FAIL: the batch took more reconfiguration passes\n"); passed = false; }
+    }
+
+    // Restore the original connection state.
+    bool restored = true;
+    if (0 != (allDisplays & ~wasConnected)) restored = control.displayDisconnectMask(allDisplays & ~wasConnected) && restored;
+    if (0 != wasConnected) restored = control.displayConnectMask(wasConnected) && restored;
+    if (!restored) { printf("FAIL: could not restore the connection state\n"); passed = false; }
+    control.close();
+    return passed;
+}
+
+
+#pragma mark    -
+#pragma mark    Mode Switch Downtime
+
+
+/** A client following mode switches.
+ */
+struct ModeClient
+{
+    DisplayXFBInterface m_interface;                //!< The connection that receives notifications
+    DisplayXFBInterface m_session;                  //!< The connection that is rebuilt (remapping client only)
+    bool m_inPlace;                                 //!< Logical true to follow kNotificationDisplayMode and keep the mapping
+    DisplayXFBMap m_map;                            //!< The current framebuffer mapping
+    volatile double m_eventTime;                    //!< Time the switch notification arrived, or zero
+    volatile double m_readyTime;                    //!< Time the client could read the new frame, or zero
+    unsigned m_width;                               //!< The frame size after the switch
+    unsigned m_height;
+    uint32_t m_sink;                                //!< The pixel read (keeps the read live)
+};
+
+
+/** Shared state for the mode switch test.
+ */
+struct ModeSwitch
+{
+    unsigned m_display;                             //!< The display under test
+    ModeClient m_clients[2];                        //!< The clients: in place and remapping
+    volatile bool m_started;                        //!< Set once the clients are ready for the first switch
+    volatile bool m_stop;                           //!< Set to end the client thread
+    volatile unsigned m_failures;                   //!< Client calls that failed
+};
+
+
+static void modeHandler(DisplayXFBInterface::Notification notification, unsigned displayIndex, void* context)
+{
+    ModeClient* client = (ModeClient*)context;
+    DisplayXFBInterface::Notification wanted = (client->m_inPlace) ? DisplayXFBInterface::kNotificationDisplayMode : DisplayXFBInterface::kNotificationDisplayState;
+    (void)displayIndex;
+    if (notification == wanted && 0 == client->m_eventTime) client->m_eventTime = now();
+}
+
+
+/** Bring a client up to date after a switch: read the new geometry and the last pixel of the new frame.
+ */
+static bool modeClientUpdate(ModeClient& client, unsigned display)
+{
+    DisplayXFBState state;
+    bool ok;
+    if (client.m_inPlace)
+    {
+        unsigned modeGeneration;
+        ok = client.m_interface.displayGetStatus(state, modeGeneration, display) &&
+             client.m_interface.displayMapFramebuffer(client.m_map, display);
+    }
+    else
+    {
+        client.m_session.close();
+        ok = client.m_session.open() && client.m_session.displayGetState(state, display) &&
+             client.m_session.displayMapFramebuffer(client.m_map, display);
+    }
+    if (!ok || client.m_map.size() < state.offset() + state.bytesPerFrame()) return false;
+
+    const uint8_t* frame = (const uint8_t*)(uintptr_t)client.m_map.address() + state.offset();
+    client.m_sink = *(const volatile uint32_t*)(frame + ((state.height() - 1) * state.bytesPerRow()) + ((state.width() - 1) * 4));
+    client.m_width = state.width();
+    client.m_height = state.height();
+    return true;
+}
+
+
+/** Run the clients, each on this thread's run loop, until told to stop.
+ */
+static void* modeClientThread(void* context)
+{
+    ModeSwitch* test = (ModeSwitch*)context;
+    const unsigned display = test->m_display;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        ModeClient& client = test->m_clients[i];
+        unsigned eventMask = (client.m_inPlace) ? kDisplayXFBNotificationMaskDisplayMode : kDisplayXFBNotificationMaskDisplayState;
+        bool ok = client.m_interface.open() && client.m_interface.setNotificationMask(1u << display, eventMask) &&
+                  client.m_interface.setNotificationHandler(modeHandler, &client, CFRunLoopGetCurrent()) &&
+                  modeClientUpdate(client, display);
+        if (!ok) __sync_fetch_and_add(&test->m_failures, 1u);
+    }
+    test->m_started = true;
+
+    while (!test->m_stop)
+    {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.001, false);
+        for (unsigned i = 0; i < 2; i++)
+        {
+            ModeClient& client = test->m_clients[i];
+            if (0 == client.m_eventTime || 0 != client.m_readyTime) continue;
+            if (!modeClientUpdate(client, display)) __sync_fetch_and_add(&test->m_failures, 1u);
+            __sync_synchronize();                                       // Publish the update before the time
+            client.m_readyTime = now();
+        }
+    }
+
+    for (unsigned i = 0; i < 2; i++)
+    {
+        test->m_clients[i].m_interface.clearNotificationHandler();
+        test->m_clients[i].m_interface.close();
+        test->m_clients[i].m_session.close();
+    }
+    return 0;
+}
+
+
+/** Switch a display to a mode through Quartz, as the display preferences do.
+ */
+static bool modeSwitchTo(CGDirectDisplayID displayID, CGDisplayModeRef mode)
+{
+    CGDisplayConfigRef config;
+    if (kCGErrorSuccess != CGBeginDisplayConfiguration(&config)) return false;
+    if (kCGErrorSuccess != CGConfigureDisplayWithDisplayMode(config, displayID, mode, NULL))
+    {
+        CGCancelDisplayConfiguration(config);
+        return false;
+    }
+    return kCGErrorSuccess == CGCompleteDisplayConfiguration(config, kCGConfigureForSession);
+}
+
+
+/** Measure the downtime of clients that keep their mapping across a mode switch and of clients that rebuild it.
+ *
+ *  @param  display     The display to use (must be connected, with at least two sizes of mode).
+ *  @param  rounds      The number of times to switch to the other mode and back.
+ *  @return             Logical true if all checks passed.
+ */
+static bool testModeSwitch(unsigned display, unsigned rounds)
+{
+    CGDirectDisplayID displayID;
+    if (0 == rounds || !DisplayXFBInterface::displayIndexToID(displayID, display))
+    {
+        printf("FAIL: display %u is not connected\n", display);
+        return false;
+    }
+
+    // Find a mode of another size.
+    CGDisplayModeRef modes[2] = { CGDisplayCopyDisplayMode(displayID), 0 };
+    CFArrayRef allModes = CGDisplayCopyAllDisplayModes(displayID, NULL);
+    for (CFIndex i = 0; allModes && modes[0] && !modes[1] && i < CFArrayGetCount(allModes); i++)
+    {
+        CGDisplayModeRef mode = (CGDisplayModeRef)CFArrayGetValueAtIndex(allModes, i);
+        if (CGDisplayModeGetWidth(mode) != CGDisplayModeGetWidth(modes[0]) || CGDisplayModeGetHeight(mode) != CGDisplayModeGetHeight(modes[0]))
+        {
+            modes[1] = CGDisplayModeRetain(mode);
+        }
+    }
+    if (allModes) CFRelease(allModes);
+    if (!modes[0] || !modes[1])
+    {
+        printf("FAIL: display %u has only one size of mode\n", display);
+        CGDisplayModeRelease(modes[0]);
+        return false;
+    }
+
+    ModeSwitch test;
+    test.m_display = display;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        test.m_clients[i].m_inPlace = (0 == i);
+        test.m_clients[i].m_eventTime = 0;
+        test.m_clients[i].m_readyTime = 0;
+        test.m_clients[i].m_width = 0;
+        test.m_clients[i].m_height = 0;
+        test.m_clients[i].m_sink = 0;
+    }
+    test.m_started = false;
+    test.m_stop = false;
+    test.m_failures = 0;
+    pthread_t thread;
+    if (0 != pthread_create(&thread, 0, modeClientThread, &test))
+    {
+        printf("FAIL: could not start the client thread\n");
+        CGDisplayModeRelease(modes[0]);
+        CGDisplayModeRelease(modes[1]);
+        return false;
+    }
+    while (!test.m_started) usleep(1000);
+    const uint64_t address = test.m_clients[0].m_map.address();
+    const unsigned generation = test.m_clients[0].m_map.generation();
+
+    double total[2] = { 0, 0 };
+    double worst[2] = { 0, 0 };
+    unsigned switches = 0;
+    bool passed = (0 == test.m_failures);
+    if (!passed) printf("FAIL: the clients could not connect to display %u\n", display);
+    for (unsigned round = 0; round < rounds * 2 && passed; round++)
+    {
+        CGDisplayModeRef target = modes[(round & 1) ? 0 : 1];
+        for (unsigned i = 0; i < 2; i++)
+        {
+            test.m_clients[i].m_eventTime = 0;                          // Before m_readyTime, so the thread sees no event
+            test.m_clients[i].m_readyTime = 0;
+        }
+        double start = now();
+        if (!modeSwitchTo(displayID, target)) { printf("FAIL: could not switch mode\n"); passed = false; break; }
+        while ((0 == test.m_clients[0].m_readyTime || 0 == test.m_clients[1].m_readyTime) && now() < start + 10.0) usleep(1000);
+        __sync_synchronize();
+
+        for (unsigned i = 0; i < 2; i++)
+        {
+            const ModeClient& client = test.m_clients[i];
+            if (0 == client.m_readyTime) { printf("FAIL: client %u missed a mode switch\n", i); passed = false; continue; }
+            double downtime = client.m_readyTime - start;
+            total[i] += downtime;
+            if (downtime > worst[i]) worst[i] = downtime;
+            if (client.m_width != CGDisplayModeGetWidth(target) || client.m_height != CGDisplayModeGetHeight(target))
+            {
+                printf("FAIL: client %u read %ux%u after a switch to %zux%zu\n", i, client.m_width, client.m_height,
+                       CGDisplayModeGetWidth(target), CGDisplayModeGetHeight(target));
+                passed = false;
+            }
+        }
+        if (test.m_clients[0].m_map.address() != address || test.m_clients[0].m_map.generation() != generation)
+        {
+            printf("FAIL: the mapping changed on a mode switch\n");
+            passed = false;
+        }
+        switches ++;
+    }
+    if (0 != test.m_failures) { printf("FAIL: %u client calls failed\n", test.m_failures); passed = false; }
+
+    // Restore the original mode if a switch was left half way.
+    if (0 != (switches & 1) && !modeSwitchTo(displayID, modes[0])) { printf("FAIL: could not restore the mode\n"); passed = false; }
+    test.m_stop = true;
+    pthread_join(thread, 0);
+    CGDisplayModeRelease(modes[0]);
+    CGDisplayModeRelease(modes[1]);
+
+    if (switches)
+    {
+        printf("%u switches between %zux%zu and %zux%zu:\n", switches, CGDisplayModeGetWidth(modes[0]), CGDisplayModeGetHeight(modes[0]),
+               CGDisplayModeGetWidth(modes[1]), CGDisplayModeGetHeight(modes[1]));
+        printf("in place (mode event, status page)   mean %7.1f ms, worst %7.1f ms\n", (total[0] * 1000.0) / switches, worst[0] * 1000.0);
+        printf("rebuilt (state event, remap)         mean %7.1f ms, worst %7.1f ms\n", (total[1] * 1000.0) / switches, worst[1] * 1000.0);
+    }
+    return passed;
+}
+
+
+#pragma mark    -
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: dxstress clients [count] [seconds]\n"
+                    "       dxstress state [display] [seconds]\n"
+                    "       dxstress notify [display] [seconds]\n"
+                    "       dxstress broker [display] [seconds]\n"
+                    "       dxstress wakeups [displays] [seconds]\n"
+                    "       dxstress maps [display] [count]\n"
+                    "       dxstress bringup [displays] [rounds]\n"
+                    "       dxstress modeswitch [display] [rounds]\n");
+}
+
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2) { usage(); return 2; }
+
+    if (!DisplayXFBInterface::isInstalled())
+    {
+        fprintf(stderr, "no compatible driver is installed\n");
+        return 2;
+    }
+
+    bool passed;
+    if (0 == strcmp(argv[1], "clients"))
+    {
+        unsigned count = (argc > 2) ? (unsigned)atoi(argv[2]) : kDisplayXFBMaxClients;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 10;
+        passed = testClients(count, seconds);
+    }
+    else if (0 == strcmp(argv[1], "state"))
+    {
+        unsigned display = (argc > 2) ? (unsigned)atoi(argv[2]) : 0;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 30;
+        passed = testState(display, seconds);
+    }
+    else if (0 == strcmp(argv[1], "notify"))
+    {
+        unsigned display = (argc > 2) ? (unsigned)atoi(argv[2]) : 0;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 5;
+        passed = testNotify(display, seconds);
+    }
+    else if (0 == strcmp(argv[1], "broker"))
+    {
+        unsigned display = (argc > 2) ? (unsigned)atoi(argv[2]) : 0;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 2;
+        passed = testBroker(display, seconds);
+    }
+    else if (0 == strcmp(argv[1], "wakeups"))
+    {
+        unsigned displays = (argc > 2) ? (unsigned)atoi(argv[2]) : 4;
+        unsigned seconds = (argc > 3) ? (unsigned)atoi(argv[3]) : 5;
+        passed = testWakeups(displays, seconds);
+    }
+    else if (0 == strcmp(argv[1], "maps"))
+    {
+        unsigned display = (argc > 2) ? (unsigned)atoi(argv[2]) : 0;
+        unsigned count = (argc > 3) ? (unsigned)atoi(argv[3]) : 1000;
+        passed = testMaps(display, count);
+    }
+    else if (0 == strcmp(argv[1], "bringup"))
+    {
+        unsigned displays = (argc > 2) ? (unsigned)atoi(argv[2]) : 4;
+        unsigned rounds = (argc > 3) ? (unsigned)atoi(argv[3]) : 5;
+        passed = testBringup(displays, rounds);
+    }
+    else if (0 == strcmp(argv[1], "modeswitch"))
+    {
+        unsigned display = (argc > 2) ? (unsigned)atoi(argv[2]) : 0;
+        unsigned rounds = (argc > 3) ? (unsigned)atoi(argv[3]) : 5;
+        passed = testModeSwitch(display, rounds);
+    }
+    else
+    {
+        usage();
+        return 2;
+    }
+
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}